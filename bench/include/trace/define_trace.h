@@ -0,0 +1 @@
+/* tracepoints are stubbed in kshim.h */
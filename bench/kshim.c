@@ -0,0 +1,791 @@
+/*
+ * Userspace kernel API for the benchmark, see kshim.h.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ */
+
+#include "kshim.h"
+#include <ctype.h>
+#include <malloc.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/membarrier.h>
+
+struct net init_net;
+long kshim_mem;
+
+/* memory, usable size is what the allocator really hands out */
+void *
+kshim_alloc(size_t size, bool zero)
+{
+	void *p = zero ? calloc(1, size ?: 1) : malloc(size ?: 1);
+
+	if (p)
+		__atomic_fetch_add(&kshim_mem, malloc_usable_size(p),
+		    __ATOMIC_RELAXED);
+	return p;
+}
+
+void
+kshim_free(const void *p)
+{
+	if (!p)
+		return;
+	__atomic_fetch_sub(&kshim_mem, malloc_usable_size((void *)p),
+	    __ATOMIC_RELAXED);
+	free((void *)p);
+}
+
+/* per-cpu copies are cache line apart */
+static int nr_cpus = 1;
+static int cpu_next;
+static __thread int this_cpu = -1;
+
+void
+kshim_set_cpus(int n)
+{
+	nr_cpus = n > 0 ? n : 1;
+}
+
+int
+kshim_nr_cpus(void)
+{
+	return nr_cpus;
+}
+
+int
+kshim_this_cpu(void)
+{
+	if (this_cpu < 0)
+		this_cpu = __atomic_fetch_add(&cpu_next, 1,
+		    __ATOMIC_RELAXED) % nr_cpus;
+	return this_cpu;
+}
+
+void *
+kshim_alloc_percpu(size_t size)
+{
+	return kshim_alloc(KSHIM_PCPU_STRIDE(size) * nr_cpus, true);
+}
+
+/*
+ * RCU: each reader thread publishes the grace period counter it saw on
+ * entry, synchronize_rcu() starts a new period and waits until no
+ * thread is still inside an older one. Callbacks are batched and run
+ * after a grace period by a thread of their own, woken once the batch
+ * is big or by rcu_barrier(); as in the kernel they never run inside
+ * the locked section of the writer that queued them. With membarrier()
+ * the fence is taken by the updater only, so readers cost about what
+ * they cost in softirq.
+ */
+#define RCU_READERS	256
+#define RCU_BATCH	65536
+
+static unsigned long rcu_gp = 1;
+static unsigned long rcu_seen[RCU_READERS];
+static int rcu_nreaders;
+static __thread int rcu_slot = -1;
+static __thread int rcu_nest;
+static pthread_mutex_t rcu_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t rcu_gp_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rcu_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t rcu_done_cond = PTHREAD_COND_INITIALIZER;
+static struct rcu_head *rcu_cbs;
+static unsigned long rcu_ncbs;
+static bool rcu_flush;		/* rcu_barrier() waits, run a short batch */
+static bool rcu_busy;		/* batch taken, callbacks not all run */
+static bool rcu_started;
+static bool rcu_memb;
+
+static void __attribute__((constructor))
+rcu_init(void)
+{
+	rcu_memb = !syscall(__NR_membarrier,
+	    MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0);
+}
+
+static void
+rcu_mb_master(void)
+{
+	if (rcu_memb)
+		syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0);
+}
+
+void
+rcu_read_lock(void)
+{
+	if (rcu_nest++)
+		return;
+	if (rcu_slot < 0) {
+		rcu_slot = __atomic_fetch_add(&rcu_nreaders, 1,
+		    __ATOMIC_SEQ_CST);
+		BUG_ON(rcu_slot >= RCU_READERS);
+	}
+	if (rcu_memb) {
+		__atomic_store_n(&rcu_seen[rcu_slot],
+		    __atomic_load_n(&rcu_gp, __ATOMIC_RELAXED),
+		    __ATOMIC_RELAXED);
+		__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	} else {
+		__atomic_store_n(&rcu_seen[rcu_slot],
+		    __atomic_load_n(&rcu_gp, __ATOMIC_SEQ_CST),
+		    __ATOMIC_SEQ_CST);
+	}
+}
+
+void
+rcu_read_unlock(void)
+{
+	if (--rcu_nest)
+		return;
+	__atomic_store_n(&rcu_seen[rcu_slot], 0, __ATOMIC_RELEASE);
+}
+
+void
+synchronize_rcu(void)
+{
+	unsigned long gp;
+	int i, n;
+
+	BUG_ON(rcu_nest);
+	pthread_mutex_lock(&rcu_gp_lock);
+	gp = __atomic_add_fetch(&rcu_gp, 1, __ATOMIC_SEQ_CST);
+	rcu_mb_master();
+	n = __atomic_load_n(&rcu_nreaders, __ATOMIC_SEQ_CST);
+	for (i = 0; i < n && i < RCU_READERS; i++) {
+		unsigned long seen;
+
+		while ((seen = __atomic_load_n(&rcu_seen[i],
+		    __ATOMIC_SEQ_CST)) && seen < gp)
+			sched_yield();
+	}
+	rcu_mb_master();
+	pthread_mutex_unlock(&rcu_gp_lock);
+}
+
+/* kfree_rcu() keeps the offset of the head in place of a callback */
+#define RCU_KFREE_MAX	65536
+
+static void *
+rcu_thread(void *arg)
+{
+	pthread_mutex_lock(&rcu_lock);
+	for (;;) {
+		struct rcu_head *h, *n;
+
+		while (rcu_ncbs < RCU_BATCH && !rcu_flush)
+			pthread_cond_wait(&rcu_cond, &rcu_lock);
+		h = rcu_cbs;
+		rcu_cbs = NULL;
+		rcu_ncbs = 0;
+		rcu_flush = false;
+		rcu_busy = true;
+		pthread_mutex_unlock(&rcu_lock);
+
+		if (h)
+			synchronize_rcu();
+		for (; h; h = n) {
+			const uintptr_t f = (uintptr_t)h->func;
+
+			n = h->next;
+			if (f < RCU_KFREE_MAX)
+				kshim_free((char *)h - f);
+			else
+				h->func(h);
+		}
+
+		pthread_mutex_lock(&rcu_lock);
+		rcu_busy = false;
+		pthread_cond_broadcast(&rcu_done_cond);
+	}
+	return NULL;
+}
+
+/* under rcu_lock */
+static void
+rcu_start(void)
+{
+	pthread_t t;
+
+	if (!rcu_started) {
+		rcu_started = !pthread_create(&t, NULL, rcu_thread, NULL);
+		BUG_ON(!rcu_started);
+		pthread_detach(t);
+	}
+}
+
+void
+call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *))
+{
+	head->func = func;
+	pthread_mutex_lock(&rcu_lock);
+	rcu_start();
+	head->next = rcu_cbs;
+	rcu_cbs = head;
+	if (++rcu_ncbs >= RCU_BATCH)
+		pthread_cond_signal(&rcu_cond);
+	pthread_mutex_unlock(&rcu_lock);
+}
+
+void
+kshim_kfree_rcu(struct rcu_head *head, size_t off)
+{
+	call_rcu(head, (void (*)(struct rcu_head *))(uintptr_t)off);
+}
+
+/* callbacks queued by callbacks are waited for too */
+void
+rcu_barrier(void)
+{
+	pthread_mutex_lock(&rcu_lock);
+	while (rcu_ncbs || rcu_busy) {
+		rcu_flush = true;
+		pthread_cond_signal(&rcu_cond);
+		pthread_cond_wait(&rcu_done_cond, &rcu_lock);
+	}
+	pthread_mutex_unlock(&rcu_lock);
+}
+
+/*
+ * Workqueues: one worker thread runs all queued items in order, as
+ * the table's resize and reclaim work would run beside its users.
+ */
+struct workqueue_struct {
+	int unused;
+};
+
+static struct workqueue_struct kshim_wq;
+struct workqueue_struct *system_long_wq = &kshim_wq;
+
+static pthread_mutex_t work_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static struct work_struct *work_head, **work_tail = &work_head;
+static struct work_struct *work_running;
+static unsigned int work_done;
+static bool worker_started;
+
+static void *
+worker(void *arg)
+{
+	pthread_mutex_lock(&work_lock);
+	for (;;) {
+		struct work_struct *w;
+
+		while (!work_head)
+			pthread_cond_wait(&work_cond, &work_lock);
+		w = work_head;
+		work_head = w->next;
+		if (!work_head)
+			work_tail = &work_head;
+		w->pending = false;
+		work_running = w;
+		pthread_mutex_unlock(&work_lock);
+
+		w->func(w);
+
+		pthread_mutex_lock(&work_lock);
+		work_running = NULL;
+		work_done++;
+		pthread_cond_broadcast(&work_cond);
+	}
+	return NULL;
+}
+
+struct workqueue_struct *
+alloc_workqueue(const char *fmt, unsigned int flags, int max_active)
+{
+	return &kshim_wq;
+}
+
+void
+destroy_workqueue(struct workqueue_struct *wq)
+{
+	kshim_run_work();
+}
+
+bool
+queue_work(struct workqueue_struct *wq, struct work_struct *w)
+{
+	pthread_t t;
+
+	pthread_mutex_lock(&work_lock);
+	if (!worker_started) {
+		worker_started = !pthread_create(&t, NULL, worker, NULL);
+		BUG_ON(!worker_started);
+		pthread_detach(t);
+	}
+	if (w->pending) {
+		pthread_mutex_unlock(&work_lock);
+		return false;
+	}
+	w->pending = true;
+	w->next = NULL;
+	*work_tail = w;
+	work_tail = &w->next;
+	pthread_cond_broadcast(&work_cond);
+	pthread_mutex_unlock(&work_lock);
+	return true;
+}
+
+bool
+cancel_work_sync(struct work_struct *w)
+{
+	struct work_struct **pw;
+	bool was = false;
+
+	pthread_mutex_lock(&work_lock);
+	for (pw = &work_head; *pw; pw = &(*pw)->next)
+		if (*pw == w) {
+			*pw = w->next;
+			if (!*pw)
+				work_tail = pw;
+			w->pending = false;
+			was = true;
+			break;
+		}
+	while (work_running == w)
+		pthread_cond_wait(&work_cond, &work_lock);
+	pthread_mutex_unlock(&work_lock);
+	return was;
+}
+
+bool
+flush_work(struct work_struct *w)
+{
+	bool was;
+
+	pthread_mutex_lock(&work_lock);
+	was = w->pending || work_running == w;
+	while (w->pending || work_running == w)
+		pthread_cond_wait(&work_cond, &work_lock);
+	pthread_mutex_unlock(&work_lock);
+	return was;
+}
+
+/* wait until the worker is idle, returns items run so far */
+unsigned int
+kshim_run_work(void)
+{
+	unsigned int done;
+
+	pthread_mutex_lock(&work_lock);
+	while (work_head || work_running)
+		pthread_cond_wait(&work_cond, &work_lock);
+	done = work_done;
+	pthread_mutex_unlock(&work_lock);
+	return done;
+}
+
+/* misc */
+u64
+ktime_get_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void
+get_random_bytes(void *buf, size_t n)
+{
+	unsigned char *p = buf;
+
+	while (n--)
+		*p++ = rand();
+}
+
+/* xorshift per thread, rand() would serialize the stress threads */
+u32
+get_random_u32(void)
+{
+	static unsigned int seed;
+	static __thread u32 x;
+
+	if (!x)
+		x = __atomic_add_fetch(&seed, 0x9e3779b9, __ATOMIC_RELAXED)
+		    | 1;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return x;
+}
+
+void
+msleep(unsigned int msecs)
+{
+	usleep(msecs * 1000UL);
+}
+
+/* kernel threads */
+struct task_struct {
+	pthread_t tid;
+	int (*fn)(void *);
+	void *data;
+	bool stop;
+};
+
+static __thread struct task_struct *kthread_current;
+
+static void *
+kthread_main(void *arg)
+{
+	struct task_struct *t = arg;
+
+	kthread_current = t;
+	return (void *)(long)t->fn(t->data);
+}
+
+struct task_struct *
+kthread_run(int (*fn)(void *), void *data, const char *fmt, ...)
+{
+	struct task_struct *t = kshim_alloc(sizeof(*t), true);
+
+	if (!t)
+		return ERR_PTR(-ENOMEM);
+	t->fn = fn;
+	t->data = data;
+	if (pthread_create(&t->tid, NULL, kthread_main, t)) {
+		kshim_free(t);
+		return ERR_PTR(-EAGAIN);
+	}
+	return t;
+}
+
+bool
+kthread_should_stop(void)
+{
+	return __atomic_load_n(&kthread_current->stop, __ATOMIC_RELAXED);
+}
+
+int
+kthread_stop(struct task_struct *t)
+{
+	void *ret;
+
+	__atomic_store_n(&t->stop, true, __ATOMIC_RELAXED);
+	pthread_join(t->tid, &ret);
+	kshim_free(t);
+	return (long)ret;
+}
+
+/* KUnit cases in order, in the layout of the kernel's TAP output */
+int
+kshim_kunit_run(void)
+{
+	const struct kunit_case *c;
+	int n = 0, failed = 0;
+
+	for (c = kshim_kunit_suite->test_cases; c->run_case; c++)
+		n++;
+	printf("    # Subtest: %s\n    1..%d\n", kshim_kunit_suite->name, n);
+	for (c = kshim_kunit_suite->test_cases, n = 1; c->run_case; c++, n++) {
+		struct kunit test = { .name = c->name };
+
+		c->run_case(&test);
+		printf("    %s %d %s\n", test.failed ? "not ok" : "ok", n,
+		    c->name);
+		fflush(stdout);
+		failed += test.failed;
+	}
+	printf("%s 1 %s\n", failed ? "not ok" : "ok", kshim_kunit_suite->name);
+	return failed != 0;
+}
+
+int
+scnprintf(char *buf, size_t size, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(buf, size, fmt, ap);
+	va_end(ap);
+	if (!size)
+		return 0;
+	return n < (int)size ? n : (int)size - 1;
+}
+
+int
+in4_pton(const char *src, int srclen, u8 *dst, int delim, const char **end)
+{
+	const char *s = src;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		unsigned int w = 0;
+
+		if (!isdigit((unsigned char)*s))
+			return 0;
+		while (isdigit((unsigned char)*s)) {
+			w = w * 10 + (*s++ - '0');
+			if (w > 255)
+				return 0;
+		}
+		dst[i] = w;
+		if (i < 3 && *s++ != '.')
+			return 0;
+	}
+	if (end)
+		*end = s;
+	return 1;
+}
+
+/* from <arpa/inet.h>, whose in6_addr would clash with kshim.h */
+int inet_pton(int af, const char *src, void *dst);
+
+int
+in6_pton(const char *src, int srclen, u8 *dst, int delim, const char **end)
+{
+	char buf[46];	/* INET6_ADDRSTRLEN */
+	size_t len = srclen < 0 ? strlen(src) : (size_t)srclen;
+
+	if (len >= sizeof(buf))
+		return 0;
+	memcpy(buf, src, len);
+	buf[len] = '\0';
+	if (inet_pton(10 /* AF_INET6 */, buf, dst) != 1)
+		return 0;
+	if (end)
+		*end = src + len;
+	return 1;
+}
+
+/* only init_net exists */
+void *
+net_generic(const struct net *net, unsigned int id)
+{
+	return net->gen;
+}
+
+int
+register_pernet_subsys(struct pernet_operations *ops)
+{
+	init_net.gen = kshim_alloc(ops->size, true);
+	return ops->init(&init_net);
+}
+
+void
+unregister_pernet_subsys(struct pernet_operations *ops)
+{
+	ops->exit(&init_net);
+	kshim_free(init_net.gen);
+}
+
+int
+xt_register_targets(struct xt_target *t, unsigned int n)
+{
+	return 0;
+}
+
+void
+xt_unregister_targets(struct xt_target *t, unsigned int n)
+{
+}
+
+unsigned int
+nf_nat_setup_info(struct nf_conn *ct, const struct nf_nat_range2 *range,
+    enum nf_nat_manip_type maniptype)
+{
+	return NF_ACCEPT;
+}
+
+/* proc entries are only handles, never looked up */
+struct proc_dir_entry {
+	int unused;
+};
+
+static struct proc_dir_entry kshim_pde;
+
+struct proc_dir_entry *
+proc_create_data(const char *name, int mode, struct proc_dir_entry *parent,
+    const struct proc_ops *ops, void *data)
+{
+	return &kshim_pde;
+}
+
+struct proc_dir_entry *
+proc_mkdir(const char *name, struct proc_dir_entry *parent)
+{
+	return &kshim_pde;
+}
+
+void
+remove_proc_entry(const char *name, struct proc_dir_entry *parent)
+{
+}
+
+/* seq_file over a flat buffer */
+void
+seq_write(struct seq_file *m, const void *d, size_t len)
+{
+	if (m->count + len > m->size) {
+		m->count = m->size;
+		return;
+	}
+	memcpy(m->buf + m->count, d, len);
+	m->count += len;
+}
+
+void
+seq_printf(struct seq_file *m, const char *fmt, ...)
+{
+	char tmp[512];
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+	va_end(ap);
+	seq_write(m, tmp, min_t(size_t, n, sizeof(tmp) - 1));
+}
+
+void
+seq_puts(struct seq_file *m, const char *s)
+{
+	seq_write(m, s, strlen(s));
+}
+
+bool
+seq_has_overflowed(struct seq_file *m)
+{
+	return m->count == m->size;
+}
+
+ssize_t
+seq_read(struct file *f, char __user *buf, size_t size, loff_t *ppos)
+{
+	return 0;
+}
+
+loff_t
+seq_lseek(struct file *f, loff_t off, int whence)
+{
+	return 0;
+}
+
+void *
+__seq_open_private(struct file *f, const struct seq_operations *op, int psize)
+{
+	return NULL;
+}
+
+int
+seq_release_private(struct inode *i, struct file *f)
+{
+	return 0;
+}
+
+int
+single_open(struct file *f, int (*show)(struct seq_file *, void *), void *data)
+{
+	return -ENOSYS;
+}
+
+int
+single_release(struct inode *i, struct file *f)
+{
+	return 0;
+}
+
+/* netlink, enough to register the family */
+int
+genl_register_family(struct genl_family *f)
+{
+	return 0;
+}
+
+int
+genl_unregister_family(const struct genl_family *f)
+{
+	return 0;
+}
+
+int
+nla_strcmp(const struct nlattr *a, const char *s)
+{
+	return strcmp(nla_data(a), s);
+}
+
+int
+nlmsg_parse(const struct nlmsghdr *nlh, int hdrlen, struct nlattr **tb,
+    int max, const struct nla_policy *p, struct netlink_ext_ack *extack)
+{
+	return -EOPNOTSUPP;
+}
+
+int
+nla_parse_nested(struct nlattr **tb, int max, const struct nlattr *nla,
+    const struct nla_policy *p, struct netlink_ext_ack *extack)
+{
+	return -EOPNOTSUPP;
+}
+
+int
+nla_put(struct sk_buff *skb, int type, int len, const void *data)
+{
+	return -EMSGSIZE;
+}
+
+struct nlattr *
+nla_reserve(struct sk_buff *skb, int type, int len)
+{
+	return NULL;
+}
+
+struct nlattr *
+nla_nest_start(struct sk_buff *skb, int type)
+{
+	return NULL;
+}
+
+int
+nla_nest_end(struct sk_buff *skb, struct nlattr *start)
+{
+	return 0;
+}
+
+void
+nla_nest_cancel(struct sk_buff *skb, struct nlattr *start)
+{
+}
+
+void *
+genlmsg_put(struct sk_buff *skb, u32 portid, u32 seq,
+    const struct genl_family *f, int flags, u8 cmd)
+{
+	return NULL;
+}
+
+void
+genlmsg_end(struct sk_buff *skb, void *hdr)
+{
+}
+
+void
+genlmsg_cancel(struct sk_buff *skb, void *hdr)
+{
+}
+
+struct sk_buff *
+nlmsg_new(size_t size, gfp_t flags)
+{
+	return NULL;
+}
+
+void
+nlmsg_free(struct sk_buff *skb)
+{
+}
+
+int
+genlmsg_reply(struct sk_buff *skb, struct genl_info *info)
+{
+	return 0;
+}
@@ -0,0 +1,946 @@
+/*
+ * Userspace stand-ins for the kernel API used by xt_NATMAP.c, enough
+ * to build the module's data structures into the benchmark. Headers
+ * under bench/include/ all resolve here.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ */
+
+#ifndef _NATMAP_KSHIM_H
+#define _NATMAP_KSHIM_H
+
+/* built over the stand-ins, see xt_NATMAP_kunit.h */
+#define NATMAP_KSHIM		1
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef unsigned long long u64;
+typedef int32_t s32;
+typedef int64_t s64;
+typedef uint8_t __u8;
+typedef uint16_t __u16;
+typedef uint32_t __u32;
+typedef unsigned long long __u64;
+typedef uint16_t __be16;
+typedef uint32_t __be32;
+typedef unsigned int gfp_t;
+
+/* uapi netlink structures, they only need the types above */
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+
+/* annotations and compiler helpers */
+#define __rcu
+#define __percpu
+#define __user
+#define __read_mostly
+#define __ro_after_init
+#define __init
+#define __exit
+#define __net_init
+#define __net_exit
+#define __acquires(x)
+#define __releases(x)
+#define __printf(a, b)		__attribute__((format(printf, a, b)))
+#undef __always_inline
+#define __always_inline		inline __attribute__((always_inline))
+#define L1_CACHE_BYTES		64
+#define ____cacheline_aligned	__attribute__((aligned(64)))
+#define likely(x)		__builtin_expect(!!(x), 1)
+#define unlikely(x)		__builtin_expect(!!(x), 0)
+#define READ_ONCE(x)		(*(volatile typeof(x) *)&(x))
+#define WRITE_ONCE(x, v)	(*(volatile typeof(x) *)&(x) = (v))
+#define ARRAY_SIZE(a)		(sizeof(a) / sizeof((a)[0]))
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+#define min(a, b)		((a) < (b) ? (a) : (b))
+#define max(a, b)		((a) > (b) ? (a) : (b))
+#define min_t(t, a, b)		((t)(a) < (t)(b) ? (t)(a) : (t)(b))
+#define max_t(t, a, b)		((t)(a) > (t)(b) ? (t)(a) : (t)(b))
+#define struct_size(p, member, n) \
+	(sizeof(*(p)) + sizeof((p)->member[0]) * (size_t)(n))
+#define BUG_ON(c)		do { if (c) abort(); } while (0)
+#define WARN_ON(c) ({ \
+	int __w = !!(c); \
+	if (__w) \
+		fprintf(stderr, "WARN_ON at %s:%d\n", __FILE__, __LINE__); \
+	__w; })
+#define IS_ERR(p)		((unsigned long)(p) >= (unsigned long)-4095)
+#define ERR_PTR(e)		((void *)(long)(e))
+#define PTR_ERR(p)		((long)(p))
+#define U16_MAX			65535
+#define U32_MAX			0xffffffffU
+#define INADDR_ANY		0x00000000U
+#define INADDR_BROADCAST	0xffffffffU
+#define DIV_ROUND_UP(n, d)	(((n) + (d) - 1) / (d))
+#define PAGE_SIZE		4096UL
+#define S_IRUSR			0400
+#define S_IWUSR			0200
+
+/* module */
+#define KBUILD_MODNAME		"xt_NATMAP"
+#define MODULE_AUTHOR(x)
+#define MODULE_DESCRIPTION(x)
+#define MODULE_LICENSE(x)
+#define MODULE_VERSION(x)
+#define MODULE_ALIAS(x)
+#define MODULE_PARM_DESC(a, b)
+#define module_param(n, t, p)
+#define module_init(f)		int kshim_module_init(void) { return f(); }
+#define module_exit(f)		void kshim_module_exit(void) { f(); }
+#define THIS_MODULE		NULL
+#define KERNEL_VERSION(a, b, c)	(((a) << 16) + ((b) << 8) + (c))
+#define LINUX_VERSION_CODE	KERNEL_VERSION(6, 1, 0)
+#define __ARG_PLACEHOLDER_1	0,
+#define __take_second_arg(__ignored, val, ...) val
+#define ____is_defined(arg1_or_junk) __take_second_arg(arg1_or_junk 1, 0)
+#define ___is_defined(val)	____is_defined(__ARG_PLACEHOLDER_##val)
+#define __is_defined(x)		___is_defined(x)
+#define IS_ENABLED(option)	__is_defined(option)
+#define CONFIG_NF_CONNTRACK_MARK 1
+
+/* printing, logs go to stderr */
+#ifndef pr_fmt
+#define pr_fmt(fmt) fmt
+#endif
+#define pr_info(fmt, ...)	fprintf(stderr, pr_fmt(fmt), ##__VA_ARGS__)
+#define pr_err(fmt, ...)	fprintf(stderr, pr_fmt(fmt), ##__VA_ARGS__)
+#define pr_debug(fmt, ...)	do { } while (0)
+int scnprintf(char *buf, size_t size, const char *fmt, ...) __printf(3, 4);
+
+/* hlist */
+struct hlist_head {
+	struct hlist_node *first;
+};
+
+struct hlist_node {
+	struct hlist_node *next, **pprev;
+};
+
+#define INIT_HLIST_HEAD(ptr)	((ptr)->first = NULL)
+#define hlist_entry(ptr, type, member) container_of(ptr, type, member)
+#define hlist_entry_safe(ptr, type, member) ({ \
+	typeof(ptr) ____ptr = (ptr); \
+	____ptr ? hlist_entry(____ptr, type, member) : NULL; })
+#define hlist_first_rcu(head)	(*((struct hlist_node **)(&(head)->first)))
+#define hlist_next_rcu(node)	(*((struct hlist_node **)(&(node)->next)))
+#define hlist_for_each_entry(pos, head, member) \
+	for (pos = hlist_entry_safe((head)->first, typeof(*(pos)), member); \
+	     pos; \
+	     pos = hlist_entry_safe((pos)->member.next, typeof(*(pos)), member))
+#define hlist_for_each_entry_safe(pos, n, head, member) \
+	for (pos = hlist_entry_safe((head)->first, typeof(*pos), member); \
+	     pos && ({ n = pos->member.next; 1; }); \
+	     pos = hlist_entry_safe(n, typeof(*pos), member))
+
+static inline void
+__hlist_del(struct hlist_node *n)
+{
+	struct hlist_node *next = n->next, **pprev = n->pprev;
+
+	WRITE_ONCE(*pprev, next);
+	if (next)
+		next->pprev = pprev;
+}
+
+static inline void
+hlist_del(struct hlist_node *n)
+{
+	__hlist_del(n);
+	n->next = NULL;
+	n->pprev = NULL;
+}
+
+static inline void
+hlist_del_rcu(struct hlist_node *n)
+{
+	__hlist_del(n);
+	n->pprev = NULL;
+}
+
+static inline void
+hlist_add_head(struct hlist_node *n, struct hlist_head *h)
+{
+	struct hlist_node *first = h->first;
+
+	n->next = first;
+	if (first)
+		first->pprev = &n->next;
+	h->first = n;
+	n->pprev = &h->first;
+}
+
+static inline void
+hlist_add_head_rcu(struct hlist_node *n, struct hlist_head *h)
+{
+	struct hlist_node *first = h->first;
+
+	n->next = first;
+	n->pprev = &h->first;
+	__atomic_store_n(&h->first, n, __ATOMIC_RELEASE);
+	if (first)
+		first->pprev = &n->next;
+}
+
+static inline void
+hlist_replace_rcu(struct hlist_node *old, struct hlist_node *new)
+{
+	struct hlist_node *next = old->next;
+
+	new->next = next;
+	new->pprev = old->pprev;
+	__atomic_store_n(new->pprev, new, __ATOMIC_RELEASE);
+	if (next)
+		new->next->pprev = &new->next;
+	old->pprev = NULL;
+}
+
+/* RCU, see kshim.c */
+struct rcu_head {
+	struct rcu_head *next;
+	void (*func)(struct rcu_head *);
+};
+
+void rcu_read_lock(void);
+void rcu_read_unlock(void);
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *));
+void kshim_kfree_rcu(struct rcu_head *head, size_t off);
+#define kfree_rcu(p, field) \
+	kshim_kfree_rcu(&(p)->field, offsetof(typeof(*(p)), field))
+void synchronize_rcu(void);
+void rcu_barrier(void);
+#define rcu_dereference_raw(p)	__atomic_load_n(&(p), __ATOMIC_CONSUME)
+#define rcu_dereference(p)	rcu_dereference_raw(p)
+#define rcu_dereference_check(p, c) rcu_dereference_raw(p)
+#define rcu_dereference_protected(p, c) (p)
+#define rcu_access_pointer(p)	READ_ONCE(p)
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+#define RCU_INIT_POINTER(p, v)	WRITE_ONCE(p, v)
+#define smp_store_release(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define smp_load_acquire(p)	__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define lockdep_is_held(l)	1
+
+/* locks, bh and sleeping are no-ops */
+typedef struct {
+	pthread_mutex_t m;
+} spinlock_t;
+
+struct mutex {
+	pthread_mutex_t m;
+};
+
+#define DEFINE_MUTEX(n)		struct mutex n = { PTHREAD_MUTEX_INITIALIZER }
+#define spin_lock_init(l)	pthread_mutex_init(&(l)->m, NULL)
+#define spin_lock(l)		pthread_mutex_lock(&(l)->m)
+#define spin_unlock(l)		pthread_mutex_unlock(&(l)->m)
+#define spin_lock_bh(l)		pthread_mutex_lock(&(l)->m)
+#define spin_unlock_bh(l)	pthread_mutex_unlock(&(l)->m)
+#define mutex_init(l)		pthread_mutex_init(&(l)->m, NULL)
+#define mutex_lock(l)		pthread_mutex_lock(&(l)->m)
+#define mutex_unlock(l)		pthread_mutex_unlock(&(l)->m)
+#define cond_resched()		do { } while (0)
+#define local_bh_disable()	do { } while (0)
+#define local_bh_enable()	do { } while (0)
+
+typedef struct {
+	long counter;
+} atomic_long_t;
+
+#define atomic_long_read(v)	__atomic_load_n(&(v)->counter, __ATOMIC_RELAXED)
+#define atomic_long_set(v, i)	__atomic_store_n(&(v)->counter, (i), __ATOMIC_RELAXED)
+#define atomic_long_inc(v)	__atomic_fetch_add(&(v)->counter, 1, __ATOMIC_RELAXED)
+#define atomic_long_add(i, v)	__atomic_fetch_add(&(v)->counter, (i), __ATOMIC_RELAXED)
+#define atomic_long_inc_return(v) __atomic_add_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST)
+
+/* memory, counted in kshim_mem for per entry figures */
+#define GFP_KERNEL		0
+#define GFP_ATOMIC		1
+#define __GFP_NOWARN		0
+extern long kshim_mem;
+void *kshim_alloc(size_t size, bool zero);
+void kshim_free(const void *p);
+#define kmalloc(sz, f)		kshim_alloc(sz, false)
+#define kzalloc(sz, f)		kshim_alloc(sz, true)
+#define kcalloc(n, sz, f)	kshim_alloc((n) * (sz), true)
+#define kvmalloc(sz, f)		kshim_alloc(sz, false)
+#define kvzalloc(sz, f)		kshim_alloc(sz, true)
+#define vzalloc(sz)		kshim_alloc(sz, true)
+#define kfree(p)		kshim_free(p)
+#define kvfree(p)		kshim_free(p)
+
+/* per-cpu data, kshim_set_cpus() copies of each object */
+void kshim_set_cpus(int n);
+int kshim_nr_cpus(void);
+int kshim_this_cpu(void);
+void *kshim_alloc_percpu(size_t size);
+#define KSHIM_PCPU_STRIDE(sz)	(((sz) + 63) / 64 * 64)
+#define alloc_percpu(type)	((type *)kshim_alloc_percpu(sizeof(type)))
+#define alloc_percpu_gfp(type, gfp) alloc_percpu(type)
+#define free_percpu(p)		kshim_free(p)
+#define per_cpu_ptr(p, cpu) \
+	((typeof(p))((char *)(p) + (size_t)(cpu) * \
+	    KSHIM_PCPU_STRIDE(sizeof(*(p)))))
+#define this_cpu_ptr(p)		per_cpu_ptr(p, kshim_this_cpu())
+#define for_each_possible_cpu(cpu) \
+	for ((cpu) = 0; (cpu) < kshim_nr_cpus(); (cpu)++)
+/* counters of the packet path are not timed here, cpu 0 takes them */
+#define this_cpu_inc(v)		__atomic_fetch_add(&(v), 1, __ATOMIC_RELAXED)
+#define this_cpu_add(v, i)	__atomic_fetch_add(&(v), (i), __ATOMIC_RELAXED)
+
+/* byte order, hashing and bits */
+#define htonl(x)		__builtin_bswap32(x)
+#define ntohl(x)		__builtin_bswap32(x)
+#define htons(x)		__builtin_bswap16(x)
+#define ntohs(x)		__builtin_bswap16(x)
+
+static inline u32
+rol32(u32 w, unsigned int s)
+{
+	return (w << s) | (w >> ((-s) & 31));
+}
+
+#define JHASH_INITVAL		0xdeadbeef
+#define __jhash_final(a, b, c) { \
+	c ^= b; c -= rol32(b, 14); \
+	a ^= c; a -= rol32(c, 11); \
+	b ^= a; b -= rol32(a, 25); \
+	c ^= b; c -= rol32(b, 16); \
+	a ^= c; a -= rol32(c, 4); \
+	b ^= a; b -= rol32(a, 14); \
+	c ^= b; c -= rol32(b, 24); }
+
+static inline u32
+__jhash_nwords(u32 a, u32 b, u32 c, u32 initval)
+{
+	a += initval;
+	b += initval;
+	c += initval;
+	__jhash_final(a, b, c);
+	return c;
+}
+
+static inline u32
+jhash_2words(u32 a, u32 b, u32 initval)
+{
+	return __jhash_nwords(a, b, 0, initval + JHASH_INITVAL + (2 << 2));
+}
+
+static inline u32
+jhash_1word(u32 a, u32 initval)
+{
+	return __jhash_nwords(a, 0, 0, initval + JHASH_INITVAL + (1 << 2));
+}
+
+static inline u32
+jhash2(const u32 *k, u32 length, u32 initval)
+{
+	u32 a, b, c;
+
+	a = b = c = JHASH_INITVAL + (length << 2) + initval;
+	while (length > 3) {
+		a += k[0];
+		b += k[1];
+		c += k[2];
+		a -= c; a ^= rol32(c, 4); c += b;
+		b -= a; b ^= rol32(a, 6); a += c;
+		c -= b; c ^= rol32(b, 8); b += a;
+		a -= c; a ^= rol32(c, 16); c += b;
+		b -= a; b ^= rol32(a, 19); a += c;
+		c -= b; c ^= rol32(b, 4); b += a;
+		length -= 3;
+		k += 3;
+	}
+	switch (length) {
+	case 3: c += k[2]; /* fall through */
+	case 2: b += k[1]; /* fall through */
+	case 1: a += k[0];
+		__jhash_final(a, b, c);
+	}
+	return c;
+}
+
+static inline u32
+reciprocal_scale(u32 val, u32 ep_ro)
+{
+	return (u32)(((u64)val * ep_ro) >> 32);
+}
+
+#define BITS_PER_LONG		64
+#define BITS_TO_LONGS(n)	DIV_ROUND_UP(n, BITS_PER_LONG)
+#define DECLARE_BITMAP(n, bits)	unsigned long n[BITS_TO_LONGS(bits)]
+#define set_bit(nr, a) \
+	__atomic_fetch_or(&(a)[(nr) / 64], 1UL << ((nr) % 64), __ATOMIC_RELAXED)
+#define clear_bit(nr, a) \
+	__atomic_fetch_and(&(a)[(nr) / 64], ~(1UL << ((nr) % 64)), \
+	    __ATOMIC_RELAXED)
+
+static inline unsigned long
+find_last_bit(const unsigned long *a, unsigned long size)
+{
+	unsigned long i = size;
+
+	while (i--)
+		if ((READ_ONCE(a[i / 64]) >> (i % 64)) & 1)
+			return i;
+	return size;
+}
+
+#define ilog2(n)		(63 - __builtin_clzll(n))
+#define roundup_pow_of_two(n)	(1UL << (64 - __builtin_clzl((unsigned long)(n) - 1)))
+void get_random_bytes(void *buf, size_t n);
+u32 get_random_u32(void);
+
+/* time */
+typedef s64 ktime_t;
+u64 ktime_get_ns(void);
+#define ktime_get()		((ktime_t)ktime_get_ns())
+#define ktime_us_delta(a, b)	(((a) - (b)) / 1000)
+void msleep(unsigned int msecs);
+
+/* kernel threads are pthreads, kthread_stop() joins them */
+struct task_struct;
+struct task_struct *kthread_run(int (*fn)(void *), void *data,
+    const char *fmt, ...) __printf(3, 4);
+bool kthread_should_stop(void);
+int kthread_stop(struct task_struct *t);
+
+/* work items are queued and run by kshim_run_work() */
+struct work_struct {
+	void (*func)(struct work_struct *);
+	struct work_struct *next;
+	bool pending;
+};
+
+struct workqueue_struct;
+extern struct workqueue_struct *system_long_wq;
+#define WQ_UNBOUND		2
+#define INIT_WORK(w, f) \
+	do { (w)->func = (f); (w)->pending = false; } while (0)
+struct workqueue_struct *alloc_workqueue(const char *fmt, unsigned int flags,
+    int max_active);
+void destroy_workqueue(struct workqueue_struct *wq);
+bool queue_work(struct workqueue_struct *wq, struct work_struct *w);
+bool cancel_work_sync(struct work_struct *w);
+bool flush_work(struct work_struct *w);
+unsigned int kshim_run_work(void);
+
+/* static keys */
+struct static_key_false {
+	int enabled;
+};
+
+#define DEFINE_STATIC_KEY_FALSE(n) struct static_key_false n = { 0 }
+#define static_branch_unlikely(k) unlikely(READ_ONCE((k)->enabled))
+#define static_branch_inc(k)	__atomic_fetch_add(&(k)->enabled, 1, __ATOMIC_RELAXED)
+#define static_branch_dec(k)	__atomic_fetch_sub(&(k)->enabled, 1, __ATOMIC_RELAXED)
+
+/* tracepoints compile away */
+#define TP_PROTO(args...)	args
+#define TP_ARGS(args...)	args
+#define TRACE_EVENT(name, proto, args, struct, assign, print) \
+	static inline void trace_##name(proto) { }
+
+/* seq_file and proc, the benchmark does not read them */
+struct seq_operations;
+
+struct seq_file {
+	char *buf;
+	size_t size, count;
+	loff_t index;
+	void *private;
+	const struct seq_operations *op;
+};
+
+struct seq_operations {
+	void *(*start)(struct seq_file *, loff_t *);
+	void (*stop)(struct seq_file *, void *);
+	void *(*next)(struct seq_file *, void *, loff_t *);
+	int (*show)(struct seq_file *, void *);
+};
+
+struct inode {
+	void *data;
+};
+
+struct file {
+	void *private_data;
+};
+
+struct proc_dir_entry;
+
+struct proc_ops {
+	int (*proc_open)(struct inode *, struct file *);
+	ssize_t (*proc_read)(struct file *, char __user *, size_t, loff_t *);
+	ssize_t (*proc_write)(struct file *, const char __user *, size_t,
+	    loff_t *);
+	loff_t (*proc_lseek)(struct file *, loff_t, int);
+	int (*proc_release)(struct inode *, struct file *);
+};
+
+#define SEQ_START_TOKEN		((void *)1)
+#define PDE_DATA(inode)		((inode)->data)
+void seq_printf(struct seq_file *m, const char *fmt, ...) __printf(2, 3);
+void seq_puts(struct seq_file *m, const char *s);
+void seq_write(struct seq_file *m, const void *d, size_t len);
+bool seq_has_overflowed(struct seq_file *m);
+ssize_t seq_read(struct file *f, char __user *buf, size_t size, loff_t *ppos);
+loff_t seq_lseek(struct file *f, loff_t off, int whence);
+void *__seq_open_private(struct file *f, const struct seq_operations *op,
+    int psize);
+int seq_release_private(struct inode *i, struct file *f);
+int single_open(struct file *f, int (*show)(struct seq_file *, void *),
+    void *data);
+int single_release(struct inode *i, struct file *f);
+struct proc_dir_entry *proc_create_data(const char *name, int mode,
+    struct proc_dir_entry *parent, const struct proc_ops *ops, void *data);
+struct proc_dir_entry *proc_mkdir(const char *name,
+    struct proc_dir_entry *parent);
+void remove_proc_entry(const char *name, struct proc_dir_entry *parent);
+
+static inline unsigned long
+copy_from_user(void *to, const void *from, unsigned long n)
+{
+	memcpy(to, from, n);
+	return 0;
+}
+
+static inline unsigned long
+copy_to_user(void *to, const void *from, unsigned long n)
+{
+	memcpy(to, from, n);
+	return 0;
+}
+
+/* net namespaces, only init_net */
+struct net {
+	struct proc_dir_entry *proc_net, *proc_net_stat;
+	void *gen;
+};
+
+extern struct net init_net;
+
+struct pernet_operations {
+	int (*init)(struct net *);
+	void (*exit)(struct net *);
+	int *id;
+	size_t size;
+};
+
+void *net_generic(const struct net *net, unsigned int id);
+int register_pernet_subsys(struct pernet_operations *ops);
+void unregister_pernet_subsys(struct pernet_operations *ops);
+int in4_pton(const char *src, int srclen, u8 *dst, int delim,
+    const char **end);
+int in6_pton(const char *src, int srclen, u8 *dst, int delim,
+    const char **end);
+
+struct in6_addr {
+	union {
+		__u8 u6_addr8[16];
+		__be32 u6_addr32[4];
+	} in6_u;
+};
+
+#define s6_addr			in6_u.u6_addr8
+#define s6_addr32		in6_u.u6_addr32
+
+static inline bool
+ipv6_addr_equal(const struct in6_addr *a, const struct in6_addr *b)
+{
+	return !memcmp(a, b, sizeof(*a));
+}
+
+static inline void
+ipv6_addr_prefix(struct in6_addr *pfx, const struct in6_addr *addr, int plen)
+{
+	const int o = plen >> 3, b = plen & 7;
+
+	memset(pfx, 0, sizeof(*pfx));
+	memcpy(pfx->s6_addr, addr, o);
+	if (b)
+		pfx->s6_addr[o] = addr->s6_addr[o] & (0xff00 >> b);
+}
+
+static inline void
+ipv6_addr_prefix_copy(struct in6_addr *addr, const struct in6_addr *pfx,
+    int plen)
+{
+	const int o = plen >> 3, b = plen & 7;
+
+	memcpy(addr->s6_addr, pfx, o);
+	if (b)
+		addr->s6_addr[o] = (addr->s6_addr[o] & (0xff >> b)) |
+		    (pfx->s6_addr[o] & (0xff00 >> b));
+}
+
+/* packets */
+struct iphdr {
+	__u8 ihl_version, tos;
+	__be16 tot_len, id, frag_off;
+	__u8 ttl, protocol;
+	__u16 check;
+	__be32 saddr, daddr;
+};
+
+struct sk_buff {
+	unsigned int len;
+	__u32 mark, priority;
+	int skb_iif;
+	void *data;
+	void *nfct;
+	struct sock *sk;
+	unsigned int size;	/* netlink messages only */
+};
+
+static inline struct iphdr *
+ip_hdr(const struct sk_buff *skb)
+{
+	return (struct iphdr *)skb->data;
+}
+
+struct ipv6hdr {
+	__u8 priority_version, flow_lbl[3];
+	__be16 payload_len;
+	__u8 nexthdr, hop_limit;
+	struct in6_addr saddr, daddr;
+};
+
+static inline struct ipv6hdr *
+ipv6_hdr(const struct sk_buff *skb)
+{
+	return (struct ipv6hdr *)skb->data;
+}
+
+#define TC_H_MAJ(h)		((h) & 0xFFFF0000U)
+#define TC_H_MIN(h)		((h) & 0x0000FFFFU)
+#define TC_H_MAKE(maj, min)	(((maj) & 0xFFFF0000U) | ((min) & 0x0000FFFFU))
+
+/* netfilter, nf_nat_setup_info() only accepts */
+enum {
+	NFPROTO_IPV4 = 2,
+	NFPROTO_IPV6 = 10,
+};
+
+enum nf_inet_hooks {
+	NF_INET_PRE_ROUTING,
+	NF_INET_LOCAL_IN,
+	NF_INET_FORWARD,
+	NF_INET_LOCAL_OUT,
+	NF_INET_POST_ROUTING,
+};
+
+#define NF_DROP			0
+#define NF_ACCEPT		1
+#define XT_CONTINUE		0xFFFFFFFF
+#define NF_NAT_RANGE_MAP_IPS	(1 << 0)
+#define NF_NAT_RANGE_PROTO_SPECIFIED (1 << 1)
+#define NF_NAT_RANGE_PERSISTENT	(1 << 3)
+
+union nf_inet_addr {
+	__u32 all[4];
+	__be32 ip;
+	struct in6_addr in6;
+};
+
+union nf_conntrack_man_proto {
+	__be16 all;
+};
+
+struct nf_nat_range2 {
+	unsigned int flags;
+	union nf_inet_addr min_addr, max_addr;
+	union nf_conntrack_man_proto min_proto, max_proto, base_proto;
+};
+
+enum nf_nat_manip_type {
+	NF_NAT_MANIP_SRC,
+	NF_NAT_MANIP_DST,
+};
+
+enum ip_conntrack_info {
+	IP_CT_NEW = 2,
+};
+
+enum ip_conntrack_events {
+	IPCT_MARK = 6,
+};
+
+struct nf_conntrack_zone {
+	u16 id;
+};
+
+struct nf_conn {
+	u32 mark;
+	struct nf_conntrack_zone zone;
+};
+
+static inline const struct nf_conntrack_zone *
+nf_ct_zone(const struct nf_conn *ct)
+{
+	return &ct->zone;
+}
+
+static inline struct nf_conn *
+nf_ct_get(const struct sk_buff *skb, enum ip_conntrack_info *ctinfo)
+{
+	*ctinfo = IP_CT_NEW;
+	return skb->nfct;
+}
+
+static inline void
+nf_conntrack_event_cache(enum ip_conntrack_events e, struct nf_conn *ct)
+{
+}
+
+unsigned int nf_nat_setup_info(struct nf_conn *ct,
+    const struct nf_nat_range2 *range, enum nf_nat_manip_type maniptype);
+
+struct xt_action_param {
+	const void *targinfo;
+	unsigned int hooknum;
+};
+
+static inline unsigned int
+xt_hooknum(const struct xt_action_param *par)
+{
+	return par->hooknum;
+}
+
+struct xt_tgchk_param {
+	struct net *net;
+	const char *table;
+	void *targinfo;
+	unsigned int hook_mask;
+	u8 family;
+};
+
+struct xt_tgdtor_param {
+	struct net *net;
+	void *targinfo;
+};
+
+struct xt_target {
+	const char *name;
+	u8 revision, family;
+	unsigned int (*target)(struct sk_buff *,
+	    const struct xt_action_param *);
+	int (*checkentry)(const struct xt_tgchk_param *);
+	void (*destroy)(const struct xt_tgdtor_param *);
+	unsigned int targetsize, hooks;
+	const char *table;
+	void *me;
+};
+
+int xt_register_targets(struct xt_target *t, unsigned int n);
+void xt_unregister_targets(struct xt_target *t, unsigned int n);
+
+/* generic netlink, the family is registered but never called */
+struct sock {
+	struct net *net;
+};
+
+struct netlink_ext_ack {
+	const char *msg;
+};
+
+#define NL_SET_ERR_MSG(e, m)	do { if (e) (e)->msg = (m); } while (0)
+#define NL_SET_ERR_MSG_ATTR(e, a, m) NL_SET_ERR_MSG(e, m)
+#define NLMSG_DEFAULT_SIZE	4096
+
+enum {
+	NLA_UNSPEC,
+	NLA_U8,
+	NLA_U16,
+	NLA_U32,
+	NLA_U64,
+	NLA_STRING,
+	NLA_FLAG,
+	NLA_MSECS,
+	NLA_NESTED,
+	NLA_NUL_STRING = 10,
+	NLA_BINARY = 11,
+};
+
+struct nla_policy {
+	u8 type;
+	u16 len;
+};
+
+struct genl_info {
+	u32 snd_seq, snd_portid;
+	struct genlmsghdr *genlhdr;
+	struct nlattr **attrs;
+	struct net *net;
+	struct netlink_ext_ack *extack;
+};
+
+struct netlink_callback {
+	struct sk_buff *skb;
+	const struct nlmsghdr *nlh;
+	long args[6];
+};
+
+struct netlink_skb_parms {
+	u32 portid;
+};
+
+struct genl_ops {
+	int (*doit)(struct sk_buff *, struct genl_info *);
+	int (*dumpit)(struct sk_buff *, struct netlink_callback *);
+	u8 cmd, flags;
+};
+
+struct genl_family {
+	const char *name;
+	unsigned int version, maxattr;
+	const struct nla_policy *policy;
+	bool netnsok;
+	void *module;
+	const struct genl_ops *ops;
+	unsigned int n_ops, resv_start_op;
+};
+
+#define NETLINK_CB(skb)		(*(struct netlink_skb_parms *)&(skb)->mark)
+
+static inline struct net *
+sock_net(const struct sock *sk)
+{
+	return sk->net;
+}
+
+static inline struct net *
+genl_info_net(const struct genl_info *i)
+{
+	return i->net;
+}
+
+static inline void *
+nla_data(const struct nlattr *a)
+{
+	return (char *)a + NLA_HDRLEN;
+}
+
+static inline int
+nla_len(const struct nlattr *a)
+{
+	return a->nla_len - NLA_HDRLEN;
+}
+
+static inline int
+nla_type(const struct nlattr *a)
+{
+	return a->nla_type & NLA_TYPE_MASK;
+}
+
+static inline int
+nla_ok(const struct nlattr *a, int rem)
+{
+	return rem >= (int)sizeof(*a) && a->nla_len >= sizeof(*a) &&
+	    a->nla_len <= rem;
+}
+
+static inline struct nlattr *
+nla_next(const struct nlattr *a, int *rem)
+{
+	const int len = NLA_ALIGN(a->nla_len);
+
+	*rem -= len;
+	return (struct nlattr *)((char *)a + len);
+}
+
+#define nla_get_u8(a)		(*(u8 *)nla_data(a))
+#define nla_get_u32(a)		(*(u32 *)nla_data(a))
+#define nla_get_u64(a)		(*(u64 *)nla_data(a))
+#define nla_get_in_addr(a)	(*(__be32 *)nla_data(a))
+#define nla_attr_size(payload)	(NLA_HDRLEN + (payload))
+#define nla_total_size(payload)	NLA_ALIGN(nla_attr_size(payload))
+#define nla_for_each_attr(pos, head, len, rem) \
+	for (pos = head, rem = len; nla_ok(pos, rem); \
+	     pos = nla_next(pos, &(rem)))
+#define nla_for_each_nested(pos, nla, rem) \
+	nla_for_each_attr(pos, (struct nlattr *)nla_data(nla), \
+	    nla_len(nla), rem)
+
+int nlmsg_parse(const struct nlmsghdr *nlh, int hdrlen, struct nlattr **tb,
+    int max, const struct nla_policy *p, struct netlink_ext_ack *extack);
+int nla_strcmp(const struct nlattr *a, const char *s);
+int nla_parse_nested(struct nlattr **tb, int max, const struct nlattr *nla,
+    const struct nla_policy *p, struct netlink_ext_ack *extack);
+int nla_put(struct sk_buff *skb, int type, int len, const void *data);
+struct nlattr *nla_reserve(struct sk_buff *skb, int type, int len);
+struct nlattr *nla_nest_start(struct sk_buff *skb, int type);
+int nla_nest_end(struct sk_buff *skb, struct nlattr *start);
+void nla_nest_cancel(struct sk_buff *skb, struct nlattr *start);
+#define nla_put_u8(s, t, v)	({ u8 __v = (v); nla_put(s, t, 1, &__v); })
+#define nla_put_u32(s, t, v)	({ u32 __v = (v); nla_put(s, t, 4, &__v); })
+#define nla_put_in_addr(s, t, v) nla_put_u32(s, t, v)
+#define nla_put_in6_addr(s, t, v) nla_put(s, t, 16, v)
+#define nla_put_string(s, t, v)	nla_put(s, t, strlen(v) + 1, v)
+#define nla_put_u64_64bit(s, t, v, pad) \
+	({ u64 __v = (v); nla_put(s, t, 8, &__v); })
+#define skb_tailroom(skb)	((int)((skb)->size - (skb)->len))
+#define skb_trim(skb, l)	((skb)->len = min((skb)->len, (unsigned int)(l)))
+
+int genl_register_family(struct genl_family *f);
+int genl_unregister_family(const struct genl_family *f);
+void *genlmsg_put(struct sk_buff *skb, u32 portid, u32 seq,
+    const struct genl_family *f, int flags, u8 cmd);
+#define genlmsg_put_reply(skb, i, f, flags, cmd) \
+	genlmsg_put(skb, (i)->snd_portid, (i)->snd_seq, f, flags, cmd)
+void genlmsg_end(struct sk_buff *skb, void *hdr);
+void genlmsg_cancel(struct sk_buff *skb, void *hdr);
+struct sk_buff *nlmsg_new(size_t size, gfp_t flags);
+void nlmsg_free(struct sk_buff *skb);
+int genlmsg_reply(struct sk_buff *skb, struct genl_info *info);
+
+/* KUnit, kshim_kunit_run() runs the one suite of xt_NATMAP_kunit.h */
+struct kunit {
+	const char *name;
+	bool failed;
+};
+
+struct kunit_case {
+	void (*run_case)(struct kunit *);
+	const char *name;
+};
+
+struct kunit_suite {
+	const char *name;
+	struct kunit_case *test_cases;
+};
+
+extern struct kunit_suite *kshim_kunit_suite;
+#define kunit_test_suite(s)	struct kunit_suite *kshim_kunit_suite = &(s)
+#define KUNIT_CASE(f)		{ .run_case = (f), .name = #f }
+#define kunit_info(t, fmt, ...) \
+	printf("    # %s: " fmt, (t)->name, ##__VA_ARGS__)
+#define KUNIT_EXPECT_TRUE(t, c) do { \
+	if (!(c)) { \
+		(t)->failed = true; \
+		printf("    # %s: EXPECTATION FAILED at %s:%d: %s\n", \
+		    (t)->name, __FILE__, __LINE__, #c); \
+	} } while (0)
+#define KUNIT_EXPECT_EQ(t, a, b) KUNIT_EXPECT_TRUE(t, (a) == (b))
+int kshim_kunit_run(void);
+
+#endif /* _NATMAP_KSHIM_H */
@@ -0,0 +1,352 @@
+/*
+ * Microbenchmark of the NATMAP tables in userspace: xt_NATMAP.c itself
+ * is built against kshim.h, so the numbers are of the real insert,
+ * lookup and resize code, without the rest of the kernel.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ */
+
+/* stress and test cases come with the KUnit suite */
+#define NATMAP_KUNIT
+#include "../xt_NATMAP.c"
+
+#include <getopt.h>
+#include <unistd.h>
+
+#define BENCH_BATCH	65536	/* rules formatted per timed batch */
+
+static unsigned long lookups = 2000000;
+static unsigned int miss_pct = 10;
+
+static double
+secs(u64 t0)
+{
+	return (ktime_get_ns() - t0) / 1e9;
+}
+
+/* load count entries, returns rules per second of parse_rule() */
+static double
+bench_load(struct xt_natmap_htable *ht, const int kind,
+    const unsigned long count)
+{
+	static char rules[BENCH_BATCH][NATMAP_TEST_RULE_LEN];
+	static int len[BENCH_BATCH];
+	unsigned long i, j, n;
+	double t = 0;
+
+	for (i = 0; i < count; i += n) {
+		u64 t0;
+
+		n = min_t(unsigned long, count - i, BENCH_BATCH);
+		for (j = 0; j < n; j++)
+			len[j] = natmap_test_rule(rules[j], kind, i + j,
+			    natmap_test_post(i + j));
+		t0 = ktime_get_ns();
+		for (j = 0; j < n; j++)
+			if (parse_rule(ht, rules[j], len[j]))
+				fprintf(stderr, "rule failed: %s\n", rules[j]);
+		t += secs(t0);
+	}
+	return count / t;
+}
+
+/* keys to look up, miss_pct of them not in the table */
+static __be32 *
+bench_keys(const int kind, const unsigned long count, const bool post)
+{
+	__be32 *keys = malloc(lookups * sizeof(*keys));
+	unsigned long i;
+
+	if (!keys)
+		return NULL;
+	for (i = 0; i < lookups; i++) {
+		const unsigned long e = (unsigned long)rand() % count;
+
+		if ((unsigned int)rand() % 100 < miss_pct)
+			keys[i] = post ? natmap_test_post(count + e) :
+			    natmap_test_key(kind, count + e);
+		else if (natmap_test_prefix(kind, e) && !post)
+			/* some host inside the prefix */
+			keys[i] = natmap_test_key(kind, e) | htonl(rand() & 0xf);
+		else
+			keys[i] = post ? natmap_test_post(e) : natmap_test_key(kind, e);
+	}
+	return keys;
+}
+
+/* lookups per second, readers hold rcu per batch as softirq would */
+static double
+bench_lookup(const struct xt_natmap_htable *ht, const __be32 *keys,
+    const bool post, unsigned long *hits)
+{
+	const u64 t0 = ktime_get_ns();
+	unsigned long i, h = 0;
+
+	for (i = 0; i < lookups; ) {
+		const unsigned long end = min(i + 1024, lookups);
+		const struct natmap_data *d;
+
+		rcu_read_lock();
+		d = rcu_dereference(ht->data);
+		for (; i < end; i++) {
+			__be32 ip;
+
+			if (ht->mode & XT_NATMAP_IPV6) {
+				const struct in6_addr a = natmap_test_in6(post,
+				    keys[i]);
+
+				h += !!natmap6_lookup(ht, d, &a, post);
+			} else if (post)
+				h += !!natmap_pre_rfind(d, keys[i], &ip);
+			else if (natmap_tagged(ht->mode))
+				h += !!natmap_pre_tlookup(ht, d,
+				    natmap_test_tag(keys[i]), keys[i]);
+			else
+				h += !!natmap_pre_lookup(ht, d, keys[i]);
+		}
+		rcu_read_unlock();
+	}
+	*hits = h;
+	return lookups / secs(t0);
+}
+
+/* packets per second through the whole target, NAT setup stubbed */
+static double
+bench_target(struct xt_natmap_tginfo *tinfo, const int kind,
+    const __be32 *keys)
+{
+	struct iphdr iph = { .ihl_version = 0x45 };
+	struct ipv6hdr ip6h = { .priority_version = 0x60 };
+	struct nf_conn ct = { 0 };
+	struct sk_buff skb = { .len = 100, .data = &iph, .nfct = &ct };
+	struct xt_action_param par = {
+		.targinfo = tinfo,
+		.hooknum = NF_INET_POST_ROUTING,
+	};
+	const u64 t0 = ktime_get_ns();
+	unsigned long i;
+
+	if (kind == NATMAP_TEST_ADDR6)
+		skb.data = &ip6h;
+	for (i = 0; i < lookups; i++) {
+		if (kind == NATMAP_TEST_ADDR6)
+			ip6h.saddr = natmap_test_in6(false, keys[i]);
+		else if (kind == NATMAP_TEST_MARK)
+			skb.mark = keys[i];
+		else if (kind == NATMAP_TEST_PRIO)
+			skb.priority = keys[i];
+		else
+			iph.saddr = keys[i];
+		ct.zone.id = natmap_test_tag(keys[i]);
+		natmap_tg(&skb, &par);
+	}
+	return lookups / secs(t0);
+}
+
+static void
+bench_run(const int kind, const unsigned long count)
+{
+	struct xt_natmap_tginfo tinfo = { .mode = natmap_test_kinds[kind].mode };
+	struct xt_natmap_htable *ht;
+	unsigned long hits, rhits = 0;
+	double ins, settle, look, rlook = 0, tg;
+	__be32 *keys, *rkeys = NULL;
+	long mem0, mem;
+	u64 t0;
+
+	strcpy(tinfo.name, "bench");
+	mem0 = kshim_mem;
+	mutex_lock(&natmap_mutex);
+	if (htable_create(&init_net, &tinfo)) {
+		mutex_unlock(&natmap_mutex);
+		fprintf(stderr, "cannot create table\n");
+		exit(1);
+	}
+	mutex_unlock(&natmap_mutex);
+	ht = tinfo.ht;
+
+	ins = bench_load(ht, kind, count);
+	t0 = ktime_get_ns();
+	kshim_run_work();
+	settle = secs(t0);
+	rcu_barrier();
+	mem = kshim_mem - mem0;
+
+	keys = bench_keys(kind, count, false);
+	if (kind == NATMAP_TEST_2WAY)
+		rkeys = bench_keys(kind, count, true);
+	if (!keys || (kind == NATMAP_TEST_2WAY && !rkeys)) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	look = bench_lookup(ht, keys, false, &hits);
+	if (rkeys)
+		rlook = bench_lookup(ht, rkeys, true, &rhits);
+	tg = bench_target(&tinfo, kind, keys);
+
+	printf("%-5s %9lu %9.0f %6.1f %3u %8u %6.1f %7.2f %7.2f %5.1f%%",
+	    natmap_test_kinds[kind].name, count, ins, settle * 1e3, ht->resizes,
+	    ht->resize_us, (double)mem / count, look / 1e6, tg / 1e6,
+	    100.0 * hits / lookups);
+	if (rkeys)
+		printf("  rev %7.2f %5.1f%%", rlook / 1e6,
+		    100.0 * rhits / lookups);
+	printf("\n");
+	fflush(stdout);
+
+	free(keys);
+	free(rkeys);
+	mutex_lock(&natmap_mutex);
+	htable_put(ht);
+	mutex_unlock(&natmap_mutex);
+	kshim_run_work();
+	rcu_barrier();
+}
+
+/* readers against writers, see natmap_stress_run() */
+static int
+stress_run(const int kind, const unsigned long count, const double secs_max,
+    const int readers, const int writers)
+{
+	struct natmap_stress st;
+	int err;
+
+	err = natmap_stress_run(&st, kind, count, secs_max * 1000, readers,
+	    writers);
+	if (err) {
+		fprintf(stderr, "stress run failed: %d\n", err);
+		return 1;
+	}
+	printf("%-5s %9lu %7d %7d %10.2f %10.3f %5u %9ld %s\n",
+	    natmap_test_kinds[kind].name, count, readers, writers,
+	    atomic_long_read(&st.lookups) / secs_max / 1e6,
+	    atomic_long_read(&st.ops) / secs_max / 1e6, st.resizes,
+	    st.resize_miss, atomic_long_read(&st.errors) ? "FAILED" : "ok");
+	fflush(stdout);
+	kshim_run_work();
+	rcu_barrier();
+	return atomic_long_read(&st.errors) != 0;
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr,
+	    "Usage: %s [-n COUNT[,COUNT...]] [-k KIND[,KIND...]] [-l LOOKUPS]\n"
+	    "          [-m MISS%%] [-s HASHSIZE] [-c CPUS]\n"
+	    "       %s -S SECONDS [-r READERS] [-w WRITERS] [-n ...] [-k ...]\n"
+	    "       %s -T\n"
+	    "  kinds: addr cidr 2way mark prio addr6 zaddr range (default all)\n"
+	    "  CPUS is the count of per-cpu copies in B/ent (default 1)\n"
+	    "  counts default to 10000,100000,1000000\n"
+	    "  -S runs readers against writers changing the table\n"
+	    "  -T runs the KUnit suite of xt_NATMAP_kunit.h\n",
+	    prog, prog, prog);
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *counts = "10000,100000,1000000";
+	unsigned int kmask = 0;
+	char *s, *tok, *save;
+	double stress = 0;
+	bool test = false;
+	int readers = 4, writers = 2;
+	int opt, k, err = 0;
+
+	while ((opt = getopt(argc, argv, "n:k:l:m:s:c:S:r:w:Th")) != -1) {
+		switch (opt) {
+		case 'n':
+			counts = optarg;
+			break;
+		case 'k':
+			for (tok = strtok_r(optarg, ",", &save); tok;
+			     tok = strtok_r(NULL, ",", &save)) {
+				for (k = 0; k < NATMAP_TEST_KINDS; k++)
+					if (!strcmp(tok, natmap_test_kinds[k].name))
+						break;
+				if (k == NATMAP_TEST_KINDS)
+					usage(argv[0]);
+				kmask |= 1 << k;
+			}
+			break;
+		case 'l':
+			lookups = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			miss_pct = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			hashsize = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			kshim_set_cpus(atoi(optarg));
+			break;
+		case 'S':
+			stress = strtod(optarg, NULL);
+			break;
+		case 'r':
+			readers = atoi(optarg);
+			break;
+		case 'w':
+			writers = atoi(optarg);
+			break;
+		case 'T':
+			test = true;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (!kmask)
+		kmask = (1 << NATMAP_TEST_KINDS) - 1;
+	if (!lookups || miss_pct > 100 || readers < 1 || writers < 1 ||
+	    readers + writers > NATMAP_STRESS_THREADS)
+		usage(argv[0]);
+	if (stress)
+		kshim_set_cpus(readers + writers);
+
+	disable_log = 1;
+	srand(1);
+	if (kshim_module_init())
+		return 1;
+	if (test) {
+		err = kshim_kunit_run();
+		kshim_module_exit();
+		return err;
+	}
+
+	if (stress) {
+		printf("# kind    count readers writers  lookups/M  changes/M"
+		    "   rsz  rsz_miss\n");
+		printf("#                                   (per s)    (per s)"
+		    "\n");
+	} else {
+		printf("# kind    count  insert/s  settle rsz rsz_last  B/ent"
+		    " lookup/M target/M  hits\n");
+		printf("#                             (ms)          (us)"
+		    "         (per s)  (per s)\n");
+	}
+	for (k = 0; k < NATMAP_TEST_KINDS; k++) {
+		if (!(kmask & (1 << k)))
+			continue;
+		s = strdup(counts);
+		for (tok = strtok_r(s, ",", &save); tok;
+		     tok = strtok_r(NULL, ",", &save))
+			if (stress)
+				err |= stress_run(k, strtoul(tok, NULL, 0),
+				    stress, readers, writers);
+			else
+				bench_run(k, strtoul(tok, NULL, 0));
+		free(s);
+	}
+
+	kshim_module_exit();
+	return err;
+}
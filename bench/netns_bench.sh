@@ -0,0 +1,247 @@
+#!/bin/sh
+# End-to-end benchmark of xt_NATMAP on one host, no external network.
+#
+#   pktgen --> nmb0 ==veth== nmb1 [ns nmr: NATMAP] nmb2 ==veth== nmb3 [ns nms]
+#
+# pktgen (init netns only) sends UDP from random sources of the prenat
+# pool with random ports, so every packet is a new connection through
+# the NATMAP rule of the router namespace. Reports new connections and
+# packets per second, softirq CPU, and with perf the share of cycles in
+# natmap_tg and nf_nat_setup_info, for each table mode and size.
+#
+# Settings from environment, e.g. make netns-bench NETNS_ARGS="SIZES=1000000":
+#   MODES     addr mark prio 2way cgnat
+#   SIZES     table entries, "1000 100000"
+#   MIX       percent of entries that are /24 prefixes (addr modes), 0
+#   DURATION  seconds per run, 10
+#   THREADS   pktgen threads, 1
+#   PKT_SIZE  bytes, 64
+
+PATH=$PATH:/usr/local/sbin:/usr/sbin:/sbin
+
+MODES=${MODES:-"addr mark prio 2way cgnat"}
+SIZES=${SIZES:-"1000 100000"}
+MIX=${MIX:-0}
+DURATION=${DURATION:-10}
+THREADS=${THREADS:-1}
+PKT_SIZE=${PKT_SIZE:-64}
+for a in "$@"; do
+  case "$a" in
+    *=*) eval "${a%%=*}=\"\${a#*=}\"" ;;
+    *) echo "usage: $0 [VAR=value]..." >&2; exit 2 ;;
+  esac
+done
+
+R=nmr   # router netns
+S=nms   # sink netns
+T=bench # table
+PG=/proc/net/pktgen
+HERE=$(cd "$(dirname "$0")/.." && pwd)
+TMP=`mktemp -d /tmp/natmap-bench.XXXXXX`
+
+die() {
+  echo "$0: $*" >&2
+  exit 1
+}
+
+rx() {
+  ip netns exec $S cat /sys/class/net/nmb3/statistics/rx_packets
+}
+
+# sum of conntrack inserts of all cpus in the router netns,
+# columns differ between kernels
+ct_inserts() {
+  ip netns exec $R awk '
+    function hex(s,  i, v) {
+      v = 0
+      for (i = 1; i <= length(s); i++)
+        v = v * 16 + index("0123456789abcdef", substr(s, i, 1)) - 1
+      return v
+    }
+    NR == 1 { for (i = 1; i <= NF; i++) if ($i == "insert") c = i; next }
+    { n += hex($c) }
+    END { print n }' /proc/net/stat/nf_conntrack
+}
+
+# softirq and total jiffies of all cpus
+cpu_stat() {
+  awk '/^cpu / { t = 0; for (i = 2; i <= NF; i++) t += $i; print $8, t }' /proc/stat
+}
+
+cleanup() {
+  [ -w $PG/pgctrl ] && echo stop > $PG/pgctrl 2>/dev/null
+  for i in `seq 0 $((THREADS - 1))`; do
+    [ -w $PG/kpktgend_$i ] && echo rem_device_all > $PG/kpktgend_$i
+  done
+  ip link del nmb0 2>/dev/null
+  ip netns del $R 2>/dev/null
+  ip netns del $S 2>/dev/null
+  rm -rf "$TMP"
+}
+
+setup() {
+  ip netns add $R && ip netns add $S || die "cannot create namespaces"
+  ip link add nmb0 type veth peer name nmb1 netns $R
+  ip link add nmb2 netns $R type veth peer name nmb3 netns $S
+  ip link set nmb0 up
+  ip -n $R addr add 198.18.0.1/24 dev nmb1
+  ip -n $R addr add 198.18.1.1/24 dev nmb2
+  ip -n $R link set nmb1 up
+  ip -n $R link set nmb2 up
+  ip -n $S addr add 198.18.1.2/24 dev nmb3
+  ip -n $S link set nmb3 up
+  ip -n $S route add default via 198.18.1.1
+  ip netns exec $R sysctl -qw net.ipv4.ip_forward=1
+  ip netns exec $R sysctl -qw net.ipv4.conf.all.rp_filter=0
+  ip netns exec $R sysctl -qw net.ipv4.conf.nmb1.rp_filter=0
+  ip netns exec $R sysctl -qw net.netfilter.nf_conntrack_udp_timeout=1 2>/dev/null
+  # the sink only counts
+  ip netns exec $S iptables -t raw -A PREROUTING -j DROP
+  # resolve the sink once, pktgen does no ARP
+  ip netns exec $R ping -c1 -W1 198.18.1.2 >/dev/null 2>&1
+}
+
+# rules: N entries of the prenat pool 10.0.0.0/8 (or marks, prios)
+# mapped into 100.64.0.0/10
+rules() {
+  awk -v n=$2 -v mode=$1 -v mix=$MIX 'BEGIN {
+    for (i = 0; i < n; i++) {
+      p = sprintf("%d.%d.%d.%d", 100 + int(i / 4194304) % 4 + 0, \
+        64 + int(i / 65536) % 64, int(i / 256) % 256, i % 256)
+      if (mode == "mark")
+        printf("+0x%x=%s\n", i + 1, p)
+      else if (mode == "prio" && i < 65535)
+        printf("+1:%x=%s\n", i + 1, p)
+      else if (mode == "prio")
+        break
+      else if (mode == "cgnat")
+        printf("+10.%d.%d.0/24=%s\n", int(i / 256) % 256, i % 256, p)
+      else if (mode != "2way" && i * 100 < mix * n)
+        printf("+10.%d.%d.0/24=%s\n", 128 + int(i / 256) % 128, i % 256, p)
+      else
+        printf("+10.%d.%d.%d=%s\n", int(i / 65536) % 256, \
+          int(i / 256) % 256, i % 256, p)
+    }
+  }'
+}
+
+# source range of pktgen covering the table keys
+src_max() {
+  case $1 in
+    cgnat) echo 10.255.255.254 ;;
+    *) n=$(($2 - 1)); echo 10.$((n / 65536 % 256)).$((n / 256 % 256)).$((n % 256)) ;;
+  esac
+}
+
+table() {
+  mode=$1
+  size=$2
+  opt="--nm-mode addr"
+  case $mode in
+    mark) opt="--nm-mode mark" ;;
+    prio) opt="--nm-mode prio" ;;
+    2way) opt="--nm-mode addr --nm-2way" ;;
+    cgnat) opt="--nm-mode addr --nm-cgnt" ;;
+  esac
+  ipt="ip netns exec $R iptables"
+  $ipt -t nat -F
+  $ipt -t mangle -F
+  case $mode in
+    # marks 1..size spread by source address
+    mark) $ipt -t mangle -A PREROUTING -i nmb1 -j HMARK --hmark-tuple src \
+            --hmark-mod $size --hmark-offset 1 --hmark-rnd 1 ;;
+    # priority cannot be spread per flow here, all hit one entry
+    prio) $ipt -t mangle -A POSTROUTING -o nmb2 -j CLASSIFY --set-class 1:1 ;;
+  esac
+  $ipt -t nat -A POSTROUTING -o nmb2 -j NATMAP --nm-name $T $opt || return 1
+  [ $mode = 2way ] && $ipt -t nat -A PREROUTING -i nmb2 -j NATMAP --nm-name $T $opt
+  rules $mode $size > "$TMP/rules"
+  ip netns exec $R sh -c "cat '$TMP/rules' > /proc/net/ipt_NATMAP/$T" ||
+    return 1
+  ip netns exec $R sh -c "echo +hist > /proc/net/ipt_NATMAP/$T"
+}
+
+pktgen_start() {
+  mac=`ip -n $R -o link show nmb1 | sed 's/.*link\/ether \([^ ]*\).*/\1/'`
+  for i in `seq 0 $((THREADS - 1))`; do
+    dev=nmb0@$i
+    echo rem_device_all > $PG/kpktgend_$i
+    echo "add_device $dev" > $PG/kpktgend_$i
+    for c in "count 0" "clone_skb 0" "pkt_size $PKT_SIZE" "delay 0" \
+        "dst 198.18.1.2" "dst_mac $mac" "src_min 10.0.0.0" \
+        "src_max `src_max $1 $2`" "flag IPSRC_RND" "udp_src_min 1024" \
+        "udp_src_max 65535" "flag UDPSRC_RND" "udp_dst_min 9" \
+        "udp_dst_max 9"; do
+      echo "$c" > $PG/$dev
+    done
+  done
+  echo start > $PG/pgctrl &
+}
+
+# inclusive share of cycles by symbol
+perf_share() {
+  perf report -i "$TMP/perf.data" --children --sort symbol --stdio -q \
+      2>/dev/null | awk -v s="$1" '$NF ~ s { sub("%", "", $1); v += $1 }
+    END { printf("%.1f", v) }'
+}
+
+run() {
+  mode=$1
+  size=$2
+  table $mode $size || { echo "$mode $size: cannot set up table" >&2; return; }
+  pktgen_start $mode $size
+  sleep 1 # warm up
+  rx0=`rx`; ct0=`ct_inserts`; set -- `cpu_stat`; si0=$1; tot0=$2
+  if [ "$PERF" ]; then
+    perf record -a -g -o "$TMP/perf.data" -- sleep $DURATION >/dev/null 2>&1
+  else
+    sleep $DURATION
+  fi
+  rx1=`rx`; ct1=`ct_inserts`; set -- `cpu_stat`; si1=$1; tot1=$2
+  echo stop > $PG/pgctrl
+  wait
+
+  ncpu=`nproc`
+  tg=-; nat=-
+  if [ "$PERF" ]; then
+    tg=`perf_share '^natmap_tg'`
+    nat=`perf_share '^nf_nat_setup_info$'`
+  fi
+  printf "%-5s %10s %10d %10d %8.1f %9s %12s\n" $mode $size \
+    $(((ct1 - ct0) / DURATION)) $(((rx1 - rx0) / DURATION)) \
+    `echo "$si0 $tot0 $si1 $tot1 $ncpu" |
+      awk '{ print ($3 - $1) * 100 * $5 / ($4 - $2) }'` $tg $nat
+  ip netns exec $R cat /proc/net/stat/ipt_NATMAP/$T > "$TMP/hist.$mode.$size"
+  ip netns exec $R iptables -t nat -F
+  ip netns exec $R iptables -t mangle -F
+  ip netns exec $R conntrack -F 2>/dev/null
+}
+
+[ `id -u` = 0 ] || die "must run as root"
+modprobe pktgen || die "pktgen module is needed"
+if ! lsmod | grep -q '^xt_NATMAP'; then
+  insmod "$HERE/xt_NATMAP.ko" disable_log=1 || die "cannot load xt_NATMAP.ko"
+fi
+[ "$THREADS" -le `nproc` ] || die "THREADS above cpu count"
+which perf >/dev/null 2>&1 && PERF=1
+# iptables finds libxt_NATMAP.so in the tree if not installed
+if [ -e "$HERE/libxt_NATMAP.so" ]; then
+  XTLIB=`pkg-config --variable xtlibdir xtables 2>/dev/null`
+  export XTABLES_LIBDIR="$HERE:${XTLIB:-/usr/lib/xtables}"
+fi
+
+trap cleanup EXIT INT TERM
+setup
+
+echo "# mode      size     conn/s        pps  softirq natmap_tg nf_nat_setup"
+echo "#                                         (% cpu) (% cycles, children)"
+for mode in $MODES; do
+  for size in $SIZES; do
+    run $mode $size
+  done
+done
+for f in "$TMP"/hist.*; do
+  [ -s "$f" ] || continue
+  echo "# latency ${f##*/hist.}"
+  cat "$f"
+done
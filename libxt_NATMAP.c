@@ -38,11 +38,21 @@ static void natmap_help(void)
 "natmap match options:\n"
 "  --nm-name <name>   Name of the natmap set to be used.\n"
 "                     DEFAULT will be used if none given.\n"
-"  --nm-mode <mode>   Address match: prio, mark or addr (default).\n"
+"  --nm-mode <mode>   Address match: prio, mark or addr (default),\n"
+"                     or key: daddr, zone+addr, mark+addr (addr entries),\n"
+"                     ctmark, zone or iif (mark entries).\n"
+"  --nm-mask <mask>   Mask of skb or ct mark in mark keys.\n"
 "  --nm-pers          Persistent mode when flushing NAT tables.\n"
 "  --nm-drop          Hotdrop mode for not-matching packets.\n"
 "  --nm-cgnt          Carrier-Grade NAT variant of postnat/cidr mode.\n"
 "  --nm-2way          Two-way 1:1 DNAT/SNAT mode.\n"
+"                     ip6tables supports addr mode only, without CG-NAT.\n"
+"  --nm-ctmark        Set conntrack mark to id of matched entry.\n"
+"  --nm-ports <min-max>\n"
+"                     Port range to split in CG-NAT mode.\n"
+"                     1536-65535 will be used if none given.\n"
+"  --nm-block <ports> CG-NAT ports per prenat address.\n"
+"                     Range split evenly if none given.\n"
 "xt_NATMAP by: Stasn77 <stasn77@gmail.com>.\n");
 }
 
@@ -53,6 +63,10 @@ enum {
 	O_DROP,
 	O_CGNT,
 	O_2WAY,
+	O_CTMK,
+	O_PORTS,
+	O_BLOCK,
+	O_MASK,
 };
 
 #define s struct xt_natmap_tginfo
@@ -64,12 +78,44 @@ static const struct xt_option_entry natmap_opts[] = {
 	{.name = "nm-drop", .id = O_DROP, .type = XTTYPE_NONE},
 	{.name = "nm-cgnt", .id = O_CGNT, .type = XTTYPE_NONE},
 	{.name = "nm-2way", .id = O_2WAY, .type = XTTYPE_NONE},
+	{.name = "nm-ctmark", .id = O_CTMK, .type = XTTYPE_NONE},
+	{.name = "nm-ports", .id = O_PORTS, .type = XTTYPE_PORTRC},
+	{.name = "nm-block", .id = O_BLOCK, .type = XTTYPE_UINT16,
+	 .flags = XTOPT_PUT, XTOPT_POINTER(s, block)},
+	{.name = "nm-mask", .id = O_MASK, .type = XTTYPE_UINT32,
+	 .flags = XTOPT_PUT, XTOPT_POINTER(s, markmask)},
 	XTOPT_TABLEEND,
 };
 #undef s
 
-static int parse_mode(uint8_t *mode, const char *option_arg)
+/* other key sources, in XT_NATMAP_KEY order */
+static const struct {
+	const char *name;
+	uint16_t mode;
+} natmap_keys[] = {
+	{ "daddr",	XT_NATMAP_ADDR | XT_NATMAP_KEY_DADDR },
+	{ "zone+addr",	XT_NATMAP_ADDR | XT_NATMAP_KEY_ZONE_ADDR },
+	{ "mark+addr",	XT_NATMAP_ADDR | XT_NATMAP_KEY_MARK_ADDR },
+	{ "ctmark",	XT_NATMAP_MARK | XT_NATMAP_KEY_CTMARK },
+	{ "zone",	XT_NATMAP_MARK | XT_NATMAP_KEY_ZONE },
+	{ "iif",	XT_NATMAP_MARK | XT_NATMAP_KEY_IIF },
+};
+
+static int parse_mode(uint16_t *mode, const char *option_arg)
 {
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(natmap_keys); i++) {
+		if (strcasecmp(natmap_keys[i].name, option_arg))
+			continue;
+		if (*mode & (XT_NATMAP_2WAY | XT_NATMAP_CGNT))
+			xtables_error(PARAMETER_PROBLEM,
+			    "%s key is not possible with 2-way or CG-NAT "
+			    "mode\n", natmap_keys[i].name);
+		*mode &= ~(XT_NATMAP_MODE | XT_NATMAP_KEY);
+		*mode |= natmap_keys[i].mode;
+		return 0;
+	}
 	if (strcasecmp("prio", option_arg) == 0) {
 		*mode &= ~XT_NATMAP_ADDR;
 		*mode |= XT_NATMAP_PRIO;
@@ -89,10 +135,13 @@ static int parse_mode(uint8_t *mode, const char *option_arg)
 	return 0;
 }
 
-static void print_mode(uint8_t mode)
+static void print_mode(uint16_t mode)
 {
 	/* SRC is primary and exclusive with SKB*/
-	if (mode & XT_NATMAP_PRIO)
+	if (mode & XT_NATMAP_KEY)
+		fputs(natmap_keys[((mode & XT_NATMAP_KEY) >>
+		    XT_NATMAP_KEY_SHIFT) - 1].name, stdout);
+	else if (mode & XT_NATMAP_PRIO)
 		fputs("prio", stdout);
 	else if (mode & XT_NATMAP_MARK)
 		fputs("mark", stdout);
@@ -118,14 +167,31 @@ static void natmap_parse(struct xt_option_call *cb)
 		info->mode |= XT_NATMAP_DROP;
 		break;
 	case O_CGNT:
+		if (info->mode & XT_NATMAP_KEY)
+			xtables_error(PARAMETER_PROBLEM,
+			    "CG-NAT mode is not possible with this key\n");
 		info->mode |= XT_NATMAP_CGNT;
 		break;
 	case O_2WAY:
-		if (!(info->mode & XT_NATMAP_ADDR))
+		if (!(info->mode & XT_NATMAP_ADDR) ||
+		    (info->mode & XT_NATMAP_KEY))
 			xtables_error(PARAMETER_PROBLEM,
 			    "2-way mode only available with ADDR mode\n");
 		info->mode |= XT_NATMAP_2WAY;
 		break;
+	case O_CTMK:
+		info->mode |= XT_NATMAP_CTMK;
+		break;
+	case O_PORTS:
+		if (cb->nvals == 1)
+			cb->val.port_range[1] = cb->val.port_range[0];
+		if (cb->val.port_range[0] > cb->val.port_range[1])
+			xtables_error(PARAMETER_PROBLEM,
+			    "Port range min must not exceed max\n");
+		info->range.flags |= NF_NAT_RANGE_PROTO_SPECIFIED;
+		info->range.min_proto.all = htons(cb->val.port_range[0]);
+		info->range.max_proto.all = htons(cb->val.port_range[1]);
+		break;
 	}
 }
 
@@ -157,6 +223,15 @@ int numeric)
 		printf(" cgnt");
 	if (tginfo->mode & XT_NATMAP_2WAY)
 		printf(" 2way");
+	if (tginfo->mode & XT_NATMAP_CTMK)
+		printf(" ctmark");
+	if (tginfo->range.flags & NF_NAT_RANGE_PROTO_SPECIFIED)
+		printf(" ports=%u-%u", ntohs(tginfo->range.min_proto.all),
+		    ntohs(tginfo->range.max_proto.all));
+	if (tginfo->block)
+		printf(" block=%u", tginfo->block);
+	if (tginfo->markmask)
+		printf(" mask=0x%x", tginfo->markmask);
 }
 
 static void natmap_save(const void *ip, const struct xt_entry_target *target)
@@ -173,6 +248,15 @@ static void natmap_save(const void *ip, const struct xt_entry_target *target)
 		printf(" --nm-cgnt");
 	if (info->mode & XT_NATMAP_2WAY)
 		printf(" --nm-2way");
+	if (info->mode & XT_NATMAP_CTMK)
+		printf(" --nm-ctmark");
+	if (info->range.flags & NF_NAT_RANGE_PROTO_SPECIFIED)
+		printf(" --nm-ports %u-%u", ntohs(info->range.min_proto.all),
+		    ntohs(info->range.max_proto.all));
+	if (info->block)
+		printf(" --nm-block %u", info->block);
+	if (info->markmask)
+		printf(" --nm-mask 0x%x", info->markmask);
 	if (info->mode & XT_NATMAP_MODE) {
 		fputs(" --nm-mode ", stdout);
 		print_mode(info->mode);
@@ -180,9 +264,22 @@ static void natmap_save(const void *ip, const struct xt_entry_target *target)
 
 }
 
+/* ip6tables tables map prefixes by address only */
+static void natmap6_check(struct xt_fcheck_call *cb)
+{
+	const struct xt_natmap_tginfo *info = cb->data;
+
+	if (info->mode & (XT_NATMAP_PRIO | XT_NATMAP_MARK | XT_NATMAP_CGNT |
+	    XT_NATMAP_KEY))
+		xtables_error(PARAMETER_PROBLEM,
+		    "IPv6 NATMAP is only available in ADDR mode without "
+		    "CG-NAT\n");
+}
+
 static struct xtables_target natmap_tg_reg[] = {
 	{
 		.name		= "NATMAP",
+		.revision	= 1,
 		.version	= XTABLES_VERSION,
 		.family		= NFPROTO_IPV4,
 		.size		= XT_ALIGN(sizeof(struct xt_natmap_tginfo)),
@@ -194,6 +291,21 @@ static struct xtables_target natmap_tg_reg[] = {
 		.x6_options	= natmap_opts,
 		.x6_parse	= natmap_parse,
 	},
+	{
+		.name		= "NATMAP",
+		.revision	= 1,
+		.version	= XTABLES_VERSION,
+		.family		= NFPROTO_IPV6,
+		.size		= XT_ALIGN(sizeof(struct xt_natmap_tginfo)),
+		.userspacesize	= offsetof(struct xt_natmap_tginfo, ht),
+		.help		= natmap_help,
+		.init		= natmap_init,
+		.print		= natmap_print,
+		.save		= natmap_save,
+		.x6_options	= natmap_opts,
+		.x6_parse	= natmap_parse,
+		.x6_fcheck	= natmap6_check,
+	},
 };
 
 void _init(void)
@@ -0,0 +1,1086 @@
+/*
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Bulk control of NATMAP tables over generic netlink, rules use the
+ * same text syntax as /proc/net/ipt_NATMAP/<table>. */
+
+#define _DEFAULT_SOURCE 1
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+#include <linux/netfilter/nf_nat.h>
+#include "xt_NATMAP.h"
+
+#ifndef SOL_NETLINK
+# define SOL_NETLINK 270
+#endif
+
+/* entries per message, keeps ENTRIES nest below 64K */
+#define NATMAP_BATCH	1024
+#define MSG_SIZE	(64 * 1024)
+/* snapshot records per RESTORE message, in bytes */
+#define SNAP_CHUNK	(48 * 1024)
+#define RCV_SIZE	(128 * 1024)
+
+struct nl {
+	int fd;
+	uint16_t family;
+	uint32_t seq;
+};
+
+struct rule {
+	uint32_t prenat;
+	uint8_t prenat_cidr;
+	uint32_t prenat_last;
+	uint32_t from, to;
+	uint8_t postnat_cidr;
+	uint32_t id;
+	uint32_t tag;
+	struct in6_addr prenat6, postnat6;
+	bool has_prenat, has_postnat, has_to, has_id, has_tag;
+	bool has_last, ipv6;
+};
+
+static uint32_t msgbuf[MSG_SIZE / sizeof(uint32_t)];
+static uint32_t rcvbuf[RCV_SIZE / sizeof(uint32_t)];
+
+static void usage(void)
+{
+	fprintf(stderr,
+"Usage: natmapctl [-u] TABLE add PRENAT=POSTNAT[,id=0xID]...\n"
+"       natmapctl [-u] TABLE del PRENAT... | =POSTNAT...\n"
+"       natmapctl TABLE get PRENAT\n"
+"       natmapctl TABLE lookup PRENAT | =POSTNAT\n"
+"       natmapctl TABLE flush [stat]\n"
+"       natmapctl TABLE dump\n"
+"       natmapctl [-u] TABLE load [FILE]\n"
+"       natmapctl [-u] TABLE reload [FILE]\n"
+"       natmapctl TABLE begin | commit | abort\n"
+"       natmapctl TABLE sync [FILE]\n"
+"       natmapctl TABLE gen [N] | sweep\n"
+"       natmapctl TABLE save FILE [stat]\n"
+"       natmapctl TABLE restore FILE\n"
+"  PRENAT:  ADDR[/CIDR], ADDR-ADDR, 0xMARK or MAJ:MIN, NUMBER of zone and\n"
+"           iif keys,\n"
+"           ZONE:ADDR[/CIDR] or 0xMARK:ADDR[/CIDR] of composite keys\n"
+"  POSTNAT: ADDR, ADDR-ADDR or ADDR/CIDR\n"
+"  IPv6 tables take ADDR6[/PLEN] on both sides, with the same PLEN\n"
+"  -u       update existing entries, ignore missing ones on delete\n"
+"  get finds the entry by its exact PRENAT, lookup finds the one the\n"
+"  packet path picks for it, or the one =POSTNAT maps back to (two-way).\n"
+"  load reads [@]+RULE, [@]-PRENAT, -=POSTNAT, / and : lines\n"
+"  as written to /proc/net/ipt_NATMAP/TABLE, dump output is loadable.\n"
+"  reload loads into an empty shadow table and makes it live at once,\n"
+"  begin, commit and abort do that in steps.\n"
+"  sync makes the table match FILE in place, entries that didn't change\n"
+"  are only marked, others are deleted by the final sweep.\n"
+"  save writes a binary snapshot, with counters if stat is given,\n"
+"  restore loads it into a shadow table and makes it live at once.\n");
+	exit(2);
+}
+
+static struct nlattr *attr_put(struct nlmsghdr *nh, int type,
+    const void *data, int len)
+{
+	struct nlattr *nla = (struct nlattr *)((char *)nh + NLMSG_ALIGN(nh->nlmsg_len));
+
+	nla->nla_type = type;
+	nla->nla_len = NLA_HDRLEN + len;
+	if (len)
+		memcpy((char *)nla + NLA_HDRLEN, data, len);
+	nh->nlmsg_len = NLMSG_ALIGN(nh->nlmsg_len) + NLA_ALIGN(nla->nla_len);
+	return nla;
+}
+
+static void attr_u8(struct nlmsghdr *nh, int type, uint8_t v)
+{
+	attr_put(nh, type, &v, sizeof(v));
+}
+
+static void attr_u32(struct nlmsghdr *nh, int type, uint32_t v)
+{
+	attr_put(nh, type, &v, sizeof(v));
+}
+
+static void attr_u64(struct nlmsghdr *nh, int type, uint64_t v)
+{
+	attr_put(nh, type, &v, sizeof(v));
+}
+
+static struct nlattr *nest_start(struct nlmsghdr *nh, int type)
+{
+	return attr_put(nh, type | NLA_F_NESTED, NULL, 0);
+}
+
+static void nest_end(struct nlmsghdr *nh, struct nlattr *nest)
+{
+	nest->nla_len = (char *)nh + nh->nlmsg_len - (char *)nest;
+}
+
+static void *attr_data(const struct nlattr *nla)
+{
+	return (char *)nla + NLA_HDRLEN;
+}
+
+static int attr_parse(struct nlattr **tb, int max, const void *head, int len)
+{
+	const struct nlattr *nla = head;
+
+	memset(tb, 0, sizeof(*tb) * (max + 1));
+	while (len >= (int)sizeof(*nla) && nla->nla_len >= sizeof(*nla) &&
+	    nla->nla_len <= len) {
+		int type = nla->nla_type & NLA_TYPE_MASK;
+
+		if (type <= max)
+			tb[type] = (struct nlattr *)nla;
+		len -= NLA_ALIGN(nla->nla_len);
+		nla = (const struct nlattr *)((char *)nla + NLA_ALIGN(nla->nla_len));
+	}
+	return 0;
+}
+
+static struct nlmsghdr *msg_init(struct nl *nl, uint16_t type,
+    uint16_t flags, uint8_t cmd, uint8_t version)
+{
+	struct nlmsghdr *nh = (struct nlmsghdr *)msgbuf;
+	struct genlmsghdr *gh;
+
+	memset(nh, 0, NLMSG_HDRLEN + GENL_HDRLEN);
+	nh->nlmsg_len = NLMSG_HDRLEN + GENL_HDRLEN;
+	nh->nlmsg_type = type;
+	nh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+	nh->nlmsg_seq = ++nl->seq;
+	gh = NLMSG_DATA(nh);
+	gh->cmd = cmd;
+	gh->version = version;
+	return nh;
+}
+
+/* print kernel error with extended ack message if there is one */
+static int nl_error(const struct nlmsghdr *nh)
+{
+	const struct nlmsgerr *err = NLMSG_DATA(nh);
+	struct nlattr *tb[NLMSGERR_ATTR_MAX + 1];
+	const char *msg = NULL;
+
+	if (!err->error)
+		return 0;
+	if (nh->nlmsg_flags & NLM_F_ACK_TLVS) {
+		unsigned int off = sizeof(*err);
+
+		if (!(nh->nlmsg_flags & NLM_F_CAPPED))
+			off += err->msg.nlmsg_len - NLMSG_HDRLEN;
+		attr_parse(tb, NLMSGERR_ATTR_MAX, (char *)err + off,
+		    nh->nlmsg_len - NLMSG_HDRLEN - off);
+		if (tb[NLMSGERR_ATTR_MSG])
+			msg = attr_data(tb[NLMSGERR_ATTR_MSG]);
+	}
+	fprintf(stderr, "natmapctl: %s%s%s\n", strerror(-err->error),
+	    msg ? ": " : "", msg ? msg : "");
+	return err->error;
+}
+
+/* send request, feed replies to cb until ack or end of dump */
+static int nl_talk(struct nl *nl, struct nlmsghdr *req,
+    int (*cb)(const struct nlmsghdr *, void *), void *arg)
+{
+	struct sockaddr_nl sa = { .nl_family = AF_NETLINK };
+
+	if (sendto(nl->fd, req, req->nlmsg_len, 0,
+	    (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		perror("natmapctl: sendto");
+		return -errno;
+	}
+	for (;;) {
+		ssize_t len = recv(nl->fd, rcvbuf, sizeof(rcvbuf), 0);
+		struct nlmsghdr *nh;
+
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("natmapctl: recv");
+			return -errno;
+		}
+		for (nh = (struct nlmsghdr *)rcvbuf; NLMSG_OK(nh, len);
+		    nh = NLMSG_NEXT(nh, len)) {
+			int ret;
+
+			if (nh->nlmsg_seq != req->nlmsg_seq)
+				continue;
+			if (nh->nlmsg_type == NLMSG_ERROR)
+				return nl_error(nh);
+			if (nh->nlmsg_type == NLMSG_DONE) {
+				int err = 0;
+
+				if (nh->nlmsg_len >= NLMSG_LENGTH(sizeof(err)))
+					memcpy(&err, NLMSG_DATA(nh), sizeof(err));
+				if (err)
+					fprintf(stderr, "natmapctl: %s\n",
+					    strerror(-err));
+				return err;
+			}
+			if (cb && (ret = cb(nh, arg)))
+				return ret;
+		}
+	}
+}
+
+static int family_cb(const struct nlmsghdr *nh, void *arg)
+{
+	struct nlattr *tb[CTRL_ATTR_MAX + 1];
+
+	attr_parse(tb, CTRL_ATTR_MAX, (char *)NLMSG_DATA(nh) + GENL_HDRLEN,
+	    nh->nlmsg_len - NLMSG_HDRLEN - GENL_HDRLEN);
+	if (tb[CTRL_ATTR_FAMILY_ID])
+		*(uint16_t *)arg = *(uint16_t *)attr_data(tb[CTRL_ATTR_FAMILY_ID]);
+	return 0;
+}
+
+static int nl_open(struct nl *nl)
+{
+	struct sockaddr_nl sa = { .nl_family = AF_NETLINK };
+	struct nlmsghdr *nh;
+	int one = 1;
+
+	nl->fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_GENERIC);
+	if (nl->fd < 0 || bind(nl->fd, (struct sockaddr *)&sa, sizeof(sa))) {
+		perror("natmapctl: netlink socket");
+		return -1;
+	}
+	/* both are optional */
+	setsockopt(nl->fd, SOL_NETLINK, NETLINK_EXT_ACK, &one, sizeof(one));
+	setsockopt(nl->fd, SOL_NETLINK, NETLINK_CAP_ACK, &one, sizeof(one));
+
+	nl->family = 0;
+	nh = msg_init(nl, GENL_ID_CTRL, 0, CTRL_CMD_GETFAMILY, 1);
+	attr_put(nh, CTRL_ATTR_FAMILY_NAME, NATMAP_GENL_NAME,
+	    sizeof(NATMAP_GENL_NAME));
+	if (nl_talk(nl, nh, family_cb, &nl->family) || !nl->family) {
+		fprintf(stderr, "natmapctl: is xt_NATMAP module loaded?\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* ADDR6[/PLEN] up to end, plen is left alone without /PLEN */
+static int parse_in6(const char *s, const char *end, struct in6_addr *a,
+    uint8_t *plen)
+{
+	char addr[INET6_ADDRSTRLEN];
+	const char *slash = memchr(s, '/', end - s);
+	unsigned int len;
+	int n;
+
+	if (!slash)
+		slash = end;
+	if (slash - s >= (int)sizeof(addr))
+		return -1;
+	memcpy(addr, s, slash - s);
+	addr[slash - s] = '\0';
+	if (inet_pton(AF_INET6, addr, a) != 1)
+		return -1;
+	if (slash == end)
+		return 0;
+	if (sscanf(slash, "/%u%n", &len, &n) != 1 || slash + n != end ||
+	    len < 1 || len > 128)
+		return -1;
+	*plen = len;
+	return 0;
+}
+
+static bool is_in6(const char *s)
+{
+	struct in6_addr a;
+	uint8_t plen;
+
+	return !parse_in6(s, s + strcspn(s, ","), &a, &plen);
+}
+
+/* decimal, or hex with 0x */
+static int parse_num(const char *s, const char *end, uint32_t *v)
+{
+	char *e;
+
+	if (s == end || *s < '0' || *s > '9')
+		return -1;
+	*v = strtoul(s, &e, strncmp(s, "0x", 2) ? 10 : 16);
+	return e == end ? 0 : -1;
+}
+
+static int parse_prenat(const char *s, struct rule *r)
+{
+	unsigned int maj, min, cidr;
+	char addr[INET_ADDRSTRLEN];
+	const char *slash, *colon, *dash;
+	char *end;
+
+	r->has_prenat = true;
+	if (is_in6(s)) {
+		r->ipv6 = true;
+		return parse_in6(s, s + strlen(s), &r->prenat6,
+		    &r->prenat_cidr);
+	}
+	/* ZONE:ADDR or 0xMARK:ADDR */
+	colon = strchr(s, ':');
+	if (colon && strchr(colon, '.')) {
+		if (parse_num(s, colon, &r->tag))
+			return -1;
+		r->has_tag = true;
+		s = colon + 1;
+		goto addr;
+	}
+	if (!strncmp(s, "0x", 2)) {
+		r->prenat = strtoul(s, &end, 16);
+		return *end ? -1 : 0;
+	}
+	if (strchr(s, ':')) {
+		if (sscanf(s, "%x:%x", &maj, &min) != 2 ||
+		    maj > 0xffff || min > 0xffff)
+			return -1;
+		r->prenat = maj << 16 | min;
+		return 0;
+	}
+	if (!strchr(s, '.'))
+		return parse_num(s, s + strlen(s), &r->prenat);
+	/* FIRST-LAST */
+	dash = strchr(s, '-');
+	if (dash) {
+		if (dash - s >= (int)sizeof(addr))
+			return -1;
+		memcpy(addr, s, dash - s);
+		addr[dash - s] = '\0';
+		if (inet_pton(AF_INET, addr, &r->prenat) != 1 ||
+		    inet_pton(AF_INET, dash + 1, &r->prenat_last) != 1 ||
+		    ntohl(r->prenat_last) < ntohl(r->prenat))
+			return -1;
+		r->has_last = true;
+		return 0;
+	}
+addr:
+	slash = strchr(s, '/');
+	if (slash) {
+		if (sscanf(slash, "/%u", &cidr) != 1 || cidr < 1 || cidr > 32)
+			return -1;
+		r->prenat_cidr = cidr;
+	} else
+		slash = s + strlen(s);
+	if (slash - s >= (int)sizeof(addr))
+		return -1;
+	memcpy(addr, s, slash - s);
+	addr[slash - s] = '\0';
+	return inet_pton(AF_INET, addr, &r->prenat) == 1 ? 0 : -1;
+}
+
+static int parse_postnat(const char *s, struct rule *r)
+{
+	char addr[INET_ADDRSTRLEN];
+	const char *end, *sep;
+	unsigned int cidr;
+
+	r->has_postnat = true;
+	end = strchr(s, ',');
+	if (!end)
+		end = s + strlen(s);
+	if (is_in6(s)) {
+		uint8_t plen = 128;
+
+		/* the mapping keeps the host part, lengths must match */
+		if ((r->has_prenat && !r->ipv6) ||
+		    parse_in6(s, end, &r->postnat6, &plen) ||
+		    (r->has_prenat && plen != (r->prenat_cidr ?: 128)))
+			return -1;
+		r->ipv6 = true;
+		goto id;
+	}
+	if (r->ipv6)
+		return -1;
+	sep = memchr(s, '-', end - s);
+	if (!sep)
+		sep = memchr(s, '/', end - s);
+	if (!sep)
+		sep = end;
+	if (sep - s >= (int)sizeof(addr))
+		return -1;
+	memcpy(addr, s, sep - s);
+	addr[sep - s] = '\0';
+	if (inet_pton(AF_INET, addr, &r->from) != 1)
+		return -1;
+	if (*sep == '-') {
+		if (end - sep - 1 >= (int)sizeof(addr))
+			return -1;
+		memcpy(addr, sep + 1, end - sep - 1);
+		addr[end - sep - 1] = '\0';
+		if (inet_pton(AF_INET, addr, &r->to) != 1)
+			return -1;
+		r->has_to = true;
+	} else if (*sep == '/') {
+		if (sscanf(sep, "/%u", &cidr) != 1 || cidr < 1 || cidr > 32)
+			return -1;
+		r->postnat_cidr = cidr;
+	}
+id:
+	if (*end) {
+		if (sscanf(end, ",id=0x%x", &r->id) != 1)
+			return -1;
+		r->has_id = true;
+	}
+	return 0;
+}
+
+/* PRENAT=POSTNAT[,id=0xID], PRENAT or =POSTNAT */
+static int parse_rule(const char *s, struct rule *r)
+{
+	char pre[64];
+	const char *eq = strchr(s, '=');
+	size_t len = eq ? (size_t)(eq - s) : strlen(s);
+
+	memset(r, 0, sizeof(*r));
+	if (len >= sizeof(pre))
+		return -1;
+	memcpy(pre, s, len);
+	pre[len] = '\0';
+	if (len && parse_prenat(pre, r))
+		return -1;
+	if (eq && parse_postnat(eq + 1, r))
+		return -1;
+	return 0;
+}
+
+static void put_entry(struct nlmsghdr *nh, const struct rule *r)
+{
+	struct nlattr *nest = nest_start(nh, NATMAP_ATTR_ENTRY);
+
+	if (r->ipv6) {
+		if (r->has_prenat)
+			attr_put(nh, NATMAP_ENTRY_PRENAT6, &r->prenat6,
+			    sizeof(r->prenat6));
+		if (r->prenat_cidr)
+			attr_u8(nh, NATMAP_ENTRY_PRENAT_CIDR, r->prenat_cidr);
+		if (r->has_postnat)
+			attr_put(nh, NATMAP_ENTRY_POSTNAT6, &r->postnat6,
+			    sizeof(r->postnat6));
+		goto id;
+	}
+	if (r->has_prenat)
+		attr_u32(nh, NATMAP_ENTRY_PRENAT, r->prenat);
+	if (r->has_tag)
+		attr_u32(nh, NATMAP_ENTRY_TAG, r->tag);
+	if (r->prenat_cidr)
+		attr_u8(nh, NATMAP_ENTRY_PRENAT_CIDR, r->prenat_cidr);
+	if (r->has_last)
+		attr_u32(nh, NATMAP_ENTRY_PRENAT_LAST, r->prenat_last);
+	if (r->has_postnat)
+		attr_u32(nh, NATMAP_ENTRY_POSTNAT_FROM, r->from);
+	if (r->has_to)
+		attr_u32(nh, NATMAP_ENTRY_POSTNAT_TO, r->to);
+	if (r->postnat_cidr)
+		attr_u8(nh, NATMAP_ENTRY_POSTNAT_CIDR, r->postnat_cidr);
+id:
+	if (r->has_id)
+		attr_u32(nh, NATMAP_ENTRY_ID, r->id);
+	nest_end(nh, nest);
+}
+
+/* batch of ADD or DEL entries being filled */
+struct batch {
+	struct nl *nl;
+	const char *table;
+	struct nlmsghdr *nh;
+	struct nlattr *entries;
+	uint8_t cmd;
+	uint32_t flags;
+	unsigned int count;
+	unsigned long done;
+};
+
+static int batch_flush(struct batch *b)
+{
+	int ret;
+
+	if (!b->nh)
+		return 0;
+	nest_end(b->nh, b->entries);
+	ret = nl_talk(b->nl, b->nh, NULL, NULL);
+	if (!ret)
+		b->done += b->count;
+	b->nh = NULL;
+	b->count = 0;
+	return ret;
+}
+
+static int batch_add(struct batch *b, uint8_t cmd, uint32_t flags,
+    const struct rule *r)
+{
+	int ret;
+
+	if (b->nh && (b->cmd != cmd || b->flags != flags ||
+	    b->count == NATMAP_BATCH)) {
+		ret = batch_flush(b);
+		if (ret)
+			return ret;
+	}
+	if (!b->nh) {
+		b->nh = msg_init(b->nl, b->nl->family, 0, cmd,
+		    NATMAP_GENL_VERSION);
+		attr_put(b->nh, NATMAP_ATTR_TABLE, b->table,
+		    strlen(b->table) + 1);
+		if (flags)
+			attr_u32(b->nh, NATMAP_ATTR_FLAGS, flags);
+		b->entries = nest_start(b->nh, NATMAP_ATTR_ENTRIES);
+		b->cmd = cmd;
+		b->flags = flags;
+	}
+	put_entry(b->nh, r);
+	b->count++;
+	return 0;
+}
+
+static int simple_cmd(struct nl *nl, const char *table, uint8_t cmd,
+    uint32_t flags)
+{
+	struct nlmsghdr *nh;
+
+	nh = msg_init(nl, nl->family, 0, cmd, NATMAP_GENL_VERSION);
+	attr_put(nh, NATMAP_ATTR_TABLE, table, strlen(table) + 1);
+	if (flags)
+		attr_u32(nh, NATMAP_ATTR_FLAGS, flags);
+	return nl_talk(nl, nh, NULL, NULL);
+}
+
+/* open shadow sized for count entries, for the live ones if 0 */
+static int begin_cmd(struct nl *nl, const char *table, uint64_t count)
+{
+	struct nlmsghdr *nh;
+
+	nh = msg_init(nl, nl->family, 0, NATMAP_CMD_BEGIN, NATMAP_GENL_VERSION);
+	attr_put(nh, NATMAP_ATTR_TABLE, table, strlen(table) + 1);
+	if (count)
+		attr_u64(nh, NATMAP_ATTR_SHADOW, count);
+	return nl_talk(nl, nh, NULL, NULL);
+}
+
+/* start generation N, next one if N is not given */
+static int gen_cmd(struct nl *nl, const char *table, const char *n)
+{
+	struct nlmsghdr *nh;
+	unsigned long gen = 0;
+	char *end;
+
+	if (n) {
+		gen = strtoul(n, &end, 0);
+		if (*end || !gen || gen > UINT32_MAX) {
+			fprintf(stderr, "natmapctl: invalid generation: %s\n", n);
+			return -EINVAL;
+		}
+	}
+	nh = msg_init(nl, nl->family, 0, NATMAP_CMD_GEN, NATMAP_GENL_VERSION);
+	attr_put(nh, NATMAP_ATTR_TABLE, table, strlen(table) + 1);
+	if (gen)
+		attr_u32(nh, NATMAP_ATTR_GEN, gen);
+	return nl_talk(nl, nh, NULL, NULL);
+}
+
+/* text line as in /proc, returns 1 on syntax error */
+static int load_line(struct batch *b, char *line, uint32_t flags)
+{
+	struct rule r;
+	size_t len;
+	int ret;
+
+	len = strcspn(line, "\r\n");
+	line[len] = '\0';
+	/* dump output has counters after two spaces */
+	line[strcspn(line, " \t")] = '\0';
+	if (!*line || *line == '#')
+		return 0;
+	if (*line == '@') {
+		flags |= NATMAP_F_UPDATE;
+		line++;
+	}
+	if (!strcmp(line, "/") || !strcmp(line, ":")) {
+		ret = batch_flush(b);
+		if (ret)
+			return ret;
+		return simple_cmd(b->nl, b->table, NATMAP_CMD_FLUSH,
+		    *line == ':' ? NATMAP_F_STAT : 0);
+	}
+	if (!strcmp(line, "+sweep") || !strcmp(line, "+gen") ||
+	    !strncmp(line, "+gen=", 5)) {
+		ret = batch_flush(b);
+		if (ret)
+			return ret;
+		if (line[1] == 's')
+			return simple_cmd(b->nl, b->table, NATMAP_CMD_SWEEP, 0);
+		return gen_cmd(b->nl, b->table, line[4] ? line + 5 : NULL);
+	}
+	if (!strcmp(line, "+begin") || !strcmp(line, "+commit") ||
+	    !strcmp(line, "+abort")) {
+		ret = batch_flush(b);
+		if (ret)
+			return ret;
+		return simple_cmd(b->nl, b->table, line[1] == 'b' ?
+		    NATMAP_CMD_BEGIN : line[1] == 'c' ? NATMAP_CMD_COMMIT :
+		    NATMAP_CMD_ABORT, 0);
+	}
+	if ((*line != '+' && *line != '-') || parse_rule(line + 1, &r) ||
+	    (*line == '+' && (!r.has_prenat || !r.has_postnat)) ||
+	    (*line == '-' && (r.has_prenat == r.has_postnat || r.has_id)))
+		return 1;
+	return batch_add(b, *line == '+' ? NATMAP_CMD_ADD : NATMAP_CMD_DEL,
+	    flags, &r);
+}
+
+static int load(struct batch *b, const char *file, uint32_t flags)
+{
+	FILE *f = stdin;
+	char line[256];
+	unsigned long n = 0;
+	int ret = 0;
+
+	if (file && strcmp(file, "-")) {
+		f = fopen(file, "r");
+		if (!f) {
+			perror(file);
+			return -errno;
+		}
+	}
+	while (fgets(line, sizeof(line), f)) {
+		n++;
+		ret = load_line(b, line, flags);
+		if (ret > 0) {
+			fprintf(stderr, "natmapctl: %s:%lu: invalid rule: %s\n",
+			    file ? file : "-", n, line);
+			ret = -EINVAL;
+		}
+		if (ret)
+			break;
+	}
+	if (!ret)
+		ret = batch_flush(b);
+	if (f != stdin)
+		fclose(f);
+	return ret;
+}
+
+/* lines of file, 0 for stdin or if it can't be read */
+static uint64_t count_lines(const char *file)
+{
+	char buf[65536];
+	uint64_t n = 0;
+	size_t len;
+	FILE *f;
+
+	if (!file || !strcmp(file, "-"))
+		return 0;
+	f = fopen(file, "r");
+	if (!f)
+		return 0;
+	while ((len = fread(buf, 1, sizeof(buf), f))) {
+		const char *p = buf, *end = buf + len;
+
+		while ((p = memchr(p, '\n', end - p))) {
+			n++;
+			p++;
+		}
+	}
+	fclose(f);
+	return n;
+}
+
+/* zone and ifindex are decimal */
+static bool key_dec(uint32_t mode)
+{
+	const uint32_t key = mode & XT_NATMAP_KEY;
+
+	return key == XT_NATMAP_KEY_ZONE_ADDR || key == XT_NATMAP_KEY_ZONE ||
+	    key == XT_NATMAP_KEY_IIF;
+}
+
+static void print_entry(const struct nlattr *nest, uint32_t mode)
+{
+	struct nlattr *tb[NATMAP_ENTRY_MAX + 1];
+	char a[INET6_ADDRSTRLEN], z[INET6_ADDRSTRLEN];
+	uint32_t pre;
+
+	attr_parse(tb, NATMAP_ENTRY_MAX, attr_data(nest),
+	    nest->nla_len - NLA_HDRLEN);
+	if (tb[NATMAP_ENTRY_PRENAT6] && tb[NATMAP_ENTRY_POSTNAT6] &&
+	    tb[NATMAP_ENTRY_PRENAT_CIDR]) {
+		unsigned int plen =
+		    *(uint8_t *)attr_data(tb[NATMAP_ENTRY_PRENAT_CIDR]);
+
+		printf("@+%s/%u=%s/%u", inet_ntop(AF_INET6,
+		    attr_data(tb[NATMAP_ENTRY_PRENAT6]), a, sizeof(a)), plen,
+		    inet_ntop(AF_INET6, attr_data(tb[NATMAP_ENTRY_POSTNAT6]),
+		    z, sizeof(z)), plen);
+		goto tail;
+	}
+	if (!tb[NATMAP_ENTRY_PRENAT] || !tb[NATMAP_ENTRY_POSTNAT_FROM] ||
+	    !tb[NATMAP_ENTRY_POSTNAT_TO] || !tb[NATMAP_ENTRY_POSTNAT_CIDR])
+		return;
+	pre = *(uint32_t *)attr_data(tb[NATMAP_ENTRY_PRENAT]);
+
+	printf("@+");
+	if (tb[NATMAP_ENTRY_TAG])
+		printf(key_dec(mode) ? "%u:" : "0x%x:",
+		    *(uint32_t *)attr_data(tb[NATMAP_ENTRY_TAG]));
+	if (tb[NATMAP_ENTRY_PRENAT_LAST])
+		printf("%s-%s", inet_ntop(AF_INET, &pre, a, sizeof(a)),
+		    inet_ntop(AF_INET, attr_data(tb[NATMAP_ENTRY_PRENAT_LAST]),
+		    z, sizeof(z)));
+	else if (mode & XT_NATMAP_ADDR)
+		printf("%s/%u", inet_ntop(AF_INET, &pre, a, sizeof(a)),
+		    tb[NATMAP_ENTRY_PRENAT_CIDR] ?
+		    *(uint8_t *)attr_data(tb[NATMAP_ENTRY_PRENAT_CIDR]) : 32);
+	else if (mode & XT_NATMAP_PRIO)
+		printf("%04x:%04x", pre >> 16, pre & 0xffff);
+	else
+		printf(key_dec(mode) ? "%u" : "0x%08x", pre);
+
+	inet_ntop(AF_INET, attr_data(tb[NATMAP_ENTRY_POSTNAT_FROM]), a, sizeof(a));
+	inet_ntop(AF_INET, attr_data(tb[NATMAP_ENTRY_POSTNAT_TO]), z, sizeof(z));
+	if (*(uint8_t *)attr_data(tb[NATMAP_ENTRY_POSTNAT_CIDR]))
+		printf("=%s/%u", a,
+		    *(uint8_t *)attr_data(tb[NATMAP_ENTRY_POSTNAT_CIDR]));
+	else
+		printf("=%s-%s", a, z);
+tail:
+	if (tb[NATMAP_ENTRY_ID])
+		printf(",id=0x%x", *(uint32_t *)attr_data(tb[NATMAP_ENTRY_ID]));
+	if (tb[NATMAP_ENTRY_PKTS] && tb[NATMAP_ENTRY_BYTES])
+		printf("  %llu:%llu",
+		    (unsigned long long)*(uint64_t *)attr_data(tb[NATMAP_ENTRY_PKTS]),
+		    (unsigned long long)*(uint64_t *)attr_data(tb[NATMAP_ENTRY_BYTES]));
+	printf("\n");
+}
+
+static int dump_cb(const struct nlmsghdr *nh, void *arg)
+{
+	struct nlattr *tb[NATMAP_ATTR_MAX + 1];
+	const struct nlattr *nla;
+	uint32_t mode = 0;
+	int rem;
+
+	attr_parse(tb, NATMAP_ATTR_MAX, (char *)NLMSG_DATA(nh) + GENL_HDRLEN,
+	    nh->nlmsg_len - NLMSG_HDRLEN - GENL_HDRLEN);
+	if (tb[NATMAP_ATTR_MODE])
+		mode = *(uint32_t *)attr_data(tb[NATMAP_ATTR_MODE]);
+	if (tb[NATMAP_ATTR_ENTRY])
+		print_entry(tb[NATMAP_ATTR_ENTRY], mode);
+	if (!tb[NATMAP_ATTR_ENTRIES])
+		return 0;
+	nla = attr_data(tb[NATMAP_ATTR_ENTRIES]);
+	rem = tb[NATMAP_ATTR_ENTRIES]->nla_len - NLA_HDRLEN;
+	while (rem >= (int)sizeof(*nla) && nla->nla_len >= sizeof(*nla) &&
+	    nla->nla_len <= rem) {
+		if ((nla->nla_type & NLA_TYPE_MASK) == NATMAP_ATTR_ENTRY)
+			print_entry(nla, mode);
+		rem -= NLA_ALIGN(nla->nla_len);
+		nla = (const struct nlattr *)((char *)nla + NLA_ALIGN(nla->nla_len));
+	}
+	return 0;
+}
+
+struct save {
+	FILE *f;
+	struct natmap_snap_hdr hdr;
+	unsigned int rsize;
+	uint64_t count;
+};
+
+static unsigned int snap_size(uint32_t flags)
+{
+	return sizeof(struct natmap_snap_rec) +
+	    ((flags & NATMAP_SNAP_F_STAT) ? sizeof(struct natmap_snap_stat) : 0);
+}
+
+static int save_cb(const struct nlmsghdr *nh, void *arg)
+{
+	struct nlattr *tb[NATMAP_ATTR_MAX + 1];
+	struct save *sv = arg;
+	size_t len;
+
+	attr_parse(tb, NATMAP_ATTR_MAX, (char *)NLMSG_DATA(nh) + GENL_HDRLEN,
+	    nh->nlmsg_len - NLMSG_HDRLEN - GENL_HDRLEN);
+	if (tb[NATMAP_ATTR_SNAP_HDR]) {
+		memcpy(&sv->hdr, attr_data(tb[NATMAP_ATTR_SNAP_HDR]),
+		    sizeof(sv->hdr));
+		sv->rsize = snap_size(sv->hdr.flags);
+		if (fwrite(&sv->hdr, sizeof(sv->hdr), 1, sv->f) != 1)
+			goto err;
+	}
+	if (!tb[NATMAP_ATTR_SNAP_RECS] || !sv->rsize)
+		return 0;
+	len = tb[NATMAP_ATTR_SNAP_RECS]->nla_len - NLA_HDRLEN;
+	if (len && fwrite(attr_data(tb[NATMAP_ATTR_SNAP_RECS]), len, 1,
+	    sv->f) != 1)
+		goto err;
+	sv->count += len / sv->rsize;
+	return 0;
+err:
+	perror("natmapctl: write");
+	return -EIO;
+}
+
+static int save(struct nl *nl, const char *table, const char *file,
+    uint32_t flags)
+{
+	struct save sv = { .f = stdout };
+	struct nlmsghdr *nh;
+	int ret;
+
+	if (strcmp(file, "-")) {
+		sv.f = fopen(file, "w");
+		if (!sv.f) {
+			perror(file);
+			return -errno;
+		}
+	}
+	nh = msg_init(nl, nl->family, NLM_F_DUMP, NATMAP_CMD_SAVE,
+	    NATMAP_GENL_VERSION);
+	attr_put(nh, NATMAP_ATTR_TABLE, table, strlen(table) + 1);
+	if (flags)
+		attr_u32(nh, NATMAP_ATTR_FLAGS, flags);
+	ret = nl_talk(nl, nh, save_cb, &sv);
+	/* count in header is from the start of dump, fix it if we can */
+	if (!ret && sv.count != sv.hdr.count && !fseek(sv.f, 0, SEEK_SET)) {
+		sv.hdr.count = sv.count;
+		fwrite(&sv.hdr, sizeof(sv.hdr), 1, sv.f);
+	}
+	if (fflush(sv.f) && !ret) {
+		perror("natmapctl: write");
+		ret = -EIO;
+	}
+	if (sv.f != stdout)
+		fclose(sv.f);
+	return ret;
+}
+
+static int restore(struct nl *nl, const char *table, const char *file)
+{
+	static char buf[SNAP_CHUNK];
+	struct natmap_snap_hdr hdr;
+	struct nlmsghdr *nh;
+	FILE *f = stdin;
+	uint64_t done = 0;
+	unsigned int rsize;
+	size_t len;
+	int ret;
+
+	if (strcmp(file, "-")) {
+		f = fopen(file, "r");
+		if (!f) {
+			perror(file);
+			return -errno;
+		}
+	}
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    hdr.magic != NATMAP_SNAP_MAGIC ||
+	    hdr.version != NATMAP_SNAP_VERSION) {
+		fprintf(stderr, "natmapctl: %s: not a snapshot\n", file);
+		ret = -EINVAL;
+		goto out;
+	}
+	rsize = snap_size(hdr.flags);
+
+	nh = msg_init(nl, nl->family, 0, NATMAP_CMD_BEGIN, NATMAP_GENL_VERSION);
+	attr_put(nh, NATMAP_ATTR_TABLE, table, strlen(table) + 1);
+	attr_put(nh, NATMAP_ATTR_SNAP_HDR, &hdr, sizeof(hdr));
+	ret = nl_talk(nl, nh, NULL, NULL);
+	if (ret)
+		goto out;
+
+	while ((len = fread(buf, 1, SNAP_CHUNK / rsize * rsize, f))) {
+		if (len % rsize) {
+			fprintf(stderr, "natmapctl: %s: truncated\n", file);
+			ret = -EINVAL;
+			break;
+		}
+		nh = msg_init(nl, nl->family, 0, NATMAP_CMD_RESTORE,
+		    NATMAP_GENL_VERSION);
+		attr_put(nh, NATMAP_ATTR_TABLE, table, strlen(table) + 1);
+		attr_put(nh, NATMAP_ATTR_SNAP_HDR, &hdr, sizeof(hdr));
+		attr_put(nh, NATMAP_ATTR_SNAP_RECS, buf, len);
+		ret = nl_talk(nl, nh, NULL, NULL);
+		if (ret)
+			break;
+		done += len / rsize;
+	}
+	if (!ret && ferror(f)) {
+		perror(file);
+		ret = -EIO;
+	}
+	if (!ret)
+		ret = simple_cmd(nl, table, NATMAP_CMD_COMMIT, 0);
+	else {
+		simple_cmd(nl, table, NATMAP_CMD_ABORT, 0);
+		fprintf(stderr, "natmapctl: restore aborted after %llu "
+		    "records, table is unchanged\n", (unsigned long long)done);
+	}
+out:
+	if (f != stdin)
+		fclose(f);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	struct nl nl = { .seq = 0 };
+	struct batch b = { .nl = &nl };
+	const char *table, *cmd;
+	uint32_t flags = 0;
+	struct nlmsghdr *nh;
+	struct rule r;
+	int i, ret = 0;
+
+	if (argc > 1 && !strcmp(argv[1], "-u")) {
+		flags |= NATMAP_F_UPDATE;
+		argv++;
+		argc--;
+	}
+	if (argc < 3)
+		usage();
+	table = argv[1];
+	cmd = argv[2];
+	if (strlen(table) >= XT_NATMAP_NAME_LEN) {
+		fprintf(stderr, "natmapctl: table name is too long\n");
+		return 2;
+	}
+	b.table = table;
+	if (nl_open(&nl))
+		return 1;
+
+	if (!strcmp(cmd, "add") || !strcmp(cmd, "del")) {
+		bool add = cmd[0] == 'a';
+
+		for (i = 3; i < argc && !ret; i++) {
+			if (parse_rule(argv[i], &r) ||
+			    (add && (!r.has_prenat || !r.has_postnat)) ||
+			    (!add && (r.has_prenat == r.has_postnat || r.has_id))) {
+				fprintf(stderr, "natmapctl: invalid rule: %s\n",
+				    argv[i]);
+				return 2;
+			}
+			ret = batch_add(&b, add ? NATMAP_CMD_ADD :
+			    NATMAP_CMD_DEL, flags, &r);
+		}
+		if (!ret)
+			ret = batch_flush(&b);
+	} else if (!strcmp(cmd, "load")) {
+		if (argc > 4)
+			usage();
+		ret = load(&b, argc == 4 ? argv[3] : NULL, flags);
+		if (ret)
+			fprintf(stderr, "natmapctl: %lu entries applied\n",
+			    b.done);
+	} else if (!strcmp(cmd, "reload")) {
+		if (argc > 4)
+			usage();
+		/* shadow sized for the file up front, it grows otherwise */
+		ret = begin_cmd(&nl, table,
+		    count_lines(argc == 4 ? argv[3] : NULL));
+		if (!ret)
+			ret = load(&b, argc == 4 ? argv[3] : NULL, flags);
+		if (!ret)
+			ret = simple_cmd(&nl, table, NATMAP_CMD_COMMIT, 0);
+		else if (ret != -EBUSY) {
+			simple_cmd(&nl, table, NATMAP_CMD_ABORT, 0);
+			fprintf(stderr, "natmapctl: reload aborted, table is "
+			    "unchanged\n");
+		}
+	} else if (!strcmp(cmd, "sync")) {
+		if (argc > 4)
+			usage();
+		/* changed entries are replaced, not refused */
+		ret = gen_cmd(&nl, table, NULL);
+		if (!ret)
+			ret = load(&b, argc == 4 ? argv[3] : NULL,
+			    flags | NATMAP_F_UPDATE);
+		if (!ret)
+			ret = simple_cmd(&nl, table, NATMAP_CMD_SWEEP, 0);
+		else
+			fprintf(stderr, "natmapctl: sync stopped before sweep, "
+			    "%lu entries applied\n", b.done);
+	} else if (!strcmp(cmd, "save")) {
+		if (argc < 4 || argc > 5 || (argc == 5 && strcmp(argv[4], "stat")))
+			usage();
+		ret = save(&nl, table, argv[3], argc == 5 ? NATMAP_F_STAT : 0);
+	} else if (!strcmp(cmd, "restore")) {
+		if (argc != 4)
+			usage();
+		ret = restore(&nl, table, argv[3]);
+	} else if (!strcmp(cmd, "gen")) {
+		if (argc > 4)
+			usage();
+		ret = gen_cmd(&nl, table, argc == 4 ? argv[3] : NULL);
+	} else if (!strcmp(cmd, "sweep")) {
+		if (argc != 3)
+			usage();
+		ret = simple_cmd(&nl, table, NATMAP_CMD_SWEEP, 0);
+	} else if (!strcmp(cmd, "begin") || !strcmp(cmd, "commit") ||
+	    !strcmp(cmd, "abort")) {
+		if (argc != 3)
+			usage();
+		ret = simple_cmd(&nl, table, cmd[0] == 'b' ? NATMAP_CMD_BEGIN :
+		    cmd[0] == 'c' ? NATMAP_CMD_COMMIT : NATMAP_CMD_ABORT, 0);
+	} else if (!strcmp(cmd, "get")) {
+		if (argc != 4 || parse_rule(argv[3], &r) || !r.has_prenat ||
+		    r.has_postnat)
+			usage();
+		nh = msg_init(&nl, nl.family, 0, NATMAP_CMD_GET,
+		    NATMAP_GENL_VERSION);
+		attr_put(nh, NATMAP_ATTR_TABLE, table, strlen(table) + 1);
+		put_entry(nh, &r);
+		ret = nl_talk(&nl, nh, dump_cb, NULL);
+	} else if (!strcmp(cmd, "lookup")) {
+		if (argc != 4 || parse_rule(argv[3], &r) ||
+		    r.has_prenat == r.has_postnat || r.prenat_cidr ||
+		    r.has_last || r.has_to || r.postnat_cidr || r.has_id)
+			usage();
+		nh = msg_init(&nl, nl.family, 0, NATMAP_CMD_GET,
+		    NATMAP_GENL_VERSION);
+		attr_put(nh, NATMAP_ATTR_TABLE, table, strlen(table) + 1);
+		attr_u32(nh, NATMAP_ATTR_FLAGS, r.has_prenat ?
+		    NATMAP_F_LOOKUP : NATMAP_F_REVERSE);
+		put_entry(nh, &r);
+		ret = nl_talk(&nl, nh, dump_cb, NULL);
+	} else if (!strcmp(cmd, "flush")) {
+		if (argc > 4 || (argc == 4 && strcmp(argv[3], "stat")))
+			usage();
+		ret = simple_cmd(&nl, table, NATMAP_CMD_FLUSH,
+		    argc == 4 ? NATMAP_F_STAT : 0);
+	} else if (!strcmp(cmd, "dump")) {
+		if (argc != 3)
+			usage();
+		nh = msg_init(&nl, nl.family, NLM_F_DUMP, NATMAP_CMD_DUMP,
+		    NATMAP_GENL_VERSION);
+		attr_put(nh, NATMAP_ATTR_TABLE, table, strlen(table) + 1);
+		ret = nl_talk(&nl, nh, dump_cb, NULL);
+	} else
+		usage();
+
+	close(nl.fd);
+	return ret ? 1 : 0;
+}
@@ -29,19 +29,37 @@
 #include <linux/list.h>
 #include <linux/skbuff.h>
 #include <linux/mm.h>
+#include <linux/cache.h>
+#include <linux/percpu.h>
 #include <linux/inet.h>
 #include <linux/in.h>
 #include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/bitops.h>
+#include <net/ipv6.h>
 #include <net/net_namespace.h>
 #include <net/netns/generic.h>
+#include <net/genetlink.h>
 #include <linux/pkt_sched.h>
 #include <linux/netfilter/x_tables.h>
 #include <linux/netfilter_ipv4/ip_tables.h>
 #include <net/netfilter/nf_nat.h>
+#include <net/netfilter/nf_conntrack_ecache.h>
+#include <net/netfilter/nf_conntrack_zones.h>
+#if IS_ENABLED(CONFIG_NF_TABLES)
+#include <net/netfilter/nf_tables.h>
+#endif
 #include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#include <linux/overflow.h>
+#include <linux/jump_label.h>
+#include <linux/log2.h>
 #include <linux/version.h>
 #include "xt_NATMAP.h"
 #include "compat.h"
+#define CREATE_TRACE_POINTS
+#include "xt_NATMAP_trace.h"
 
 #define XT_NATMAP_VERSION "0.2.1"
 #include "version.h"
@@ -55,6 +73,7 @@ MODULE_DESCRIPTION("iptables NATMAP module");
 MODULE_LICENSE("GPL");
 MODULE_VERSION(XT_NATMAP_VERSION);
 MODULE_ALIAS("ipt_NATMAP");
+MODULE_ALIAS("ip6t_NATMAP");
 
 static unsigned int hashsize __read_mostly = 256;
 static unsigned int disable_log __read_mostly = 0;
@@ -66,10 +85,11 @@ MODULE_PARM_DESC(disable_log,
 		" disables logging of bind/timeout events (default: 0)");
 
 static DEFINE_MUTEX(natmap_mutex);	/* htable lists management */
+static struct workqueue_struct *natmap_wq; /* reclaim of replaced content */
 
 struct pre_ip {
 	__be32 addr;
-	u32 cidr;
+	u32 cidr;			/* 0 - first address of a range */
 };
 
 struct post_ip {
@@ -77,47 +97,269 @@ struct post_ip {
 	u32 cidr;
 };
 
-/* set entity: prenat=postnat pairs */
+/* parsed rule, from proc text or netlink attributes */
+struct natmap_rule {
+	struct pre_ip prenat;
+	struct post_ip postnat;
+	u32 id;
+	u32 tag;			/* zone or mark of composite keys */
+	__be32 prenat_last;		/* of ranges, prenat.cidr 0 */
+	struct in6_addr prenat6;	/* IPv6 tables, length in prenat.cidr */
+	struct in6_addr postnat6;
+};
+
+/* what natmap_tg does with matched entity */
+enum {
+	NATMAP_ACT_RANGE,		/* postnat from-to as is */
+	NATMAP_ACT_HOST,		/* host bits from source, cg-nat ports */
+	NATMAP_ACT_PFX6,		/* IPv6 prefix, see natmap6_pre */
+};
+
+/* per-cpu entry counters, folded on read */
+struct natmap_stat {
+	u64 pkts;
+	u64 bytes;
+};
+
+/* per-cpu log2 latency histograms of a table, see +hist */
+#define NATMAP_HIST_SLOTS	32	/* by log2 of ns, last one open */
+
+enum {
+	NATMAP_HIST_LOOKUP,		/* table lookup */
+	NATMAP_HIST_NAT,		/* nf_nat_setup_info() */
+	NATMAP_HIST_MAX,
+};
+
+struct natmap_hist {
+	u64 slot[NATMAP_HIST_MAX][NATMAP_HIST_SLOTS];
+};
+
+/* set entity: prenat=postnat pairs, immutable once linked,
+ * updates replace the whole pre/post pair under rcu */
 struct natmap_pre {
-	struct hlist_node node;		/* hash bucket list */
-	spinlock_t lock_bh;
+	struct hlist_node node[2];	/* hash bucket lists, see natmap_hash */
 	struct pre_ip  prenat;		/* prenat addr/cidr */
 	struct post_ip postnat;		/* postnat from[-to|/cidr] range */
-	struct {
-		u32 pkts;
-		u64 bytes;
-	} stat;				/* stats for each entry */
+	u32 id;				/* class id for ct mark, 0 if none */
+	u32 gen;			/* generation last added in, see +sweep */
+	u8 act;				/* NATMAP_ACT_*, see natmap_act_init() */
+	u8 cgnt_shift;			/* log2 of postnat block size */
+	u8 cgnt_bits;			/* log2 of port blocks per address */
+	__be32 hostmask;		/* postnat bits taken from source */
+	u32 tag;			/* zone or mark, see natmap_tagged() */
+	struct natmap_stat __percpu *stat; /* stats for each entry */
 	struct natmap_post *post;	/* pointer to postnat ent */
 	struct rcu_head rcu;		/* destruction call list */
 };
 
 struct natmap_post {
-	struct hlist_node node;		/* hash bucket list */
-	spinlock_t lock_bh;
+	struct hlist_node node[2];	/* hash bucket lists, see natmap_hash */
 	struct natmap_pre *pre;		/* pointer to prenat ent */
 	struct rcu_head rcu;		/* destruction call list */
 };
 
+/* IPv6 entity: prenat prefix maps to the postnat prefix of the same
+ * length keeping host bits, as NETMAP does; pre.prenat and pre.postnat
+ * hold a /32 fold of the prefixes, so code shared with IPv4 tables
+ * (generations, shadow, dump cursor) treats it as a plain entry */
+struct natmap6_pre {
+	struct natmap_pre pre;		/* act is NATMAP_ACT_PFX6 */
+	struct in6_addr prenat;		/* masked to plen */
+	struct in6_addr postnat;	/* masked to plen */
+	u8 plen;
+};
+
+#define natmap6(p)	container_of(p, struct natmap6_pre, pre)
+#define NATMAP6_PLENS	129		/* prefix lengths 0..128 */
+#define NATMAP6_PLENS_MAX 16		/* in use by a table, probes per packet */
+
+/* prenat address range entity, pre.prenat has the first address and
+ * cidr 0, so the hash, dumps and generations treat it as a plain
+ * entry; packets find it through natmap_ranges */
+struct natmap_range_pre {
+	struct natmap_pre pre;
+	__be32 last;			/* last prenat address */
+};
+
+#define natmap_range(p)	container_of(p, struct natmap_range_pre, pre)
+
+/* ranges sorted by first address, never overlapping; readers binary
+ * search it, an insert past the last one fills a spare slot, others
+ * publish a compacted copy, deletes and updates only change the entry
+ * of a slot */
+struct natmap_range_slot {
+	u32 first, last;		/* host order */
+	struct natmap_pre __rcu *pre;	/* NULL once deleted */
+};
+
+struct natmap_ranges {
+	unsigned int count;		/* slots, deleted ones included,
+					 * released after the slot is set */
+	unsigned int size;		/* slots allocated */
+	struct rcu_head rcu;		/* destruction call list */
+	struct natmap_range_slot slot[];
+};
+
+/* multibit trie of prenat prefixes shorter than /32, each prefix is
+ * expanded to its stride boundary, so a lookup reads at most
+ * NATMAP_LPM_LEVELS nodes; /32 entries are resolved by the hash alone */
+#define NATMAP_LPM_STRIDE	8
+#define NATMAP_LPM_SLOTS	(1 << NATMAP_LPM_STRIDE)
+#define NATMAP_LPM_LEVELS	(32 / NATMAP_LPM_STRIDE)
+
+struct natmap_lpm_node {
+	struct natmap_pre __rcu *pre[NATMAP_LPM_SLOTS];	/* longest match */
+	struct natmap_lpm_node __rcu *child[NATMAP_LPM_SLOTS];
+	unsigned int used;		/* slots with pre or child set */
+	struct rcu_head rcu;		/* destruction call list */
+};
+
+/* two-way reverse map: open addressing by postnat address with the
+ * prenat address inline, a bucket is one cache line of slots and
+ * probing continues into the next bucket until a free slot is seen;
+ * deleted slots are only reclaimed by natmap_rmap_rebuild() */
+struct natmap_rmap_slot {
+	__be32 post;			/* key, see NATMAP_RMAP_* */
+	__be32 addr;			/* prenat address */
+	struct natmap_pre *pre;		/* entry for counters */
+};
+
+#define NATMAP_RMAP_FREE	htonl(INADDR_ANY)
+#define NATMAP_RMAP_DELETED	htonl(INADDR_BROADCAST)
+#define NATMAP_RMAP_SLOTS	(L1_CACHE_BYTES / sizeof(struct natmap_rmap_slot))
+#define NATMAP_RMAP_MIN		16	/* buckets */
+
+struct natmap_rmap_bucket {
+	struct natmap_rmap_slot slot[NATMAP_RMAP_SLOTS];
+} ____cacheline_aligned;
+
+struct natmap_rmap {
+	unsigned int size;		/* buckets, power of 2 */
+	unsigned int used;		/* slots not free, incl. deleted */
+	struct rcu_head rcu;		/* destruction call list */
+	struct natmap_rmap_bucket bucket[];
+};
+
+/* bucket array, entries are chained through their node[idx], so the
+ * resize worker can link them into the next array through the other
+ * node while readers keep walking this one */
+struct natmap_hash {
+	unsigned int size;		/* number of buckets */
+	unsigned int idx;		/* entry node used by this array */
+	struct hlist_head head[];
+};
+
+#define NATMAP_HSIZE_MIN	256
+#define NATMAP_HSIZE_MAX	(1U << 27)
+#define NATMAP_RESIZE_BATCH	1024	/* buckets migrated per lock hold */
+
+typedef unsigned int (*natmap_tg_fn)(struct sk_buff *skb,
+    const struct xt_action_param *par);
+
+/* table content, replaced as a whole on commit of a shadow */
+struct natmap_data {
+	struct natmap_hash __rcu *pre;	/* rcu lists array of pre_ip's */
+	struct natmap_hash __rcu *post;	/* rcu lists array of post_ip's */
+	struct natmap_lpm_node __rcu *lpm; /* trie of prenat prefixes */
+	struct natmap_rmap __rcu *rmap;	/* two-way reverse map */
+	struct natmap_ranges __rcu *ranges; /* prenat address ranges */
+	unsigned int count;		/* currently entities linked */
+	unsigned int cidr_map[33];	/* count of prefixes, [0] of ranges */
+	unsigned int post_cidr_map[33];	/* count of postnat prefixes */
+	unsigned int cgnt_map[33];	/* count of cg-nat block bits */
+	unsigned int plen6_map[NATMAP6_PLENS]; /* count of IPv6 prefixes */
+	DECLARE_BITMAP(plen6_used, NATMAP6_PLENS); /* lengths to probe */
+	unsigned int plen6_count;	/* bits set in plen6_used */
+
+	/* background resize, of the shadow too */
+	unsigned int id;		/* unique in table, see natmap_resize_work() */
+	struct natmap_hash *pre_next;	/* arrays being filled */
+	struct natmap_hash *post_next;
+	unsigned int resize_pos;	/* old buckets already migrated */
+	bool resizing;
+
+	struct work_struct free_work;	/* reclaim once replaced */
+};
+
+/* cg-nat port geometry, replaced whole so that packets never combine
+ * the port range of one setting with the block of another */
+struct natmap_cgnt {
+	u16 min;			/* first port */
+	u32 range;			/* ports to split */
+	u32 block;			/* ports per prenat, 0 - auto */
+	struct rcu_head rcu;
+};
+
 /* per-net named hash table, locked with natmap_mutex */
 struct xt_natmap_htable {
 	struct hlist_node node;		/* all htables */
 	int use;			/* references from iptables */
-	__u8 mode;			/* src or skb mode, pers & drop */
+	__u16 mode;			/* src or skb mode, pers & drop */
+	natmap_tg_fn tg_pre, tg_post;	/* target for mode, see natmap_tg() */
 	spinlock_t lock;		/* write access to hash */
-	unsigned int count;		/* currently entities linked */
-	unsigned int hsize;		/* hash array size */
-	unsigned int cidr_map[33];	/* count of prefixes */
+	struct natmap_cgnt __rcu *cgnt;	/* cg-nat port geometry */
+	u32 markmask;			/* of mark keys, all bits if not given */
 	struct net *net;		/* for destruction */
 	struct proc_dir_entry *pde;
 	char name[XT_NATMAP_NAME_LEN];
-	struct hlist_head *pre;		/* rcu lists array of pre_ip's */
-	struct hlist_head *post;	/* rcu lists array of post_ip's */
+	struct natmap_data __rcu *data;	/* content seen by packets */
+	struct natmap_data __rcu *shadow; /* being filled, see +begin */
+	unsigned int data_seq;		/* bumped when data is replaced */
+	unsigned int shadow_seq;	/* bumped when shadow is opened or closed */
+	unsigned int data_ids;		/* last natmap_data.id given */
+
+	/* background resize, see natmap_resize_work() */
+	struct work_struct resize_work;
+	unsigned int resizes;		/* completed resizes */
+	unsigned int resize_us;		/* duration of the last one */
+	atomic_long_t resize_miss;	/* lookup misses while resizing */
+
+	unsigned long load_rules;	/* by the last closed proc writer */
+	unsigned long load_failed;
+
+	u32 gen;			/* tag for added entries, see +gen */
+
+	struct natmap_hist __percpu *hist; /* kept once allocated */
+	bool hist_on;			/* see +hist */
 };
 
+#define natmap_deref(ht, p) \
+	rcu_dereference_check(p, lockdep_is_held(&(ht)->lock))
+
+/* content the control plane changes: the shadow while one is open */
+static inline struct natmap_data *
+natmap_wdata(const struct xt_natmap_htable *ht)
+	/* under ht->lock or rcu_read_lock */
+{
+	struct natmap_data *d = natmap_deref(ht, ht->shadow);
+
+	return d ?: natmap_deref(ht, ht->data);
+}
+
+/* chain walking through node[tbl->idx] */
+#define natmap_hash_entry(ptr, type, idx) \
+	({ struct hlist_node *____ptr = (ptr); \
+	   ____ptr ? container_of(____ptr - (idx), type, node[0]) : NULL; })
+
+#define natmap_hash_for_each_rcu(pos, tbl, h) \
+	for (pos = natmap_hash_entry(rcu_dereference_raw( \
+		hlist_first_rcu(&(tbl)->head[h])), typeof(*(pos)), (tbl)->idx); \
+	     pos; \
+	     pos = natmap_hash_entry(rcu_dereference_raw( \
+		hlist_next_rcu(&(pos)->node[(tbl)->idx])), \
+		typeof(*(pos)), (tbl)->idx))
+
+#define natmap_hash_for_each_safe(pos, n, tbl, h) \
+	for (pos = natmap_hash_entry((tbl)->head[h].first, \
+		typeof(*(pos)), (tbl)->idx); \
+	     pos && ({ n = pos->node[(tbl)->idx].next; 1; }); \
+	     pos = natmap_hash_entry(n, typeof(*(pos)), (tbl)->idx))
+
 /* net namespace support */
 struct natmap_net {
 	struct hlist_head	htables;
 	struct proc_dir_entry	*ipt_natmap;
+	struct proc_dir_entry	*ipt_natmap_stat; /* histograms */
 };
 
 static int natmap_net_id;
@@ -131,9 +373,16 @@ natmap_net *natmap_pernet(struct net *net)
 /* need to declare this at the top */
 #if  LINUX_VERSION_CODE < KERNEL_VERSION(5,6,0)
 static const struct file_operations natmap_fops;
+static const struct file_operations natmap_hist_fops;
 #else
 static const struct proc_ops natmap_fops;
+static const struct proc_ops natmap_hist_fops;
 #endif
+static void natmap_tg_select(struct xt_natmap_htable *ht);
+static void natmap_data_free(struct natmap_data *d);
+static void natmap_data_free_work(struct work_struct *work);
+static void natmap_range_set(struct natmap_data *d,
+    const struct natmap_pre *old, struct natmap_pre *pre);
 
 const __be32 cidr2mask[33] = {
 	0x00000000, 0x00000080, 0x000000C0, 0x000000E0,
@@ -157,10 +406,44 @@ hash_addr(unsigned int hsize, const __be32 addr)
 	return reciprocal_scale(jhash_1word(addr, 0), hsize);
 }
 
+/* tag of composite keys is the seed, 0 for the others */
 static inline u32
-hash_addr_mask(unsigned int hsize, const __be32 addr, const u32 cidr)
+hash_addr_mask(unsigned int hsize, const __be32 addr, const u32 cidr,
+const u32 tag)
+{
+	return reciprocal_scale(jhash_2words(addr, cidr2mask[cidr], tag),
+	    hsize);
+}
+
+static inline u32
+hash_addr6(unsigned int hsize, const struct in6_addr *addr, const u32 plen)
+{
+	return reciprocal_scale(jhash2(addr->s6_addr32, 4, plen), hsize);
+}
+
+/* zone:addr and mark:addr keys, entries of other tags never match */
+static inline bool
+natmap_tagged(const unsigned int mode)
+{
+	const unsigned int key = mode & XT_NATMAP_KEY;
+
+	return key == XT_NATMAP_KEY_ZONE_ADDR || key == XT_NATMAP_KEY_MARK_ADDR;
+}
+
+/* key names as in --nm-mode, by XT_NATMAP_KEY */
+static const char * const natmap_key_names[] = {
+	"", ", key: daddr", ", key: zone+addr", ", key: mark+addr",
+	", key: ctmark", ", key: zone", ", key: iif", "",
+};
+
+#define natmap_key_name(mode) \
+	natmap_key_names[((mode) & XT_NATMAP_KEY) >> XT_NATMAP_KEY_SHIFT]
+
+static inline __be32
+natmap6_fold(const struct in6_addr *addr)
 {
-	return reciprocal_scale(jhash_2words(addr, cidr2mask[cidr], 0), hsize);
+	return addr->s6_addr32[0] ^ addr->s6_addr32[1] ^
+	    addr->s6_addr32[2] ^ addr->s6_addr32[3];
 }
 
 static inline void *
@@ -177,1060 +460,5246 @@ natmap_ent_zalloc(const size_t sz)
 	return ret;
 }
 
-static struct hlist_head *
-natmap_hash_zalloc(unsigned int hsize)
+static struct natmap_hash *
+natmap_hash_zalloc(unsigned int hsize, unsigned int idx)
 {
-	struct hlist_head *hash;
-	unsigned int sz = hsize * sizeof(struct hlist_head);
+	struct natmap_hash *hash;
+	size_t sz = struct_size(hash, head, hsize);
 
 	if (sz <= PAGE_SIZE)
 		hash = kzalloc(sz, GFP_KERNEL);
 	else
 		hash = vzalloc(sz);
 	/* will not need INIT_HLIST_NODE because elements's are zeroized */
+	if (hash) {
+		hash->size = hsize;
+		hash->idx = idx;
+	}
 
 	return hash;
 }
 
-static void
-natmap_hash_change(struct xt_natmap_htable *ht, size_t nsize)
+static inline u32
+hash_pre(const struct natmap_hash *tbl, const struct natmap_pre *pre)
 {
-	struct natmap_pre *pre;
-	struct natmap_post *post;
-	struct hlist_node *n;
-	struct hlist_head *nhash, *ohash;
-	size_t osize;
-	unsigned int i;
-
-	if (nsize < 256)
-		return;
+	if (pre->act == NATMAP_ACT_PFX6)
+		return hash_addr6(tbl->size, &natmap6(pre)->prenat,
+		    natmap6(pre)->plen);
+	return hash_addr_mask(tbl->size, pre->prenat.addr, pre->prenat.cidr,
+	    pre->tag);
+}
 
-	nhash = natmap_hash_zalloc(nsize);
-	if (nhash == NULL)
-		return;
-	ohash = ht->pre;
-	osize = ht->hsize;
-	ht->hsize = nsize;
-	for (i = 0; i < osize; i++) {
-		hlist_for_each_entry_safe(pre, n, &ohash[i], node) {
-			spin_lock_bh(&pre->lock_bh);
-			hlist_add_head_rcu(&pre->node, &nhash[hash_addr_mask(
-			    nsize, pre->prenat.addr, pre->prenat.cidr)]);
-			spin_unlock_bh(&pre->lock_bh);
-		}
-	}
-	ht->pre = nhash;
-	kvfree(ohash);
-
-	nhash = natmap_hash_zalloc(nsize);
-	if (nhash == NULL)
-		return;
-	ohash = ht->post;
-	for (i = 0; i < osize; i++) {
-		hlist_for_each_entry_safe(post, n, &ohash[i], node) {
-			spin_lock_bh(&post->lock_bh);
-			hlist_add_head_rcu(&post->node, &nhash[hash_addr(
-			    nsize, post->pre->postnat.from)]);
-			spin_unlock_bh(&post->lock_bh);
-		}
-	}
-	ht->post = nhash;
-	kvfree(ohash);
+static inline u32
+hash_post(const struct natmap_hash *tbl, const struct natmap_post *post)
+{
+	if (post->pre->act == NATMAP_ACT_PFX6)
+		return hash_addr6(tbl->size, &natmap6(post->pre)->postnat,
+		    natmap6(post->pre)->plen);
+	return hash_addr(tbl->size, post->pre->postnat.from);
+}
 
-	if (!disable_log)
-		pr_info("Changed hash size %zu -> %zu\n", osize, nsize);
+/* is old bucket h already linked into the arrays being filled */
+static inline bool
+natmap_hash_migrated(const struct natmap_data *d, const u32 h)
+	/* under ht->lock */
+{
+	return d->pre_next && h < d->resize_pos;
 }
 
 /* register entry into hash table */
-static void
-natmap_pre_add(struct xt_natmap_htable *ht, struct natmap_pre *pre)
-	/* under ht->lock */
+static struct natmap_rmap *
+natmap_rmap_alloc(const unsigned int count)
 {
-	/* add each address into htable hash */
-	hlist_add_head_rcu(&pre->node, &ht->pre[hash_addr_mask(
-		ht->hsize, pre->prenat.addr, pre->prenat.cidr)]);
+	struct natmap_rmap *rmap;
+	unsigned int size;
 
-	ht->cidr_map[pre->prenat.cidr]++;
-	ht->count++;
+	/* sized for load factor 1/2 */
+	size = roundup_pow_of_two(max_t(unsigned int, NATMAP_RMAP_MIN,
+	    DIV_ROUND_UP(count * 2, NATMAP_RMAP_SLOTS)));
+	rmap = kvzalloc(struct_size(rmap, bucket, size), GFP_KERNEL);
+	if (rmap)
+		rmap->size = size;
+
+	return rmap;
 }
 
 static void
-natmap_post_add(struct xt_natmap_htable *ht, struct natmap_post *post)
-	/* under ht->lock */
+natmap_rmap_free_rcu(struct rcu_head *head)
 {
-	/* add each address into htable hash */
-	hlist_add_head_rcu(&post->node, &ht->post[hash_addr(
-		ht->hsize, post->pre->postnat.from)]);
+	struct natmap_rmap *rmap = container_of(head, struct natmap_rmap, rcu);
+
+	kvfree(rmap);
 }
 
-/* get entity by prenat address */
-static inline struct natmap_pre *
-natmap_pre_find(const struct xt_natmap_htable *ht,
-const __be32 prenat_addr, const u32 cidr)
+/* too full to insert into, or too sparse */
+static bool
+natmap_rmap_stale(const struct natmap_rmap *rmap, const unsigned int count)
 {
-	u32 h;
-	__be32 a;
+	const unsigned int slots = rmap->size * NATMAP_RMAP_SLOTS;
 
-	a = prenat_addr & cidr2mask[cidr];
-	h = hash_addr_mask(ht->hsize, a, cidr);
-
-	if (!hlist_empty(&ht->pre[h])) {
-		struct natmap_pre *pre;
+	return rmap->used >= slots / 4 * 3 ||
+	    (rmap->size > NATMAP_RMAP_MIN && count < slots / 8);
+}
 
-		hlist_for_each_entry_rcu(pre,
-		    &ht->pre[h], node)
-			if ((pre->prenat.cidr == cidr) &&
-			    (pre->prenat.addr == a))
-				return pre;
+static bool
+natmap_rmap_insert(struct natmap_rmap *rmap, const __be32 post_ip,
+const __be32 addr, struct natmap_pre *pre)
+	/* under ht->lock */
+{
+	const unsigned int mask = rmap->size - 1;
+	unsigned int b, i, n;
+
+	b = hash_addr(rmap->size, post_ip);
+	for (n = 0; n <= mask; n++, b = (b + 1) & mask) {
+		struct natmap_rmap_slot *slot = rmap->bucket[b].slot;
+
+		for (i = 0; i < NATMAP_RMAP_SLOTS; i++)
+			if (slot[i].post == NATMAP_RMAP_FREE) {
+				slot[i].addr = addr;
+				slot[i].pre = pre;
+				/* key goes last for lockless readers */
+				smp_store_release(&slot[i].post, post_ip);
+				rmap->used++;
+				return true;
+			}
 	}
 
-	return NULL;
+	return false;
 }
 
-/* reverse get entity by postnat address */
-static inline struct natmap_pre *
-natmap_pre_rfind(const struct xt_natmap_htable *ht,
-const __be32 post_ip)
+static struct natmap_rmap_slot *
+natmap_rmap_slot(struct natmap_rmap *rmap, const struct natmap_pre *pre)
+	/* under ht->lock */
 {
-	u32 h;
-	struct natmap_post *post;
-
-	h = hash_addr(ht->hsize, post_ip);
-	if (!hlist_empty(&ht->post[h]))
-		hlist_for_each_entry_rcu(post, &ht->post[h], node)
-			if (post->pre->postnat.from == post_ip)
-				return post->pre;
+	const unsigned int mask = rmap->size - 1;
+	const __be32 post_ip = pre->postnat.from;
+	unsigned int b, i, n;
+
+	b = hash_addr(rmap->size, post_ip);
+	for (n = 0; n <= mask; n++, b = (b + 1) & mask) {
+		struct natmap_rmap_slot *slot = rmap->bucket[b].slot;
+
+		for (i = 0; i < NATMAP_RMAP_SLOTS; i++) {
+			if (slot[i].post == NATMAP_RMAP_FREE)
+				return NULL;
+			if (slot[i].post == post_ip && slot[i].pre == pre)
+				return &slot[i];
+		}
+	}
 
 	return NULL;
 }
 
-/* allocate named hash table, register its proc entry */
-static int
-htable_create(struct net *net, struct xt_natmap_tginfo *tinfo)
-	/* rule insertion chain, under natmap_mutex */
+/* no free slot left, deleted ones are only reused after a rebuild */
+static bool
+natmap_rmap_full(struct xt_natmap_htable *ht)
+	/* under ht->lock */
 {
-	struct natmap_net *natmap_net = natmap_pernet(net);
-	struct xt_natmap_htable *ht;
-	unsigned int hsize = hashsize;	/* (entities) */
-	unsigned int sz;		/* (bytes) */
-
-	if (hsize < 256 || hsize > 1000000)
-		hsize = 256;
-
-	sz = sizeof(struct xt_natmap_htable);
-	if (sz <= PAGE_SIZE)
-		ht = kzalloc(sz, GFP_KERNEL);
-	else
-		ht = vzalloc(sz);
-	if (ht == NULL)
-		return -ENOMEM;
+	const struct natmap_rmap *rmap = natmap_deref(ht,
+	    natmap_wdata(ht)->rmap);
 
-	ht->pre = natmap_hash_zalloc(hsize);
-	if (ht->pre == NULL) {
-		kvfree(ht);
-		return -ENOMEM;
-	}
+	return rmap && rmap->used >= rmap->size * NATMAP_RMAP_SLOTS;
+}
 
-	ht->post = natmap_hash_zalloc(hsize);
-	if (ht->post == NULL) {
-		kvfree(ht->pre);
-		kvfree(ht);
-		return -ENOMEM;
-	}
+/* writers check natmap_rmap_full() before linking anything */
+static void
+natmap_rmap_add(struct xt_natmap_htable *ht, struct natmap_pre *pre)
+	/* under ht->lock */
+{
+	struct natmap_rmap *rmap = natmap_deref(ht, natmap_wdata(ht)->rmap);
 
-	tinfo->ht = ht;
+	if (rmap)
+		WARN_ON(!natmap_rmap_insert(rmap, pre->postnat.from,
+		    pre->prenat.addr, pre));
+}
 
-	ht->use = 1;
-	ht->hsize = hsize;
-	ht->count = 0;
-	ht->mode = tinfo->mode;
-	strcpy(ht->name, tinfo->name);
+static void
+natmap_rmap_del(struct xt_natmap_htable *ht, const struct natmap_pre *pre)
+	/* under ht->lock */
+{
+	struct natmap_rmap *rmap = natmap_deref(ht, natmap_wdata(ht)->rmap);
+	struct natmap_rmap_slot *slot;
 
-	spin_lock_init(&ht->lock);
+	if (rmap && (slot = natmap_rmap_slot(rmap, pre)))
+		WRITE_ONCE(slot->post, NATMAP_RMAP_DELETED);
+}
 
-	ht->pde = proc_create_data(tinfo->name, 0644, natmap_net->ipt_natmap,
-		    &natmap_fops, ht);
-	if (ht->pde == NULL) {
-		kvfree(ht->pre);
-		kvfree(ht->post);
-		kvfree(ht);
-		return -ENOMEM;
+/* copy live slots into an array sized for the current count */
+static int
+natmap_rmap_rebuild(struct xt_natmap_htable *ht)
+	/* process context, takes ht->lock */
+{
+	struct natmap_rmap *rmap, *old;
+	struct natmap_data *d;
+	unsigned int b, i, count;
+
+	for (;;) {
+		rcu_read_lock();
+		count = READ_ONCE(natmap_wdata(ht)->count);
+		rcu_read_unlock();
+		rmap = natmap_rmap_alloc(count + NATMAP_RMAP_SLOTS);
+		if (!rmap)
+			return -ENOMEM;
+
+		spin_lock(&ht->lock);
+		d = natmap_wdata(ht);
+		old = natmap_deref(ht, d->rmap);
+		if (!natmap_rmap_stale(old, d->count)) {
+			/* done by concurrent writer */
+			spin_unlock(&ht->lock);
+			kvfree(rmap);
+			return 0;
+		}
+		if (d->count < rmap->size * NATMAP_RMAP_SLOTS / 2)
+			break;
+		spin_unlock(&ht->lock);
+		kvfree(rmap);
 	}
-	ht->net = net;
 
-	hlist_add_head(&ht->node, &natmap_net->htables);
+	for (b = 0; b < old->size; b++)
+		for (i = 0; i < NATMAP_RMAP_SLOTS; i++) {
+			const struct natmap_rmap_slot *slot =
+			    &old->bucket[b].slot[i];
 
-	if (!disable_log)
-		pr_info("Create table: %s (%s%s%s%s%s%s)\n", tinfo->name,
-		    (tinfo->mode & XT_NATMAP_PRIO) ? "mode: prio"    : "",
-		    (tinfo->mode & XT_NATMAP_MARK) ? "mode: mark"    : "",
-		    (tinfo->mode & XT_NATMAP_ADDR) ? "mode: addr"    : "",
-		    (tinfo->mode & XT_NATMAP_PERS) ? ", +persistent" : "",
-		    (tinfo->mode & XT_NATMAP_DROP) ? ", +hotdrop"    : "",
-		    (tinfo->mode & XT_NATMAP_CGNT) ? ", +cg-nat"     : "");
+			if (slot->post != NATMAP_RMAP_FREE &&
+			    slot->post != NATMAP_RMAP_DELETED)
+				natmap_rmap_insert(rmap, slot->post,
+				    slot->addr, slot->pre);
+		}
+	rcu_assign_pointer(d->rmap, rmap);
+	spin_unlock(&ht->lock);
 
+	call_rcu(&old->rcu, natmap_rmap_free_rcu);
 	return 0;
 }
 
 static void
-natmap_pre_free_rcu(struct rcu_head *head)
+natmap_pre_add(struct xt_natmap_htable *ht, struct natmap_pre *pre)
+	/* under ht->lock */
 {
-	struct natmap_pre *pre = container_of(head, struct natmap_pre, rcu);
+	struct natmap_data *d = natmap_wdata(ht);
+	struct natmap_hash *tbl = natmap_deref(ht, d->pre);
+	const u32 h = hash_pre(tbl, pre);
+
+	/* length is probed before its first entry is reachable */
+	if (pre->act == NATMAP_ACT_PFX6 &&
+	    !d->plen6_map[natmap6(pre)->plen]++) {
+		set_bit(natmap6(pre)->plen, d->plen6_used);
+		d->plen6_count++;
+	}
 
-	kvfree(pre);
+	/* add each address into htable hash */
+	hlist_add_head_rcu(&pre->node[tbl->idx], &tbl->head[h]);
+	if (natmap_hash_migrated(d, h))
+		hlist_add_head_rcu(&pre->node[d->pre_next->idx],
+		    &d->pre_next->head[hash_pre(d->pre_next, pre)]);
+
+	WRITE_ONCE(d->cidr_map[pre->prenat.cidr],
+	    d->cidr_map[pre->prenat.cidr] + 1);
+	if (pre->act == NATMAP_ACT_HOST)
+		d->cgnt_map[pre->cgnt_bits]++;
+	d->count++;
 }
 
 static void
-natmap_post_free_rcu(struct rcu_head *head)
+natmap_post_add(struct xt_natmap_htable *ht, struct natmap_post *post)
+	/* under ht->lock */
 {
-	struct natmap_post *post = container_of(head, struct natmap_post, rcu);
+	struct natmap_data *d = natmap_wdata(ht);
+	struct natmap_hash *tbl = natmap_deref(ht, d->post);
+	const u32 h = hash_post(tbl, post);
 
-	kvfree(post);
+	/* add each address into htable hash */
+	hlist_add_head_rcu(&post->node[tbl->idx], &tbl->head[h]);
+	if (natmap_hash_migrated(d, h))
+		hlist_add_head_rcu(&post->node[d->post_next->idx],
+		    &d->post_next->head[hash_post(d->post_next, post)]);
+	natmap_rmap_add(ht, post->pre);
+	WRITE_ONCE(d->post_cidr_map[post->pre->postnat.cidr],
+	    d->post_cidr_map[post->pre->postnat.cidr] + 1);
 }
 
-/* remove natmap entry, called from proc interface */
+/* swap linked entry with its successor having the same prenat */
 static void
-natmap_pre_del(struct xt_natmap_htable *ht, struct natmap_pre *pre)
-	/* htable_cleanup, under natmap_mutex */
+natmap_pre_replace(struct xt_natmap_htable *ht, struct natmap_pre *old,
+struct natmap_pre *pre)
 	/* under ht->lock */
 {
-	ht->cidr_map[pre->prenat.cidr]--;
+	struct natmap_data *d = natmap_wdata(ht);
+	struct natmap_hash *tbl = natmap_deref(ht, d->pre);
+
+	hlist_replace_rcu(&old->node[tbl->idx], &pre->node[tbl->idx]);
+	if (natmap_hash_migrated(d, hash_pre(tbl, old)))
+		hlist_replace_rcu(&old->node[d->pre_next->idx],
+		    &pre->node[d->pre_next->idx]);
+	if (!old->prenat.cidr)
+		natmap_range_set(d, old, pre);
+	if (old->act == NATMAP_ACT_HOST)
+		d->cgnt_map[old->cgnt_bits]--;
+	if (pre->act == NATMAP_ACT_HOST)
+		d->cgnt_map[pre->cgnt_bits]++;
+}
 
-	hlist_del_rcu(&pre->node);
-	call_rcu(&pre->rcu, natmap_pre_free_rcu);
+/* cg-nat layout: prenat offset k gets postnat address k % npub
+ * and port block k / npub, so the mapping is invertible;
+ * both npub and blocks per address are powers of 2 */
+#define NATMAP_CGNT_PORT_MIN	1536
+#define NATMAP_CGNT_PORT_MAX	65535
+
+/* compile entity into ready NAT action */
+static void
+natmap_act_init(struct natmap_pre *pre)
+{
+	if (!pre->postnat.cidr) {
+		pre->act = NATMAP_ACT_RANGE;
+		return;
+	}
+	pre->act = NATMAP_ACT_HOST;
+	pre->hostmask = pre->postnat.from ^ pre->postnat.to;
+	pre->cgnt_shift = 32 - pre->postnat.cidr;
+	if (pre->postnat.cidr > pre->prenat.cidr)
+		pre->cgnt_bits = pre->postnat.cidr - pre->prenat.cidr;
+}
 
-	BUG_ON(ht->count == 0);
-	ht->count--;
+/* ports must be given and the blocks must tile them */
+static bool
+natmap_cgnt_valid(const struct natmap_cgnt *g)
+{
+	return g->min && g->range &&
+	    g->min + g->range - 1 <= NATMAP_CGNT_PORT_MAX &&
+	    (!g->block || g->range % g->block == 0);
 }
 
-static void
-natmap_post_del(struct xt_natmap_htable *ht, struct natmap_post *post)
-	/* htable_cleanup, under natmap_mutex */
-	/* under ht->lock */
+/* ports per prenat address of an entity with 1 << bits of them */
+static inline u32
+natmap_cgnt_ports(const struct natmap_cgnt *g, const unsigned int bits)
 {
-	hlist_del_rcu(&post->node);
-	call_rcu(&post->rcu, natmap_post_free_rcu);
+	return g->block ?: (bits < 32 ? g->range >> bits : 0) ?: 1;
 }
 
-/* destroy linked content of hash table */
-static void
-htable_cleanup(struct xt_natmap_htable *ht, const bool stat)
-	/* under natmap_mutex */
+/* the blocks of 1 << bits prenat addresses fit in the port range,
+ * so that no two of them share ports */
+static bool
+natmap_cgnt_fits(const struct natmap_cgnt *g, const unsigned int bits)
 {
-	unsigned int i;
+	return bits <= 16 && natmap_cgnt_ports(g, bits) << bits <= g->range;
+}
 
-	spin_lock(&ht->lock);
-	for (i = 0; i < ht->hsize; i++) {
-		struct natmap_pre *pre;
-		struct hlist_node *n;
+/* largest block bits of the entities linked in d */
+static unsigned int
+natmap_cgnt_bits(const struct natmap_data *d)
+{
+	unsigned int bits = 32;
 
-		hlist_for_each_entry_safe(pre, n, &ht->pre[i], node)
-			if (stat)
-				memset(&pre->stat, 0, sizeof(pre->stat));
-			else {
-				natmap_post_del(ht, pre->post);
-				natmap_pre_del(ht, pre);
-			}
-	}
-	if (!stat && ht->hsize > 256)
-		natmap_hash_change(ht, 256);
-	spin_unlock(&ht->lock);
-	cond_resched();
+	while (bits && !d->cgnt_map[bits])
+		bits--;
+	return bits;
 }
 
+/* geometry of the target rule, defaults if no ports are given */
 static void
-natmap_table_flush(struct xt_natmap_htable *ht, const bool stat)
+natmap_cgnt_init(struct natmap_cgnt *g, const struct xt_natmap_tginfo *tinfo)
 {
-	mutex_lock(&natmap_mutex);
-	htable_cleanup(ht, stat);
-	mutex_unlock(&natmap_mutex);
+	g->min = NATMAP_CGNT_PORT_MIN;
+	g->range = NATMAP_CGNT_PORT_MAX - NATMAP_CGNT_PORT_MIN + 1;
+	if (tinfo->range.flags & NF_NAT_RANGE_PROTO_SPECIFIED) {
+		g->min = ntohs(tinfo->range.min_proto.all);
+		g->range = ntohs(tinfo->range.max_proto.all) - g->min + 1;
+	}
+	g->block = tinfo->block;
 }
 
-static void
-natmap_post_flush(struct xt_natmap_htable *ht,
-struct post_ip *postnat)
+#define NATMAP_CGNT_KEEP	U32_MAX	/* natmap_cgnt_set() keeps the field */
+
+/* publish new ports and/or block, checked together with the part kept
+ * (-EINVAL) and against the entities of the table and of its shadow,
+ * whose blocks must still fit (-ERANGE) */
+static int
+natmap_cgnt_set(struct xt_natmap_htable *ht, const u32 min, const u32 range,
+const u32 block)
 {
-	struct natmap_post *post;
-	struct hlist_node *n;
+	struct natmap_cgnt *g, *old;
+	const struct natmap_data *shadow;
+	int ret = 0;
+
+	g = kmalloc(sizeof(*g), GFP_KERNEL);
+	if (!g)
+		return -ENOMEM;
 
-	mutex_lock(&natmap_mutex);
 	spin_lock(&ht->lock);
-	hlist_for_each_entry_safe(post, n, &ht->post[hash_addr(
-				ht->hsize, postnat->from)], node)
-		if (memcmp(&post->pre->postnat, postnat,
-		    sizeof(struct post_ip)) == 0) {
-			natmap_pre_del(ht, post->pre);
-			natmap_post_del(ht, post);
-		}
+	old = natmap_deref(ht, ht->cgnt);
+	g->min = min != NATMAP_CGNT_KEEP ? min : old->min;
+	g->range = range != NATMAP_CGNT_KEEP ? range : old->range;
+	g->block = block != NATMAP_CGNT_KEEP ? block : old->block;
+	shadow = natmap_deref(ht, ht->shadow);
+	if (!natmap_cgnt_valid(g))
+		ret = -EINVAL;
+	else if ((ht->mode & XT_NATMAP_CGNT) &&
+	    (!natmap_cgnt_fits(g, natmap_cgnt_bits(natmap_deref(ht, ht->data))) ||
+	     (shadow && !natmap_cgnt_fits(g, natmap_cgnt_bits(shadow)))))
+		ret = -ERANGE;
+	if (ret) {
+		spin_unlock(&ht->lock);
+		kfree(g);
+		return ret;
+	}
+	rcu_assign_pointer(ht->cgnt, g);
 	spin_unlock(&ht->lock);
-	cond_resched();
-	mutex_unlock(&natmap_mutex);
+
+	kfree_rcu(old, rcu);
+	return 0;
 }
 
-static void
-htable_destroy(struct xt_natmap_htable *ht)
-	/* caller htable_put, iptables rule deletion chain */
-	/* under natmap_mutex */
+/* port blocks of the rule's entity fit the geometry of the table */
+static bool
+natmap_cgnt_rule_fits(const struct xt_natmap_htable *ht,
+const struct natmap_rule *rule)
+	/* under ht->lock */
 {
-	struct natmap_net *natmap_net = natmap_pernet(ht->net);
-
-	/* natmap_net_exit() can independently unregister
-	 * proc entries */
-	if (natmap_net->ipt_natmap)
-		remove_proc_entry(ht->name, natmap_net->ipt_natmap);
-
-	if (!disable_log)
-		pr_info("Remove table: %s \n", ht->name);
+	if (!(ht->mode & XT_NATMAP_CGNT) || !rule->postnat.cidr ||
+	    rule->postnat.cidr <= rule->prenat.cidr)
+		return true;
+	return natmap_cgnt_fits(natmap_deref(ht, ht->cgnt),
+	    rule->postnat.cidr - rule->prenat.cidr);
+}
 
-	htable_cleanup(ht, false);
-	BUG_ON(ht->count != 0);
-	kvfree(ht->post);
-	kvfree(ht->pre);
-	kvfree(ht);
+static inline u32
+natmap_cgnt_slot(const struct natmap_pre *pre, const __be32 prenat_ip)
+{
+	return (ntohl(prenat_ip ^ pre->prenat.addr) >> pre->cgnt_shift) &
+	    ((1U << pre->cgnt_bits) - 1);
 }
 
-/* allocate htable caused by target insertion with iptables */
+/* prenat address which was given postnat_ip:port by entity */
 static int
-htable_get(struct net *net, struct xt_natmap_tginfo *tinfo, const bool pre_r)
-	/* iptables rule addition chain */
-	/* under natmap_mutex */
+natmap_cgnt_owners(const struct xt_natmap_htable *ht,
+const struct natmap_pre *pre, const __be32 postnat_ip, const u16 port,
+int (*fn)(void *, const struct natmap_pre *, __be32), void *arg)
+	/* under rcu_read_lock */
 {
-	struct natmap_net *natmap_net = natmap_pernet(net);
-	struct xt_natmap_htable *ht;
-
-	hlist_for_each_entry(ht, &natmap_net->htables, node)
-		if (!strcmp(tinfo->name, ht->name)) {
-			if (pre_r) {
-				if (!(ht->mode & XT_NATMAP_ADDR) ||
-				    !(ht->mode & XT_NATMAP_2WAY)) {
-					pr_err("Target with same name in "
-					"POSTROUTING must be addr & 2way, "
-					"<%s>\n", tinfo->name);
-					return -EINVAL;
-				}
-			} else if (tinfo->mode != ht->mode) {
-				pr_err("Mode/flags differ from previous "
-				    "declaration, <%s>\n", tinfo->name);
-				return -EINVAL;
-			}
-			ht->use++;
-			tinfo->ht = ht;
+	const __be32 netmask = ~(pre->postnat.from ^ pre->postnat.to);
+	const struct natmap_cgnt *g = rcu_dereference(ht->cgnt);
+	const u32 ports = natmap_cgnt_ports(g, pre->cgnt_bits);
+	u32 slot;
+	__be32 prenat_ip;
+
+	if (pre->prenat.cidr > pre->postnat.cidr) {
+		/* prenat block is smaller than postnat one */
+		if ((u16)(port - g->min) >= ports)
 			return 0;
-		}
-	return htable_create(net, tinfo);
+		prenat_ip = pre->prenat.addr |
+		    (postnat_ip & ~cidr2mask[pre->prenat.cidr]);
+		if ((prenat_ip ^ postnat_ip) & ~netmask)
+			return 0;
+		return fn(arg, pre, prenat_ip);
+	}
+
+	if (port < g->min)
+		return 0;
+	slot = (port - g->min) / ports;
+	if (slot >> pre->cgnt_bits)
+		return 0;
+	prenat_ip = pre->prenat.addr | htonl(slot << pre->cgnt_shift |
+	    ntohl(postnat_ip & ~netmask));
+	return fn(arg, pre, prenat_ip);
 }
 
-/* remove htable caused by target rule deletion with iptables */
-static void
-htable_put(struct xt_natmap_htable *ht)
-	/* caller natmap_tg_destroy, iptables rule deletion */
-	/* under natmap_mutex */
+/* call fn for each cg-nat entity which has given out postnat_ip:port,
+ * probing the postnat hash once per postnat prefix length in use */
+static int
+natmap_cgnt_query(const struct xt_natmap_htable *ht, const __be32 postnat_ip,
+const u16 port, int (*fn)(void *, const struct natmap_pre *, __be32),
+void *arg)
+	/* under rcu_read_lock */
 {
-	if (--ht->use == 0 && (!(ht->mode & XT_NATMAP_PERS))) {
-		hlist_del(&ht->node);
-		htable_destroy(ht);
+	const struct natmap_data *d = rcu_dereference(ht->data);
+	const struct natmap_hash *tbl = rcu_dereference(d->post);
+	const struct natmap_post *post;
+	int c, ret;
+
+	for (c = 32; c > 0; c--) {
+		const __be32 a = postnat_ip & cidr2mask[c];
+
+		if (!READ_ONCE(d->post_cidr_map[c]))
+			continue;
+		natmap_hash_for_each_rcu(post, tbl, hash_addr(tbl->size, a)) {
+			const struct natmap_pre *pre = post->pre;
+
+			if (pre->postnat.cidr != c || pre->postnat.from != a)
+				continue;
+			ret = natmap_cgnt_owners(ht, pre, postnat_ip, port,
+			    fn, arg);
+			if (ret)
+				return ret;
+		}
 	}
+
+	return 0;
 }
 
-/* check the packet */
-static unsigned int
-natmap_tg(struct sk_buff *skb, const struct xt_action_param *par)
-	/* under bh */
+/* get entity by prenat address, and tag in composite key tables */
+static inline struct natmap_pre *
+natmap_pre_find(const struct xt_natmap_htable *ht, const struct natmap_data *d,
+const u32 tag, const __be32 prenat_addr, const u32 cidr)
 {
-	const struct xt_natmap_tginfo *tginfo = par->targinfo;
-	struct xt_natmap_htable *ht = tginfo->ht;
-	const struct nf_nat_range2 *mr = &tginfo->range;
-	struct nf_nat_range2 newrange;
-	struct natmap_pre *pre = NULL;
-	struct nf_conn *ct;
-	enum ip_conntrack_info ctinfo;
-	int ret = XT_CONTINUE;
-	__be32 prenat_ip, postnat_ip;
-	u32 c;
-	unsigned int hooknum = xt_hooknum(par);
-/*
-	NF_CT_ASSERT(hooknum == NF_INET_POST_ROUTING ||
-		     hooknum == NF_INET_PRE_ROUTING);
-*/
-	ct = nf_ct_get(skb, &ctinfo);
-/*
-	NF_CT_ASSERT(ct != NULL &&
-	    (ctinfo == IP_CT_NEW || ctinfo == IP_CT_RELATED ||
-	    ctinfo == IP_CT_RELATED_REPLY));
-*/
-	rcu_read_lock();
-
-	if (hooknum == NF_INET_PRE_ROUTING) {
-		if (!(ht->mode & XT_NATMAP_2WAY))
-			goto unlock;
+	const struct natmap_hash *tbl = natmap_deref(ht, d->pre);
+	struct natmap_pre *pre;
+	u32 h;
+	__be32 a;
 
-		postnat_ip = ip_hdr(skb)->daddr;
+	/* ranges by their first address */
+	a = cidr ? prenat_addr & cidr2mask[cidr] : prenat_addr;
+	h = hash_addr_mask(tbl->size, a, cidr, tag);
 
-		pre = natmap_pre_rfind(ht, postnat_ip);
-		if (pre) {
-			spin_lock(&pre->lock_bh);
-			prenat_ip = pre->prenat.addr;
-			if (ht->mode & XT_NATMAP_STAT) {
-				pre->stat.pkts++;
-				pre->stat.bytes += skb->len;
-			}
-			spin_unlock(&pre->lock_bh);
-
-			memset(&newrange, 0, sizeof(newrange));
-			newrange.flags = mr->flags
-			    | NF_NAT_RANGE_MAP_IPS
-			    | NF_NAT_RANGE_PERSISTENT;
-			newrange.min_addr.ip = prenat_ip;
-			newrange.max_addr.ip = prenat_ip;
-			newrange.min_proto = mr->min_proto;
-			newrange.max_proto = mr->max_proto;
-			ret = nf_nat_setup_info(ct, &newrange,
-					 HOOK2MANIP(hooknum));
-		}
-		goto unlock;
-	}
+	natmap_hash_for_each_rcu(pre, tbl, h)
+		if ((pre->prenat.cidr == cidr) &&
+		    (pre->prenat.addr == a) && (pre->tag == tag))
+			return pre;
 
-	if (tginfo->mode & XT_NATMAP_PRIO)
-		prenat_ip = skb->priority;
-	else if (tginfo->mode & XT_NATMAP_MARK)
-		prenat_ip = skb->mark;
-	else
-		prenat_ip = ip_hdr(skb)->saddr;
+	return NULL;
+}
 
-	for (c = 32; c >= 1; c--) {
-		if (ht->cidr_map[c])
-			pre = natmap_pre_find(ht, prenat_ip, c);
-		if (pre)
-			break;
-	}
+/* reverse get entity by postnat address, two-way tables only */
+static inline struct natmap_pre *
+natmap_pre_rfind(const struct natmap_data *d,
+const __be32 post_ip, __be32 *prenat_ip)
+{
+	const struct natmap_rmap *rmap = rcu_dereference(d->rmap);
+	unsigned int b, i, n, mask;
 
-	if (pre) {
-		memset(&newrange, 0, sizeof(newrange));
-		newrange.flags = mr->flags
-		    | NF_NAT_RANGE_MAP_IPS
-		    | NF_NAT_RANGE_PERSISTENT;
+	if (!rmap)
+		return NULL;
 
-		spin_lock(&pre->lock_bh);
-		if (pre->postnat.cidr) {
-			__be32 netmask;
+	mask = rmap->size - 1;
+	b = hash_addr(rmap->size, post_ip);
+	for (n = 0; n <= mask; n++, b = (b + 1) & mask) {
+		const struct natmap_rmap_slot *slot = rmap->bucket[b].slot;
+		bool last = false;
 
-			prenat_ip = ip_hdr(skb)->saddr;
-			netmask = ~(pre->postnat.from ^ pre->postnat.to);
-			newrange.min_addr.ip = (prenat_ip & ~netmask)
-				| (pre->postnat.from & netmask);
-			newrange.max_addr.ip = newrange.min_addr.ip;
+		for (i = 0; i < NATMAP_RMAP_SLOTS; i++) {
+			const __be32 key = smp_load_acquire(&slot[i].post);
 
-			if (ht->mode & XT_NATMAP_CGNT) {
-				u32 addrs;
-				u16 min_port = 1536, ports = 64000;
-
-				addrs = (1U << (32 - pre->prenat.cidr)) /
-				    (htonl(pre->postnat.to
-				    ^ pre->postnat.from) + 1);
-				if (addrs) {
-					if (!(ports /= addrs))
-						ports = 1;
-					min_port += ((htonl(prenat_ip
-					    ^ pre->prenat.addr)
-					    % addrs)) * ports;
-				}
-				newrange.min_proto.all = htons(min_port);
-				newrange.max_proto.all = htons(min_port
-							    + ports - 1);
-				newrange.flags |= NF_NAT_RANGE_PROTO_SPECIFIED;
-			} else {
-				newrange.min_proto = mr->min_proto;
-				newrange.max_proto = mr->max_proto;
+			if (key == post_ip) {
+				*prenat_ip = READ_ONCE(slot[i].addr);
+				return READ_ONCE(slot[i].pre);
 			}
-		} else {
-			newrange.min_addr.ip = pre->postnat.from;
-			newrange.max_addr.ip = pre->postnat.to;
-			newrange.min_proto = mr->min_proto;
-			newrange.max_proto = mr->max_proto;
-		/*	newrange.flags |= NF_NAT_RANGE_PROTO_RANDOM_FULLY; */
-		}
-		if (ht->mode & XT_NATMAP_STAT) {
-			pre->stat.pkts++;
-			pre->stat.bytes += skb->len;
+			if (key == NATMAP_RMAP_FREE)
+				last = true;
 		}
-		spin_unlock(&pre->lock_bh);
+		/* insertion takes the first free slot */
+		if (last)
+			break;
+	}
 
-		ret = nf_nat_setup_info(ct, &newrange, HOOK2MANIP(hooknum));
-		if (ret != NF_ACCEPT)
-			pr_err("No free tuples to setup nat\n");
-	} else if (ht->mode & XT_NATMAP_DROP)
-		ret = NF_DROP;
+	return NULL;
+}
 
-unlock:
-	rcu_read_unlock();
-	return ret;
+static inline unsigned int
+natmap_lpm_index(const u32 key, const unsigned int level)
+{
+	return (key >> (32 - NATMAP_LPM_STRIDE * (level + 1))) &
+	    (NATMAP_LPM_SLOTS - 1);
 }
 
-/* check and init target rule, allocating htable */
-static int
-natmap_tg_check(const struct xt_tgchk_param *par)
-	/* iptables rule addition chain */
+/* longest prefix match among entries shorter than /32 */
+static inline struct natmap_pre *
+natmap_lpm_find(const struct natmap_data *d, const __be32 prenat_addr)
 {
-	struct net *net = par->net;
-	struct xt_natmap_tginfo *tinfo = par->targinfo;
-	const struct nf_nat_range2 *mr = &tinfo->range;
-	bool pre_r = false;
-	int ret = 0;
+	const struct natmap_lpm_node *node;
+	struct natmap_pre *best = NULL;
+	const u32 key = ntohl(prenat_addr);
+	unsigned int l;
 
-	if (!(mr->flags & NF_NAT_RANGE_MAP_IPS)) {
-		pr_debug("NATMAP: bad MAP_IPS.\n");
-		return -EINVAL;
+	node = rcu_dereference(d->lpm);
+	for (l = 0; node && l < NATMAP_LPM_LEVELS; l++) {
+		const unsigned int i = natmap_lpm_index(key, l);
+		struct natmap_pre *pre = rcu_dereference(node->pre[i]);
+
+		if (pre)
+			best = pre;
+		node = rcu_dereference(node->child[i]);
 	}
 
-	if (tinfo->name[sizeof(tinfo->name) - 1] != '\0')
-		return -EINVAL;
+	return best;
+}
 
-	tinfo->mode |= XT_NATMAP_STAT;
-	if (par->hook_mask & (1 << NF_INET_PRE_ROUTING)) {
-		if (!(tinfo->mode & (XT_NATMAP_ADDR | XT_NATMAP_2WAY))) {
-			pr_err("No any mode/flags allowed in PREROUTING, except"
-			" nm-mode addr and nm-2way, <%s>!\n", tinfo->name);
-			return -EINVAL;
-		}
-		pre_r = true;
-		tinfo->mode |= XT_NATMAP_2WAY;
+/* count of slots starting at or below the address */
+static inline unsigned int
+natmap_range_index(const struct natmap_ranges *rs, const u32 addr)
+{
+	unsigned int lo = 0, hi = smp_load_acquire(&rs->count);
+
+	while (lo < hi) {
+		const unsigned int m = (lo + hi) / 2;
+
+		if (rs->slot[m].first <= addr)
+			lo = m + 1;
+		else
+			hi = m;
 	}
 
-	mutex_lock(&natmap_mutex);
-	ret = htable_get(net, tinfo, pre_r);
-	mutex_unlock(&natmap_mutex);
-	return ret;
+	return lo;
 }
 
-/* remove iptables target rule */
-static void
-natmap_tg_destroy(const struct xt_tgdtor_param *par)
-	/* iptables rule deletion chain */
+/* range containing the address */
+static inline struct natmap_pre *
+natmap_range_find(const struct natmap_data *d, const __be32 prenat_addr)
 {
-	const struct xt_natmap_tginfo *tginfo = par->targinfo;
+	const struct natmap_ranges *rs = rcu_dereference(d->ranges);
+	const u32 a = ntohl(prenat_addr);
+	unsigned int i;
 
-	mutex_lock(&natmap_mutex);
-	htable_put(tginfo->ht);
-	mutex_unlock(&natmap_mutex);
-}
+	if (!rs)
+		return NULL;
+	i = natmap_range_index(rs, a);
+	if (i && a <= rs->slot[i - 1].last)
+		return rcu_dereference(rs->slot[i - 1].pre);
 
-static struct xt_target natmap_tg_reg[] __read_mostly = {
-	{
-		.name		= "NATMAP",
-		.family		= NFPROTO_IPV4,
-		.target		= natmap_tg,
-		.targetsize	= sizeof(struct xt_natmap_tginfo),
-		.table		= "nat",
-		.hooks		= (1 << NF_INET_POST_ROUTING) |
-				  (1 << NF_INET_PRE_ROUTING),
-		.checkentry	= natmap_tg_check,
-		.destroy	= natmap_tg_destroy,
-		.me		= THIS_MODULE,
-	},
-};
+	return NULL;
+}
 
-/* PROC stuff */
-static int
-natmap_seq_ent_show(struct natmap_pre *pre, int mode, struct seq_file *s)
+/* get entity matching the packet key, exact /32 first, then
+ * prefixes, then ranges */
+static inline struct natmap_pre *
+natmap_pre_lookup(const struct xt_natmap_htable *ht, const struct natmap_data *d,
+const __be32 prenat_addr)
 {
-	/* lock for consistent reads from the counters */
-	spin_lock_bh(&pre->lock_bh);
+	struct natmap_pre *pre = NULL;
 
-	seq_puts(s, "@+");
-	if (mode & XT_NATMAP_ADDR)
-		seq_printf(s, "%pI4/%u",
-		    &pre->prenat.addr, pre->prenat.cidr);
-	else if (mode & XT_NATMAP_PRIO)
-		seq_printf(s, "%04x:%04x",
-		    TC_H_MAJ(pre->prenat.addr)>>16,
-		    TC_H_MIN(pre->prenat.addr));
-	else
-		seq_printf(s, "0x%08x",
-		    pre->prenat.addr);
-	seq_puts(s, "=");
+	if (READ_ONCE(d->cidr_map[32]))
+		pre = natmap_pre_find(ht, d, 0, prenat_addr, 32);
+	if (!pre)
+		pre = natmap_lpm_find(d, prenat_addr);
+	if (!pre && READ_ONCE(d->cidr_map[0]))
+		pre = natmap_range_find(d, prenat_addr);
 
-	if (pre->postnat.cidr)
-		seq_printf(s, "%pI4/%u",
-		    &pre->postnat.from, pre->postnat.cidr);
-	else
-		seq_printf(s, "%pI4-%pI4",
-		    &pre->postnat.from, &pre->postnat.to);
+	return pre;
+}
 
-	if (mode & XT_NATMAP_STAT)
-		seq_printf(s, "  %u:%llu",
-		    pre->stat.pkts, pre->stat.bytes);
-	seq_puts(s, "\n");
+/* natmap_pre_lookup() of composite keys, the trie knows no tags, so
+ * one hash probe per prefix length in use, longest first */
+static inline struct natmap_pre *
+natmap_pre_tlookup(const struct xt_natmap_htable *ht,
+const struct natmap_data *d, const u32 tag, const __be32 prenat_addr)
+{
+	struct natmap_pre *pre;
+	int c;
 
-	spin_unlock_bh(&pre->lock_bh);
-	return seq_has_overflowed(s);
+	for (c = 32; c > 0; c--)
+		if (READ_ONCE(d->cidr_map[c]) &&
+		    (pre = natmap_pre_find(ht, d, tag, prenat_addr, c)))
+			return pre;
+
+	return NULL;
 }
 
-static int
-natmap_seq_show(struct seq_file *s, void *v)
+/* get IPv6 entity by prenat prefix */
+static inline struct natmap_pre *
+natmap6_pre_find(const struct xt_natmap_htable *ht, const struct natmap_data *d,
+const struct in6_addr *addr, const u32 plen)
 {
-	struct xt_natmap_htable *ht = s->private;
-	unsigned int *bucket = (unsigned int *)v;
+	const struct natmap_hash *tbl = natmap_deref(ht, d->pre);
 	struct natmap_pre *pre;
+	struct in6_addr a;
 
-	/* print everything from the bucket at once */
-	if (!hlist_empty(&ht->pre[*bucket]))
-		hlist_for_each_entry(pre, &ht->pre[*bucket], node)
-			if (natmap_seq_ent_show(pre, ht->mode, s))
-				return -1;
+	ipv6_addr_prefix(&a, addr, plen);
+	natmap_hash_for_each_rcu(pre, tbl, hash_addr6(tbl->size, &a, plen))
+		if (natmap6(pre)->plen == plen &&
+		    ipv6_addr_equal(&natmap6(pre)->prenat, &a))
+			return pre;
 
-	return 0;
+	return NULL;
 }
 
-static void *
-natmap_seq_start(struct seq_file *s, loff_t *pos)
-	__acquires(&ht->lock)
-{
-	struct xt_natmap_htable *ht = s->private;
-	unsigned int *bucket;
-
-	spin_lock_bh(&ht->lock);
-
-	if ((ht->mode & XT_NATMAP_STAT) && !(*pos))
-		seq_printf(s, "# name: %s; entities: %u; hash size: %u; mode: "
-						    "%s%s%s; flags: %s%s%s%s\n",
-		    ht->name, ht->count, ht->hsize,
-		    (ht->mode & XT_NATMAP_PRIO) ? "prio"  : "",
-		    (ht->mode & XT_NATMAP_MARK) ? "mark"  : "",
-		    (ht->mode & XT_NATMAP_ADDR) ? "addr"  : "",
-		    (ht->mode & XT_NATMAP_PERS) ? "+persistent" : "-persistent",
-		    (ht->mode & XT_NATMAP_DROP) ? ", +hotdrop"  : ", -hotdrop",
-		    (ht->mode & XT_NATMAP_CGNT) ? ", +cg-nat"   : ", -cg-nat",
-		    (ht->mode & XT_NATMAP_2WAY) ? ", +two-way"  : ", -two-way");
-
-	if (*pos >= ht->hsize)
-		return NULL;
+/* get IPv6 entity by postnat prefix */
+static inline struct natmap_pre *
+natmap6_post_find(const struct xt_natmap_htable *ht,
+const struct natmap_data *d, const struct in6_addr *addr, const u32 plen)
+{
+	const struct natmap_hash *tbl = natmap_deref(ht, d->post);
+	struct natmap_post *post;
+	struct in6_addr a;
 
-	bucket = kmalloc(sizeof(unsigned int), GFP_ATOMIC);
-	if (!bucket)
-		return ERR_PTR(-ENOMEM);
-	*bucket = *pos;
+	ipv6_addr_prefix(&a, addr, plen);
+	natmap_hash_for_each_rcu(post, tbl, hash_addr6(tbl->size, &a, plen))
+		if (natmap6(post->pre)->plen == plen &&
+		    ipv6_addr_equal(&natmap6(post->pre)->postnat, &a))
+			return post->pre;
 
-	return bucket;
+	return NULL;
 }
 
-static void *
-natmap_seq_next(struct seq_file *s, void *v, loff_t *pos)
+/* longest prefix match, by postnat for reverse; one hash probe per
+ * prefix length in use, longest first, whatever the entity count, and
+ * no more than NATMAP6_PLENS_MAX of them */
+static inline struct natmap_pre *
+natmap6_lookup(const struct xt_natmap_htable *ht, const struct natmap_data *d,
+const struct in6_addr *addr, const bool reverse)
 {
-	struct xt_natmap_htable *ht = s->private;
-	unsigned int *bucket = (unsigned int *)v;
+	unsigned int plen = NATMAP6_PLENS, l;
+	struct natmap_pre *pre;
 
-	*pos = ++(*bucket);
-	if (*pos >= ht->hsize) {
-		kfree(v);
-		return NULL;
+	while ((l = find_last_bit(d->plen6_used, plen)) < plen) {
+		plen = l;
+		pre = reverse ? natmap6_post_find(ht, d, addr, plen) :
+		    natmap6_pre_find(ht, d, addr, plen);
+		if (pre)
+			return pre;
 	}
-	return bucket;
+
+	return NULL;
 }
 
-static void
-natmap_seq_stop(struct seq_file *s, void *v)
-	__releases(&ht->lock)
+static struct natmap_lpm_node *
+natmap_lpm_take(struct natmap_lpm_node **prealloc)
 {
-	struct xt_natmap_htable *ht = s->private;
-	unsigned int *bucket = (unsigned int *)v;
+	struct natmap_lpm_node *node;
+	unsigned int i;
 
-	if (!IS_ERR(bucket))
-		kfree(bucket);
-	spin_unlock_bh(&ht->lock);
-}
+	for (i = 0; i < NATMAP_LPM_LEVELS; i++)
+		if (prealloc[i]) {
+			node = prealloc[i];
+			prealloc[i] = NULL;
+			return node;
+		}
 
-static const struct seq_operations natmap_seq_ops = {
-	.start		= natmap_seq_start,
-	.show		= natmap_seq_show,
-	.next		= natmap_seq_next,
-	.stop		= natmap_seq_stop,
-};
+	return NULL;
+}
 
-static int
-natmap_proc_open(struct inode *inode, struct file *file)
+/* recalculate trie slots covered by prefix after it was added to or
+ * removed from the hash; missing nodes are taken from prealloc (NULL
+ * on removal), emptied nodes are released */
+static void
+natmap_lpm_update(struct xt_natmap_htable *ht, const __be32 prenat_addr,
+const u32 cidr, struct natmap_lpm_node **prealloc)
+	/* under ht->lock */
 {
-	int ret = seq_open(file, &natmap_seq_ops);
+	struct natmap_data *d = natmap_wdata(ht);
+	struct natmap_lpm_node *path[NATMAP_LPM_LEVELS];
+	struct natmap_lpm_node *node;
+	const u32 key = ntohl(prenat_addr & cidr2mask[cidr]);
+	int level, l;
+	unsigned int i, n, shift;
+
+	if (cidr < 1 || cidr >= 32 || natmap_tagged(ht->mode))
+		return;
+	level = (cidr - 1) / NATMAP_LPM_STRIDE;
+
+	node = rcu_dereference_protected(d->lpm, 1);
+	for (l = 0; l <= level; l++) {
+		if (!node) {
+			if (!prealloc)
+				return;
+			node = natmap_lpm_take(prealloc);
+			if (WARN_ON(!node))
+				return;
+			if (l == 0) {
+				rcu_assign_pointer(d->lpm, node);
+			} else {
+				i = natmap_lpm_index(key, l - 1);
+				if (!rcu_access_pointer(path[l - 1]->pre[i]))
+					path[l - 1]->used++;
+				rcu_assign_pointer(path[l - 1]->child[i], node);
+			}
+		}
+		path[l] = node;
+		if (l < level)
+			node = rcu_dereference_protected(
+			    node->child[natmap_lpm_index(key, l)], 1);
+	}
 
-	if (!ret) {
-		struct seq_file *sf = file->private_data;
+	/* each covered slot gets the longest prefix of this level */
+	node = path[level];
+	shift = 32 - NATMAP_LPM_STRIDE * (level + 1);
+	n = 1U << (NATMAP_LPM_STRIDE * (level + 1) - cidr);
+	for (i = natmap_lpm_index(key, level); n--; i++) {
+		const __be32 a = htonl((key & ~((NATMAP_LPM_SLOTS - 1U) << shift))
+		    | (i << shift));
+		struct natmap_pre *best = NULL, *old;
+		u32 c;
+
+		for (c = min_t(u32, 31, NATMAP_LPM_STRIDE * (level + 1));
+		    c > NATMAP_LPM_STRIDE * level; c--)
+			if (d->cidr_map[c] &&
+			    (best = natmap_pre_find(ht, d, 0, a, c)))
+				break;
 
-		sf->private = PDE_DATA(inode);
+		old = rcu_dereference_protected(node->pre[i], 1);
+		if (old == best)
+			continue;
+		if (!rcu_access_pointer(node->child[i])) {
+			if (!old)
+				node->used++;
+			else if (!best)
+				node->used--;
+		}
+		rcu_assign_pointer(node->pre[i], best);
 	}
 
-	return ret;
+	/* release emptied nodes bottom-up */
+	for (l = level; l >= 0 && path[l]->used == 0; l--) {
+		if (l == 0) {
+			RCU_INIT_POINTER(d->lpm, NULL);
+		} else {
+			i = natmap_lpm_index(key, l - 1);
+			RCU_INIT_POINTER(path[l - 1]->child[i], NULL);
+			if (!rcu_access_pointer(path[l - 1]->pre[i]))
+				path[l - 1]->used--;
+		}
+		kfree_rcu(path[l], rcu);
+	}
 }
 
-static int
-parse_rule(struct xt_natmap_htable *ht, char *c1, size_t size)
+static void
+natmap_lpm_free(struct natmap_lpm_node *node, const unsigned int level)
 {
-	char * const buf = c1;			/* for logging only */
-	const char *c2;
-	struct pre_ip prenat;
-	struct post_ip postnat;
-	struct natmap_pre *pre;			/* new entry  */
-	struct natmap_post *post;		/* new entry  */
-	struct natmap_pre *pre_chk;		/* old entry  */
-	bool warn = true;
-	int add;
+	unsigned int i;
 
-	/* make sure that size is enough for two decrements */
-	if (size < 1 || !c1 || !ht)
-		return -EINVAL;
+	if (level + 1 < NATMAP_LPM_LEVELS)
+		for (i = 0; i < NATMAP_LPM_SLOTS; i++) {
+			struct natmap_lpm_node *child =
+			    rcu_dereference_protected(node->child[i], 1);
 
-	/* rule format is: [@]+prenat_addr[/cidr]=postnat_from[-postnat_to]
-	 *             or: [@]+0xFWMARK=postnat_from[-postnat_to]
-	 *             or: [@]+MAJ:MIN=postnat_from[-postnat_to]
-	*/
-	if (*c1 == '@') {
-		warn = false; /* hide redundant deletion warning */
-		++c1;
-		--size;
-	}
-	if (size < 1)
+			if (child)
+				natmap_lpm_free(child, level + 1);
+		}
+	kfree_rcu(node, rcu);
+}
+
+/* drop the whole trie, entries are unlinked by the caller */
+static void
+natmap_lpm_flush(struct natmap_data *d)
+	/* under ht->lock */
+{
+	struct natmap_lpm_node *root = rcu_dereference_protected(d->lpm, 1);
+
+	if (root) {
+		RCU_INIT_POINTER(d->lpm, NULL);
+		natmap_lpm_free(root, 0);
+	}
+}
+
+/* before ht->lock, see natmap_range_add() */
+static struct natmap_ranges *
+natmap_ranges_alloc(const unsigned int size)
+{
+	struct natmap_ranges *rs;
+
+	rs = kvmalloc(sizeof(struct natmap_ranges) +
+	    size * sizeof(struct natmap_range_slot), GFP_KERNEL);
+	if (rs) {
+		rs->count = 0;
+		rs->size = size;
+	}
+	return rs;
+}
+
+static void
+natmap_ranges_free_rcu(struct rcu_head *head)
+{
+	struct natmap_ranges *rs = container_of(head, struct natmap_ranges,
+	    rcu);
+
+	kvfree(rs);
+}
+
+/* does first..last (host order) overlap a linked range */
+static bool
+natmap_range_overlap(struct xt_natmap_htable *ht, const u32 first,
+const u32 last)
+	/* under ht->lock */
+{
+	const struct natmap_ranges *rs = natmap_deref(ht,
+	    natmap_wdata(ht)->ranges);
+	unsigned int i;
+
+	if (!rs)
+		return false;
+	/* slots are sorted by both ends, overlapping ones end at i */
+	for (i = natmap_range_index(rs, last);
+	    i && rs->slot[i - 1].last >= first; i--)
+		if (rcu_access_pointer(rs->slot[i - 1].pre))
+			return true;
+
+	return false;
+}
+
+/* add pre to the ranges: in place if it goes last and there is room,
+ * else publish a copy in prealloc with deleted slots dropped, it's
+ * taken then; -EAGAIN if it's missing or too small, as it's allocated
+ * before ht->lock. An add out of address order copies all n slots, so
+ * loading ranges sorted by address keeps each add O(1) */
+static int
+natmap_range_add(struct xt_natmap_htable *ht, struct natmap_pre *pre,
+struct natmap_ranges **prealloc)
+	/* under ht->lock */
+{
+	struct natmap_data *d = natmap_wdata(ht);
+	struct natmap_ranges *old = natmap_deref(ht, d->ranges);
+	const unsigned int size = (old ? old->count : 0) + 1;
+	const u32 first = ntohl(pre->prenat.addr);
+	struct natmap_ranges *rs = *prealloc;
+	unsigned int i, n = 0;
+	bool added = false;
+
+	if (old && old->count < old->size &&
+	    (!old->count || old->slot[old->count - 1].first < first)) {
+		n = old->count;
+		old->slot[n].first = first;
+		old->slot[n].last = ntohl(natmap_range(pre)->last);
+		RCU_INIT_POINTER(old->slot[n].pre, pre);
+		smp_store_release(&old->count, n + 1);
+		return 0;
+	}
+
+	if (!rs || rs->size < size)
+		return -EAGAIN;
+	*prealloc = NULL;
+
+	for (i = 0; old && i < old->count; i++) {
+		struct natmap_pre *p = natmap_deref(ht, old->slot[i].pre);
+
+		if (!p)
+			continue;
+		if (!added && old->slot[i].first > first) {
+			rs->slot[n].first = first;
+			rs->slot[n].last = ntohl(natmap_range(pre)->last);
+			RCU_INIT_POINTER(rs->slot[n++].pre, pre);
+			added = true;
+		}
+		rs->slot[n].first = old->slot[i].first;
+		rs->slot[n].last = old->slot[i].last;
+		RCU_INIT_POINTER(rs->slot[n++].pre, p);
+	}
+	if (!added) {
+		rs->slot[n].first = first;
+		rs->slot[n].last = ntohl(natmap_range(pre)->last);
+		RCU_INIT_POINTER(rs->slot[n++].pre, pre);
+	}
+	rs->count = n;
+
+	rcu_assign_pointer(d->ranges, rs);
+	if (old)
+		call_rcu(&old->rcu, natmap_ranges_free_rcu);
+	return 0;
+}
+
+/* point the slot of old's range to pre, NULL on removal */
+static void
+natmap_range_set(struct natmap_data *d, const struct natmap_pre *old,
+struct natmap_pre *pre)
+	/* under ht->lock */
+{
+	struct natmap_ranges *rs = rcu_dereference_protected(d->ranges, 1);
+	unsigned int i;
+
+	if (!rs)
+		return;
+	i = natmap_range_index(rs, ntohl(old->prenat.addr));
+	if (i && rcu_access_pointer(rs->slot[i - 1].pre) == old)
+		rcu_assign_pointer(rs->slot[i - 1].pre, pre);
+}
+
+/* drop all ranges, entries are unlinked by the caller */
+static void
+natmap_ranges_flush(struct natmap_data *d)
+	/* under ht->lock */
+{
+	struct natmap_ranges *rs = rcu_dereference_protected(d->ranges, 1);
+
+	if (rs) {
+		RCU_INIT_POINTER(d->ranges, NULL);
+		call_rcu(&rs->rcu, natmap_ranges_free_rcu);
+	}
+}
+
+/* size the hash should have for current count, load kept in 1/4..3/4 */
+static unsigned int
+natmap_hash_target(const unsigned int count, unsigned int size)
+{
+	while (count > size / 4 * 3 && size <= NATMAP_HSIZE_MAX / 2)
+		size *= 2;
+	while (count < size / 4 && size / 2 >= NATMAP_HSIZE_MIN)
+		size /= 2;
+
+	return size;
+}
+
+static bool
+natmap_hash_unfit(const struct xt_natmap_htable *ht,
+const struct natmap_data *d)
+	/* under ht->lock */
+{
+	const struct natmap_hash *tbl = natmap_deref(ht, d->pre);
+
+	return !d->resizing &&
+	    natmap_hash_target(d->count, tbl->size) != tbl->size;
+}
+
+/* content whose load factor went out of bounds, live one first */
+static struct natmap_data *
+natmap_hash_resize_target(const struct xt_natmap_htable *ht)
+	/* under ht->lock */
+{
+	struct natmap_data *d = natmap_deref(ht, ht->data);
+
+	if (natmap_hash_unfit(ht, d))
+		return d;
+	d = natmap_deref(ht, ht->shadow);
+	return d && natmap_hash_unfit(ht, d) ? d : NULL;
+}
+
+/* kick background resize if load factor of live content or of the
+ * shadow being filled went out of bounds */
+static void
+natmap_hash_check(struct xt_natmap_htable *ht)
+	/* under ht->lock */
+{
+	if (natmap_hash_resize_target(ht))
+		queue_work(system_long_wq, &ht->resize_work);
+}
+
+/* content being resized is still reachable, a shadow committed
+ * meanwhile goes on as the live one; the id is compared as a new
+ * content may be allocated where the old one was */
+static bool
+natmap_resize_live(const struct xt_natmap_htable *ht,
+const struct natmap_data *d, const unsigned int id)
+	/* under ht->lock */
+{
+	return (d == natmap_deref(ht, ht->data) ||
+	    d == natmap_deref(ht, ht->shadow)) && d->id == id;
+}
+
+/* rehash into arrays of the new size: entries are linked into them
+ * through their spare node, a batch of buckets per ht->lock hold, and
+ * the new arrays are published when complete, so concurrent lookups
+ * always see a whole table and writers are only delayed per batch */
+static void
+natmap_resize_work(struct work_struct *work)
+{
+	struct xt_natmap_htable *ht = container_of(work,
+	    struct xt_natmap_htable, resize_work);
+	struct natmap_hash *opre, *opost, *npre, *npost;
+	struct natmap_data *d;
+	struct natmap_pre *pre;
+	struct natmap_post *post;
+	struct hlist_node *n;
+	unsigned int osize, nsize, i, end, id;
+	ktime_t start = ktime_get();
+	bool shadow;
+
+	spin_lock(&ht->lock);
+	d = natmap_hash_resize_target(ht);
+	if (!d) {
+		spin_unlock(&ht->lock);
+		return;
+	}
+	id = d->id;
+	shadow = d != natmap_deref(ht, ht->data);
+	opre = natmap_deref(ht, d->pre);
+	opost = natmap_deref(ht, d->post);
+	osize = opre->size;
+	nsize = natmap_hash_target(d->count, osize);
+	spin_unlock(&ht->lock);
+
+	npre = natmap_hash_zalloc(nsize, !opre->idx);
+	npost = natmap_hash_zalloc(nsize, !opost->idx);
+	if (!npre || !npost) {
+		kvfree(npre);
+		kvfree(npost);
+		return;
+	}
+
+	/* content replaced by commit or aborted meanwhile is left to its
+	 * reclaim, together with the arrays being filled */
+	spin_lock(&ht->lock);
+	if (!natmap_resize_live(ht, d, id)) {
+		spin_unlock(&ht->lock);
+		kvfree(npre);
+		kvfree(npost);
+		return;
+	}
+	d->pre_next = npre;
+	d->post_next = npost;
+	d->resize_pos = 0;
+	WRITE_ONCE(d->resizing, true);
+	spin_unlock(&ht->lock);
+
+	for (i = 0; i < osize; ) {
+		spin_lock(&ht->lock);
+		if (!natmap_resize_live(ht, d, id)) {
+			spin_unlock(&ht->lock);
+			return;
+		}
+		for (end = min(i + NATMAP_RESIZE_BATCH, osize); i < end; i++) {
+			natmap_hash_for_each_safe(pre, n, opre, i)
+				hlist_add_head_rcu(&pre->node[npre->idx],
+				    &npre->head[hash_pre(npre, pre)]);
+			natmap_hash_for_each_safe(post, n, opost, i)
+				hlist_add_head_rcu(&post->node[npost->idx],
+				    &npost->head[hash_post(npost, post)]);
+		}
+		d->resize_pos = i;
+		spin_unlock(&ht->lock);
+		cond_resched();
+	}
+
+	spin_lock(&ht->lock);
+	if (!natmap_resize_live(ht, d, id)) {
+		spin_unlock(&ht->lock);
+		return;
+	}
+	rcu_assign_pointer(d->pre, npre);
+	rcu_assign_pointer(d->post, npost);
+	d->pre_next = NULL;
+	d->post_next = NULL;
+	WRITE_ONCE(d->resizing, false);
+	ht->resizes++;
+	ht->resize_us = ktime_us_delta(ktime_get(), start);
+	natmap_hash_check(ht);
+	spin_unlock(&ht->lock);
+
+	/* wait for readers of old arrays and of the nodes they use,
+	 * those nodes are reused by the next resize */
+	synchronize_rcu();
+	kvfree(opre);
+	kvfree(opost);
+
+	if (!disable_log)
+		pr_info("Changed %shash size %u -> %u, <%s> (%u us)\n",
+		    shadow ? "shadow " : "", osize, nsize, ht->name,
+		    ht->resize_us);
+}
+
+/* IPv6 two-way tables reverse through the postnat hash instead */
+static inline bool
+natmap_rmap_mode(const unsigned int mode)
+{
+	return (mode & (XT_NATMAP_2WAY | XT_NATMAP_IPV6)) == XT_NATMAP_2WAY;
+}
+
+/* allocate empty content, two-way map sized for count entries */
+static struct natmap_data *
+natmap_data_alloc(const unsigned int hsize, const unsigned int count,
+const bool two_way)
+{
+	struct natmap_data *d;
+
+	d = kzalloc(sizeof(struct natmap_data), GFP_KERNEL);
+	if (d == NULL)
+		return NULL;
+	INIT_WORK(&d->free_work, natmap_data_free_work);
+
+	d->pre = natmap_hash_zalloc(hsize, 0);
+	d->post = natmap_hash_zalloc(hsize, 0);
+	if (two_way)
+		d->rmap = natmap_rmap_alloc(count);
+	if (d->pre == NULL || d->post == NULL ||
+	    (two_way && d->rmap == NULL)) {
+		natmap_data_free(d);
+		return NULL;
+	}
+
+	return d;
+}
+
+/* allocate named hash table, register its proc entry */
+static int
+htable_create(struct net *net, struct xt_natmap_tginfo *tinfo)
+	/* rule insertion chain, under natmap_mutex */
+{
+	struct natmap_net *natmap_net = natmap_pernet(net);
+	struct xt_natmap_htable *ht;
+	struct natmap_cgnt *cgnt;
+	unsigned int hsize = hashsize;	/* (entities) */
+	unsigned int sz;		/* (bytes) */
+
+	if (hsize < NATMAP_HSIZE_MIN || hsize > 1000000)
+		hsize = NATMAP_HSIZE_MIN;
+
+	sz = sizeof(struct xt_natmap_htable);
+	if (sz <= PAGE_SIZE)
+		ht = kzalloc(sz, GFP_KERNEL);
+	else
+		ht = vzalloc(sz);
+	if (ht == NULL)
+		return -ENOMEM;
+
+	ht->data = natmap_data_alloc(hsize, 0, natmap_rmap_mode(tinfo->mode));
+	cgnt = kmalloc(sizeof(*cgnt), GFP_KERNEL);
+	if (ht->data == NULL || cgnt == NULL) {
+		natmap_data_free(rcu_dereference_protected(ht->data, 1));
+		kfree(cgnt);
+		kvfree(ht);
+		return -ENOMEM;
+	}
+	rcu_dereference_protected(ht->data, 1)->id = ++ht->data_ids;
+
+	tinfo->ht = ht;
+
+	ht->use = 1;
+	ht->mode = tinfo->mode;
+	strcpy(ht->name, tinfo->name);
+
+	natmap_cgnt_init(cgnt, tinfo);
+	RCU_INIT_POINTER(ht->cgnt, cgnt);
+	ht->markmask = tinfo->markmask ?: ~0U;
+
+	spin_lock_init(&ht->lock);
+	natmap_tg_select(ht);
+	INIT_WORK(&ht->resize_work, natmap_resize_work);
+
+	ht->pde = proc_create_data(tinfo->name, 0644, natmap_net->ipt_natmap,
+		    &natmap_fops, ht);
+	if (ht->pde == NULL)
+		goto out_free;
+	if (!proc_create_data(tinfo->name, 0444, natmap_net->ipt_natmap_stat,
+		    &natmap_hist_fops, ht)) {
+		remove_proc_entry(tinfo->name, natmap_net->ipt_natmap);
+		goto out_free;
+	}
+	ht->net = net;
+
+	hlist_add_head(&ht->node, &natmap_net->htables);
+
+	if (!disable_log)
+		pr_info("Create table: %s (%s%s%s%s%s%s%s%s%s)\n", tinfo->name,
+		    (tinfo->mode & XT_NATMAP_PRIO) ? "mode: prio"    : "",
+		    (tinfo->mode & XT_NATMAP_MARK) ? "mode: mark"    : "",
+		    (tinfo->mode & XT_NATMAP_ADDR) ? "mode: addr"    : "",
+		    natmap_key_name(tinfo->mode),
+		    (tinfo->mode & XT_NATMAP_PERS) ? ", +persistent" : "",
+		    (tinfo->mode & XT_NATMAP_DROP) ? ", +hotdrop"    : "",
+		    (tinfo->mode & XT_NATMAP_CGNT) ? ", +cg-nat"     : "",
+		    (tinfo->mode & XT_NATMAP_CTMK) ? ", +ct-mark"    : "",
+		    (tinfo->mode & XT_NATMAP_IPV6) ? ", ipv6"        : "");
+
+	return 0;
+
+out_free:
+	natmap_data_free(rcu_dereference_protected(ht->data, 1));
+	kfree(cgnt);
+	kvfree(ht);
+	return -ENOMEM;
+}
+
+static void
+natmap_pre_free(struct natmap_pre *pre)
+{
+	free_percpu(pre->stat);
+	kvfree(pre);
+}
+
+static void
+natmap_pre_free_rcu(struct rcu_head *head)
+{
+	struct natmap_pre *pre = container_of(head, struct natmap_pre, rcu);
+
+	natmap_pre_free(pre);
+}
+
+/* replaced entry, its counters were handed over to the successor */
+static void
+natmap_pre_replaced_rcu(struct rcu_head *head)
+{
+	struct natmap_pre *pre = container_of(head, struct natmap_pre, rcu);
+
+	kvfree(pre);
+}
+
+static inline void
+natmap_stat_update(struct natmap_pre *pre, const struct sk_buff *skb)
+	/* under bh */
+{
+	this_cpu_inc(pre->stat->pkts);
+	this_cpu_add(pre->stat->bytes, skb->len);
+}
+
+static void
+natmap_stat_fold(const struct natmap_pre *pre, struct natmap_stat *sum)
+{
+	int cpu;
+
+	sum->pkts = 0;
+	sum->bytes = 0;
+	for_each_possible_cpu(cpu) {
+		const struct natmap_stat *st = per_cpu_ptr(pre->stat, cpu);
+
+		sum->pkts += READ_ONCE(st->pkts);
+		sum->bytes += READ_ONCE(st->bytes);
+	}
+}
+
+static void
+natmap_stat_clear(struct natmap_pre *pre)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(pre->stat, cpu), 0,
+		    sizeof(struct natmap_stat));
+}
+
+/* any table has +hist, timing costs a patched out branch otherwise */
+static DEFINE_STATIC_KEY_FALSE(natmap_hist_key);
+
+static __always_inline u64
+natmap_hist_start(void)
+{
+	if (static_branch_unlikely(&natmap_hist_key))
+		return ktime_get_ns();
+	return 0;
+}
+
+static __always_inline void
+natmap_hist_end(const struct xt_natmap_htable *ht, const unsigned int which,
+const u64 t0)
+	/* under bh */
+{
+	struct natmap_hist __percpu *hist;
+	u64 ns;
+
+	if (!static_branch_unlikely(&natmap_hist_key) || !t0)
+		return;
+	hist = READ_ONCE(ht->hist);
+	if (!hist || !READ_ONCE(ht->hist_on))
+		return;
+	ns = ktime_get_ns() - t0;
+	this_cpu_inc(hist->slot[which][min_t(unsigned int, ilog2(ns | 1),
+	    NATMAP_HIST_SLOTS - 1)]);
+}
+
+/* turning on clears previous counts */
+static int
+natmap_hist_set(struct xt_natmap_htable *ht, const bool on)
+{
+	struct natmap_hist __percpu *hist;
+	int cpu, ret = 0;
+
+	mutex_lock(&natmap_mutex);
+	if (on && !ht->hist) {
+		hist = alloc_percpu(struct natmap_hist);
+		if (!hist) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		WRITE_ONCE(ht->hist, hist);
+	}
+	if (on)
+		for_each_possible_cpu(cpu)
+			memset(per_cpu_ptr(ht->hist, cpu), 0,
+			    sizeof(struct natmap_hist));
+	if (on != ht->hist_on) {
+		WRITE_ONCE(ht->hist_on, on);
+		if (on)
+			static_branch_inc(&natmap_hist_key);
+		else
+			static_branch_dec(&natmap_hist_key);
+	}
+out:
+	mutex_unlock(&natmap_mutex);
+	return ret;
+}
+
+static void
+natmap_post_free_rcu(struct rcu_head *head)
+{
+	struct natmap_post *post = container_of(head, struct natmap_post, rcu);
+
+	kvfree(post);
+}
+
+/* free unlinked content, entries included */
+static void
+natmap_data_free(struct natmap_data *d)
+{
+	struct natmap_hash *tbl = rcu_dereference_protected(d->pre, 1);
+	struct natmap_lpm_node *root = rcu_dereference_protected(d->lpm, 1);
+	unsigned int i;
+
+	for (i = 0; tbl && i < tbl->size; i++) {
+		struct natmap_pre *pre;
+		struct hlist_node *n;
+
+		natmap_hash_for_each_safe(pre, n, tbl, i) {
+			kvfree(pre->post);
+			natmap_pre_free(pre);
+		}
+		cond_resched();
+	}
+	if (root)
+		natmap_lpm_free(root, 0);
+	kvfree(rcu_dereference_protected(d->ranges, 1));
+	kvfree(rcu_dereference_protected(d->rmap, 1));
+	kvfree(rcu_dereference_protected(d->post, 1));
+	kvfree(tbl);
+	kvfree(d->pre_next);
+	kvfree(d->post_next);
+	kfree(d);
+}
+
+static void
+natmap_data_free_work(struct work_struct *work)
+{
+	struct natmap_data *d = container_of(work, struct natmap_data,
+	    free_work);
+
+	synchronize_rcu();
+	natmap_data_free(d);
+}
+
+/* content no longer reachable from the table, free it after readers
+ * leave without holding up the writer */
+static void
+natmap_data_release(struct natmap_data *d)
+{
+	if (d)
+		queue_work(natmap_wq, &d->free_work);
+}
+
+/* unlink natmap entry, freeing is left to the caller */
+static void
+natmap_pre_unlink(struct xt_natmap_htable *ht, struct natmap_pre *pre)
+	/* under ht->lock */
+{
+	struct natmap_data *d = natmap_wdata(ht);
+	struct natmap_hash *tbl = natmap_deref(ht, d->pre);
+
+	WRITE_ONCE(d->cidr_map[pre->prenat.cidr],
+	    d->cidr_map[pre->prenat.cidr] - 1);
+	if (!pre->prenat.cidr)
+		natmap_range_set(d, pre, NULL);
+
+	if (natmap_hash_migrated(d, hash_pre(tbl, pre)))
+		hlist_del_rcu(&pre->node[d->pre_next->idx]);
+	hlist_del_rcu(&pre->node[tbl->idx]);
+	if (pre->act == NATMAP_ACT_PFX6 &&
+	    !--d->plen6_map[natmap6(pre)->plen]) {
+		clear_bit(natmap6(pre)->plen, d->plen6_used);
+		d->plen6_count--;
+	}
+	if (pre->act == NATMAP_ACT_HOST)
+		d->cgnt_map[pre->cgnt_bits]--;
+
+	BUG_ON(d->count == 0);
+	d->count--;
+}
+
+static void
+natmap_post_unlink(struct xt_natmap_htable *ht, struct natmap_post *post)
+	/* under ht->lock */
+{
+	struct natmap_data *d = natmap_wdata(ht);
+	struct natmap_hash *tbl = natmap_deref(ht, d->post);
+
+	natmap_rmap_del(ht, post->pre);
+	WRITE_ONCE(d->post_cidr_map[post->pre->postnat.cidr],
+	    d->post_cidr_map[post->pre->postnat.cidr] - 1);
+	if (natmap_hash_migrated(d, hash_post(tbl, post)))
+		hlist_del_rcu(&post->node[d->post_next->idx]);
+	hlist_del_rcu(&post->node[tbl->idx]);
+}
+
+/* post of a replaced entry, whose pre stays until its own call_rcu */
+static void
+natmap_post_del(struct xt_natmap_htable *ht, struct natmap_post *post)
+	/* under ht->lock */
+{
+	natmap_post_unlink(ht, post);
+	call_rcu(&post->rcu, natmap_post_free_rcu);
+}
+
+/* remove the pair, frees are queued only once the hashes and the trie
+ * no longer point to it */
+static void
+natmap_ent_del(struct xt_natmap_htable *ht, struct natmap_pre *pre)
+	/* under ht->lock */
+{
+	struct natmap_post *post = pre->post;
+
+	natmap_post_unlink(ht, post);
+	natmap_pre_unlink(ht, pre);
+	natmap_lpm_update(ht, pre->prenat.addr, pre->prenat.cidr, NULL);
+	call_rcu(&post->rcu, natmap_post_free_rcu);
+	call_rcu(&pre->rcu, natmap_pre_free_rcu);
+}
+
+/* destroy linked content of hash table, or of the open shadow,
+ * counters are always cleared in live content */
+static void
+htable_cleanup(struct xt_natmap_htable *ht, const bool stat)
+	/* under natmap_mutex */
+{
+	struct natmap_data *d;
+	struct natmap_hash *tbl;
+	unsigned int i;
+
+	spin_lock(&ht->lock);
+	d = stat ? natmap_deref(ht, ht->data) : natmap_wdata(ht);
+	if (!stat) {
+		natmap_lpm_flush(d);
+		natmap_ranges_flush(d);
+	}
+	tbl = natmap_deref(ht, d->pre);
+	for (i = 0; i < tbl->size; i++) {
+		struct natmap_pre *pre;
+		struct hlist_node *n;
+
+		natmap_hash_for_each_safe(pre, n, tbl, i)
+			if (stat)
+				natmap_stat_clear(pre);
+			else
+				natmap_ent_del(ht, pre);
+	}
+	if (!stat)
+		natmap_hash_check(ht);
+	spin_unlock(&ht->lock);
+	cond_resched();
+}
+
+static void
+natmap_table_flush(struct xt_natmap_htable *ht, const bool stat)
+{
+	mutex_lock(&natmap_mutex);
+	htable_cleanup(ht, stat);
+	mutex_unlock(&natmap_mutex);
+}
+
+static void
+__natmap_post_flush(struct xt_natmap_htable *ht, const struct post_ip *postnat)
+	/* under natmap_mutex */
+{
+	struct natmap_hash *tbl;
+	struct natmap_post *post;
+	struct hlist_node *n;
+
+	spin_lock(&ht->lock);
+	tbl = natmap_deref(ht, natmap_wdata(ht)->post);
+	natmap_hash_for_each_safe(post, n, tbl, hash_addr(tbl->size,
+				postnat->from))
+		if (memcmp(&post->pre->postnat, postnat,
+		    sizeof(struct post_ip)) == 0)
+			natmap_ent_del(ht, post->pre);
+	natmap_hash_check(ht);
+	spin_unlock(&ht->lock);
+	cond_resched();
+}
+
+static void
+natmap_post_flush(struct xt_natmap_htable *ht,
+struct post_ip *postnat)
+{
+	mutex_lock(&natmap_mutex);
+	__natmap_post_flush(ht, postnat);
+	mutex_unlock(&natmap_mutex);
+}
+
+/* swept entries freed by one rcu callback per page */
+#define NATMAP_SWEEP_BATCH \
+	((PAGE_SIZE - sizeof(struct rcu_head) - sizeof(unsigned int)) / \
+	 sizeof(struct natmap_pre *))
+
+struct natmap_sweep {
+	struct rcu_head rcu;
+	unsigned int count;
+	struct natmap_pre *pre[NATMAP_SWEEP_BATCH];
+};
+
+static void
+natmap_sweep_free_rcu(struct rcu_head *head)
+{
+	struct natmap_sweep *batch = container_of(head, struct natmap_sweep,
+	    rcu);
+	unsigned int i;
+
+	for (i = 0; i < batch->count; i++) {
+		kvfree(batch->pre[i]->post);
+		natmap_pre_free(batch->pre[i]);
+	}
+	kfree(batch);
+}
+
+/* start generation, 0 picks the next one */
+static int
+natmap_gen_begin(struct xt_natmap_htable *ht, u32 gen)
+{
+	spin_lock(&ht->lock);
+	if (!gen)
+		gen = ht->gen + 1;
+	else if (gen == ht->gen) {
+		spin_unlock(&ht->lock);
+		return -EINVAL;
+	}
+	WRITE_ONCE(ht->gen, gen);
+	spin_unlock(&ht->lock);
+
+	if (!disable_log)
+		pr_info("Generation %u: <%s>\n", gen, ht->name);
+	return 0;
+}
+
+/* delete every entry not added in the current generation, returns
+ * count of deleted; ht->lock is dropped after each batch, position is
+ * kept unless the hash was resized or replaced meanwhile, which the
+ * sequences tell as new content may be allocated where the old was */
+static unsigned int
+__natmap_sweep(struct xt_natmap_htable *ht)
+	/* under natmap_mutex */
+{
+	struct natmap_sweep *batch;
+	unsigned int i = 0, resizes = 0, swept = 0;
+	unsigned int data_seq = 0, shadow_seq = 0;
+	bool done = false;
+
+	while (!done) {
+		struct natmap_data *d;
+		struct natmap_hash *tbl;
+		u32 gen;
+
+		/* without a batch entries are freed one by one */
+		batch = kmalloc(sizeof(struct natmap_sweep), GFP_KERNEL);
+		if (batch)
+			batch->count = 0;
+
+		spin_lock(&ht->lock);
+		d = natmap_wdata(ht);
+		tbl = natmap_deref(ht, d->pre);
+		gen = ht->gen;
+		if (ht->data_seq != data_seq || ht->shadow_seq != shadow_seq ||
+		    ht->resizes != resizes)
+			i = 0;
+		data_seq = ht->data_seq;
+		shadow_seq = ht->shadow_seq;
+		resizes = ht->resizes;
+		for (; i < tbl->size; i++) {
+			struct natmap_pre *pre;
+			struct hlist_node *n;
+
+			natmap_hash_for_each_safe(pre, n, tbl, i) {
+				struct pre_ip prenat = pre->prenat;
+
+				if (pre->gen == gen)
+					continue;
+				if (batch && batch->count == NATMAP_SWEEP_BATCH)
+					goto unlock;
+				natmap_post_unlink(ht, pre->post);
+				natmap_pre_unlink(ht, pre);
+				natmap_lpm_update(ht, prenat.addr, prenat.cidr,
+				    NULL);
+				if (batch)
+					batch->pre[batch->count++] = pre;
+				else {
+					call_rcu(&pre->post->rcu,
+					    natmap_post_free_rcu);
+					call_rcu(&pre->rcu, natmap_pre_free_rcu);
+				}
+				swept++;
+			}
+		}
+		done = true;
+unlock:
+		natmap_hash_check(ht);
+		spin_unlock(&ht->lock);
+
+		if (batch && batch->count)
+			call_rcu(&batch->rcu, natmap_sweep_free_rcu);
+		else
+			kfree(batch);
+		cond_resched();
+	}
+
+	if (!disable_log)
+		pr_info("Swept %u entries: <%s>\n", swept, ht->name);
+	return swept;
+}
+
+static void
+natmap_sweep(struct xt_natmap_htable *ht)
+{
+	mutex_lock(&natmap_mutex);
+	__natmap_sweep(ht);
+	mutex_unlock(&natmap_mutex);
+}
+
+static void
+htable_destroy(struct xt_natmap_htable *ht)
+	/* caller htable_put, iptables rule deletion chain */
+	/* under natmap_mutex */
+{
+	struct natmap_net *natmap_net = natmap_pernet(ht->net);
+
+	/* natmap_net_exit() can independently unregister
+	 * proc entries */
+	if (natmap_net->ipt_natmap) {
+		remove_proc_entry(ht->name, natmap_net->ipt_natmap);
+		remove_proc_entry(ht->name, natmap_net->ipt_natmap_stat);
+	}
+
+	if (!disable_log)
+		pr_info("Remove table: %s \n", ht->name);
+
+	cancel_work_sync(&ht->resize_work);
+	natmap_data_release(rcu_dereference_protected(ht->shadow, 1));
+	natmap_data_release(rcu_dereference_protected(ht->data, 1));
+	if (ht->hist_on)
+		static_branch_dec(&natmap_hist_key);
+	free_percpu(ht->hist);
+	kfree(rcu_dereference_protected(ht->cgnt, 1));
+	kvfree(ht);
+}
+
+/* open empty shadow content, rule changes go there until commit,
+ * it's sized for count entries or for about the live content if 0,
+ * and resized as it's filled */
+static int
+natmap_shadow_begin(struct xt_natmap_htable *ht, u64 count)
+{
+	struct natmap_data *d;
+	unsigned int hsize;
+
+	rcu_read_lock();
+	d = rcu_dereference(ht->data);
+	if (!count)
+		count = READ_ONCE(d->count);
+	hsize = rcu_dereference(d->pre)->size;
+	rcu_read_unlock();
+	count = min_t(u64, count, NATMAP_HSIZE_MAX);
+
+	d = natmap_data_alloc(natmap_hash_target(count, hsize), count,
+	    natmap_rmap_mode(ht->mode));
+	if (d == NULL)
+		return -ENOMEM;
+
+	spin_lock(&ht->lock);
+	if (natmap_deref(ht, ht->shadow)) {
+		spin_unlock(&ht->lock);
+		natmap_data_free(d);
+		return -EBUSY;
+	}
+	d->id = ++ht->data_ids;
+	rcu_assign_pointer(ht->shadow, d);
+	ht->shadow_seq++;
+	spin_unlock(&ht->lock);
+
+	return 0;
+}
+
+/* publish the shadow to packets at once, old content reclaimed later */
+static int
+natmap_shadow_commit(struct xt_natmap_htable *ht)
+{
+	struct natmap_data *old, *d;
+
+	spin_lock(&ht->lock);
+	d = natmap_deref(ht, ht->shadow);
+	if (!d) {
+		spin_unlock(&ht->lock);
+		return -ENOENT;
+	}
+	old = natmap_deref(ht, ht->data);
+	rcu_assign_pointer(ht->data, d);
+	ht->data_seq++;
+	RCU_INIT_POINTER(ht->shadow, NULL);
+	ht->shadow_seq++;
+	natmap_hash_check(ht);
+	spin_unlock(&ht->lock);
+
+	natmap_data_release(old);
+	if (!disable_log)
+		pr_info("Commit table: %s (%u entities)\n", ht->name, d->count);
+	return 0;
+}
+
+static int
+natmap_shadow_abort(struct xt_natmap_htable *ht)
+{
+	struct natmap_data *d;
+
+	spin_lock(&ht->lock);
+	d = natmap_deref(ht, ht->shadow);
+	RCU_INIT_POINTER(ht->shadow, NULL);
+	ht->shadow_seq++;
+	spin_unlock(&ht->lock);
+
+	if (!d)
+		return -ENOENT;
+	natmap_data_release(d);
+	return 0;
+}
+
+/* ports or block given by a later rule of a cg-nat table replace
+ * those in use, as +ports and +block do */
+static int
+natmap_cgnt_rule_set(struct xt_natmap_htable *ht,
+const struct xt_natmap_tginfo *tinfo)
+	/* under natmap_mutex */
+{
+	struct natmap_cgnt g;
+	int ret;
+
+	if (!(tinfo->range.flags & NF_NAT_RANGE_PROTO_SPECIFIED) &&
+	    !tinfo->block)
+		return 0;
+	natmap_cgnt_init(&g, tinfo);
+	ret = natmap_cgnt_set(ht,
+	    (tinfo->range.flags & NF_NAT_RANGE_PROTO_SPECIFIED) ?
+	    g.min : NATMAP_CGNT_KEEP,
+	    (tinfo->range.flags & NF_NAT_RANGE_PROTO_SPECIFIED) ?
+	    g.range : NATMAP_CGNT_KEEP,
+	    tinfo->block ?: NATMAP_CGNT_KEEP);
+	if (ret == -EINVAL)
+		pr_err("Ports do not split into blocks, <%s>\n", tinfo->name);
+	else if (ret == -ERANGE)
+		pr_err("CG-NAT port blocks of entries would not fit, <%s>\n",
+		    tinfo->name);
+	return ret;
+}
+
+/* allocate htable caused by target insertion with iptables */
+static int
+htable_get(struct net *net, struct xt_natmap_tginfo *tinfo, const bool pre_r)
+	/* iptables rule addition chain */
+	/* under natmap_mutex */
+{
+	struct natmap_net *natmap_net = natmap_pernet(net);
+	struct xt_natmap_htable *ht;
+
+	hlist_for_each_entry(ht, &natmap_net->htables, node)
+		if (!strcmp(tinfo->name, ht->name)) {
+			if ((tinfo->mode ^ ht->mode) & XT_NATMAP_IPV6) {
+				pr_err("Table with same name is of the other "
+				    "family, <%s>\n", tinfo->name);
+				return -EINVAL;
+			}
+			if (pre_r) {
+				if (!(ht->mode & XT_NATMAP_ADDR) ||
+				    !(ht->mode & XT_NATMAP_2WAY)) {
+					pr_err("Target with same name in "
+					"POSTROUTING must be addr & 2way, "
+					"<%s>\n", tinfo->name);
+					return -EINVAL;
+				}
+			} else if (tinfo->mode != ht->mode ||
+			    (tinfo->markmask ?: ~0U) != ht->markmask) {
+				pr_err("Mode/flags differ from previous "
+				    "declaration, <%s>\n", tinfo->name);
+				return -EINVAL;
+			} else if (ht->mode & XT_NATMAP_CGNT) {
+				int ret = natmap_cgnt_rule_set(ht, tinfo);
+
+				if (ret)
+					return ret;
+			}
+			ht->use++;
+			tinfo->ht = ht;
+			return 0;
+		}
+	return htable_create(net, tinfo);
+}
+
+/* remove htable caused by target rule deletion with iptables */
+static void
+htable_put(struct xt_natmap_htable *ht)
+	/* caller natmap_tg_destroy, iptables rule deletion */
+	/* under natmap_mutex */
+{
+	if (--ht->use == 0 && (!(ht->mode & XT_NATMAP_PERS))) {
+		hlist_del(&ht->node);
+		htable_destroy(ht);
+	}
+}
+
+/* stamp entry class id for later rules of the flow */
+static inline void
+natmap_ct_mark(struct nf_conn *ct, const struct natmap_pre *pre)
+{
+#if IS_ENABLED(CONFIG_NF_CONNTRACK_MARK)
+	if (pre->id && READ_ONCE(ct->mark) != pre->id) {
+		WRITE_ONCE(ct->mark, pre->id);
+		nf_conntrack_event_cache(IPCT_MARK, ct);
+	}
+#endif
+}
+
+/* lookup key of the packet and tag of composite keys,
+ * mode is constant in each variant */
+static __always_inline __be32
+natmap_key(const struct sk_buff *skb, const struct nf_conn *ct,
+const struct xt_natmap_htable *ht, const unsigned int mode, u32 *tag)
+{
+	*tag = 0;
+	switch (mode & XT_NATMAP_KEY) {
+	case XT_NATMAP_KEY_DADDR:
+		return ip_hdr(skb)->daddr;
+	case XT_NATMAP_KEY_ZONE_ADDR:
+		*tag = nf_ct_zone(ct)->id;
+		return ip_hdr(skb)->saddr;
+	case XT_NATMAP_KEY_MARK_ADDR:
+		*tag = skb->mark & ht->markmask;
+		return ip_hdr(skb)->saddr;
+#if IS_ENABLED(CONFIG_NF_CONNTRACK_MARK)
+	case XT_NATMAP_KEY_CTMARK:
+		return READ_ONCE(ct->mark) & ht->markmask;
+#endif
+	case XT_NATMAP_KEY_ZONE:
+		return nf_ct_zone(ct)->id;
+	case XT_NATMAP_KEY_IIF:
+		return skb->skb_iif;
+	}
+	if (mode & XT_NATMAP_PRIO)
+		return skb->priority;
+	if (mode & XT_NATMAP_MARK)
+		return skb->mark & ht->markmask;
+	return ip_hdr(skb)->saddr;
+}
+
+/* two-way DNAT of the packet, mode is constant in each variant */
+static __always_inline unsigned int
+natmap_tg_pre(struct sk_buff *skb, const struct xt_action_param *par,
+const unsigned int mode)
+	/* under bh */
+{
+	const struct xt_natmap_tginfo *tginfo = par->targinfo;
+	struct xt_natmap_htable *ht = tginfo->ht;
+	const struct nf_nat_range2 *mr = &tginfo->range;
+	const struct natmap_data *d;
+	struct natmap_pre *pre;
+	struct nf_conn *ct;
+	enum ip_conntrack_info ctinfo;
+	int ret = XT_CONTINUE;
+	__be32 prenat_ip;
+	u64 t0;
+
+	ct = nf_ct_get(skb, &ctinfo);
+
+	rcu_read_lock();
+
+	d = rcu_dereference(ht->data);
+	t0 = natmap_hist_start();
+	pre = natmap_pre_rfind(d, ip_hdr(skb)->daddr, &prenat_ip);
+	natmap_hist_end(ht, NATMAP_HIST_LOOKUP, t0);
+	trace_natmap_lookup(ht->name, ntohl(ip_hdr(skb)->daddr), true, pre);
+	if (unlikely(!pre && READ_ONCE(d->resizing)))
+		atomic_long_inc(&ht->resize_miss);
+	if (pre) {
+		const struct nf_nat_range2 newrange = {
+			.flags		= mr->flags
+					| NF_NAT_RANGE_MAP_IPS
+					| NF_NAT_RANGE_PERSISTENT,
+			.min_addr.ip	= prenat_ip,
+			.max_addr.ip	= prenat_ip,
+			.min_proto	= mr->min_proto,
+			.max_proto	= mr->max_proto,
+		};
+
+		if (mode & XT_NATMAP_STAT)
+			natmap_stat_update(pre, skb);
+
+		t0 = natmap_hist_start();
+		ret = nf_nat_setup_info(ct, &newrange, NF_NAT_MANIP_DST);
+		natmap_hist_end(ht, NATMAP_HIST_NAT, t0);
+		trace_natmap_nat(ht->name, true, prenat_ip, prenat_ip, ret);
+		if (ret == NF_ACCEPT && (ht->mode & XT_NATMAP_CTMK))
+			natmap_ct_mark(ct, pre);
+	}
+
+	rcu_read_unlock();
+	return ret;
+}
+
+/* SNAT of the packet, mode is constant in each variant */
+static __always_inline unsigned int
+natmap_tg_post(struct sk_buff *skb, const struct xt_action_param *par,
+const unsigned int mode)
+	/* under bh */
+{
+	const struct xt_natmap_tginfo *tginfo = par->targinfo;
+	struct xt_natmap_htable *ht = tginfo->ht;
+	const struct nf_nat_range2 *mr = &tginfo->range;
+	const struct natmap_data *d;
+	struct natmap_pre *pre;
+	struct nf_conn *ct;
+	enum ip_conntrack_info ctinfo;
+	int ret = XT_CONTINUE;
+	__be32 prenat_ip;
+	u32 tag;
+	u64 t0;
+
+	ct = nf_ct_get(skb, &ctinfo);
+
+	rcu_read_lock();
+
+	prenat_ip = natmap_key(skb, ct, ht, mode, &tag);
+
+	d = rcu_dereference(ht->data);
+	t0 = natmap_hist_start();
+	pre = natmap_tagged(mode) ? natmap_pre_tlookup(ht, d, tag, prenat_ip) :
+	    natmap_pre_lookup(ht, d, prenat_ip);
+	natmap_hist_end(ht, NATMAP_HIST_LOOKUP, t0);
+	trace_natmap_lookup(ht->name, (mode & XT_NATMAP_ADDR) ?
+	    ntohl(prenat_ip) : prenat_ip, false, pre);
+	if (unlikely(!pre && READ_ONCE(d->resizing)))
+		atomic_long_inc(&ht->resize_miss);
+	if (pre) {
+		struct nf_nat_range2 newrange = {
+			.flags		= mr->flags
+					| NF_NAT_RANGE_MAP_IPS
+					| NF_NAT_RANGE_PERSISTENT,
+			.min_addr.ip	= pre->postnat.from,
+			.max_addr.ip	= pre->postnat.to,
+			.min_proto	= mr->min_proto,
+			.max_proto	= mr->max_proto,
+		};
+
+		if (pre->act == NATMAP_ACT_HOST) {
+			prenat_ip = ip_hdr(skb)->saddr;
+			newrange.min_addr.ip |= prenat_ip & pre->hostmask;
+			newrange.max_addr.ip = newrange.min_addr.ip;
+
+			if (mode & XT_NATMAP_CGNT) {
+				const struct natmap_cgnt *g =
+				    rcu_dereference(ht->cgnt);
+				const u32 ports = natmap_cgnt_ports(g,
+				    pre->cgnt_bits);
+				const u32 min_port = g->min +
+				    natmap_cgnt_slot(pre, prenat_ip) * ports;
+
+				/* entities are checked to fit the geometry
+				 * they are linked with, a packet racing a
+				 * change of it must not share ports */
+				if (unlikely(min_port + ports - 1 >
+				    NATMAP_CGNT_PORT_MAX)) {
+					rcu_read_unlock();
+					return NF_DROP;
+				}
+				newrange.min_proto.all = htons(min_port);
+				newrange.max_proto.all = htons(min_port
+							    + ports - 1);
+				newrange.flags |= NF_NAT_RANGE_PROTO_SPECIFIED;
+			}
+		}
+	/*	newrange.flags |= NF_NAT_RANGE_PROTO_RANDOM_FULLY; */
+
+		if (mode & XT_NATMAP_STAT)
+			natmap_stat_update(pre, skb);
+
+		t0 = natmap_hist_start();
+		ret = nf_nat_setup_info(ct, &newrange, NF_NAT_MANIP_SRC);
+		natmap_hist_end(ht, NATMAP_HIST_NAT, t0);
+		trace_natmap_nat(ht->name, false, newrange.min_addr.ip,
+		    newrange.max_addr.ip, ret);
+		if (ret != NF_ACCEPT)
+			pr_err("No free tuples to setup nat\n");
+		else if (ht->mode & XT_NATMAP_CTMK)
+			natmap_ct_mark(ct, pre);
+	} else if (ht->mode & XT_NATMAP_DROP) {
+		trace_natmap_hotdrop(ht->name, (mode & XT_NATMAP_ADDR) ?
+		    ntohl(prenat_ip) : prenat_ip);
+		ret = NF_DROP;
+	}
+
+	rcu_read_unlock();
+	return ret;
+}
+
+/* IPv6 prefix translation keeping host bits: SNAT by source prefix,
+ * DNAT back by destination prefix in PREROUTING of two-way tables,
+ * mode is constant in each variant */
+static __always_inline unsigned int
+natmap6_tg(struct sk_buff *skb, const struct xt_action_param *par,
+const unsigned int mode)
+	/* under bh */
+{
+	const struct xt_natmap_tginfo *tginfo = par->targinfo;
+	struct xt_natmap_htable *ht = tginfo->ht;
+	const struct nf_nat_range2 *mr = &tginfo->range;
+	const bool dnat = xt_hooknum(par) == NF_INET_PRE_ROUTING;
+	const struct ipv6hdr *iph = ipv6_hdr(skb);
+	const struct in6_addr *key = dnat ? &iph->daddr : &iph->saddr;
+	const struct natmap_data *d;
+	struct natmap_pre *pre;
+	struct nf_conn *ct;
+	enum ip_conntrack_info ctinfo;
+	int ret = XT_CONTINUE;
+	u64 t0;
+
+	ct = nf_ct_get(skb, &ctinfo);
+
+	rcu_read_lock();
+
+	d = rcu_dereference(ht->data);
+	t0 = natmap_hist_start();
+	pre = natmap6_lookup(ht, d, key, dnat);
+	natmap_hist_end(ht, NATMAP_HIST_LOOKUP, t0);
+	trace_natmap_lookup6(ht->name, key, dnat, pre);
+	if (unlikely(!pre && READ_ONCE(d->resizing)))
+		atomic_long_inc(&ht->resize_miss);
+	if (pre) {
+		const struct natmap6_pre *pre6 = natmap6(pre);
+		struct nf_nat_range2 newrange = {
+			.flags		= mr->flags
+					| NF_NAT_RANGE_MAP_IPS
+					| NF_NAT_RANGE_PERSISTENT,
+			.min_proto	= mr->min_proto,
+			.max_proto	= mr->max_proto,
+		};
+
+		newrange.min_addr.in6 = *key;
+		ipv6_addr_prefix_copy(&newrange.min_addr.in6,
+		    dnat ? &pre6->prenat : &pre6->postnat, pre6->plen);
+		newrange.max_addr = newrange.min_addr;
+
+		if (mode & XT_NATMAP_STAT)
+			natmap_stat_update(pre, skb);
+
+		t0 = natmap_hist_start();
+		ret = nf_nat_setup_info(ct, &newrange,
+		    dnat ? NF_NAT_MANIP_DST : NF_NAT_MANIP_SRC);
+		natmap_hist_end(ht, NATMAP_HIST_NAT, t0);
+		trace_natmap_nat6(ht->name, dnat, &newrange.min_addr.in6, ret);
+		if (ret == NF_ACCEPT && (ht->mode & XT_NATMAP_CTMK))
+			natmap_ct_mark(ct, pre);
+		else if (ret != NF_ACCEPT && !dnat)
+			pr_err("No free tuples to setup nat\n");
+	} else if (!dnat && (ht->mode & XT_NATMAP_DROP))
+		ret = NF_DROP;
+
+	rcu_read_unlock();
+	return ret;
+}
+
+/* variants of target without mode branches in hot path,
+ * selected by natmap_tg_select() whenever ht->mode changes */
+#define NATMAP_TG_VARIANT(name, body, mode) \
+static unsigned int \
+name(struct sk_buff *skb, const struct xt_action_param *par) \
+{ \
+	return body(skb, par, mode); \
+}
+
+NATMAP_TG_VARIANT(natmap_tg_pre_n, natmap_tg_pre, 0)
+NATMAP_TG_VARIANT(natmap_tg_pre_s, natmap_tg_pre, XT_NATMAP_STAT)
+NATMAP_TG_VARIANT(natmap_tg6_n, natmap6_tg, 0)
+NATMAP_TG_VARIANT(natmap_tg6_s, natmap6_tg, XT_NATMAP_STAT)
+
+#define NATMAP_TG_POST_VARIANTS(key, mode) \
+NATMAP_TG_VARIANT(natmap_tg_##key##_n, natmap_tg_post, mode) \
+NATMAP_TG_VARIANT(natmap_tg_##key##_c, natmap_tg_post, \
+    mode | XT_NATMAP_CGNT) \
+NATMAP_TG_VARIANT(natmap_tg_##key##_s, natmap_tg_post, \
+    mode | XT_NATMAP_STAT) \
+NATMAP_TG_VARIANT(natmap_tg_##key##_sc, natmap_tg_post, \
+    mode | XT_NATMAP_STAT | XT_NATMAP_CGNT)
+
+NATMAP_TG_POST_VARIANTS(addr, XT_NATMAP_ADDR)
+NATMAP_TG_POST_VARIANTS(prio, XT_NATMAP_PRIO)
+NATMAP_TG_POST_VARIANTS(mark, XT_NATMAP_MARK)
+
+/* other key sources go without cg-nat */
+#define NATMAP_TG_KEY_VARIANTS(key, mode) \
+NATMAP_TG_VARIANT(natmap_tg_##key##_n, natmap_tg_post, mode) \
+NATMAP_TG_VARIANT(natmap_tg_##key##_s, natmap_tg_post, \
+    mode | XT_NATMAP_STAT)
+
+NATMAP_TG_KEY_VARIANTS(daddr, XT_NATMAP_ADDR | XT_NATMAP_KEY_DADDR)
+NATMAP_TG_KEY_VARIANTS(zaddr, XT_NATMAP_ADDR | XT_NATMAP_KEY_ZONE_ADDR)
+NATMAP_TG_KEY_VARIANTS(maddr, XT_NATMAP_ADDR | XT_NATMAP_KEY_MARK_ADDR)
+NATMAP_TG_KEY_VARIANTS(ctmark, XT_NATMAP_MARK | XT_NATMAP_KEY_CTMARK)
+NATMAP_TG_KEY_VARIANTS(zone, XT_NATMAP_MARK | XT_NATMAP_KEY_ZONE)
+NATMAP_TG_KEY_VARIANTS(iif, XT_NATMAP_MARK | XT_NATMAP_KEY_IIF)
+
+static void
+natmap_tg_select(struct xt_natmap_htable *ht)
+{
+	/* [key][stat][cgnat] */
+	static const natmap_tg_fn post[9][2][2] = {
+		{ { natmap_tg_addr_n, natmap_tg_addr_c },
+		  { natmap_tg_addr_s, natmap_tg_addr_sc } },
+		{ { natmap_tg_prio_n, natmap_tg_prio_c },
+		  { natmap_tg_prio_s, natmap_tg_prio_sc } },
+		{ { natmap_tg_mark_n, natmap_tg_mark_c },
+		  { natmap_tg_mark_s, natmap_tg_mark_sc } },
+		/* by XT_NATMAP_KEY, cg-nat is refused with these */
+		{ { natmap_tg_daddr_n, natmap_tg_daddr_n },
+		  { natmap_tg_daddr_s, natmap_tg_daddr_s } },
+		{ { natmap_tg_zaddr_n, natmap_tg_zaddr_n },
+		  { natmap_tg_zaddr_s, natmap_tg_zaddr_s } },
+		{ { natmap_tg_maddr_n, natmap_tg_maddr_n },
+		  { natmap_tg_maddr_s, natmap_tg_maddr_s } },
+		{ { natmap_tg_ctmark_n, natmap_tg_ctmark_n },
+		  { natmap_tg_ctmark_s, natmap_tg_ctmark_s } },
+		{ { natmap_tg_zone_n, natmap_tg_zone_n },
+		  { natmap_tg_zone_s, natmap_tg_zone_s } },
+		{ { natmap_tg_iif_n, natmap_tg_iif_n },
+		  { natmap_tg_iif_s, natmap_tg_iif_s } },
+	};
+	const unsigned int mode = READ_ONCE(ht->mode);
+	const bool stat = mode & XT_NATMAP_STAT;
+	unsigned int key = (mode & XT_NATMAP_KEY) >> XT_NATMAP_KEY_SHIFT;
+
+	/* one body for both hooks, it checks the hook itself */
+	if (mode & XT_NATMAP_IPV6) {
+		WRITE_ONCE(ht->tg_post, stat ? natmap_tg6_s : natmap_tg6_n);
+		WRITE_ONCE(ht->tg_pre, stat ? natmap_tg6_s : natmap_tg6_n);
+		return;
+	}
+
+	if (key)
+		key += 2;
+	else if (mode & XT_NATMAP_PRIO)
+		key = 1;
+	else if (mode & XT_NATMAP_MARK)
+		key = 2;
+
+	WRITE_ONCE(ht->tg_post, post[key][stat][!!(mode & XT_NATMAP_CGNT)]);
+	WRITE_ONCE(ht->tg_pre, stat ? natmap_tg_pre_s : natmap_tg_pre_n);
+}
+
+/* toggle mode flags together with the target they select, so that
+ * concurrent proc writers and genl don't lose each other's change */
+static void
+__natmap_mode_set(struct xt_natmap_htable *ht, const unsigned int set,
+const unsigned int clear)
+	/* under ht->lock */
+{
+	WRITE_ONCE(ht->mode, (ht->mode & ~clear) | set);
+	natmap_tg_select(ht);
+}
+
+static void
+natmap_mode_set(struct xt_natmap_htable *ht, const unsigned int set,
+const unsigned int clear)
+{
+	spin_lock(&ht->lock);
+	__natmap_mode_set(ht, set, clear);
+	spin_unlock(&ht->lock);
+}
+
+/* check the packet */
+static unsigned int
+natmap_tg(struct sk_buff *skb, const struct xt_action_param *par)
+	/* under bh */
+{
+	const struct xt_natmap_tginfo *tginfo = par->targinfo;
+	struct xt_natmap_htable *ht = tginfo->ht;
+
+	if (xt_hooknum(par) == NF_INET_PRE_ROUTING)
+		return READ_ONCE(ht->tg_pre)(skb, par);
+	return READ_ONCE(ht->tg_post)(skb, par);
+}
+
+/* check and init target rule, allocating htable */
+static int
+natmap_tg_check(const struct xt_tgchk_param *par)
+	/* iptables rule addition chain */
+{
+	struct net *net = par->net;
+	struct xt_natmap_tginfo *tinfo = par->targinfo;
+	const struct nf_nat_range2 *mr = &tinfo->range;
+	bool pre_r = false;
+	int ret = 0;
+
+	if (!(mr->flags & NF_NAT_RANGE_MAP_IPS)) {
+		pr_debug("NATMAP: bad MAP_IPS.\n");
+		return -EINVAL;
+	}
+
+	if (tinfo->name[sizeof(tinfo->name) - 1] != '\0')
+		return -EINVAL;
+
+	if ((mr->flags & NF_NAT_RANGE_PROTO_SPECIFIED) &&
+	    ntohs(mr->min_proto.all) > ntohs(mr->max_proto.all)) {
+		pr_err("Bad port range, <%s>\n", tinfo->name);
+		return -EINVAL;
+	}
+	if (tinfo->mode & XT_NATMAP_CGNT) {
+		struct natmap_cgnt g;
+
+		natmap_cgnt_init(&g, tinfo);
+		if (!natmap_cgnt_valid(&g)) {
+			pr_err("Bad cg-nat ports or block, <%s>\n",
+			    tinfo->name);
+			return -EINVAL;
+		}
+	}
+
+#if !IS_ENABLED(CONFIG_NF_CONNTRACK_MARK)
+	if ((tinfo->mode & XT_NATMAP_CTMK) ||
+	    (tinfo->mode & XT_NATMAP_KEY) == XT_NATMAP_KEY_CTMARK) {
+		pr_err("nm-ctmark needs CONFIG_NF_CONNTRACK_MARK, <%s>\n",
+		    tinfo->name);
+		return -EOPNOTSUPP;
+	}
+#endif
+
+	/* key sources of addr mode come first, then those of mark mode */
+	if (tinfo->mode & XT_NATMAP_KEY) {
+		const unsigned int key = tinfo->mode & XT_NATMAP_KEY;
+
+		if (key > XT_NATMAP_KEY_IIF ||
+		    (tinfo->mode & XT_NATMAP_MODE) != (key < XT_NATMAP_KEY_CTMARK ?
+		    XT_NATMAP_ADDR : XT_NATMAP_MARK)) {
+			pr_err("Bad key for nm-mode, <%s>\n", tinfo->name);
+			return -EINVAL;
+		}
+		if ((tinfo->mode & (XT_NATMAP_CGNT | XT_NATMAP_2WAY)) ||
+		    par->family == NFPROTO_IPV6 ||
+		    (par->hook_mask & (1 << NF_INET_PRE_ROUTING))) {
+			pr_err("Key%s is for IPv4 POSTROUTING without cg-nat "
+			    "or 2-way, <%s>\n", natmap_key_name(tinfo->mode) + 6,
+			    tinfo->name);
+			return -EINVAL;
+		}
+	}
+
+	if (par->family == NFPROTO_IPV6) {
+		if ((tinfo->mode & (XT_NATMAP_MODE | XT_NATMAP_CGNT)) !=
+		    XT_NATMAP_ADDR) {
+			pr_err("IPv6 table needs nm-mode addr without cg-nat, "
+			    "<%s>\n", tinfo->name);
+			return -EINVAL;
+		}
+		tinfo->mode |= XT_NATMAP_IPV6;
+	} else
+		tinfo->mode &= ~XT_NATMAP_IPV6;
+
+	tinfo->mode |= XT_NATMAP_STAT;
+	if (par->hook_mask & (1 << NF_INET_PRE_ROUTING)) {
+		if (!(tinfo->mode & (XT_NATMAP_ADDR | XT_NATMAP_2WAY))) {
+			pr_err("No any mode/flags allowed in PREROUTING, except"
+			" nm-mode addr and nm-2way, <%s>!\n", tinfo->name);
+			return -EINVAL;
+		}
+		pre_r = true;
+		tinfo->mode |= XT_NATMAP_2WAY;
+	}
+
+	mutex_lock(&natmap_mutex);
+	ret = htable_get(net, tinfo, pre_r);
+	mutex_unlock(&natmap_mutex);
+	return ret;
+}
+
+/* remove iptables target rule */
+static void
+natmap_tg_destroy(const struct xt_tgdtor_param *par)
+	/* iptables rule deletion chain */
+{
+	const struct xt_natmap_tginfo *tginfo = par->targinfo;
+
+	mutex_lock(&natmap_mutex);
+	htable_put(tginfo->ht);
+	mutex_unlock(&natmap_mutex);
+}
+
+/* revision 0 rules keep working through a revision 1 copy of their
+ * info, built per packet like for the nft expression */
+static unsigned int
+natmap_tg_v0(struct sk_buff *skb, const struct xt_action_param *par)
+	/* under bh */
+{
+	const struct xt_natmap_tginfo_v0 *info = par->targinfo;
+	const struct xt_natmap_tginfo tinfo = {
+		.range	= info->range,
+		.ht	= info->ht,
+	};
+	struct xt_action_param p = *par;
+
+	p.targinfo = &tinfo;
+	return natmap_tg(skb, &p);
+}
+
+static int
+natmap_tg_check_v0(const struct xt_tgchk_param *par)
+	/* iptables rule addition chain */
+{
+	struct xt_natmap_tginfo_v0 *info = par->targinfo;
+	struct xt_natmap_tginfo tinfo = {
+		.range	= info->range,
+		.mode	= info->mode,
+	};
+	struct xt_tgchk_param p = *par;
+	int ret;
+
+	memcpy(tinfo.name, info->name, sizeof(tinfo.name));
+	p.targinfo = &tinfo;
+	ret = natmap_tg_check(&p);
+	if (!ret)
+		info->ht = tinfo.ht;
+	return ret;
+}
+
+static void
+natmap_tg_destroy_v0(const struct xt_tgdtor_param *par)
+	/* iptables rule deletion chain */
+{
+	const struct xt_natmap_tginfo_v0 *info = par->targinfo;
+
+	mutex_lock(&natmap_mutex);
+	htable_put(info->ht);
+	mutex_unlock(&natmap_mutex);
+}
+
+static struct xt_target natmap_tg_reg[] __read_mostly = {
+	{
+		.name		= "NATMAP",
+		.revision	= 0,
+		.family		= NFPROTO_IPV4,
+		.target		= natmap_tg_v0,
+		.targetsize	= sizeof(struct xt_natmap_tginfo_v0),
+		.table		= "nat",
+		.hooks		= (1 << NF_INET_POST_ROUTING) |
+				  (1 << NF_INET_PRE_ROUTING),
+		.checkentry	= natmap_tg_check_v0,
+		.destroy	= natmap_tg_destroy_v0,
+		.me		= THIS_MODULE,
+	},
+	{
+		.name		= "NATMAP",
+		.revision	= 1,
+		.family		= NFPROTO_IPV4,
+		.target		= natmap_tg,
+		.targetsize	= sizeof(struct xt_natmap_tginfo),
+		.table		= "nat",
+		.hooks		= (1 << NF_INET_POST_ROUTING) |
+				  (1 << NF_INET_PRE_ROUTING),
+		.checkentry	= natmap_tg_check,
+		.destroy	= natmap_tg_destroy,
+		.me		= THIS_MODULE,
+	},
+	{
+		.name		= "NATMAP",
+		.revision	= 1,
+		.family		= NFPROTO_IPV6,
+		.target		= natmap_tg,
+		.targetsize	= sizeof(struct xt_natmap_tginfo),
+		.table		= "nat",
+		.hooks		= (1 << NF_INET_POST_ROUTING) |
+				  (1 << NF_INET_PRE_ROUTING),
+		.checkentry	= natmap_tg_check,
+		.destroy	= natmap_tg_destroy,
+		.me		= THIS_MODULE,
+	},
+};
+
+#if IS_ENABLED(CONFIG_NF_TABLES)
+/* nftables "natmap" expression: the same target body and tables as
+ * the xt target, without the compat layer in between */
+
+/* mode bits userspace may set, the others are kernel's */
+#define NFT_NATMAP_MODE	(XT_NATMAP_MODE | XT_NATMAP_PERS | XT_NATMAP_DROP | \
+			 XT_NATMAP_CGNT | XT_NATMAP_2WAY | XT_NATMAP_CTMK | \
+			 XT_NATMAP_KEY)
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,5,0)
+# define NFT_NATMAP_DUMP_ARGS , bool reset
+#else
+# define NFT_NATMAP_DUMP_ARGS
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,12,0)
+# define NFT_NATMAP_VALIDATE_ARGS
+#else
+# define NFT_NATMAP_VALIDATE_ARGS , const struct nft_data **data
+#endif
+
+static const struct nla_policy nft_natmap_policy[NFTA_NATMAP_MAX + 1] = {
+	[NFTA_NATMAP_NAME]	= { .type = NLA_STRING,
+				    .len = XT_NATMAP_NAME_LEN - 1 },
+	[NFTA_NATMAP_MODE]	= { .type = NLA_U32 },
+	[NFTA_NATMAP_PROTO_MIN]	= { .type = NLA_U16 },
+	[NFTA_NATMAP_PROTO_MAX]	= { .type = NLA_U16 },
+	[NFTA_NATMAP_BLOCK]	= { .type = NLA_U16 },
+	[NFTA_NATMAP_MARKMASK]	= { .type = NLA_U32 },
+};
+
+static void
+nft_natmap_eval(const struct nft_expr *expr, struct nft_regs *regs,
+const struct nft_pktinfo *pkt)
+	/* under bh */
+{
+	const struct xt_action_param par = {
+		.state		= pkt->state,
+		.targinfo	= nft_expr_priv(expr),
+	};
+	const unsigned int ret = natmap_tg(pkt->skb, &par);
+
+	regs->verdict.code = ret == XT_CONTINUE ? NFT_CONTINUE : ret;
+}
+
+/* fill xt_natmap_tginfo as iptables would and check it the same way,
+ * the table is taken by name like for an iptables rule */
+static int
+nft_natmap_init(const struct nft_ctx *ctx, const struct nft_expr *expr,
+const struct nlattr * const tb[])
+	/* under nfnl mutex */
+{
+	struct xt_natmap_tginfo *tinfo = nft_expr_priv(expr);
+	struct nf_nat_range2 *mr = &tinfo->range;
+	struct xt_tgchk_param par = {
+		.net		= ctx->net,
+		.table		= "nat",
+		.targinfo	= tinfo,
+		.family		= ctx->family,
+	};
+	u32 mode = XT_NATMAP_ADDR;
+	int err;
+
+	if (!tb[NFTA_NATMAP_NAME])
+		return -EINVAL;
+	if (ctx->family != NFPROTO_IPV4 && ctx->family != NFPROTO_IPV6)
+		return -EOPNOTSUPP;
+	/* the hook chooses SNAT or DNAT, so no jumps from other chains */
+	if (!nft_is_base_chain(ctx->chain))
+		return -EOPNOTSUPP;
+	par.hook_mask = 1 << nft_base_chain(ctx->chain)->ops.hooknum;
+
+	if (tb[NFTA_NATMAP_MODE]) {
+		mode = ntohl(nla_get_be32(tb[NFTA_NATMAP_MODE]));
+		if ((mode & ~NFT_NATMAP_MODE) ||
+		    hweight32(mode & XT_NATMAP_MODE) != 1 ||
+		    ((mode & XT_NATMAP_2WAY) && !(mode & XT_NATMAP_ADDR)))
+			return -EINVAL;
+	}
+
+	memset(tinfo, 0, sizeof(*tinfo));
+	nla_memcpy(tinfo->name, tb[NFTA_NATMAP_NAME],
+	    sizeof(tinfo->name) - 1);
+	tinfo->mode = mode;
+	mr->flags = NF_NAT_RANGE_MAP_IPS;
+	if (tb[NFTA_NATMAP_PROTO_MIN]) {
+		mr->flags |= NF_NAT_RANGE_PROTO_SPECIFIED;
+		mr->min_proto.all = nla_get_be16(tb[NFTA_NATMAP_PROTO_MIN]);
+		mr->max_proto.all = tb[NFTA_NATMAP_PROTO_MAX] ?
+		    nla_get_be16(tb[NFTA_NATMAP_PROTO_MAX]) :
+		    mr->min_proto.all;
+	}
+	if (tb[NFTA_NATMAP_BLOCK])
+		tinfo->block = ntohs(nla_get_be16(tb[NFTA_NATMAP_BLOCK]));
+	if (tb[NFTA_NATMAP_MARKMASK])
+		tinfo->markmask = ntohl(nla_get_be32(tb[NFTA_NATMAP_MARKMASK]));
+
+	err = nf_ct_netns_get(ctx->net, ctx->family);
+	if (err)
+		return err;
+	err = natmap_tg_check(&par);
+	if (err)
+		nf_ct_netns_put(ctx->net, ctx->family);
+	return err;
+}
+
+static void
+nft_natmap_destroy(const struct nft_ctx *ctx, const struct nft_expr *expr)
+{
+	const struct xt_tgdtor_param par = {
+		.net		= ctx->net,
+		.targinfo	= nft_expr_priv(expr),
+		.family		= ctx->family,
+	};
+
+	natmap_tg_destroy(&par);
+	nf_ct_netns_put(ctx->net, ctx->family);
+}
+
+static int
+nft_natmap_dump(struct sk_buff *skb, const struct nft_expr *expr
+NFT_NATMAP_DUMP_ARGS)
+{
+	const struct xt_natmap_tginfo *tinfo = nft_expr_priv(expr);
+	const struct nf_nat_range2 *mr = &tinfo->range;
+
+	if (nla_put_string(skb, NFTA_NATMAP_NAME, tinfo->name) ||
+	    nla_put_be32(skb, NFTA_NATMAP_MODE,
+	    htonl(tinfo->mode & NFT_NATMAP_MODE)))
+		return -1;
+	if ((mr->flags & NF_NAT_RANGE_PROTO_SPECIFIED) &&
+	    (nla_put_be16(skb, NFTA_NATMAP_PROTO_MIN, mr->min_proto.all) ||
+	     nla_put_be16(skb, NFTA_NATMAP_PROTO_MAX, mr->max_proto.all)))
+		return -1;
+	if (tinfo->block &&
+	    nla_put_be16(skb, NFTA_NATMAP_BLOCK, htons(tinfo->block)))
+		return -1;
+	if (tinfo->markmask &&
+	    nla_put_be32(skb, NFTA_NATMAP_MARKMASK, htonl(tinfo->markmask)))
+		return -1;
+	return 0;
+}
+
+static int
+nft_natmap_validate(const struct nft_ctx *ctx, const struct nft_expr *expr
+NFT_NATMAP_VALIDATE_ARGS)
+{
+	int err;
+
+	err = nft_chain_validate_dependency(ctx->chain, NFT_CHAIN_T_NAT);
+	if (err < 0)
+		return err;
+	return nft_chain_validate_hooks(ctx->chain,
+	    (1 << NF_INET_PRE_ROUTING) | (1 << NF_INET_POST_ROUTING));
+}
+
+static struct nft_expr_type nft_natmap_type;
+static const struct nft_expr_ops nft_natmap_ops = {
+	.type		= &nft_natmap_type,
+	.size		= NFT_EXPR_SIZE(sizeof(struct xt_natmap_tginfo)),
+	.eval		= nft_natmap_eval,
+	.init		= nft_natmap_init,
+	.destroy	= nft_natmap_destroy,
+	.dump		= nft_natmap_dump,
+	.validate	= nft_natmap_validate,
+};
+
+static struct nft_expr_type nft_natmap_type __read_mostly = {
+	.name		= "natmap",
+	.ops		= &nft_natmap_ops,
+	.policy		= nft_natmap_policy,
+	.maxattr	= NFTA_NATMAP_MAX,
+	.owner		= THIS_MODULE,
+};
+MODULE_ALIAS_NFT_EXPR("natmap");
+
+static inline int
+nft_natmap_register(void)
+{
+	return nft_register_expr(&nft_natmap_type);
+}
+
+static inline void
+nft_natmap_unregister(void)
+{
+	nft_unregister_expr(&nft_natmap_type);
+}
+#else
+static inline int nft_natmap_register(void) { return 0; }
+static inline void nft_natmap_unregister(void) { }
+#endif
+
+/* PROC stuff */
+
+/* per open file */
+struct natmap_proc {
+	struct xt_natmap_htable *ht;
+	struct mutex lock;		/* answers */
+	char *ans;			/* answers to '?' queries */
+	size_t len, pos;		/* filled, already read */
+	bool query;			/* reads return answers only */
+	char *line;			/* unterminated tail of last write */
+	size_t line_len;
+	bool line_skip;			/* too long, dropped up to '\n' */
+	unsigned long rules, failed;	/* written since open */
+	unsigned long wrules, wfailed;	/* in the current write */
+	loff_t seq_pos;			/* *pos the cursor below is at */
+	unsigned int bucket;		/* dump cursor */
+	unsigned int skip;		/* entries of bucket already shown */
+	struct pre_ip last;		/* key of the last one shown */
+	u32 last_tag;
+};
+
+/* zone and ifindex keys are decimal, marks hex */
+static inline bool
+natmap_key_dec(const unsigned int mode)
+{
+	const unsigned int key = mode & XT_NATMAP_KEY;
+
+	return key == XT_NATMAP_KEY_ZONE_ADDR || key == XT_NATMAP_KEY_ZONE ||
+	    key == XT_NATMAP_KEY_IIF;
+}
+
+/* number of the key or of its tag, returns what follows or NULL */
+static const char *
+natmap_parse_num(const char *c, const unsigned int mode, u32 *val)
+{
+	int n = 0;
+
+	if (natmap_key_dec(mode) ? sscanf(c, "%u%n", val, &n) != 1 :
+	    sscanf(c, "0x%x%n", val, &n) != 1)
+		return NULL;
+	return c + n;
+}
+
+#define NATMAP_ANS_SIZE		PAGE_SIZE
+#define NATMAP_ENT_MAX		192	/* longest entry line */
+
+/* entry line as in the dump, returns its length */
+static int
+natmap_ent_print(char *buf, const struct natmap_pre *pre, const int mode)
+{
+	struct natmap_stat stat;
+	const size_t size = NATMAP_ENT_MAX;
+	int n;
+
+	n = scnprintf(buf, size, "@+");
+	if (pre->act == NATMAP_ACT_PFX6)
+		n += scnprintf(buf + n, size - n, "%pI6c/%u",
+		    &natmap6(pre)->prenat, natmap6(pre)->plen);
+	else if (!pre->prenat.cidr)
+		n += scnprintf(buf + n, size - n, "%pI4-%pI4",
+		    &pre->prenat.addr, &natmap_range(pre)->last);
+	else if (mode & XT_NATMAP_ADDR) {
+		if (natmap_tagged(mode))
+			n += scnprintf(buf + n, size - n, natmap_key_dec(mode) ?
+			    "%u:" : "0x%x:", pre->tag);
+		n += scnprintf(buf + n, size - n, "%pI4/%u",
+		    &pre->prenat.addr, pre->prenat.cidr);
+	} else if (mode & XT_NATMAP_PRIO)
+		n += scnprintf(buf + n, size - n, "%04x:%04x",
+		    TC_H_MAJ(pre->prenat.addr)>>16,
+		    TC_H_MIN(pre->prenat.addr));
+	else
+		n += scnprintf(buf + n, size - n, natmap_key_dec(mode) ?
+		    "%u" : "0x%08x", pre->prenat.addr);
+	n += scnprintf(buf + n, size - n, "=");
+
+	if (pre->act == NATMAP_ACT_PFX6)
+		n += scnprintf(buf + n, size - n, "%pI6c/%u",
+		    &natmap6(pre)->postnat, natmap6(pre)->plen);
+	else if (pre->postnat.cidr)
+		n += scnprintf(buf + n, size - n, "%pI4/%u",
+		    &pre->postnat.from, pre->postnat.cidr);
+	else
+		n += scnprintf(buf + n, size - n, "%pI4-%pI4",
+		    &pre->postnat.from, &pre->postnat.to);
+	if (pre->id)
+		n += scnprintf(buf + n, size - n, ",id=0x%x", pre->id);
+
+	if (mode & XT_NATMAP_STAT) {
+		natmap_stat_fold(pre, &stat);
+		n += scnprintf(buf + n, size - n, "  %llu:%llu",
+		    stat.pkts, stat.bytes);
+	}
+	n += scnprintf(buf + n, size - n, "\n");
+
+	return n;
+}
+
+static int
+natmap_seq_ent_show(struct natmap_pre *pre, int mode, struct seq_file *s)
+{
+	char buf[NATMAP_ENT_MAX];
+
+	seq_write(s, buf, natmap_ent_print(buf, pre, mode));
+	return seq_has_overflowed(s);
+}
+
+static void
+natmap_seq_header(struct seq_file *s, struct xt_natmap_htable *ht)
+	/* under rcu_read_lock */
+{
+	const struct natmap_data *d = rcu_dereference(ht->data);
+	const struct natmap_hash *tbl = rcu_dereference(d->pre);
+	const struct natmap_cgnt *g = rcu_dereference(ht->cgnt);
+
+	seq_printf(s, "# name: %s; entities: %u; hash size: %u; mode: "
+					    "%s%s%s%s%s; flags: %s%s%s%s%s\n",
+	    ht->name, READ_ONCE(d->count), tbl->size,
+	    (ht->mode & XT_NATMAP_PRIO) ? "prio"  : "",
+	    (ht->mode & XT_NATMAP_MARK) ? "mark"  : "",
+	    (ht->mode & XT_NATMAP_ADDR) ? "addr"  : "",
+	    (ht->mode & XT_NATMAP_IPV6) ? " ipv6" : "",
+	    natmap_key_name(ht->mode),
+	    (ht->mode & XT_NATMAP_PERS) ? "+persistent" : "-persistent",
+	    (ht->mode & XT_NATMAP_DROP) ? ", +hotdrop"  : ", -hotdrop",
+	    (ht->mode & XT_NATMAP_CGNT) ? ", +cg-nat"   : ", -cg-nat",
+	    (ht->mode & XT_NATMAP_2WAY) ? ", +two-way"  : ", -two-way",
+	    (ht->mode & XT_NATMAP_CTMK) ? ", +ct-mark"  : ", -ct-mark");
+	seq_printf(s, "# resizes: %u%s; last resize: %u us; "
+	    "lookup misses while resizing: %lu\n",
+	    READ_ONCE(ht->resizes), READ_ONCE(d->resizing) ?
+	    " (in progress)" : "",
+	    READ_ONCE(ht->resize_us), atomic_long_read(&ht->resize_miss));
+	seq_printf(s, "# cg-nat ports: %u-%u; block: %u\n",
+	    g->min, g->min + g->range - 1, g->block);
+	seq_printf(s, "# last load: %lu rules, %lu failed; "
+	    "generation: %u\n",
+	    READ_ONCE(ht->load_rules), READ_ONCE(ht->load_failed),
+	    READ_ONCE(ht->gen));
+}
+
+/* entry at the cursor: the one after the last shown if it's still in
+ * its bucket, else the one at the same index, empty buckets are passed
+ * in one loop */
+static struct natmap_pre *
+natmap_seq_find(struct natmap_proc *np)
+	/* under rcu_read_lock */
+{
+	const struct natmap_data *d = rcu_dereference(np->ht->data);
+	const struct natmap_hash *tbl = rcu_dereference(d->pre);
+	struct natmap_pre *pre, *nth;
+	unsigned int i;
+	bool found;
+
+	for (; np->bucket < tbl->size; np->bucket++, np->skip = 0) {
+		if (!rcu_access_pointer(hlist_first_rcu(&tbl->head[np->bucket])))
+			continue;
+		nth = NULL;
+		found = false;
+		i = 0;
+		natmap_hash_for_each_rcu(pre, tbl, np->bucket) {
+			if (found || !np->skip)
+				return pre;
+			if (!memcmp(&pre->prenat, &np->last,
+			    sizeof(struct pre_ip)) && pre->tag == np->last_tag)
+				found = true;
+			else if (!nth && i >= np->skip)
+				nth = pre;
+			i++;
+		}
+		if (!found && nth)
+			return nth;
+	}
+
+	return NULL;
+}
+
+static void
+natmap_seq_advance(struct natmap_proc *np, const struct natmap_pre *pre)
+{
+	np->last = pre->prenat;
+	np->last_tag = pre->tag;
+	np->skip++;
+}
+
+static int
+natmap_seq_show(struct seq_file *s, void *v)
+{
+	const struct natmap_proc *np = s->private;
+	struct xt_natmap_htable *ht = np->ht;
+
+	if (v == SEQ_START_TOKEN) {
+		if (ht->mode & XT_NATMAP_STAT)
+			natmap_seq_header(s, ht);
+		return 0;
+	}
+	natmap_seq_ent_show(v, ht->mode, s);
+	return 0;
+}
+
+/* *pos 0 is the header, entries follow; the cursor is kept between
+ * reads, so sequential reads resume without walking the table again
+ * and without taking ht->lock. A read racing with a resize or commit
+ * may miss or repeat entries. */
+static void *
+natmap_seq_start(struct seq_file *s, loff_t *pos)
+	__acquires(RCU)
+{
+	struct natmap_proc *np = s->private;
+	struct natmap_pre *pre = NULL;
+	loff_t p;
+
+	rcu_read_lock();
+	if (*pos == 0) {
+		np->bucket = 0;
+		np->skip = 0;
+		np->seq_pos = 0;
+		return SEQ_START_TOKEN;
+	}
+	if (*pos == np->seq_pos)
+		return natmap_seq_find(np);
+
+	/* seek, walk from the start */
+	np->bucket = 0;
+	np->skip = 0;
+	for (p = 1; p <= *pos; p++) {
+		pre = natmap_seq_find(np);
+		if (!pre)
+			break;
+		if (p < *pos)
+			natmap_seq_advance(np, pre);
+	}
+	np->seq_pos = *pos;
+	return pre;
+}
+
+static void *
+natmap_seq_next(struct seq_file *s, void *v, loff_t *pos)
+{
+	struct natmap_proc *np = s->private;
+
+	if (v != SEQ_START_TOKEN)
+		natmap_seq_advance(np, v);
+	np->seq_pos = ++(*pos);
+	return natmap_seq_find(np);
+}
+
+static void
+natmap_seq_stop(struct seq_file *s, void *v)
+	__releases(RCU)
+{
+	rcu_read_unlock();
+}
+
+static const struct seq_operations natmap_seq_ops = {
+	.start		= natmap_seq_start,
+	.show		= natmap_seq_show,
+	.next		= natmap_seq_next,
+	.stop		= natmap_seq_stop,
+};
+
+static int
+natmap_proc_open(struct inode *inode, struct file *file)
+{
+	struct natmap_proc *np;
+
+	np = __seq_open_private(file, &natmap_seq_ops, sizeof(*np));
+	if (!np)
+		return -ENOMEM;
+	np->ht = PDE_DATA(inode);
+	mutex_init(&np->lock);
+
+	return 0;
+}
+
+static int
+natmap_proc_release(struct inode *inode, struct file *file)
+{
+	struct natmap_proc *np = ((struct seq_file *)file->private_data)->private;
+	struct xt_natmap_htable *ht = np->ht;
+
+	if (np->line_len || np->line_skip) {
+		pr_err("Rule should end with '\\n', <%s>\n", ht->name);
+		np->rules++;
+		np->failed++;
+	}
+	if (np->rules) {
+		WRITE_ONCE(ht->load_rules, np->rules);
+		WRITE_ONCE(ht->load_failed, np->failed);
+		if (np->failed)
+			pr_err("%lu of %lu rules failed, <%s>\n",
+			    np->failed, np->rules, ht->name);
+		else if (!disable_log)
+			pr_info("%lu rules loaded, <%s>\n",
+			    np->rules, ht->name);
+	}
+	kfree(np->line);
+	kfree(np->ans);
+	return seq_release_private(inode, file);
+}
+
+/* once file was queried it reads answers instead of table */
+static ssize_t
+natmap_proc_read(struct file *file, char __user *buf, size_t size,
+loff_t *ppos)
+{
+	struct natmap_proc *np = ((struct seq_file *)file->private_data)->private;
+	ssize_t ret;
+
+	if (!READ_ONCE(np->query))
+		return seq_read(file, buf, size, ppos);
+
+	mutex_lock(&np->lock);
+	ret = min(size, np->len - np->pos);
+	if (copy_to_user(buf, np->ans + np->pos, ret))
+		ret = -EFAULT;
+	else if ((np->pos += ret) == np->len)
+		np->pos = np->len = 0;
+	mutex_unlock(&np->lock);
+
+	return ret;
+}
+
+static __printf(2, 3) int
+natmap_ans_printf(struct natmap_proc *np, const char *fmt, ...)
+	/* under np->lock */
+{
+	const size_t room = NATMAP_ANS_SIZE - np->len;
+	va_list args;
+	int n;
+
+	va_start(args, fmt);
+	n = vsnprintf(np->ans + np->len, room, fmt, args);
+	va_end(args);
+	if (n >= room)
+		return -ENOSPC;
+	np->len += n;
+
+	return 0;
+}
+
+static int
+natmap_query_ans(void *arg, const struct natmap_pre *pre, __be32 prenat_ip)
+{
+	return natmap_ans_printf(arg, " %pI4", &prenat_ip);
+}
+
+/* ?postnat_addr:port, cg-nat owners of the port,
+ * answer line is: postnat_addr:port prenat_addr... or - if not found */
+static int
+natmap_query_cgnt(struct natmap_proc *np, const char *c1,
+const __be32 postnat_ip, const char *c2)
+	/* under np->lock */
+{
+	struct xt_natmap_htable *ht = np->ht;
+	unsigned int port;
+	size_t head;
+	int ret;
+
+	if (!(ht->mode & XT_NATMAP_CGNT)) {
+		pr_err("Query needs addr mode with cg-nat, <%s>\n", ht->name);
+		return -EINVAL;
+	}
+	if (sscanf(c2, ":%u", &port) != 1 || port > 65535) {
+		pr_err("Invalid query format, it should be: ?IP:PORT, (cmd: %s)\n", c1);
+		return -EINVAL;
+	}
+
+	ret = natmap_ans_printf(np, "%pI4:%u", &postnat_ip, port);
+	if (ret)
+		return ret;
+	head = np->len;
+	rcu_read_lock();
+	ret = natmap_cgnt_query(ht, postnat_ip, port, natmap_query_ans, np);
+	rcu_read_unlock();
+	if (!ret && np->len == head)
+		ret = natmap_ans_printf(np, " -");
+
+	return ret;
+}
+
+/* query format is: ?prenat_key, entry the packet path picks for it
+ *              or: ?=postnat_addr, entry it maps back to, two-way only
+ *              or: ?postnat_addr:port, see natmap_query_cgnt()
+ * answer line is the query followed by the entry line or - */
+static int
+natmap_query(struct natmap_proc *np, const char *c1)
+	/* under np->lock */
+{
+	struct xt_natmap_htable *ht = np->ht;
+	const size_t len = np->len;
+	const struct natmap_data *d;
+	const struct natmap_pre *pre;
+	char buf[NATMAP_ENT_MAX];
+	const char *c2 = NULL;
+	struct in6_addr key6;
+	__be32 key, prenat_ip;
+	bool reverse = false;
+	u32 tag = 0;
+	int ret;
+
+	if (c1[1] == '=') {
+		if (!(ht->mode & XT_NATMAP_2WAY)) {
+			pr_err("Reverse query needs two-way mode, <%s>\n", ht->name);
+			return -EINVAL;
+		}
+		if ((ht->mode & XT_NATMAP_IPV6) ?
+		    !in6_pton(c1 + 2, -1, key6.s6_addr, -1, NULL) :
+		    !in4_pton(c1 + 2, -1, (u8 *)&key, -1, NULL)) {
+			pr_err("Invalid query format, it should be: ?=IP, (cmd: %s)\n", c1);
+			return -EINVAL;
+		}
+		reverse = true;
+	} else if (ht->mode & XT_NATMAP_IPV6) {
+		if (!in6_pton(c1 + 1, -1, key6.s6_addr, -1, NULL)) {
+			pr_err("Invalid query format, it should be: ?IP or ?=IP, (cmd: %s)\n", c1);
+			return -EINVAL;
+		}
+	} else if (natmap_tagged(ht->mode)) {
+		c2 = natmap_parse_num(c1 + 1, ht->mode, &tag);
+		if (!c2 || *c2 != ':' ||
+		    !in4_pton(c2 + 1, -1, (u8 *)&key, -1, NULL)) {
+			pr_err("Invalid query format, it should be: ?%s:IP, (cmd: %s)\n",
+			    natmap_key_dec(ht->mode) ? "ZONE" : "0xMARK", c1);
+			return -EINVAL;
+		}
+		c2 = NULL;
+	} else if (ht->mode & XT_NATMAP_ADDR) {
+		if (!in4_pton(c1 + 1, -1, (u8 *)&key, ':', &c2)) {
+			pr_err("Invalid query format, it should be: ?IP, ?=IP or ?IP:PORT, (cmd: %s)\n", c1);
+			return -EINVAL;
+		}
+	} else if (ht->mode & XT_NATMAP_MARK) {
+		if (!natmap_parse_num(c1 + 1, ht->mode, &key)) {
+			pr_err("Invalid query format, it should be: ?%s, (cmd: %s)\n",
+			    natmap_key_dec(ht->mode) ? "NUMBER" : "0xMARK", c1);
+			return -EINVAL;
+		}
+	} else {
+		unsigned maj, min;
+
+		if (sscanf(c1, "?%x:%x", &maj, &min) != 2) {
+			pr_err("Invalid query format, it should be: ?MAJ:MIN, (cmd: %s)\n", c1);
+			return -EINVAL;
+		}
+		key = TC_H_MAKE(maj<<16, min);
+	}
+
+	if (!np->ans) {
+		np->ans = kmalloc(NATMAP_ANS_SIZE, GFP_KERNEL);
+		if (!np->ans)
+			return -ENOMEM;
+	}
+	WRITE_ONCE(np->query, true);
+
+	if (c2 && *c2) {
+		ret = natmap_query_cgnt(np, c1, key, c2);
+	} else {
+		rcu_read_lock();
+		d = rcu_dereference(ht->data);
+		if (ht->mode & XT_NATMAP_IPV6)
+			pre = natmap6_lookup(ht, d, &key6, reverse);
+		else
+			pre = reverse ? natmap_pre_rfind(d, key, &prenat_ip) :
+			    natmap_tagged(ht->mode) ?
+			    natmap_pre_tlookup(ht, d, tag, key) :
+			    natmap_pre_lookup(ht, d, key);
+		if (pre)
+			ret = natmap_ans_printf(np, "%s %.*s", c1 + 1,
+			    natmap_ent_print(buf, pre, ht->mode) - 1, buf);
+		else
+			ret = natmap_ans_printf(np, "%s -", c1 + 1);
+		rcu_read_unlock();
+	}
+	if (!ret)
+		ret = natmap_ans_printf(np, "\n");
+	if (ret)
+		np->len = len;	/* drop partial answer */
+
+	return ret;
+}
+
+static void
+natmap_rule_log(const struct xt_natmap_htable *ht,
+const struct natmap_rule *rule, const int add)
+{
+	const char *op = (add == 1) ? "Add" : "Del";
+
+	if (!rule->prenat.cidr)
+		pr_info("%s %pI4-%pI4 => %pI4-%pI4, <%s>\n", op,
+		    &rule->prenat.addr, &rule->prenat_last,
+		    &rule->postnat.from, &rule->postnat.to, ht->name);
+	else if (natmap_tagged(ht->mode))
+		pr_info("%s 0x%x:%pI4/%2u => %pI4-%pI4, <%s>\n", op,
+		    rule->tag, &rule->prenat.addr, rule->prenat.cidr,
+		    &rule->postnat.from, &rule->postnat.to, ht->name);
+	else if (ht->mode & XT_NATMAP_ADDR)
+		pr_info("%s %pI4/%2u => %pI4-%pI4, <%s>\n", op,
+		    &rule->prenat.addr, rule->prenat.cidr,
+		    &rule->postnat.from, &rule->postnat.to, ht->name);
+	else if (ht->mode & XT_NATMAP_MARK)
+		pr_info("%s 0x%x => %pI4-%pI4, <%s>\n", op,
+		    rule->prenat.addr,
+		    &rule->postnat.from, &rule->postnat.to, ht->name);
+	else if (ht->mode & XT_NATMAP_PRIO)
+		pr_info("%s %04x:%04x => %pI4-%pI4, <%s>\n", op,
+		    TC_H_MAJ(rule->prenat.addr) >> 16,
+		    TC_H_MIN(rule->prenat.addr),
+		    &rule->postnat.from, &rule->postnat.to, ht->name);
+}
+
+/* re-add of an unchanged entry only moves it to the current generation,
+ * a duplicate within the same generation is still an error for add */
+static bool
+natmap_rule_touch(struct xt_natmap_htable *ht, const struct natmap_rule *rule,
+const bool warn)
+{
+	struct natmap_pre *pre;
+	bool ret = false, same;
+
+	spin_lock(&ht->lock);
+	if (ht->mode & XT_NATMAP_IPV6) {
+		pre = natmap6_pre_find(ht, natmap_wdata(ht), &rule->prenat6,
+		    rule->prenat.cidr);
+		same = pre && ipv6_addr_equal(&natmap6(pre)->postnat,
+		    &rule->postnat6);
+	} else {
+		pre = natmap_pre_find(ht, natmap_wdata(ht), rule->tag,
+		    rule->prenat.addr, rule->prenat.cidr);
+		same = pre && !memcmp(&pre->postnat, &rule->postnat,
+		    sizeof(struct post_ip)) && (pre->prenat.cidr ||
+		    natmap_range(pre)->last == rule->prenat_last);
+	}
+	if (same && pre->id == rule->id && (!warn || pre->gen != ht->gen)) {
+		pre->gen = ht->gen;
+		ret = true;
+	}
+	spin_unlock(&ht->lock);
+
+	return ret;
+}
+
+/* natmap_rule_apply() of IPv6 tables, no trie, cg-nat or reverse map;
+ * postnat prefixes of two-way tables must be unique to map back */
+static int
+natmap6_rule_apply(struct xt_natmap_htable *ht, const struct natmap_rule *rule,
+const int add, const bool warn, const char *buf)
+{
+	const u32 plen = rule->prenat.cidr;
+	struct natmap6_pre *pre6;		/* new entry  */
+	struct natmap_post *post;		/* new entry  */
+	struct natmap_pre *pre_chk, *dup;	/* old entries */
+	struct natmap_stat __percpu *spare = NULL;	/* unused counters */
+	struct natmap_data *d;
+	int ret = 0;
+
+	if (add == 1 && natmap_rule_touch(ht, rule, warn))
+		return 0;
+	if (buf && !disable_log)
+		pr_info("%s %pI6c/%u => %pI6c/%u, <%s>\n",
+		    (add == 1) ? "Add" : "Del", &rule->prenat6, plen,
+		    &rule->postnat6, plen, ht->name);
+
+	/* prepare ent */
+	pre6 = natmap_ent_zalloc(sizeof(struct natmap6_pre));
+	post = natmap_ent_zalloc(sizeof(struct natmap_post));
+	if (!pre6 || !post ||
+	    (add == 1 && !(pre6->pre.stat = alloc_percpu(struct natmap_stat)))) {
+		kvfree(post);
+		if (pre6)
+			natmap_pre_free(&pre6->pre);
+		return -ENOMEM;
+	}
+	pre6->prenat = rule->prenat6;
+	pre6->postnat = rule->postnat6;
+	pre6->plen = plen;
+	pre6->pre.prenat.addr = natmap6_fold(&rule->prenat6);
+	pre6->pre.prenat.cidr = 32;
+	pre6->pre.postnat.from = natmap6_fold(&rule->postnat6);
+	pre6->pre.postnat.to = pre6->pre.postnat.from;
+	pre6->pre.postnat.cidr = 32;
+	pre6->pre.id = rule->id;
+	pre6->pre.gen = ht->gen;
+	pre6->pre.act = NATMAP_ACT_PFX6;
+	pre6->pre.post = post;
+	post->pre = &pre6->pre;
+
+	spin_lock(&ht->lock);
+	d = natmap_wdata(ht);
+
+	/* check existence of these prefixes */
+	pre_chk = natmap6_pre_find(ht, d, &rule->prenat6, plen);
+	if (add == 1 && warn && pre_chk) {
+		if (buf)
+			pr_err("Add op references existing address, (cmd: %s)\n", buf);
+		ret = -EEXIST;
+		goto unlock;
+	} else if (add == -1 && warn && !pre_chk) {
+		if (buf)
+			pr_err("Del op doesn't reference any existing address, (cmd: %s)\n", buf);
+		ret = -ENOENT;
+		goto unlock;
+	}
+	if (add == 1 && (ht->mode & XT_NATMAP_2WAY) &&
+	    (dup = natmap6_post_find(ht, d, &rule->postnat6, plen)) &&
+	    dup != pre_chk) {
+		if (buf)
+			pr_err("In 2-way mode postnat prefix is already mapped, (cmd: %s)\n", buf);
+		ret = -EEXIST;
+		goto unlock;
+	}
+	if (add == 1 && natmap_rmap_full(ht)) {
+		if (buf)
+			pr_err("Two-way map is full, (cmd: %s)\n", buf);
+		ret = -ENOSPC;
+		goto unlock;
+	}
+	/* each length in use costs a hash probe per packet */
+	if (add == 1 && !pre_chk && !d->plen6_map[plen] &&
+	    d->plen6_count >= NATMAP6_PLENS_MAX) {
+		if (buf)
+			pr_err("Table already holds %u prefix lengths, (cmd: %s)\n",
+			    NATMAP6_PLENS_MAX, buf);
+		ret = -E2BIG;
+		goto unlock;
+	}
+
+	if (add == 1 && pre_chk) {
+		/* update, publish new pair, counters carry over */
+		spare = pre6->pre.stat;
+		pre6->pre.stat = pre_chk->stat;
+		natmap_pre_replace(ht, pre_chk, &pre6->pre);
+		natmap_post_del(ht, pre_chk->post);
+		natmap_post_add(ht, post);
+		call_rcu(&pre_chk->rcu, natmap_pre_replaced_rcu);
+		pre6 = NULL;
+		post = NULL;
+	} else if (add == 1) {
+		natmap_pre_add(ht, &pre6->pre);
+		natmap_post_add(ht, post);
+		natmap_hash_check(ht);
+		pre6 = NULL;
+		post = NULL;
+	} else if (pre_chk) {
+		natmap_ent_del(ht, pre_chk);
+		natmap_hash_check(ht);
+	}
+
+unlock:
+	spin_unlock(&ht->lock);
+
+	free_percpu(spare);
+	kvfree(post);
+	if (pre6)
+		natmap_pre_free(&pre6->pre);
+	return ret;
+}
+
+/* new IPv4 entry pair of rule */
+static void
+natmap_pre_fill(struct xt_natmap_htable *ht, struct natmap_pre *pre,
+struct natmap_post *post, const struct natmap_rule *rule)
+	/* under ht->lock */
+{
+	pre->prenat.addr = rule->prenat.addr;
+	pre->prenat.cidr = rule->prenat.cidr;
+	pre->tag = rule->tag;
+	pre->postnat.from = rule->postnat.from;
+	pre->postnat.to = rule->postnat.to;
+	pre->postnat.cidr = rule->postnat.cidr;
+	pre->id = rule->id;
+	pre->gen = ht->gen;
+	natmap_act_init(pre);
+	pre->post = post;
+	post->pre = pre;
+}
+
+/* two-way map is grown or shrunk before ht->lock */
+static int
+natmap_rmap_prepare(struct xt_natmap_htable *ht)
+{
+	const struct natmap_data *d;
+	bool stale;
+
+	if (!(ht->mode & XT_NATMAP_2WAY))
+		return 0;
+	rcu_read_lock();
+	d = natmap_wdata(ht);
+	stale = natmap_rmap_stale(rcu_dereference(d->rmap),
+	    READ_ONCE(d->count));
+	rcu_read_unlock();
+	return stale ? natmap_rmap_rebuild(ht) : 0;
+}
+
+/* add (1), update (1, !warn) or delete (-1) one entity,
+ * buf is the text of rule for error messages, if any */
+static int
+natmap_rule_apply(struct xt_natmap_htable *ht, const struct natmap_rule *rule,
+const int add, const bool warn, const char *buf)
+{
+	struct natmap_pre *pre;			/* new entry  */
+	struct natmap_post *post;		/* new entry  */
+	struct natmap_pre *pre_chk;		/* old entry  */
+	struct natmap_lpm_node *lpm[NATMAP_LPM_LEVELS] = { NULL };
+	struct natmap_ranges *ranges = NULL;
+	struct natmap_stat __percpu *spare = NULL;	/* unused counters */
+	const bool range = !rule->prenat.cidr;
+	int ret, i;
+
+	if (ht->mode & XT_NATMAP_IPV6)
+		return natmap6_rule_apply(ht, rule, add, warn, buf);
+	if (add == 1 && natmap_rule_touch(ht, rule, warn))
+		return 0;
+	if (buf && !disable_log)
+		natmap_rule_log(ht, rule, add);
+
+	/* prepare ent */
+	pre = natmap_ent_zalloc(range ? sizeof(struct natmap_range_pre) :
+	    sizeof(struct natmap_pre));
+	if (!pre)
+		return -ENOMEM;
+	if (range)
+		natmap_range(pre)->last = rule->prenat_last;
+
+	post = natmap_ent_zalloc(sizeof(struct natmap_post));
+	if (!post) {
+		kvfree(pre);
+		return -ENOMEM;
+	}
+
+	/* percpu allocation can sleep, so also done before ht->lock */
+	if (add == 1) {
+		pre->stat = alloc_percpu(struct natmap_stat);
+		if (!pre->stat)
+			goto free_enomem;
+	}
+
+	/* trie nodes can't be allocated under ht->lock */
+	if (add == 1 && !range && rule->prenat.cidr < 32 &&
+	    !natmap_tagged(ht->mode))
+		for (i = 0; i <= (rule->prenat.cidr - 1) / NATMAP_LPM_STRIDE; i++) {
+			lpm[i] = kzalloc(sizeof(struct natmap_lpm_node),
+			    GFP_KERNEL);
+			if (!lpm[i])
+				goto free_enomem;
+		}
+
+	/* nor the copy of the ranges, twice as big so that following
+	 * adds in address order fill it in place; again if others were
+	 * added before ht->lock was taken */
+ranges_alloc:
+	if (add == 1 && range) {
+		const struct natmap_ranges *rs;
+		unsigned int n, size;
+		u32 end;
+
+		rcu_read_lock();
+		rs = rcu_dereference(natmap_wdata(ht)->ranges);
+		n = rs ? smp_load_acquire(&rs->count) : 0;
+		size = rs ? rs->size : 0;
+		end = n ? rs->slot[n - 1].first : 0;
+		rcu_read_unlock();
+		if ((n >= size || end >= ntohl(rule->prenat.addr)) &&
+		    (!ranges || ranges->size <= n)) {
+			kvfree(ranges);
+			ranges = natmap_ranges_alloc(n * 2 + 8);
+			if (!ranges)
+				goto free_enomem;
+		}
+	}
+
+	if (natmap_rmap_prepare(ht) && add == 1)
+		goto free_enomem;
+
+	spin_lock(&ht->lock);
+
+	/* check existence of these IPs */
+	pre_chk = natmap_pre_find(ht, natmap_wdata(ht), rule->tag,
+	    rule->prenat.addr, rule->prenat.cidr);
+	/* a range is known by its first address, but must match whole */
+	if (range && pre_chk &&
+	    natmap_range(pre_chk)->last != rule->prenat_last) {
+		if (buf)
+			pr_err("Range differs from existing one at its first address, (cmd: %s)\n", buf);
+		ret = (add == 1) ? -EEXIST : -ENOENT;
+		goto unlock_err;
+	}
+
+	if (add == 1) {
+		/* add op should not reference any existing entries */
+		/* unless it's update op (which is quiet add) */
+		if (warn && pre_chk) {
+			if (buf)
+				pr_err("Add op references existing address, (cmd: %s)\n", buf);
+			ret = -EEXIST;
+			goto unlock_err;
+		}
+		if (range && !pre_chk &&
+		    natmap_range_overlap(ht, ntohl(rule->prenat.addr),
+		    ntohl(rule->prenat_last))) {
+			if (buf)
+				pr_err("Range overlaps existing one, (cmd: %s)\n", buf);
+			ret = -EEXIST;
+			goto unlock_err;
+		}
+	} else if (add == -1) {
+		/* delete op should reference something */
+		if (warn && !pre_chk) {
+			if (buf)
+				pr_err("Del op doesn't reference any existing address, (cmd: %s)\n", buf);
+			ret = -ENOENT;
+			goto unlock_err;
+		}
+	}
+	/* a reverse entry that can't be added would leave the forward
+	 * one unreachable from the public side */
+	if (add == 1 && natmap_rmap_full(ht)) {
+		if (buf)
+			pr_err("Two-way map is full, (cmd: %s)\n", buf);
+		ret = -ENOSPC;
+		goto unlock_err;
+	}
+	/* +cgnat may have been set since the rule was parsed */
+	if (add == 1 && range && (ht->mode & XT_NATMAP_CGNT)) {
+		if (buf)
+			pr_err("Prenat range is not supported with cg-nat, (cmd: %s)\n", buf);
+		ret = -EOPNOTSUPP;
+		goto unlock_err;
+	}
+	/* nor may its cg-nat port blocks overlap those of others */
+	if (add == 1 && !natmap_cgnt_rule_fits(ht, rule)) {
+		if (buf)
+			pr_err("CG-NAT port blocks of entry don't fit in the port range, (cmd: %s)\n", buf);
+		ret = -ERANGE;
+		goto unlock_err;
+	}
+
+	if (add == 1) {
+		if (pre_chk) {
+			/* update */
+			if (memcmp(&pre_chk->postnat, &rule->postnat,
+			    sizeof(struct post_ip)) || pre_chk->id != rule->id) {
+				/* publish new pair, counters carry over */
+				spare = pre->stat;
+				pre->prenat = pre_chk->prenat;
+				pre->tag = pre_chk->tag;
+				pre->postnat = rule->postnat;
+				pre->id = rule->id;
+				pre->gen = ht->gen;
+				natmap_act_init(pre);
+				pre->stat = pre_chk->stat;
+				pre->post = post;
+				post->pre = pre;
+
+				natmap_pre_replace(ht, pre_chk, pre);
+				natmap_post_del(ht, pre_chk->post);
+				natmap_post_add(ht, post);
+				natmap_lpm_update(ht, rule->prenat.addr, rule->prenat.cidr, NULL);
+				call_rcu(&pre_chk->rcu, natmap_pre_replaced_rcu);
+				pre = NULL;
+				post = NULL;
+			}
+		} else {
+			natmap_pre_fill(ht, pre, post, rule);
+			if (range && natmap_range_add(ht, pre, &ranges)) {
+				spin_unlock(&ht->lock);
+				goto ranges_alloc;
+			}
+			natmap_pre_add(ht, pre);
+			natmap_post_add(ht, post);
+			natmap_hash_check(ht);
+			natmap_lpm_update(ht, rule->prenat.addr, rule->prenat.cidr, lpm);
+			pre = NULL;
+			post = NULL;
+		}
+	} else if (pre_chk) {
+		natmap_ent_del(ht, pre_chk);
+		natmap_hash_check(ht);
+	}
+
+	spin_unlock(&ht->lock);
+
+	free_percpu(spare);
+	for (i = 0; i < NATMAP_LPM_LEVELS; i++)
+		kfree(lpm[i]);
+	kvfree(ranges);
+	if (post)
+		kvfree(post);
+	if (pre)
+		natmap_pre_free(pre);
+	return 0;
+
+unlock_err:
+	spin_unlock(&ht->lock);
+	for (i = 0; i < NATMAP_LPM_LEVELS; i++)
+		kfree(lpm[i]);
+	kvfree(ranges);
+	kvfree(post);
+	natmap_pre_free(pre);
+	return ret;
+
+free_enomem:
+	for (i = 0; i < NATMAP_LPM_LEVELS; i++)
+		kfree(lpm[i]);
+	kvfree(ranges);
+	kvfree(post);
+	natmap_pre_free(pre);
+	return -ENOMEM;
+}
+
+/* IPv6 prefix as addr[/len], len is 128 if not given and 1..128
+ * otherwise; returns what follows it or NULL if malformed */
+static const char *
+natmap6_parse_prefix(const char *c, struct in6_addr *prefix, u32 *plen)
+{
+	const size_t len = strcspn(c, "/=,");
+	struct in6_addr addr;
+	int n = 0;
+
+	if (!len || !in6_pton(c, len, addr.s6_addr, -1, NULL))
+		return NULL;
+	c += len;
+	*plen = 128;
+	if (*c == '/' && (sscanf(c, "/%u%n", plen, &n) != 1 ||
+	    *plen < 1 || *plen > 128))
+		return NULL;
+	ipv6_addr_prefix(prefix, &addr, *plen);
+
+	return c + n;
+}
+
+/* rule format of IPv6 tables is: [@]+prenat_prefix[/len]=postnat_prefix[/len]
+ *                             or: [@]-prenat_prefix[/len]
+ * with the same length on both sides, optionally followed by: ,id=0xID */
+static int
+natmap6_parse_rule(struct xt_natmap_htable *ht, const char *c1, const int add,
+const bool warn, const char *buf)
+{
+	struct natmap_rule rule;
+	const char *c2;
+	u32 plen;
+
+	if (add == -2) {
+		pr_err("Not supported in IPv6 table, (cmd: %s)\n", buf);
+		return -EOPNOTSUPP;
+	}
+	memset(&rule, 0, sizeof(rule));
+
+	c2 = natmap6_parse_prefix(c1 + 1, &rule.prenat6, &rule.prenat.cidr);
+	if (!c2 || (add == 1) != (*c2 == '=')) {
+		pr_err("Invalid prenat IPv6 prefix format, (cmd: %s)\n", buf);
+		return -EINVAL;
+	}
+	if (add == 1) {
+		c2 = natmap6_parse_prefix(c2 + 1, &rule.postnat6, &plen);
+		if (!c2) {
+			pr_err("Invalid postnat IPv6 prefix format, (cmd: %s)\n", buf);
+			return -EINVAL;
+		}
+		if (plen != rule.prenat.cidr) {
+			pr_err("Prenat and postnat prefix lengths must be equal, (cmd: %s)\n", buf);
+			return -EINVAL;
+		}
+	}
+	if (*c2 && (add != 1 || sscanf(c2, ",id=0x%x", &rule.id) != 1)) {
+		pr_err("Invalid entry option, it should be: ,id=0xID, (cmd: %s)\n", buf);
+		return -EINVAL;
+	}
+
+	return natmap_rule_apply(ht, &rule, add, warn, buf);
+}
+
+static int
+parse_rule(struct xt_natmap_htable *ht, char *c1, size_t size)
+{
+	char * const buf = c1;			/* for logging only */
+	const char *c2, *end;
+	struct pre_ip prenat;
+	struct post_ip postnat;
+	struct natmap_rule rule;
+	__be32 last = 0;
+	bool warn = true;
+	u32 id = 0, tag = 0;
+	int add;
+
+	/* make sure that size is enough for two decrements */
+	if (size < 1 || !c1 || !ht)
+		return -EINVAL;
+
+	/* rule format is: [@]+prenat_addr[/cidr]=postnat_from[-postnat_to]
+	 *             or: [@]+prenat_first-prenat_last=postnat...
+	 *             or: [@]+0xFWMARK=postnat_from[-postnat_to]
+	 *             or: [@]+MAJ:MIN=postnat_from[-postnat_to]
+	 *             or: [@]+ZONE|IFINDEX=postnat_from[-postnat_to]
+	 *             or: [@]+ZONE|0xFWMARK:prenat_addr[/cidr]=postnat...
+	 * optionally followed by: ,id=0xID
+	*/
+	if (*c1 == '@') {
+		warn = false; /* hide redundant deletion warning */
+		++c1;
+		--size;
+	}
+	if (size < 1)
+		return -EINVAL;
+
+
+	switch (*c1) {
+	case '/': /* flush table */
+		natmap_table_flush(ht, false);
+		if (!disable_log)
+			pr_info("Flushing table <%s>\n", ht->name);
+		return 0;
+	case ':': /* clear stats */
+		natmap_table_flush(ht, true);
+		if (!disable_log)
+			pr_info("Clearing stats of table <%s>\n", ht->name);
+		return 0;
+	case '-':
+		if (strcmp(c1, "-hotdrop") == 0) {
+			natmap_mode_set(ht, 0, XT_NATMAP_DROP);
+			if (!disable_log)
+				pr_info("Hotdrop    OFF: <%s>\n", ht->name);
+			return 0;
+		} else if (strcmp(c1, "-persistent") == 0) {
+			natmap_mode_set(ht, 0, XT_NATMAP_PERS);
+			if (!disable_log)
+				pr_info("Persistent OFF: <%s>\n", ht->name);
+			return 0;
+		} else if (strcmp(c1, "-cgnat") == 0) {
+			natmap_mode_set(ht, 0, XT_NATMAP_CGNT);
+			if (!disable_log)
+				pr_info("CG-NAT     OFF: <%s>\n", ht->name);
+			return 0;
+		} else if (strcmp(c1, "-hist") == 0) {
+			natmap_hist_set(ht, false);
+			if (!disable_log)
+				pr_info("Histograms OFF: <%s>\n", ht->name);
+			return 0;
+		} else if (strcmp(c1, "-stat") == 0) {
+			natmap_mode_set(ht, 0, XT_NATMAP_STAT);
+			natmap_table_flush(ht, true);
+			if (!disable_log)
+				pr_info("Statistics OFF: <%s>\n", ht->name);
+			return 0;
+		} else if ((c2 = strchr(c1, '='))) {
+			if ((c2 - 1) == c1) {
+				add = -2;
+				break;
+			}
+		}
+		add = -1;
+		break;
+	case '+':
+		if (strcmp(c1, "+gen") == 0 || strncmp(c1, "+gen=", 5) == 0) {
+			unsigned int gen = 0;
+
+			if ((c1[4] && (sscanf(c1, "+gen=%u", &gen) != 1 || !gen)) ||
+			    natmap_gen_begin(ht, gen)) {
+				pr_err("Generation should be new and not 0, it should be: +gen[=N], (cmd: %s)\n", buf);
+				return -EINVAL;
+			}
+			return 0;
+		} else if (strcmp(c1, "+sweep") == 0) {
+			natmap_sweep(ht);
+			return 0;
+		} else if (strcmp(c1, "+begin") == 0) {
+			int ret = natmap_shadow_begin(ht, 0);
+
+			if (ret == -EBUSY)
+				pr_err("Shadow table is already open, (cmd: %s)\n", buf);
+			else if (!ret && !disable_log)
+				pr_info("Begin table: <%s>\n", ht->name);
+			return ret;
+		} else if (strcmp(c1, "+commit") == 0 ||
+		    strcmp(c1, "+abort") == 0) {
+			int ret = c1[1] == 'c' ? natmap_shadow_commit(ht) :
+			    natmap_shadow_abort(ht);
+
+			if (ret == -ENOENT)
+				pr_err("No shadow table is open, (cmd: %s)\n", buf);
+			return ret;
+		} else if (strcmp(c1, "+hotdrop") == 0) {
+			natmap_mode_set(ht, XT_NATMAP_DROP, 0);
+			if (!disable_log)
+				pr_info("Hotprop     ON: <%s>\n", ht->name);
+			return 0;
+		} else if (strcmp(c1, "+persistent") == 0) {
+			natmap_mode_set(ht, XT_NATMAP_PERS, 0);
+			if (!disable_log)
+				pr_info("Persistent  ON: <%s>\n", ht->name);
+			return 0;
+		} else if (strcmp(c1, "+cgnat") == 0) {
+			if (ht->mode & XT_NATMAP_IPV6) {
+				pr_err("Not supported in IPv6 table, (cmd: %s)\n", buf);
+				return -EOPNOTSUPP;
+			}
+			if (ht->mode & XT_NATMAP_KEY) {
+				pr_err("Not supported with key%s, (cmd: %s)\n",
+				    natmap_key_name(ht->mode) + 6, buf);
+				return -EOPNOTSUPP;
+			}
+			/* no range may be added between check and set */
+			spin_lock(&ht->lock);
+			if (natmap_wdata(ht)->cidr_map[0]) {
+				spin_unlock(&ht->lock);
+				pr_err("Not supported with prenat ranges, (cmd: %s)\n", buf);
+				return -EOPNOTSUPP;
+			}
+			__natmap_mode_set(ht, XT_NATMAP_CGNT, 0);
+			spin_unlock(&ht->lock);
+			if (!disable_log)
+				pr_info("CG-NAT      ON: <%s>\n", ht->name);
+			return 0;
+		} else if (strcmp(c1, "+hist") == 0) {
+			int ret = natmap_hist_set(ht, true);
+
+			if (!ret && !disable_log)
+				pr_info("Histograms  ON: <%s>\n", ht->name);
+			return ret;
+		} else if (strcmp(c1, "+stat") == 0) {
+			natmap_mode_set(ht, XT_NATMAP_STAT, 0);
+			if (!disable_log)
+				pr_info("Statistics  ON: <%s>\n", ht->name);
+			return 0;
+		} else if (strncmp(c1, "+ports=", 7) == 0) {
+			unsigned int min, max;
+			int ret;
+
+			if (sscanf(c1, "+ports=%u-%u", &min, &max) != 2 ||
+			    min > max || max > 65535 ||
+			    (ret = natmap_cgnt_set(ht, min, max - min + 1,
+			    NATMAP_CGNT_KEEP)) == -EINVAL) {
+				pr_err("Invalid port range, it should be: +ports=MIN-MAX, from 1 and a multiple of the block, (cmd: %s)\n", buf);
+				return -EINVAL;
+			}
+			if (ret == -ERANGE)
+				pr_err("CG-NAT port blocks of entries would not fit in it, (cmd: %s)\n", buf);
+			if (ret)
+				return ret;
+			if (!disable_log)
+				pr_info("CG-NAT ports: %u-%u <%s>\n",
+				    min, max, ht->name);
+			return 0;
+		} else if (strncmp(c1, "+block=", 7) == 0) {
+			unsigned int block;
+			int ret;
+
+			if (sscanf(c1, "+block=%u", &block) != 1 ||
+			    block > 65535 ||
+			    (ret = natmap_cgnt_set(ht, NATMAP_CGNT_KEEP,
+			    NATMAP_CGNT_KEEP, block)) == -EINVAL) {
+				pr_err("Invalid port block, it should be: +block=PORTS, dividing the port range, (cmd: %s)\n", buf);
+				return -EINVAL;
+			}
+			if (ret == -ERANGE)
+				pr_err("CG-NAT port blocks of entries would not fit with it, (cmd: %s)\n", buf);
+			if (ret)
+				return ret;
+			if (!disable_log)
+				pr_info("CG-NAT block: %u <%s>\n",
+				    block, ht->name);
+			return 0;
+		}
+		add = 1;
+		break;
+	default:
+		pr_err("Rule should start with '+', '-', or '/', (cmd: %s)\n", buf);
+		return -EINVAL;
+	}
+
+	if (ht->mode & XT_NATMAP_IPV6)
+		return natmap6_parse_rule(ht, c1, add, warn, buf);
+
+	c2 = strchr(c1, '=');
+	if (((add == 1) || (add == -2)) && !c2) {
+		pr_err("This op must contain '=' in the rule, (cmd: %s)\n", buf);
+		return -EINVAL;
+	}
+	++c1;
+	++c2;
+
+	/* Parse prenat, postnat addresses */
+	memset(&postnat, 0, sizeof(postnat));
+	if (add == 1 || add == -2) {
+		end = strchrnul(c2, ',');
+		if (!in4_pton(c2, end - c2, (u8 *)&postnat.from, -1, &c2)) {
+			pr_err("Invalid postnat IPv4 address format, (cmd: %s)\n", buf);
+			return -EINVAL;
+		}
+		if (strchr(c2, '-')) {
+			++c2;
+			if (!in4_pton(c2, end - c2, (u8 *)&postnat.to, -1, NULL)) {
+				pr_err("Invalid postnat IPv4 address format, (cmd: %s)\n", buf);
+				return -EINVAL;
+			}
+			if (postnat.from > postnat.to) {
+				pr_err("Second postnat IPv4 address must be greater than first one, (cmd: %s)\n", buf);
+				return -EINVAL;
+			}
+			if ((ht->mode & XT_NATMAP_2WAY) && (postnat.from != postnat.to)) {
+				pr_err("In 2-way mode Second postnat IPv4 address must be equal to first one, (cmd: %s)\n", buf);
+				return -EINVAL;
+			}
+		} else if (strchr(c2, '/')) {
+			if (sscanf(c2, "/%u", &postnat.cidr) == 1) {
+				if (postnat.cidr < 1 || postnat.cidr > 32) {
+					pr_err("Prefix must be in range - 1..32, (cmd: %s)\n", buf);
+					return -EINVAL;
+				}
+				if ((ht->mode & XT_NATMAP_2WAY) && (postnat.cidr != 32)) {
+					pr_err("In 2-way mode only /32 CIDR is acceptable, (cmd: %s)\n", buf);
+					return -EINVAL;
+				}
+				postnat.from &= cidr2mask[postnat.cidr];
+				postnat.to = postnat.from ^ ~cidr2mask[postnat.cidr];
+			} else {
+				pr_err("Wrong CIDR format, (cmd: %s)\n", buf);
+				return -EINVAL;
+			}
+		} else {
+			postnat.to = postnat.from;
+			postnat.cidr = 32;
+		}
+
+		if (*end && (add != 1 || sscanf(end, ",id=0x%x", &id) != 1)) {
+			pr_err("Invalid entry option, it should be: ,id=0xID, (cmd: %s)\n", buf);
+			return -EINVAL;
+		}
+	}
+
+	/* these are free and deleted keys of two-way map */
+	if (add == 1 && (ht->mode & XT_NATMAP_2WAY) &&
+	    (postnat.from == NATMAP_RMAP_FREE ||
+	     postnat.from == NATMAP_RMAP_DELETED)) {
+		pr_err("In 2-way mode postnat IPv4 address can't be %pI4, (cmd: %s)\n",
+		    &postnat.from, buf);
+		return -EINVAL;
+	}
+
+	prenat.addr = 0;
+	prenat.cidr = 32;
+	if (add == -2) {
+		if (!disable_log) {
+			if (postnat.cidr)
+				pr_info("Del all entries where postnat = %pI4/%u\n",
+				    &postnat.from, postnat.cidr);
+			else
+				pr_info("Del all entries where postnat = %pI4-%pI4\n",
+				    &postnat.from, &postnat.to);
+		}
+		natmap_post_flush(ht, &postnat);
+		return 0;
+	} else if (ht->mode & XT_NATMAP_ADDR) {
+		if (natmap_tagged(ht->mode)) {
+			c2 = natmap_parse_num(c1, ht->mode, &tag);
+			if (!c2 || *c2 != ':') {
+				pr_err("Invalid key format, it should be: %s:IP[/CIDR], (cmd: %s)\n",
+				    natmap_key_dec(ht->mode) ? "ZONE" : "0xMARK", buf);
+				return -EINVAL;
+			}
+			c1 += c2 + 1 - c1;
+		}
+		if (!in4_pton(c1, strlen(c1), (u8 *)&prenat.addr, -1, &c2)) {
+			pr_err("Invalid prenat IPv4 address format, (cmd: %s)\n", buf);
+			return -EINVAL;
+		}
+
+		if (*c2 == '-') {
+			if (natmap_tagged(ht->mode) ||
+			    (ht->mode & (XT_NATMAP_2WAY | XT_NATMAP_CGNT))) {
+				pr_err("Prenat range is not supported with cg-nat, 2-way or composite key, (cmd: %s)\n", buf);
+				return -EOPNOTSUPP;
+			}
+			if (!in4_pton(c2 + 1, strlen(c2 + 1), (u8 *)&last, -1,
+			    NULL) || ntohl(last) < ntohl(prenat.addr)) {
+				pr_err("Invalid prenat range, it should be: FIRST-LAST, (cmd: %s)\n", buf);
+				return -EINVAL;
+			}
+			prenat.cidr = 0;
+		} else if (sscanf(c2, "/%u", &prenat.cidr) == 1) {
+			if (prenat.cidr < 1 || prenat.cidr > 32) {
+				pr_err("Prefix must be in range - 1..32, (cmd: %s)\n", buf);
+				return -EINVAL;
+			}
+			if ((ht->mode & XT_NATMAP_2WAY) && (prenat.cidr != 32)) {
+				pr_err("In 2-way mode only /32 CIDR is acceptable, (cmd: %s)\n", buf);
+				return -EINVAL;
+			}
+			prenat.addr &= cidr2mask[prenat.cidr];
+		}
+	} else if (ht->mode & XT_NATMAP_MARK) {
+		if (!natmap_parse_num(c1, ht->mode, &prenat.addr)) {
+			if (natmap_key_dec(ht->mode))
+				pr_err("Invalid key format, it should be: NUMBER, (cmd: %s)\n", buf);
+			else
+				pr_err("Invalid skb mark format, it should be: 0xMARK, (cmd: %s)\n", buf);
+			return -EINVAL;
+		}
+	} else if (ht->mode & XT_NATMAP_PRIO) {
+		unsigned maj, min;
+
+		if (sscanf(c1, "%x:%x", &maj, &min) != 2) {
+			pr_err("Invalid skb prio format, it should be: MAJ:MIN, (cmd: %s)\n", buf);
+			return -EINVAL;
+		}
+		prenat.addr = TC_H_MAKE(maj<<16, min);
+	}
+
+	rule.prenat = prenat;
+	rule.postnat = postnat;
+	rule.id = id;
+	rule.tag = tag;
+	rule.prenat_last = last;
+
+	return natmap_rule_apply(ht, &rule, add, warn, buf);
+}
+
+#define NATMAP_LINE_MAX		256	/* any line, with comment and '\0' */
+#define NATMAP_WRITE_CHUNK	(1 << 20)
+
+/* append to unterminated line carried between writes */
+static void
+natmap_proc_carry(struct natmap_proc *np, const char *p, size_t len)
+	/* under np->lock */
+{
+	if (np->line_skip)
+		return;
+	if (!np->line)
+		np->line = kmalloc(NATMAP_LINE_MAX, GFP_KERNEL);
+	if (!np->line || np->line_len + len >= NATMAP_LINE_MAX) {
+		pr_err("Rule is too long, <%s>\n", np->ht->name);
+		np->line_skip = true;
+		np->line_len = 0;
+		return;
+	}
+	memcpy(np->line + np->line_len, p, len);
+	np->line_len += len;
+	np->line[np->line_len] = '\0';
+}
+
+/* line over NATMAP_LINE_MAX, counted as a failed rule */
+static void
+natmap_proc_skip(struct natmap_proc *np)
+	/* under np->lock */
+{
+	np->rules++;
+	np->wrules++;
+	np->failed++;
+	np->wfailed++;
+}
+
+/* one '\0' terminated line, returns error of query only */
+static int
+natmap_proc_line(struct natmap_proc *np, char *str)
+	/* under np->lock */
+{
+	while (*str == ' ')
+		++str;
+
+	/* strip line after first space */
+	str = strsep(&str, " ");
+
+	if (*str == '?')
+		return natmap_query(np, str);
+	if (*str == '#' || *str == '\0')
+		return 0;
+
+	np->rules++;
+	np->wrules++;
+	if (parse_rule(np->ht, str, strlen(str))) {
+		np->failed++;
+		np->wfailed++;
+	}
+	return 0;
+}
+
+/* lines may span writes, bad rules and lines too long are counted and
+ * skipped, the write only fails if all rules in it failed, so `echo`
+ * still sees errors; a failed query ends it short, before its line */
+static ssize_t
+natmap_proc_write(struct file *file, const char __user *input,
+size_t size, loff_t *loff)
+{
+	struct natmap_proc *np = ((struct seq_file *)file->private_data)->private;
+	size_t done = 0;
+	char *buf;
+	int ret = 0;
+
+	if (!size || !input)
+		return 0;
+	buf = kvmalloc(min_t(size_t, size, NATMAP_WRITE_CHUNK), GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	mutex_lock(&np->lock);
+	np->wrules = np->wfailed = 0;
+	while (done < size) {
+		const size_t n = min_t(size_t, size - done, NATMAP_WRITE_CHUNK);
+		char *p = buf;
+
+		if (copy_from_user(buf, input + done, n)) {
+			ret = -EFAULT;
+			break;
+		}
+		while (p < buf + n) {
+			char *nl = memchr(p, '\n', buf + n - p);
+
+			if (!nl) {
+				natmap_proc_carry(np, p, buf + n - p);
+				done += buf + n - p;
+				break;
+			}
+			*nl = '\0';
+			if (np->line_len || np->line_skip) {
+				natmap_proc_carry(np, p, nl - p);
+				if (np->line_skip)
+					natmap_proc_skip(np);
+				else
+					ret = natmap_proc_line(np, np->line);
+				np->line_len = 0;
+				np->line_skip = false;
+			} else if (nl - p >= NATMAP_LINE_MAX) {
+				pr_err("Rule is too long, <%s>\n", np->ht->name);
+				natmap_proc_skip(np);
+			} else
+				ret = natmap_proc_line(np, p);
+			if (ret)
+				break;
+			/* accepted up to and with this line */
+			done += nl + 1 - p;
+			p = nl + 1;
+			cond_resched();
+		}
+		if (ret)
+			break;
+	}
+	if (!ret && np->wrules && np->wfailed == np->wrules)
+		ret = -EINVAL;
+	mutex_unlock(&np->lock);
+	kvfree(buf);
+
+	/* short write up to the failed query */
+	if (ret && (ret == -EINVAL || !done))
+		return ret;
+	*loff += done;
+	return done;
+}
+
+#if  LINUX_VERSION_CODE < KERNEL_VERSION(5,6,0)
+#define PROC_OPS(s,o,r,w,l,d) static const struct file_operations s = { \
+        .open           = o, \
+        .read           = r, \
+        .write          = w, \
+        .llseek         = l, \
+        .release        = d \
+}
+#else
+#define PROC_OPS(s,o,r,w,l,d) static const struct proc_ops s = { \
+        .proc_open      = o , \
+        .proc_read      = r , \
+        .proc_write     = w , \
+        .proc_release   = d \
+}
+#endif
+PROC_OPS(natmap_fops, natmap_proc_open, natmap_proc_read, natmap_proc_write, seq_lseek, natmap_proc_release);
+
+/* /proc/net/stat/ipt_NATMAP/<table>: rows of ns from, counts */
+static int
+natmap_hist_show(struct seq_file *s, void *v)
+{
+	const struct xt_natmap_htable *ht = s->private;
+	const struct natmap_hist __percpu *hist = READ_ONCE(ht->hist);
+	u64 sum[NATMAP_HIST_MAX];
+	unsigned int i, w;
+	int cpu;
+
+	seq_printf(s, "# name: %s; histograms: %s\n", ht->name,
+	    READ_ONCE(ht->hist_on) ? "on" : "off");
+	seq_printf(s, "# %10s %12s %12s\n", "ns", "lookup", "nat setup");
+	if (!hist)
+		return 0;
+	for (i = 0; i < NATMAP_HIST_SLOTS; i++) {
+		memset(sum, 0, sizeof(sum));
+		for_each_possible_cpu(cpu)
+			for (w = 0; w < NATMAP_HIST_MAX; w++)
+				sum[w] += READ_ONCE(per_cpu_ptr(hist,
+				    cpu)->slot[w][i]);
+		if (sum[NATMAP_HIST_LOOKUP] || sum[NATMAP_HIST_NAT])
+			seq_printf(s, "%12llu %12llu %12llu\n",
+			    i ? 1ULL << i : 0ULL, sum[NATMAP_HIST_LOOKUP],
+			    sum[NATMAP_HIST_NAT]);
+	}
+
+	return 0;
+}
+
+static int
+natmap_hist_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, natmap_hist_show, PDE_DATA(inode));
+}
+
+PROC_OPS(natmap_hist_fops, natmap_hist_open, seq_read, NULL, seq_lseek, single_release);
+
+/* generic netlink control plane, bulk counterpart of the proc file */
+static struct genl_family natmap_genl_family;
+
+#define NATMAP_DUMP_BATCH	256	/* entries per dump message */
+
+static const struct nla_policy natmap_genl_policy[NATMAP_ATTR_MAX + 1] = {
+	[NATMAP_ATTR_TABLE]	= { .type = NLA_NUL_STRING,
+				    .len = XT_NATMAP_NAME_LEN - 1 },
+	[NATMAP_ATTR_FLAGS]	= { .type = NLA_U32 },
+	[NATMAP_ATTR_ENTRIES]	= { .type = NLA_NESTED },
+	[NATMAP_ATTR_ENTRY]	= { .type = NLA_NESTED },
+	[NATMAP_ATTR_MODE]	= { .type = NLA_U32 },
+	[NATMAP_ATTR_GEN]	= { .type = NLA_U32 },
+	[NATMAP_ATTR_SNAP_HDR]	= { .type = NLA_BINARY,
+				    .len = sizeof(struct natmap_snap_hdr) },
+	[NATMAP_ATTR_SNAP_RECS]	= { .type = NLA_BINARY },
+	[NATMAP_ATTR_SHADOW]	= { .type = NLA_U64 },
+};
+
+static const struct nla_policy natmap_entry_policy[NATMAP_ENTRY_MAX + 1] = {
+	[NATMAP_ENTRY_PRENAT]		= { .type = NLA_U32 },
+	[NATMAP_ENTRY_PRENAT_CIDR]	= { .type = NLA_U8 },
+	[NATMAP_ENTRY_POSTNAT_FROM]	= { .type = NLA_U32 },
+	[NATMAP_ENTRY_POSTNAT_TO]	= { .type = NLA_U32 },
+	[NATMAP_ENTRY_POSTNAT_CIDR]	= { .type = NLA_U8 },
+	[NATMAP_ENTRY_ID]		= { .type = NLA_U32 },
+	[NATMAP_ENTRY_PKTS]		= { .type = NLA_U64 },
+	[NATMAP_ENTRY_BYTES]		= { .type = NLA_U64 },
+	[NATMAP_ENTRY_PRENAT6]		= { .type = NLA_BINARY,
+					    .len = sizeof(struct in6_addr) },
+	[NATMAP_ENTRY_POSTNAT6]		= { .type = NLA_BINARY,
+					    .len = sizeof(struct in6_addr) },
+	[NATMAP_ENTRY_TAG]		= { .type = NLA_U32 },
+	[NATMAP_ENTRY_PRENAT_LAST]	= { .type = NLA_U32 },
+};
+
+static struct xt_natmap_htable *
+natmap_genl_table(struct net *net, struct nlattr **attrs,
+struct netlink_ext_ack *extack)
+	/* under natmap_mutex */
+{
+	struct natmap_net *natmap_net = natmap_pernet(net);
+	struct xt_natmap_htable *ht;
+
+	if (!attrs[NATMAP_ATTR_TABLE]) {
+		NL_SET_ERR_MSG(extack, "Table name is required");
+		return NULL;
+	}
+	hlist_for_each_entry(ht, &natmap_net->htables, node)
+		if (!nla_strcmp(attrs[NATMAP_ATTR_TABLE], ht->name))
+			return ht;
+	NL_SET_ERR_MSG(extack, "No such table");
+	return NULL;
+}
+
+static bool
+natmap_nla_in6(const struct nlattr *nla)
+{
+	return nla && nla_len(nla) == sizeof(struct in6_addr);
+}
+
+/* natmap_genl_rule() of IPv6 tables, prefixes of PRENAT_CIDR length */
+static int
+natmap6_genl_rule(struct nlattr **tb, const struct nlattr *nla, const int op,
+struct natmap_rule *rule, struct netlink_ext_ack *extack)
+{
+	rule->prenat.cidr = 128;
+	if (!natmap_nla_in6(tb[NATMAP_ENTRY_PRENAT6])) {
+		NL_SET_ERR_MSG_ATTR(extack, nla, "Entry without IPv6 prenat");
 		return -EINVAL;
+	}
+	if (tb[NATMAP_ENTRY_PRENAT_CIDR]) {
+		u8 plen = nla_get_u8(tb[NATMAP_ENTRY_PRENAT_CIDR]);
 
+		if (plen < 1 || plen > 128) {
+			NL_SET_ERR_MSG_ATTR(extack, tb[NATMAP_ENTRY_PRENAT_CIDR],
+			    "Invalid prenat prefix");
+			return -EINVAL;
+		}
+		rule->prenat.cidr = plen;
+	}
+	ipv6_addr_prefix(&rule->prenat6, nla_data(tb[NATMAP_ENTRY_PRENAT6]),
+	    rule->prenat.cidr);
 
-	switch (*c1) {
-	case '/': /* flush table */
-		natmap_table_flush(ht, false);
-		if (!disable_log)
-			pr_info("Flushing table <%s>\n", ht->name);
+	if (tb[NATMAP_ENTRY_ID]) {
+		if (op != 1) {
+			NL_SET_ERR_MSG_ATTR(extack, tb[NATMAP_ENTRY_ID],
+			    "Id is only allowed on add");
+			return -EINVAL;
+		}
+		rule->id = nla_get_u32(tb[NATMAP_ENTRY_ID]);
+	}
+
+	if (op != 1)
 		return 0;
-	case ':': /* clear stats */
-		natmap_table_flush(ht, true);
-		if (!disable_log)
-			pr_info("Clearing stats of table <%s>\n", ht->name);
+	if (!natmap_nla_in6(tb[NATMAP_ENTRY_POSTNAT6])) {
+		NL_SET_ERR_MSG_ATTR(extack, nla, "Entry without IPv6 postnat");
+		return -EINVAL;
+	}
+	ipv6_addr_prefix(&rule->postnat6, nla_data(tb[NATMAP_ENTRY_POSTNAT6]),
+	    rule->prenat.cidr);
+	return 0;
+}
+
+/* same checks as parse_rule(), op is 1 (add), -1 (del), 0 (get),
+ * del without prenat turns into -2 (del by postnat) */
+static int
+natmap_genl_rule(const struct xt_natmap_htable *ht, const struct nlattr *nla,
+int *op, struct natmap_rule *rule, struct netlink_ext_ack *extack)
+{
+	struct nlattr *tb[NATMAP_ENTRY_MAX + 1];
+	struct post_ip *postnat = &rule->postnat;
+	int err;
+
+	err = nla_parse_nested(tb, NATMAP_ENTRY_MAX, nla, natmap_entry_policy,
+	    extack);
+	if (err)
+		return err;
+
+	memset(rule, 0, sizeof(*rule));
+	if (ht->mode & XT_NATMAP_IPV6)
+		return natmap6_genl_rule(tb, nla, *op, rule, extack);
+	rule->prenat.cidr = 32;
+	if (tb[NATMAP_ENTRY_PRENAT])
+		rule->prenat.addr = nla_get_u32(tb[NATMAP_ENTRY_PRENAT]);
+	else if (*op == -1)
+		*op = -2;
+	else {
+		NL_SET_ERR_MSG_ATTR(extack, nla, "Entry without prenat");
+		return -EINVAL;
+	}
+	if (natmap_tagged(ht->mode) && *op != -2) {
+		if (!tb[NATMAP_ENTRY_TAG]) {
+			NL_SET_ERR_MSG_ATTR(extack, nla, "Entry without tag");
+			return -EINVAL;
+		}
+		rule->tag = nla_get_u32(tb[NATMAP_ENTRY_TAG]);
+	}
+
+	if (tb[NATMAP_ENTRY_PRENAT_CIDR]) {
+		u8 cidr = nla_get_u8(tb[NATMAP_ENTRY_PRENAT_CIDR]);
+
+		if (!(ht->mode & XT_NATMAP_ADDR) || cidr < 1 || cidr > 32 ||
+		    ((ht->mode & XT_NATMAP_2WAY) && cidr != 32)) {
+			NL_SET_ERR_MSG_ATTR(extack, tb[NATMAP_ENTRY_PRENAT_CIDR],
+			    "Invalid prenat prefix");
+			return -EINVAL;
+		}
+		rule->prenat.cidr = cidr;
+		rule->prenat.addr &= cidr2mask[cidr];
+	}
+	if (tb[NATMAP_ENTRY_PRENAT_LAST] && *op != -2) {
+		rule->prenat_last = nla_get_in_addr(tb[NATMAP_ENTRY_PRENAT_LAST]);
+		if (!(ht->mode & XT_NATMAP_ADDR) || natmap_tagged(ht->mode) ||
+		    (ht->mode & (XT_NATMAP_2WAY | XT_NATMAP_CGNT)) ||
+		    tb[NATMAP_ENTRY_PRENAT_CIDR] ||
+		    ntohl(rule->prenat_last) < ntohl(rule->prenat.addr)) {
+			NL_SET_ERR_MSG_ATTR(extack,
+			    tb[NATMAP_ENTRY_PRENAT_LAST], "Invalid prenat range");
+			return -EINVAL;
+		}
+		rule->prenat.cidr = 0;
+	}
+
+	if (tb[NATMAP_ENTRY_ID]) {
+		if (*op != 1) {
+			NL_SET_ERR_MSG_ATTR(extack, tb[NATMAP_ENTRY_ID],
+			    "Id is only allowed on add");
+			return -EINVAL;
+		}
+		rule->id = nla_get_u32(tb[NATMAP_ENTRY_ID]);
+	}
+
+	if (*op != 1 && *op != -2)
 		return 0;
-	case '-':
-		if (strcmp(c1, "-hotdrop") == 0) {
-			ht->mode &= ~XT_NATMAP_DROP;
-			if (!disable_log)
-				pr_info("Hotdrop    OFF: <%s>\n", ht->name);
-			return 0;
-		} else if (strcmp(c1, "-persistent") == 0) {
-			ht->mode &= ~XT_NATMAP_PERS;
-			if (!disable_log)
-				pr_info("Persistent OFF: <%s>\n", ht->name);
-			return 0;
-		} else if (strcmp(c1, "-cgnat") == 0) {
-			ht->mode &= ~XT_NATMAP_CGNT;
-			if (!disable_log)
-				pr_info("CG-NAT     OFF: <%s>\n", ht->name);
-			return 0;
-		} else if (strcmp(c1, "-stat") == 0) {
-			ht->mode &= ~XT_NATMAP_STAT;
-			natmap_table_flush(ht, true);
-			if (!disable_log)
-				pr_info("Statistics OFF: <%s>\n", ht->name);
-			return 0;
-		} else if ((c2 = strchr(c1, '='))) {
-			if ((c2 - 1) == c1) {
-				add = -2;
-				break;
-			}
+
+	if (!tb[NATMAP_ENTRY_POSTNAT_FROM]) {
+		NL_SET_ERR_MSG_ATTR(extack, nla, "Entry without postnat");
+		return -EINVAL;
+	}
+	postnat->from = nla_get_in_addr(tb[NATMAP_ENTRY_POSTNAT_FROM]);
+	if (tb[NATMAP_ENTRY_POSTNAT_CIDR])
+		postnat->cidr = nla_get_u8(tb[NATMAP_ENTRY_POSTNAT_CIDR]);
+	else if (!tb[NATMAP_ENTRY_POSTNAT_TO])
+		postnat->cidr = 32;
+
+	if (postnat->cidr) {
+		if (postnat->cidr > 32 ||
+		    ((ht->mode & XT_NATMAP_2WAY) && postnat->cidr != 32)) {
+			NL_SET_ERR_MSG_ATTR(extack, nla, "Invalid postnat prefix");
+			return -EINVAL;
 		}
-		add = -1;
-		break;
-	case '+':
-		if (strcmp(c1, "+hotdrop") == 0) {
-			ht->mode |= XT_NATMAP_DROP;
-			if (!disable_log)
-				pr_info("Hotprop     ON: <%s>\n", ht->name);
-			return 0;
-		} else if (strcmp(c1, "+persistent") == 0) {
-			ht->mode |= XT_NATMAP_PERS;
-			if (!disable_log)
-				pr_info("Persistent  ON: <%s>\n", ht->name);
-			return 0;
-		} else if (strcmp(c1, "+cgnat") == 0) {
-			ht->mode |= XT_NATMAP_CGNT;
-			if (!disable_log)
-				pr_info("CG-NAT      ON: <%s>\n", ht->name);
-			return 0;
-		} else if (strcmp(c1, "+stat") == 0) {
-			ht->mode |= XT_NATMAP_STAT;
-			if (!disable_log)
-				pr_info("Statistics  ON: <%s>\n", ht->name);
-			return 0;
+		postnat->from &= cidr2mask[postnat->cidr];
+		postnat->to = postnat->from ^ ~cidr2mask[postnat->cidr];
+	} else {
+		postnat->to = nla_get_in_addr(tb[NATMAP_ENTRY_POSTNAT_TO]);
+		if (postnat->from > postnat->to ||
+		    ((ht->mode & XT_NATMAP_2WAY) &&
+		     postnat->from != postnat->to)) {
+			NL_SET_ERR_MSG_ATTR(extack, nla, "Invalid postnat range");
+			return -EINVAL;
 		}
-		add = 1;
-		break;
-	default:
-		pr_err("Rule should start with '+', '-', or '/', (cmd: %s)\n", buf);
+	}
+
+	/* these are free and deleted keys of two-way map */
+	if (*op == 1 && (ht->mode & XT_NATMAP_2WAY) &&
+	    (postnat->from == NATMAP_RMAP_FREE ||
+	     postnat->from == NATMAP_RMAP_DELETED)) {
+		NL_SET_ERR_MSG_ATTR(extack, nla, "Reserved two-way postnat");
 		return -EINVAL;
 	}
+	return 0;
+}
 
-	c2 = strchr(c1, '=');
-	if (((add == 1) || (add == -2)) && !c2) {
-		pr_err("This op must contain '=' in the rule, (cmd: %s)\n", buf);
+static int
+natmap_genl_fill(struct sk_buff *skb, const struct xt_natmap_htable *ht,
+const struct natmap_pre *pre)
+	/* under rcu_read_lock */
+{
+	struct natmap_stat stat;
+	struct nlattr *nest;
+
+	nest = nla_nest_start(skb, NATMAP_ATTR_ENTRY);
+	if (!nest)
+		return -EMSGSIZE;
+	if (pre->act == NATMAP_ACT_PFX6) {
+		if (nla_put_in6_addr(skb, NATMAP_ENTRY_PRENAT6,
+		    &natmap6(pre)->prenat) ||
+		    nla_put_u8(skb, NATMAP_ENTRY_PRENAT_CIDR, natmap6(pre)->plen) ||
+		    nla_put_in6_addr(skb, NATMAP_ENTRY_POSTNAT6,
+		    &natmap6(pre)->postnat))
+			goto nla_put_failure;
+	} else if (nla_put_u32(skb, NATMAP_ENTRY_PRENAT, pre->prenat.addr) ||
+	    nla_put_u8(skb, NATMAP_ENTRY_PRENAT_CIDR, pre->prenat.cidr) ||
+	    nla_put_in_addr(skb, NATMAP_ENTRY_POSTNAT_FROM, pre->postnat.from) ||
+	    nla_put_in_addr(skb, NATMAP_ENTRY_POSTNAT_TO, pre->postnat.to) ||
+	    nla_put_u8(skb, NATMAP_ENTRY_POSTNAT_CIDR, pre->postnat.cidr))
+		goto nla_put_failure;
+	if (natmap_tagged(ht->mode) &&
+	    nla_put_u32(skb, NATMAP_ENTRY_TAG, pre->tag))
+		goto nla_put_failure;
+	if (!pre->prenat.cidr && nla_put_in_addr(skb, NATMAP_ENTRY_PRENAT_LAST,
+	    natmap_range(pre)->last))
+		goto nla_put_failure;
+	if (pre->id && nla_put_u32(skb, NATMAP_ENTRY_ID, pre->id))
+		goto nla_put_failure;
+	if (ht->mode & XT_NATMAP_STAT) {
+		natmap_stat_fold(pre, &stat);
+		if (nla_put_u64_64bit(skb, NATMAP_ENTRY_PKTS, stat.pkts,
+		    NATMAP_ENTRY_PAD) ||
+		    nla_put_u64_64bit(skb, NATMAP_ENTRY_BYTES, stat.bytes,
+		    NATMAP_ENTRY_PAD))
+			goto nla_put_failure;
+	}
+	nla_nest_end(skb, nest);
+	return 0;
+
+nla_put_failure:
+	nla_nest_cancel(skb, nest);
+	return -EMSGSIZE;
+}
+
+/* NATMAP_CMD_ADD, NATMAP_CMD_DEL: apply entries in order, stop at the
+ * first failing one, earlier ones stay applied */
+static int
+natmap_genl_entries(struct sk_buff *skb, struct genl_info *info)
+{
+	const int add = info->genlhdr->cmd == NATMAP_CMD_ADD ? 1 : -1;
+	struct xt_natmap_htable *ht;
+	struct natmap_rule rule;
+	struct nlattr *nla;
+	unsigned int n = 0;
+	u32 flags = 0;
+	int rem, err = 0;
+
+	if (!info->attrs[NATMAP_ATTR_ENTRIES]) {
+		NL_SET_ERR_MSG(info->extack, "No entries");
 		return -EINVAL;
 	}
-	++c1;
-	++c2;
+	if (info->attrs[NATMAP_ATTR_FLAGS])
+		flags = nla_get_u32(info->attrs[NATMAP_ATTR_FLAGS]);
 
-	/* Parse prenat, postnat addresses */
-	memset(&postnat, 0, sizeof(postnat));
-	if (add == 1 || add == -2) {
-		if (!in4_pton(c2, strlen(c2), (u8 *)&postnat.from, -1, &c2)) {
-			pr_err("Invalid postnat IPv4 address format, (cmd: %s)\n", buf);
-			return -EINVAL;
+	mutex_lock(&natmap_mutex);
+	ht = natmap_genl_table(genl_info_net(info), info->attrs, info->extack);
+	if (!ht) {
+		err = -ENOENT;
+		goto out;
+	}
+	nla_for_each_nested(nla, info->attrs[NATMAP_ATTR_ENTRIES], rem) {
+		int op = add;
+
+		if (nla_type(nla) != NATMAP_ATTR_ENTRY)
+			continue;
+		err = natmap_genl_rule(ht, nla, &op, &rule, info->extack);
+		if (err)
+			break;
+		if (op == -2)
+			__natmap_post_flush(ht, &rule.postnat);
+		else
+			err = natmap_rule_apply(ht, &rule, op,
+			    !(flags & NATMAP_F_UPDATE), NULL);
+		if (err) {
+			NL_SET_ERR_MSG_ATTR(info->extack, nla,
+			    err == -EEXIST ? "Entry already exists" :
+			    err == -ENOENT ? "No such entry" :
+			    err == -ERANGE ? "CG-NAT port blocks don't fit" :
+			    err == -E2BIG ? "Too many IPv6 prefix lengths" :
+			    "Entry failed");
+			break;
 		}
-		if (strchr(c2, '-')) {
-			++c2;
-			if (!in4_pton(c2, strlen(c2), (u8 *)&postnat.to, -1, NULL)) {
-				pr_err("Invalid postnat IPv4 address format, (cmd: %s)\n", buf);
-				return -EINVAL;
-			}
-			if (postnat.from > postnat.to) {
-				pr_err("Second postnat IPv4 address must be greater than first one, (cmd: %s)\n", buf);
-				return -EINVAL;
-			}
-			if ((ht->mode & XT_NATMAP_2WAY) && (postnat.from != postnat.to)) {
-				pr_err("In 2-way mode Second postnat IPv4 address must be equal to first one, (cmd: %s)\n", buf);
-				return -EINVAL;
-			}
-		} else if (strchr(c2, '/')) {
-			if (sscanf(c2, "/%u", &postnat.cidr) == 1) {
-				if (postnat.cidr < 1 || postnat.cidr > 32) {
-					pr_err("Prefix must be in range - 1..32, (cmd: %s)\n", buf);
-					return -EINVAL;
-				}
-				if ((ht->mode & XT_NATMAP_2WAY) && (postnat.cidr != 32)) {
-					pr_err("In 2-way mode only /32 CIDR is acceptable, (cmd: %s)\n", buf);
-					return -EINVAL;
-				}
-				postnat.from &= cidr2mask[postnat.cidr];
-				postnat.to = postnat.from ^ ~cidr2mask[postnat.cidr];
-			} else {
-				pr_err("Wrong CIDR format, (cmd: %s)\n", buf);
-				return -EINVAL;
-			}
-		} else {
-			postnat.to = postnat.from;
-			postnat.cidr = 32;
+		n++;
+		cond_resched();
+	}
+	if (!disable_log && n)
+		pr_info("%s %u entries via netlink, <%s>\n",
+		    (add == 1) ? "Add" : "Del", n, ht->name);
+out:
+	mutex_unlock(&natmap_mutex);
+	return err;
+}
+
+/* postnat address of a reverse GET, prenat is not needed */
+static int
+natmap_genl_rkey(const struct xt_natmap_htable *ht, const struct nlattr *nla,
+__be32 *post_ip, struct in6_addr *post6, struct netlink_ext_ack *extack)
+{
+	struct nlattr *tb[NATMAP_ENTRY_MAX + 1];
+	int err;
+
+	if (!(ht->mode & XT_NATMAP_2WAY)) {
+		NL_SET_ERR_MSG(extack, "Reverse lookup needs two-way table");
+		return -EOPNOTSUPP;
+	}
+	err = nla_parse_nested(tb, NATMAP_ENTRY_MAX, nla, natmap_entry_policy,
+	    extack);
+	if (err)
+		return err;
+	if (ht->mode & XT_NATMAP_IPV6) {
+		if (!natmap_nla_in6(tb[NATMAP_ENTRY_POSTNAT6])) {
+			NL_SET_ERR_MSG_ATTR(extack, nla,
+			    "Entry without IPv6 postnat");
+			return -EINVAL;
 		}
+		memcpy(post6, nla_data(tb[NATMAP_ENTRY_POSTNAT6]),
+		    sizeof(*post6));
+		return 0;
+	}
+	if (!tb[NATMAP_ENTRY_POSTNAT_FROM]) {
+		NL_SET_ERR_MSG_ATTR(extack, nla, "Entry without postnat");
+		return -EINVAL;
+	}
+	*post_ip = nla_get_in_addr(tb[NATMAP_ENTRY_POSTNAT_FROM]);
+	return 0;
+}
+
+/* exact prenat, NATMAP_F_LOOKUP picks the entry as the packet path
+ * does, NATMAP_F_REVERSE the one postnat maps back to */
+static int
+natmap_genl_get(struct sk_buff *skb, struct genl_info *info)
+{
+	struct xt_natmap_htable *ht;
+	const struct natmap_data *d;
+	const struct natmap_pre *pre;
+	struct natmap_rule rule;
+	struct sk_buff *msg;
+	struct in6_addr post6;
+	__be32 post_ip, prenat_ip;
+	u32 flags = 0;
+	int op = 0;
+	void *hdr;
+	int err;
+
+	if (!info->attrs[NATMAP_ATTR_ENTRY]) {
+		NL_SET_ERR_MSG(info->extack, "No entry");
+		return -EINVAL;
+	}
+	if (info->attrs[NATMAP_ATTR_FLAGS])
+		flags = nla_get_u32(info->attrs[NATMAP_ATTR_FLAGS]);
+	msg = nlmsg_new(NLMSG_DEFAULT_SIZE, GFP_KERNEL);
+	if (!msg)
+		return -ENOMEM;
+
+	mutex_lock(&natmap_mutex);
+	ht = natmap_genl_table(genl_info_net(info), info->attrs, info->extack);
+	if (!ht) {
+		err = -ENOENT;
+		goto free_msg;
+	}
+	if (flags & NATMAP_F_REVERSE)
+		err = natmap_genl_rkey(ht, info->attrs[NATMAP_ATTR_ENTRY],
+		    &post_ip, &post6, info->extack);
+	else
+		err = natmap_genl_rule(ht, info->attrs[NATMAP_ATTR_ENTRY], &op,
+		    &rule, info->extack);
+	if (err)
+		goto free_msg;
+
+	hdr = genlmsg_put_reply(msg, info, &natmap_genl_family, 0,
+	    NATMAP_CMD_GET);
+	if (!hdr) {
+		err = -EMSGSIZE;
+		goto free_msg;
+	}
+	rcu_read_lock();
+	d = rcu_dereference(ht->data);
+	if ((ht->mode & XT_NATMAP_IPV6) && (flags & NATMAP_F_REVERSE))
+		pre = natmap6_lookup(ht, d, &post6, true);
+	else if (ht->mode & XT_NATMAP_IPV6)
+		pre = (flags & NATMAP_F_LOOKUP) ?
+		    natmap6_lookup(ht, d, &rule.prenat6, false) :
+		    natmap6_pre_find(ht, d, &rule.prenat6, rule.prenat.cidr);
+	else if (flags & NATMAP_F_REVERSE)
+		pre = natmap_pre_rfind(d, post_ip, &prenat_ip);
+	else if ((flags & NATMAP_F_LOOKUP) && natmap_tagged(ht->mode))
+		pre = natmap_pre_tlookup(ht, d, rule.tag, rule.prenat.addr);
+	else if (flags & NATMAP_F_LOOKUP)
+		pre = natmap_pre_lookup(ht, d, rule.prenat.addr);
+	else
+		pre = natmap_pre_find(ht, d, rule.tag, rule.prenat.addr,
+		    rule.prenat.cidr);
+	if (!pre) {
+		err = -ENOENT;
+		NL_SET_ERR_MSG(info->extack, "No such entry");
+	} else if (nla_put_string(msg, NATMAP_ATTR_TABLE, ht->name) ||
+	    nla_put_u32(msg, NATMAP_ATTR_MODE, ht->mode) ||
+	    natmap_genl_fill(msg, ht, pre))
+		err = -EMSGSIZE;
+	rcu_read_unlock();
+	if (err)
+		goto free_msg;
+	mutex_unlock(&natmap_mutex);
+
+	genlmsg_end(msg, hdr);
+	return genlmsg_reply(msg, info);
+
+free_msg:
+	mutex_unlock(&natmap_mutex);
+	nlmsg_free(msg);
+	return err;
+}
+
+/* NATMAP_F_STAT only clears counters, like ':' in proc */
+static int
+natmap_genl_flush(struct sk_buff *skb, struct genl_info *info)
+{
+	struct xt_natmap_htable *ht;
+	bool stat = false;
+
+	if (info->attrs[NATMAP_ATTR_FLAGS])
+		stat = nla_get_u32(info->attrs[NATMAP_ATTR_FLAGS]) &
+		    NATMAP_F_STAT;
+
+	mutex_lock(&natmap_mutex);
+	ht = natmap_genl_table(genl_info_net(info), info->attrs, info->extack);
+	if (ht) {
+		htable_cleanup(ht, stat);
+		if (!disable_log)
+			pr_info("%s table <%s> via netlink\n",
+			    stat ? "Clearing stats of" : "Flushing", ht->name);
+	}
+	mutex_unlock(&natmap_mutex);
+	return ht ? 0 : -ENOENT;
+}
+
+/* snapshot header, for a table with the same kind of key */
+static const struct natmap_snap_hdr *
+natmap_genl_snap_hdr(const struct xt_natmap_htable *ht,
+const struct nlattr *nla, struct netlink_ext_ack *extack)
+{
+	const __u16 key = XT_NATMAP_ADDR | XT_NATMAP_MARK | XT_NATMAP_PRIO |
+	    XT_NATMAP_2WAY | XT_NATMAP_KEY;
+	const struct natmap_snap_hdr *sh = nla_data(nla);
+
+	if (ht->mode & XT_NATMAP_IPV6) {
+		NL_SET_ERR_MSG(extack, "Not supported in IPv6 table");
+		return NULL;
+	}
+	if (natmap_tagged(ht->mode)) {
+		NL_SET_ERR_MSG(extack, "Not supported with a tagged key");
+		return NULL;
+	}
+	if (nla_len(nla) != sizeof(struct natmap_snap_hdr) ||
+	    sh->magic != NATMAP_SNAP_MAGIC ||
+	    sh->version != NATMAP_SNAP_VERSION) {
+		NL_SET_ERR_MSG_ATTR(extack, nla, "Unknown snapshot format");
+		return NULL;
+	}
+	if ((sh->mode & key) != (ht->mode & key)) {
+		NL_SET_ERR_MSG_ATTR(extack, nla,
+		    "Snapshot of a table with other key");
+		return NULL;
+	}
+	return sh;
+}
+
+static unsigned int
+natmap_snap_size(const u32 flags)
+{
+	return sizeof(struct natmap_snap_rec) +
+	    ((flags & NATMAP_SNAP_F_STAT) ? sizeof(struct natmap_snap_stat) : 0);
+}
+
+/* record to rule, checked as natmap_genl_rule() does for an entry */
+static const char *
+natmap_snap_rule(const struct xt_natmap_htable *ht,
+const struct natmap_snap_rec *rec, struct natmap_rule *rule)
+{
+	struct post_ip *postnat = &rule->postnat;
+
+	memset(rule, 0, sizeof(*rule));
+	rule->prenat.addr = rec->prenat;
+	rule->prenat.cidr = rec->prenat_cidr;
+	rule->id = rec->id;
+	if (rec->prenat_cidr < 1 || rec->prenat_cidr > 32 ||
+	    (!(ht->mode & XT_NATMAP_ADDR) && rec->prenat_cidr != 32) ||
+	    ((ht->mode & XT_NATMAP_2WAY) && rec->prenat_cidr != 32))
+		return "Invalid prenat prefix";
+	rule->prenat.addr &= cidr2mask[rule->prenat.cidr];
+
+	postnat->from = rec->postnat_from;
+	postnat->cidr = rec->postnat_cidr;
+	if (postnat->cidr) {
+		if (postnat->cidr > 32 ||
+		    ((ht->mode & XT_NATMAP_2WAY) && postnat->cidr != 32))
+			return "Invalid postnat prefix";
+		postnat->from &= cidr2mask[postnat->cidr];
+		postnat->to = postnat->from ^ ~cidr2mask[postnat->cidr];
+	} else {
+		postnat->to = rec->postnat_to;
+		if (ntohl(postnat->from) > ntohl(postnat->to) ||
+		    ((ht->mode & XT_NATMAP_2WAY) &&
+		     postnat->from != postnat->to))
+			return "Invalid postnat range";
+	}
+
+	if ((ht->mode & XT_NATMAP_2WAY) &&
+	    (postnat->from == NATMAP_RMAP_FREE ||
+	     postnat->from == NATMAP_RMAP_DELETED))
+		return "Reserved two-way postnat";
+	return NULL;
+}
+
+/* restored records are linked a batch per ht->lock hold, like the
+ * sweep unlinks them */
+#define NATMAP_RESTORE_BATCH	64
+
+struct natmap_restore {
+	unsigned int count;
+	struct natmap_rule rule[NATMAP_RESTORE_BATCH];
+	struct natmap_snap_stat stat[NATMAP_RESTORE_BATCH];
+	struct natmap_pre *pre[NATMAP_RESTORE_BATCH];
+	struct natmap_post *post[NATMAP_RESTORE_BATCH];
+	struct natmap_lpm_node *lpm[NATMAP_RESTORE_BATCH][NATMAP_LPM_LEVELS];
+};
+
+/* allocations for rule[count], which can't be done under ht->lock */
+static int
+natmap_restore_prep(struct natmap_restore *b)
+{
+	const unsigned int n = b->count;
+	const u32 cidr = b->rule[n].prenat.cidr;
+	unsigned int i;
+
+	b->pre[n] = natmap_ent_zalloc(sizeof(struct natmap_pre));
+	b->post[n] = natmap_ent_zalloc(sizeof(struct natmap_post));
+	if (!b->pre[n] || !b->post[n])
+		return -ENOMEM;
+	b->pre[n]->stat = alloc_percpu(struct natmap_stat);
+	if (!b->pre[n]->stat)
+		return -ENOMEM;
+	for (i = 0; cidr < 32 && i <= (cidr - 1) / NATMAP_LPM_STRIDE; i++) {
+		b->lpm[n][i] = kzalloc(sizeof(struct natmap_lpm_node),
+		    GFP_KERNEL);
+		if (!b->lpm[n][i])
+			return -ENOMEM;
 	}
+	b->count++;
+	return 0;
+}
 
-	prenat.addr = 0;
-	prenat.cidr = 32;
-	if (add == -2) {
-		if (!disable_log) {
-			if (postnat.cidr)
-				pr_info("Del all entries where postnat = %pI4/%u\n",
-				    &postnat.from, postnat.cidr);
-			else
-				pr_info("Del all entries where postnat = %pI4-%pI4\n",
-				    &postnat.from, &postnat.to);
-		}
-		natmap_post_flush(ht, &postnat);
-		return 0;
-	} else if (ht->mode & XT_NATMAP_ADDR) {
-		if (!in4_pton(c1, strlen(c1), (u8 *)&prenat.addr, -1, &c2)) {
-			pr_err("Invalid prenat IPv4 address format, (cmd: %s)\n", buf);
-			return -EINVAL;
+/* free what the batch didn't link, and empty it */
+static void
+natmap_restore_release(struct natmap_restore *b)
+{
+	unsigned int n, i;
+
+	for (n = 0; n < NATMAP_RESTORE_BATCH; n++) {
+		kvfree(b->post[n]);
+		if (b->pre[n])
+			natmap_pre_free(b->pre[n]);
+		b->pre[n] = NULL;
+		b->post[n] = NULL;
+		for (i = 0; i < NATMAP_LPM_LEVELS; i++) {
+			kfree(b->lpm[n][i]);
+			b->lpm[n][i] = NULL;
 		}
+	}
+	b->count = 0;
+}
 
-		if (sscanf(c2, "/%u", &prenat.cidr) == 1) {
-			if (prenat.cidr < 1 || prenat.cidr > 32) {
-				pr_err("Prefix must be in range - 1..32, (cmd: %s)\n", buf);
-				return -EINVAL;
-			}
-			if ((ht->mode & XT_NATMAP_2WAY) && (prenat.cidr != 32)) {
-				pr_err("In 2-way mode only /32 CIDR is acceptable, (cmd: %s)\n", buf);
-				return -EINVAL;
-			}
-			prenat.addr &= cidr2mask[prenat.cidr];
+/* link the batch into the shadow, stopping at the first bad record */
+static int
+natmap_restore_link(struct xt_natmap_htable *ht, struct natmap_restore *b,
+const bool stat)
+{
+	unsigned int n;
+	int err;
+
+	err = natmap_rmap_prepare(ht);
+	if (err)
+		return err;
+
+	spin_lock(&ht->lock);
+	for (n = 0; n < b->count; n++) {
+		const struct natmap_rule *rule = &b->rule[n];
+		struct natmap_pre *pre = b->pre[n];
+
+		if (natmap_pre_find(ht, natmap_wdata(ht), rule->tag,
+		    rule->prenat.addr, rule->prenat.cidr)) {
+			err = -EEXIST;
+			break;
 		}
-		if (!disable_log)
-			pr_info("%s %pI4/%2u => %pI4-%pI4, <%s>\n",
-			    (add == 1) ? "Add" : "Del", &prenat.addr, prenat.cidr,
-				&postnat.from, &postnat.to, ht->name);
-	} else if (ht->mode & XT_NATMAP_MARK) {
-		if (sscanf(c1, "0x%x", &prenat.addr) != 1) {
-			pr_err("Invalid skb mark format, it should be: 0xMARK, (cmd: %s)\n", buf);
-			return -EINVAL;
+		if (natmap_rmap_full(ht)) {
+			err = -ENOSPC;
+			break;
 		}
-		if (!disable_log)
-			pr_info("%s 0x%x => %pI4-%pI4, <%s>\n",
-			    (add == 1) ? "Add" : "Del", prenat.addr,
-				&postnat.from, &postnat.to, ht->name);
-	} else if (ht->mode & XT_NATMAP_PRIO) {
-		unsigned maj, min;
+		if (!natmap_cgnt_rule_fits(ht, rule)) {
+			err = -ERANGE;
+			break;
+		}
+		natmap_pre_fill(ht, pre, b->post[n], rule);
+		if (stat) {
+			struct natmap_stat *st = this_cpu_ptr(pre->stat);
 
-		if (sscanf(c1, "%x:%x", &maj, &min) != 2) {
-			pr_err("Invalid skb prio format, it should be: MAJ:MIN, (cmd: %s)\n", buf);
-			return -EINVAL;
+			st->pkts = b->stat[n].pkts;
+			st->bytes = b->stat[n].bytes;
 		}
-		prenat.addr = TC_H_MAKE(maj<<16, min);
-		if (!disable_log)
-			pr_info("%s %04x:%04x => %pI4-%pI4, <%s>\n",
-			    (add == 1) ? "Add" : "Del", maj, min,
-				&postnat.from, &postnat.to, ht->name);
+		natmap_pre_add(ht, pre);
+		natmap_post_add(ht, b->post[n]);
+		natmap_lpm_update(ht, rule->prenat.addr, rule->prenat.cidr,
+		    b->lpm[n]);
+		b->pre[n] = NULL;
+		b->post[n] = NULL;
 	}
+	natmap_hash_check(ht);
+	spin_unlock(&ht->lock);
 
-	/* prepare ent */
-	pre = natmap_ent_zalloc(sizeof(struct natmap_pre));
-	if (!pre)
-		return -ENOMEM;
+	return err;
+}
 
-	post = natmap_ent_zalloc(sizeof(struct natmap_post));
-	if (!post) {
-		kvfree(pre);
-		return -ENOMEM;
+/* records go into the shadow opened with the header, so nothing is
+ * logged and the hash is not resized; a failed restore leaves the
+ * shadow to be aborted */
+static int
+natmap_genl_restore(struct sk_buff *skb, struct genl_info *info)
+{
+	const struct nlattr *recs = info->attrs[NATMAP_ATTR_SNAP_RECS];
+	const struct natmap_snap_hdr *sh;
+	struct natmap_restore *b = NULL;
+	struct xt_natmap_htable *ht;
+	unsigned int rsize, count, n;
+	const char *msg;
+	int err = 0;
+
+	if (!info->attrs[NATMAP_ATTR_SNAP_HDR]) {
+		NL_SET_ERR_MSG(info->extack, "No snapshot header");
+		return -EINVAL;
 	}
 
-	spin_lock_init(&pre->lock_bh);
-	spin_lock_init(&post->lock_bh);
-	spin_lock(&ht->lock);
+	mutex_lock(&natmap_mutex);
+	ht = natmap_genl_table(genl_info_net(info), info->attrs, info->extack);
+	if (!ht) {
+		err = -ENOENT;
+		goto out;
+	}
+	sh = natmap_genl_snap_hdr(ht, info->attrs[NATMAP_ATTR_SNAP_HDR],
+	    info->extack);
+	if (!sh) {
+		err = -EINVAL;
+		goto out;
+	}
+	if (!rcu_access_pointer(ht->shadow)) {
+		NL_SET_ERR_MSG(info->extack, "No shadow table is open");
+		err = -ENOENT;
+		goto out;
+	}
+	if (!recs)
+		goto out;
+	rsize = natmap_snap_size(sh->flags);
+	if (nla_len(recs) % rsize) {
+		NL_SET_ERR_MSG_ATTR(info->extack, recs, "Truncated record");
+		err = -EINVAL;
+		goto out;
+	}
+	b = kvzalloc(sizeof(*b), GFP_KERNEL);
+	if (!b) {
+		err = -ENOMEM;
+		goto out;
+	}
 
-	/* check existence of these IPs */
-	pre_chk = natmap_pre_find(ht, prenat.addr, prenat.cidr);
+	count = nla_len(recs) / rsize;
+	for (n = 0; n < count; n++) {
+		const void *p = nla_data(recs) + n * rsize;
+		struct natmap_snap_rec rec;
 
-	if (add == 1) {
-		/* add op should not reference any existing entries */
-		/* unless it's update op (which is quiet add) */
-		if (warn && pre_chk) {
-			pr_err("Add op references existing address, (cmd: %s)\n", buf);
-			goto unlock_einval;
+		memcpy(&rec, p, sizeof(rec));
+		msg = natmap_snap_rule(ht, &rec, &b->rule[b->count]);
+		if (msg) {
+			NL_SET_ERR_MSG_ATTR(info->extack, recs, msg);
+			err = -EINVAL;
+			break;
 		}
-	} else if (add == -1) {
-		/* delete op should reference something */
-		if (warn && !pre_chk) {
-			pr_err("Del op doesn't reference any existing address, (cmd: %s)\n", buf);
-			goto unlock_einval;
+		if (sh->flags & NATMAP_SNAP_F_STAT)
+			memcpy(&b->stat[b->count], p + sizeof(rec),
+			    sizeof(struct natmap_snap_stat));
+		err = natmap_restore_prep(b);
+		if (err)
+			break;
+		if (b->count < NATMAP_RESTORE_BATCH && n + 1 < count)
+			continue;
+
+		err = natmap_restore_link(ht, b,
+		    sh->flags & NATMAP_SNAP_F_STAT);
+		natmap_restore_release(b);
+		if (err) {
+			NL_SET_ERR_MSG_ATTR(info->extack, recs,
+			    err == -EEXIST ? "Duplicate record" :
+			    err == -ENOSPC ? "Two-way map is full" :
+			    err == -ERANGE ? "CG-NAT port blocks don't fit" :
+			    "Record failed");
+			break;
 		}
+		cond_resched();
 	}
+	natmap_restore_release(b);
+	kvfree(b);
+out:
+	mutex_unlock(&natmap_mutex);
+	return err;
+}
 
-	if (add == 1) {
-		if (pre_chk) {
-			/* update */
-			if (memcmp(&pre_chk->postnat, &postnat,
-			    sizeof(struct post_ip))) {
-				spin_lock_bh(&pre_chk->lock_bh);
+static void
+natmap_snap_put(void *p, const struct natmap_pre *pre, const u32 flags)
+	/* under rcu_read_lock */
+{
+	struct natmap_snap_rec rec = {
+		.prenat		= pre->prenat.addr,
+		.postnat_from	= pre->postnat.from,
+		.postnat_to	= pre->postnat.to,
+		.id		= pre->id,
+		.prenat_cidr	= pre->prenat.cidr,
+		.postnat_cidr	= pre->postnat.cidr,
+	};
+
+	memcpy(p, &rec, sizeof(rec));
+	if (flags & NATMAP_SNAP_F_STAT) {
+		struct natmap_stat stat;
+		struct natmap_snap_stat st;
+
+		natmap_stat_fold(pre, &stat);
+		st.pkts = stat.pkts;
+		st.bytes = stat.bytes;
+		memcpy(p + sizeof(rec), &st, sizeof(st));
+	}
+}
 
-				pre_chk->postnat.from = postnat.from;
-				pre_chk->postnat.to = postnat.to;
-				pre_chk->postnat.cidr = postnat.cidr;
+/* each message is filled with as many records as fit, cursor is as in
+ * natmap_genl_dump(), cb->args[2] is set once the header is sent */
+static int
+natmap_genl_save(struct sk_buff *skb, struct netlink_callback *cb)
+{
+	struct nlattr *attrs[NATMAP_ATTR_MAX + 1];
+	struct xt_natmap_htable *ht;
+	const struct natmap_data *d;
+	const struct natmap_hash *tbl;
+	const struct natmap_pre *pre;
+	unsigned int bucket = cb->args[0];
+	unsigned int skip = cb->args[1];
+	unsigned int i = 0, n = 0, max, rsize;
+	bool sent_hdr = false;
+	struct nlattr *recs;
+	u32 flags = 0;
+	void *hdr;
+	int err;
 
-				natmap_post_del(ht, pre_chk->post);
-				pre_chk->post = post;
-				post->pre = pre_chk;
-				natmap_post_add(ht, post);
-				post = NULL;
+	err = nlmsg_parse(cb->nlh, GENL_HDRLEN, attrs, NATMAP_ATTR_MAX,
+	    natmap_genl_policy, NULL);
+	if (err)
+		return err;
+	if (attrs[NATMAP_ATTR_FLAGS] &&
+	    (nla_get_u32(attrs[NATMAP_ATTR_FLAGS]) & NATMAP_F_STAT))
+		flags |= NATMAP_SNAP_F_STAT;
+	rsize = natmap_snap_size(flags);
 
-				spin_unlock_bh(&pre_chk->lock_bh);
-			}
-		} else {
-			pre->prenat.addr = prenat.addr;
-			pre->prenat.cidr = prenat.cidr;
-			pre->postnat.from = postnat.from;
-			pre->postnat.to = postnat.to;
-			pre->postnat.cidr = postnat.cidr;
-			pre->post = post;
-			post->pre = pre;
-
-			/* Rehash when load factor exceeds 0.75 */
-			if (ht->count * 4 > ht->hsize * 3)
-				natmap_hash_change(ht, ht->hsize * 2);
-			natmap_pre_add(ht, pre);
-			natmap_post_add(ht, post);
-			pre = NULL;
-			post = NULL;
+	mutex_lock(&natmap_mutex);
+	ht = natmap_genl_table(sock_net(skb->sk), attrs, NULL);
+	if (!ht || (ht->mode & XT_NATMAP_IPV6) || natmap_tagged(ht->mode)) {
+		mutex_unlock(&natmap_mutex);
+		return ht ? -EOPNOTSUPP : -ENOENT;
+	}
+
+	hdr = genlmsg_put(skb, NETLINK_CB(cb->skb).portid, cb->nlh->nlmsg_seq,
+	    &natmap_genl_family, NLM_F_MULTI, NATMAP_CMD_SAVE);
+	if (!hdr)
+		goto nla_put_failure;
+	if (nla_put_string(skb, NATMAP_ATTR_TABLE, ht->name))
+		goto nla_put_failure;
+
+	rcu_read_lock();
+	d = rcu_dereference(ht->data);
+	tbl = rcu_dereference(d->pre);
+	/* records have no room for the end of a range */
+	if (READ_ONCE(d->cidr_map[0])) {
+		rcu_read_unlock();
+		mutex_unlock(&natmap_mutex);
+		genlmsg_cancel(skb, hdr);
+		return -EOPNOTSUPP;
+	}
+	if (!cb->args[2]) {
+		const struct natmap_snap_hdr sh = {
+			.magic		= NATMAP_SNAP_MAGIC,
+			.version	= NATMAP_SNAP_VERSION,
+			.mode		= ht->mode,
+			.hsize		= tbl->size,
+			.flags		= flags,
+			.count		= READ_ONCE(d->count),
+		};
+
+		if (nla_put(skb, NATMAP_ATTR_SNAP_HDR, sizeof(sh), &sh)) {
+			rcu_read_unlock();
+			goto nla_put_failure;
 		}
-	} else if (pre_chk) {
-		natmap_post_del(ht, pre_chk->post);
-		natmap_pre_del(ht, pre_chk);
+		sent_hdr = true;
+	}
 
-		if (ht->count * 2 < ht->hsize)
-			natmap_hash_change(ht, ht->hsize / 2);
+	/* as much as is left in the message and fits one attribute */
+	max = min_t(int, skb_tailroom(skb) - NLA_HDRLEN - NLA_ALIGNTO,
+	    U16_MAX - NLA_HDRLEN) / rsize;
+	recs = max ? nla_reserve(skb, NATMAP_ATTR_SNAP_RECS, max * rsize) :
+	    NULL;
+	if (!recs) {
+		rcu_read_unlock();
+		goto nla_put_failure;
+	}
+	for (; bucket < tbl->size; bucket++, skip = 0) {
+		i = 0;
+		natmap_hash_for_each_rcu(pre, tbl, bucket) {
+			if (i < skip) {
+				i++;
+				continue;
+			}
+			if (n == max)
+				goto full;
+			natmap_snap_put(nla_data(recs) + n * rsize, pre, flags);
+			i++;
+			n++;
+		}
 	}
+full:
+	rcu_read_unlock();
+	mutex_unlock(&natmap_mutex);
 
-	spin_unlock(&ht->lock);
+	if (!n && !sent_hdr) {
+		genlmsg_cancel(skb, hdr);
+		return 0;
+	}
+	/* give back the unused part of the attribute */
+	skb_trim(skb, skb->len - nla_total_size(max * rsize) +
+	    nla_total_size(n * rsize));
+	recs->nla_len = nla_attr_size(n * rsize);
+	cb->args[0] = bucket;
+	cb->args[1] = i;
+	cb->args[2] = 1;
+	genlmsg_end(skb, hdr);
+	return skb->len;
+
+nla_put_failure:
+	mutex_unlock(&natmap_mutex);
+	if (hdr)
+		genlmsg_cancel(skb, hdr);
+	return -EMSGSIZE;
+}
 
-	if (post)
-		kvfree(post);
-	if (pre)
-		kvfree(pre);
-	return 0;
+/* shadow table for atomic reloads, like +begin/+commit/+abort in proc */
+static int
+natmap_genl_shadow(struct sk_buff *skb, struct genl_info *info)
+{
+	const u8 cmd = info->genlhdr->cmd;
+	struct xt_natmap_htable *ht;
+	int err = -ENOENT;
 
-unlock_einval:
-	spin_unlock(&ht->lock);
-	kvfree(post);
-	kvfree(pre);
-	return -EINVAL;
+	mutex_lock(&natmap_mutex);
+	ht = natmap_genl_table(genl_info_net(info), info->attrs, info->extack);
+	if (!ht)
+		goto out;
+	if (cmd == NATMAP_CMD_BEGIN && info->attrs[NATMAP_ATTR_SNAP_HDR]) {
+		const struct natmap_snap_hdr *sh;
+
+		sh = natmap_genl_snap_hdr(ht, info->attrs[NATMAP_ATTR_SNAP_HDR],
+		    info->extack);
+		err = sh ? natmap_shadow_begin(ht, sh->count) : -EINVAL;
+	} else if (cmd == NATMAP_CMD_BEGIN)
+		err = natmap_shadow_begin(ht, info->attrs[NATMAP_ATTR_SHADOW] ?
+		    nla_get_u64(info->attrs[NATMAP_ATTR_SHADOW]) : 0);
+	else if (cmd == NATMAP_CMD_COMMIT)
+		err = natmap_shadow_commit(ht);
+	else
+		err = natmap_shadow_abort(ht);
+	if (err == -EBUSY)
+		NL_SET_ERR_MSG(info->extack, "Shadow table is already open");
+	else if (err == -ENOENT)
+		NL_SET_ERR_MSG(info->extack, "No shadow table is open");
+out:
+	mutex_unlock(&natmap_mutex);
+	return err;
 }
 
-static char proc_buf[150];
+/* NATMAP_CMD_GEN with optional GEN, then NATMAP_CMD_SWEEP, like
+ * +gen[=N] and +sweep in proc */
+static int
+natmap_genl_sweep(struct sk_buff *skb, struct genl_info *info)
+{
+	struct xt_natmap_htable *ht;
+	int err = 0;
 
-static ssize_t
-natmap_proc_write(struct file *file, const char __user *input,
-size_t size, loff_t *loff)
+	mutex_lock(&natmap_mutex);
+	ht = natmap_genl_table(genl_info_net(info), info->attrs, info->extack);
+	if (!ht)
+		err = -ENOENT;
+	else if (info->genlhdr->cmd == NATMAP_CMD_SWEEP)
+		__natmap_sweep(ht);
+	else if (info->attrs[NATMAP_ATTR_GEN] &&
+	    !nla_get_u32(info->attrs[NATMAP_ATTR_GEN])) {
+		NL_SET_ERR_MSG_ATTR(info->extack, info->attrs[NATMAP_ATTR_GEN],
+		    "Generation 0 is reserved");
+		err = -EINVAL;
+	} else {
+		err = natmap_gen_begin(ht, info->attrs[NATMAP_ATTR_GEN] ?
+		    nla_get_u32(info->attrs[NATMAP_ATTR_GEN]) : 0);
+		if (err)
+			NL_SET_ERR_MSG(info->extack,
+			    "Generation is already current");
+	}
+	mutex_unlock(&natmap_mutex);
+	return err;
+}
+
+/* cursor is cb->args[0] bucket and cb->args[1] entries of it already
+ * sent, the table is looked up again on every call, so a dump racing
+ * with a resize may miss or repeat entries, like the proc file does */
+static int
+natmap_genl_dump(struct sk_buff *skb, struct netlink_callback *cb)
 {
-	struct xt_natmap_htable *ht = PDE_DATA(file_inode(file));
-	char *p;
+	struct nlattr *attrs[NATMAP_ATTR_MAX + 1];
+	struct xt_natmap_htable *ht;
+	const struct natmap_hash *tbl;
+	const struct natmap_pre *pre;
+	unsigned int bucket = cb->args[0];
+	unsigned int skip = cb->args[1];
+	unsigned int i = 0, n = 0, size;
+	struct nlattr *nest;
+	void *hdr;
+	int err;
 
-	if (!size || !input | !ht)
-		return 0;
-	if (size > sizeof(proc_buf))
-		size = sizeof(proc_buf);
-	if (copy_from_user(proc_buf, input, size) != 0)
-		return -EFAULT;
-
-	for (p = proc_buf; p < &proc_buf[size]; ) {
-		char *str = p;
-
-		while (p < &proc_buf[size] && *p != '\n')
-			++p;
-		if (p == &proc_buf[size] || *p != '\n') {
-			/* unterminated command */
-			if (str == proc_buf) {
-				pr_err("Rule should end with '\\n',"
-					    " (cmd: %s)\n", str);
-				return -EINVAL;
-			} else {
-				/* Rewind to the beginning of incomplete
-				 * command for smarter writers, this doesn't
-				 * help for `cat`, though. */
-				p = str;
-				break;
-			}
-		}
+	err = nlmsg_parse(cb->nlh, GENL_HDRLEN, attrs, NATMAP_ATTR_MAX,
+	    natmap_genl_policy, NULL);
+	if (err)
+		return err;
 
-		while (str < p && *str == ' ')
-			++str;
+	mutex_lock(&natmap_mutex);
+	ht = natmap_genl_table(sock_net(skb->sk), attrs, NULL);
+	if (!ht) {
+		mutex_unlock(&natmap_mutex);
+		return -ENOENT;
+	}
 
-		/* strip line after first space */
-		str = strsep(&str, " ");
-		/* strip trailing newline for better formatting of error messages */
-		str[p - str] = '\0';
+	hdr = genlmsg_put(skb, NETLINK_CB(cb->skb).portid, cb->nlh->nlmsg_seq,
+	    &natmap_genl_family, NLM_F_MULTI, NATMAP_CMD_DUMP);
+	if (!hdr)
+		goto nla_put_failure;
+	if (nla_put_string(skb, NATMAP_ATTR_TABLE, ht->name) ||
+	    nla_put_u32(skb, NATMAP_ATTR_MODE, ht->mode))
+		goto nla_put_failure;
+	nest = nla_nest_start(skb, NATMAP_ATTR_ENTRIES);
+	if (!nest)
+		goto nla_put_failure;
 
-		if (((*str != '#') && (*str != '\0'))
-		    && parse_rule(ht, str, p - str))
-			return -EINVAL;
-		++p;
+	rcu_read_lock();
+	tbl = rcu_dereference(rcu_dereference(ht->data)->pre);
+	for (; bucket < tbl->size; bucket++, skip = 0) {
+		i = 0;
+		natmap_hash_for_each_rcu(pre, tbl, bucket) {
+			if (i < skip) {
+				i++;
+				continue;
+			}
+			if (n == NATMAP_DUMP_BATCH ||
+			    natmap_genl_fill(skb, ht, pre))
+				goto full;
+			i++;
+			n++;
+		}
+	}
+full:
+	size = tbl->size;
+	rcu_read_unlock();
+	mutex_unlock(&natmap_mutex);
+	cb->args[0] = bucket;
+	cb->args[1] = i;
+
+	if (!n) {
+		genlmsg_cancel(skb, hdr);
+		/* nothing left, or one entry doesn't fit an empty message */
+		return bucket < size ? -EMSGSIZE : 0;
 	}
+	nla_nest_end(skb, nest);
+	genlmsg_end(skb, hdr);
+	return skb->len;
 
-	*loff += p - proc_buf;
-	return p - proc_buf;
+nla_put_failure:
+	mutex_unlock(&natmap_mutex);
+	if (hdr)
+		genlmsg_cancel(skb, hdr);
+	return -EMSGSIZE;
 }
 
-#if  LINUX_VERSION_CODE < KERNEL_VERSION(5,6,0)
-#define PROC_OPS(s,o,r,w,l,d) static const struct file_operations s = { \
-        .open           = o, \
-        .read           = r, \
-        .write          = w, \
-        .llseek         = l, \
-        .release        = d \
-}
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,2,0)
+# define NATMAP_GENL_POLICY .policy = natmap_genl_policy,
 #else
-#define PROC_OPS(s,o,r,w,l,d) static const struct proc_ops s = { \
-        .proc_open      = o , \
-        .proc_read      = r , \
-        .proc_write     = w , \
-        .proc_release   = d \
-}
+# define NATMAP_GENL_POLICY
+#endif
+
+static const struct genl_ops natmap_genl_ops[] = {
+	{
+		.cmd		= NATMAP_CMD_ADD,
+		.doit		= natmap_genl_entries,
+		.flags		= GENL_UNS_ADMIN_PERM,
+		NATMAP_GENL_POLICY
+	},
+	{
+		.cmd		= NATMAP_CMD_DEL,
+		.doit		= natmap_genl_entries,
+		.flags		= GENL_UNS_ADMIN_PERM,
+		NATMAP_GENL_POLICY
+	},
+	{
+		.cmd		= NATMAP_CMD_GET,
+		.doit		= natmap_genl_get,
+		.flags		= GENL_UNS_ADMIN_PERM,
+		NATMAP_GENL_POLICY
+	},
+	{
+		.cmd		= NATMAP_CMD_FLUSH,
+		.doit		= natmap_genl_flush,
+		.flags		= GENL_UNS_ADMIN_PERM,
+		NATMAP_GENL_POLICY
+	},
+	{
+		.cmd		= NATMAP_CMD_DUMP,
+		.dumpit		= natmap_genl_dump,
+		.flags		= GENL_UNS_ADMIN_PERM,
+		NATMAP_GENL_POLICY
+	},
+	{
+		.cmd		= NATMAP_CMD_BEGIN,
+		.doit		= natmap_genl_shadow,
+		.flags		= GENL_UNS_ADMIN_PERM,
+		NATMAP_GENL_POLICY
+	},
+	{
+		.cmd		= NATMAP_CMD_COMMIT,
+		.doit		= natmap_genl_shadow,
+		.flags		= GENL_UNS_ADMIN_PERM,
+		NATMAP_GENL_POLICY
+	},
+	{
+		.cmd		= NATMAP_CMD_ABORT,
+		.doit		= natmap_genl_shadow,
+		.flags		= GENL_UNS_ADMIN_PERM,
+		NATMAP_GENL_POLICY
+	},
+	{
+		.cmd		= NATMAP_CMD_GEN,
+		.doit		= natmap_genl_sweep,
+		.flags		= GENL_UNS_ADMIN_PERM,
+		NATMAP_GENL_POLICY
+	},
+	{
+		.cmd		= NATMAP_CMD_SWEEP,
+		.doit		= natmap_genl_sweep,
+		.flags		= GENL_UNS_ADMIN_PERM,
+		NATMAP_GENL_POLICY
+	},
+	{
+		.cmd		= NATMAP_CMD_SAVE,
+		.dumpit		= natmap_genl_save,
+		.flags		= GENL_UNS_ADMIN_PERM,
+		NATMAP_GENL_POLICY
+	},
+	{
+		.cmd		= NATMAP_CMD_RESTORE,
+		.doit		= natmap_genl_restore,
+		.flags		= GENL_UNS_ADMIN_PERM,
+		NATMAP_GENL_POLICY
+	},
+};
+
+static struct genl_family natmap_genl_family __ro_after_init = {
+	.name		= NATMAP_GENL_NAME,
+	.version	= NATMAP_GENL_VERSION,
+	.maxattr	= NATMAP_ATTR_MAX,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,2,0)
+	.policy		= natmap_genl_policy,
 #endif
-PROC_OPS(natmap_fops, natmap_proc_open, seq_read, natmap_proc_write, seq_lseek, seq_release);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,1,0)
+	.resv_start_op	= NATMAP_CMD_DUMP + 1,
+#endif
+	.netnsok	= true,
+	.module		= THIS_MODULE,
+	.ops		= natmap_genl_ops,
+	.n_ops		= ARRAY_SIZE(natmap_genl_ops),
+};
 
 /* net creation/destruction callbacks */
 static int
@@ -1242,6 +5711,12 @@ __net_init natmap_net_init(struct net *net)
 	natmap_net->ipt_natmap = proc_mkdir("ipt_NATMAP", net->proc_net);
 	if (!natmap_net->ipt_natmap)
 		return -ENOMEM;
+	natmap_net->ipt_natmap_stat = proc_mkdir("ipt_NATMAP",
+	    net->proc_net_stat);
+	if (!natmap_net->ipt_natmap_stat) {
+		remove_proc_entry("ipt_NATMAP", net->proc_net);
+		return -ENOMEM;
+	}
 	return 0;
 }
 
@@ -1251,14 +5726,26 @@ __net_exit natmap_net_exit(struct net *net)
 {
 	struct natmap_net *natmap_net = natmap_pernet(net);
 	struct xt_natmap_htable *ht;
+	struct hlist_node *n;
 
 	mutex_lock(&natmap_mutex);
-	hlist_for_each_entry(ht, &natmap_net->htables, node)
+	hlist_for_each_entry(ht, &natmap_net->htables, node) {
 		remove_proc_entry(ht->name, natmap_net->ipt_natmap);
+		remove_proc_entry(ht->name, natmap_net->ipt_natmap_stat);
+	}
 	natmap_net->ipt_natmap = NULL; /* for htable_destroy() */
+
+	/* persistent tables left without rules, others are released
+	 * by rule destruction; no resize work may outlive the module */
+	hlist_for_each_entry_safe(ht, n, &natmap_net->htables, node)
+		if (ht->use == 0) {
+			hlist_del(&ht->node);
+			htable_destroy(ht);
+		}
 	mutex_unlock(&natmap_mutex);
 
 	remove_proc_entry("ipt_NATMAP", net->proc_net); /* dir */
+	remove_proc_entry("ipt_NATMAP", net->proc_net_stat);
 }
 
 static struct pernet_operations natmap_net_ops = {
@@ -1273,12 +5760,32 @@ __init natmap_tg_init(void)
 {
 	int err;
 
+	natmap_wq = alloc_workqueue("natmap", WQ_UNBOUND, 0);
+	if (!natmap_wq)
+		return -ENOMEM;
 	err = register_pernet_subsys(&natmap_net_ops);
 	if (err)
-		return err;
+		goto out_wq;
 	err = xt_register_targets(natmap_tg_reg, ARRAY_SIZE(natmap_tg_reg));
 	if (err)
-		unregister_pernet_subsys(&natmap_net_ops);
+		goto out_pernet;
+	err = nft_natmap_register();
+	if (err)
+		goto out_targets;
+	err = genl_register_family(&natmap_genl_family);
+	if (err)
+		goto out_nft;
+	goto out;
+
+out_nft:
+	nft_natmap_unregister();
+out_targets:
+	xt_unregister_targets(natmap_tg_reg, ARRAY_SIZE(natmap_tg_reg));
+out_pernet:
+	unregister_pernet_subsys(&natmap_net_ops);
+out_wq:
+	destroy_workqueue(natmap_wq);
+out:
 	if (!disable_log)
 		pr_info(XT_NATMAP_VERSION " load %s, (hashsize=%u)\n",
 		    err ? "error" : "success", hashsize);
@@ -1290,9 +5797,17 @@ __exit natmap_tg_exit(void)
 {
 	if (!disable_log)
 		pr_info("unload module.\n");
+	genl_unregister_family(&natmap_genl_family);
+	nft_natmap_unregister();
 	xt_unregister_targets(natmap_tg_reg, ARRAY_SIZE(natmap_tg_reg));
 	unregister_pernet_subsys(&natmap_net_ops);
+	destroy_workqueue(natmap_wq);
+	rcu_barrier();
 }
 
 module_init(natmap_tg_init);
 module_exit(natmap_tg_exit);
+
+#ifdef NATMAP_KUNIT
+#include "xt_NATMAP_kunit.h"
+#endif
@@ -32,11 +32,25 @@ enum {
 	XT_NATMAP_2WAY		= 1 << 6,
 
 	XT_NATMAP_STAT		= 1 << 7,
+	XT_NATMAP_CTMK		= 1 << 8,
+	XT_NATMAP_IPV6		= 1 << 9,	/* set by kernel for ip6tables */
+
+	/* key source other than saddr, skb mark or priority;
+	 * the first three are addr mode, the next three mark mode */
+	XT_NATMAP_KEY_SHIFT	= 10,
+	XT_NATMAP_KEY		= 7 << XT_NATMAP_KEY_SHIFT,
+	XT_NATMAP_KEY_DADDR	= 1 << XT_NATMAP_KEY_SHIFT,
+	XT_NATMAP_KEY_ZONE_ADDR	= 2 << XT_NATMAP_KEY_SHIFT, /* zone:saddr */
+	XT_NATMAP_KEY_MARK_ADDR	= 3 << XT_NATMAP_KEY_SHIFT, /* mark:saddr */
+	XT_NATMAP_KEY_CTMARK	= 4 << XT_NATMAP_KEY_SHIFT,
+	XT_NATMAP_KEY_ZONE	= 5 << XT_NATMAP_KEY_SHIFT, /* ct zone id */
+	XT_NATMAP_KEY_IIF	= 6 << XT_NATMAP_KEY_SHIFT, /* input ifindex */
 
 	XT_NATMAP_NAME_LEN	= 32,
 };
 
-struct xt_natmap_tginfo {
+/* revision 0, before mode outgrew 8 bits */
+struct xt_natmap_tginfo_v0 {
 	struct nf_nat_range2 range;
 	__u8 mode;
 	char name[XT_NATMAP_NAME_LEN];
@@ -44,4 +58,127 @@ struct xt_natmap_tginfo {
 	/* values below only used in kernel */
 	struct xt_natmap_htable *ht;
 };
+
+/* revision 1 */
+struct xt_natmap_tginfo {
+	struct nf_nat_range2 range;
+	__u16 mode;
+	__u16 block;		/* cg-nat ports per prenat, 0 - auto */
+	__u32 markmask;		/* of skb or ct mark keys, 0 - all bits */
+	char name[XT_NATMAP_NAME_LEN];
+
+	/* values below only used in kernel */
+	struct xt_natmap_htable *ht;
+};
+
+/* generic netlink control plane, see natmapctl */
+#define NATMAP_GENL_NAME	"NATMAP"
+#define NATMAP_GENL_VERSION	1
+
+enum {
+	NATMAP_CMD_UNSPEC,
+	NATMAP_CMD_ADD,		/* ENTRIES into TABLE */
+	NATMAP_CMD_DEL,		/* ENTRIES by prenat, or by postnat if no prenat */
+	NATMAP_CMD_GET,		/* one ENTRY by prenat, or see NATMAP_F_* */
+	NATMAP_CMD_FLUSH,	/* whole TABLE */
+	NATMAP_CMD_DUMP,	/* all entries, multipart */
+	NATMAP_CMD_BEGIN,	/* open empty shadow TABLE for changes */
+	NATMAP_CMD_COMMIT,	/* make shadow live, old content freed */
+	NATMAP_CMD_ABORT,	/* drop shadow */
+	NATMAP_CMD_GEN,		/* start GEN, next one if none */
+	NATMAP_CMD_SWEEP,	/* delete entries not added in current GEN */
+	NATMAP_CMD_SAVE,	/* binary snapshot, multipart */
+	NATMAP_CMD_RESTORE,	/* SNAP_RECS into the open shadow */
+	__NATMAP_CMD_MAX,
+};
+#define NATMAP_CMD_MAX (__NATMAP_CMD_MAX - 1)
+
+enum {
+	NATMAP_ATTR_UNSPEC,
+	NATMAP_ATTR_TABLE,	/* string */
+	NATMAP_ATTR_FLAGS,	/* u32, NATMAP_F_* */
+	NATMAP_ATTR_ENTRIES,	/* nested list of ENTRY */
+	NATMAP_ATTR_ENTRY,	/* nested NATMAP_ENTRY_* */
+	NATMAP_ATTR_MODE,	/* u32, XT_NATMAP_*, in replies */
+	NATMAP_ATTR_GEN,	/* u32, generation, not 0 */
+	NATMAP_ATTR_SNAP_HDR,	/* struct natmap_snap_hdr */
+	NATMAP_ATTR_SNAP_RECS,	/* packed natmap_snap_rec's */
+	NATMAP_ATTR_SHADOW,	/* u64, BEGIN: entries expected, sizes shadow */
+	__NATMAP_ATTR_MAX,
+};
+#define NATMAP_ATTR_MAX (__NATMAP_ATTR_MAX - 1)
+
+enum {
+	NATMAP_ENTRY_UNSPEC,
+	NATMAP_ENTRY_PRENAT,	/* u32, address (be), mark or prio */
+	NATMAP_ENTRY_PRENAT_CIDR, /* u8, addr mode only, default 32 (128) */
+	NATMAP_ENTRY_POSTNAT_FROM, /* be32 */
+	NATMAP_ENTRY_POSTNAT_TO, /* be32, default POSTNAT_FROM */
+	NATMAP_ENTRY_POSTNAT_CIDR, /* u8, 0 - from-to range */
+	NATMAP_ENTRY_ID,	/* u32 */
+	NATMAP_ENTRY_PKTS,	/* u64, dump only */
+	NATMAP_ENTRY_BYTES,	/* u64, dump only */
+	NATMAP_ENTRY_PAD,
+	NATMAP_ENTRY_PRENAT6,	/* in6_addr, IPv6 tables instead of PRENAT */
+	NATMAP_ENTRY_POSTNAT6,	/* in6_addr, prefix of PRENAT_CIDR length */
+	NATMAP_ENTRY_TAG,	/* u32, zone or mark of zone:addr, mark:addr */
+	NATMAP_ENTRY_PRENAT_LAST, /* be32, end of PRENAT range, no CIDR */
+	__NATMAP_ENTRY_MAX,
+};
+#define NATMAP_ENTRY_MAX (__NATMAP_ENTRY_MAX - 1)
+
+enum {
+	NATMAP_F_UPDATE		= 1 << 0,	/* like '@': replace or ignore missing */
+	NATMAP_F_STAT		= 1 << 1,	/* FLUSH: clear counters only,
+						 * SAVE: with counters */
+	NATMAP_F_LOOKUP		= 1 << 2,	/* GET: match as the packet path */
+	NATMAP_F_REVERSE	= 1 << 3,	/* GET: by POSTNAT_FROM, two-way */
+};
+
+/* nftables "natmap" expression, uses the tables of the xt target */
+enum {
+	NFTA_NATMAP_UNSPEC,
+	NFTA_NATMAP_NAME,	/* string, table name */
+	NFTA_NATMAP_MODE,	/* be32, XT_NATMAP_* as given to iptables */
+	NFTA_NATMAP_PROTO_MIN,	/* be16, cg-nat port range */
+	NFTA_NATMAP_PROTO_MAX,	/* be16, default PROTO_MIN */
+	NFTA_NATMAP_BLOCK,	/* be16, cg-nat ports per prenat */
+	NFTA_NATMAP_MARKMASK,	/* be32, mask of mark keys */
+	__NFTA_NATMAP_MAX,
+};
+#define NFTA_NATMAP_MAX (__NFTA_NATMAP_MAX - 1)
+
+/* Snapshot is the header followed by count records, each followed by
+ * natmap_snap_stat if NATMAP_SNAP_F_STAT is set. Numbers are in host
+ * order, addresses in network order, as for the table it came from.
+ * SAVE sends SNAP_HDR in the first message and SNAP_RECS in each,
+ * BEGIN with SNAP_HDR opens a shadow sized for it, RESTORE carries
+ * SNAP_HDR and SNAP_RECS, then COMMIT. */
+#define NATMAP_SNAP_MAGIC	0x4e4d5350	/* "NMSP" */
+#define NATMAP_SNAP_VERSION	1
+#define NATMAP_SNAP_F_STAT	(1 << 0)
+
+struct natmap_snap_hdr {
+	__u32 magic;
+	__u16 version;
+	__u16 mode;		/* XT_NATMAP_* of the table */
+	__u32 hsize;		/* hash size of the table */
+	__u32 flags;		/* NATMAP_SNAP_F_* */
+	__u64 count;		/* records, at the start of SAVE */
+};
+
+struct natmap_snap_rec {
+	__u32 prenat;		/* address (be), mark or prio */
+	__be32 postnat_from;
+	__be32 postnat_to;
+	__u32 id;
+	__u8 prenat_cidr;
+	__u8 postnat_cidr;	/* 0 - from-to range */
+	__u16 pad;
+};
+
+struct natmap_snap_stat {
+	__u64 pkts;
+	__u64 bytes;
+};
 #endif /* _XT_NATMAP_H */
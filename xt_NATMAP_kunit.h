@@ -0,0 +1,665 @@
+/*
+ * KUnit suite of the NATMAP tables, included at the end of xt_NATMAP.c
+ * when built with NATMAP_KUNIT (make KUNIT=1), and run on module load
+ * by a kernel with CONFIG_KUNIT. With KASAN and lockdep enabled a
+ * reader touching freed entries or a lock taken in the wrong context
+ * is reported too. The benchmark builds the same suite over its
+ * stand-ins, see make check and make stress.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ */
+
+#include <kunit/test.h>
+#include <linux/delay.h>
+#include <linux/kthread.h>
+#include <linux/random.h>
+
+#define NATMAP_TEST_RULE_LEN	64
+
+enum {
+	NATMAP_TEST_ADDR,	/* /32 prenat addresses */
+	NATMAP_TEST_CIDR,	/* /32 mixed with /24 and /28 prefixes */
+	NATMAP_TEST_2WAY,	/* /32, also looked up by postnat */
+	NATMAP_TEST_MARK,
+	NATMAP_TEST_PRIO,
+	NATMAP_TEST_ADDR6,	/* /128 mixed with /120 and /124, as cidr */
+	NATMAP_TEST_ZADDR,	/* zone:addr, prefixes as cidr */
+	NATMAP_TEST_RANGE,	/* /32 mixed with unaligned ranges */
+	NATMAP_TEST_KINDS
+};
+
+static const struct {
+	const char *name;
+	__u16 mode;
+} natmap_test_kinds[NATMAP_TEST_KINDS] = {
+	[NATMAP_TEST_ADDR] = { "addr", XT_NATMAP_ADDR },
+	[NATMAP_TEST_CIDR] = { "cidr", XT_NATMAP_ADDR },
+	[NATMAP_TEST_2WAY] = { "2way", XT_NATMAP_ADDR | XT_NATMAP_2WAY },
+	[NATMAP_TEST_MARK] = { "mark", XT_NATMAP_MARK },
+	[NATMAP_TEST_PRIO] = { "prio", XT_NATMAP_PRIO },
+	[NATMAP_TEST_ADDR6] = { "addr6", XT_NATMAP_ADDR | XT_NATMAP_IPV6 },
+	[NATMAP_TEST_ZADDR] = { "zaddr",
+	    XT_NATMAP_ADDR | XT_NATMAP_KEY_ZONE_ADDR },
+	[NATMAP_TEST_RANGE] = { "range", XT_NATMAP_ADDR },
+};
+
+/* prenat key of entry i, as the packet path sees it */
+static __be32
+natmap_test_key(const int kind, const unsigned long i)
+{
+	switch (kind) {
+	case NATMAP_TEST_MARK:
+		return i + 1;
+	case NATMAP_TEST_PRIO:
+		return TC_H_MAKE((1 + (i >> 16)) << 16, i & 0xffff);
+	case NATMAP_TEST_RANGE:
+		/* every 8th entry is x.x.x.5-x.x.x.205 */
+		if (i % 8 == 0)
+			return htonl(0xc0000000 + ((i / 8) << 8) + 5);
+		return htonl(0x0a000000 + i);
+	case NATMAP_TEST_CIDR:
+	case NATMAP_TEST_ADDR6:
+	case NATMAP_TEST_ZADDR:
+		/* every 8th entry is a prefix, a /28 among four /24s */
+		if (i % 8 == 0)
+			return htonl(0xc0000000 + ((i / 8) << 8));
+		/* fall through */
+	default:
+		return htonl(0x0a000000 + i);
+	}
+}
+
+/* zone of a zaddr key, the same for all of a /24 */
+static u32
+natmap_test_tag(const __be32 key)
+{
+	return (ntohl(key) >> 8) & 15;
+}
+
+static __be32
+natmap_test_post(const unsigned long i)
+{
+	return htonl(0x64400000 + i);
+}
+
+static bool
+natmap_test_prefix(const int kind, const unsigned long i)
+{
+	return (kind == NATMAP_TEST_CIDR || kind == NATMAP_TEST_ADDR6 ||
+	    kind == NATMAP_TEST_ZADDR || kind == NATMAP_TEST_RANGE) &&
+	    i % 8 == 0;
+}
+
+/* IPv6 kinds have the 32-bit layout in the last bits of a /96,
+ * ranges have 0 */
+static unsigned int
+natmap_test_cidr(const int kind, const unsigned long i)
+{
+	const unsigned int cidr = !natmap_test_prefix(kind, i) ? 32 :
+	    (kind == NATMAP_TEST_RANGE) ? 0 :
+	    (i % 32 == 0) ? 28 : 24;
+
+	return kind == NATMAP_TEST_ADDR6 ? cidr + 96 : cidr;
+}
+
+/* 2001:db8::/96 for prenat, 2001:db8:1::/96 for postnat */
+static struct in6_addr
+natmap_test_in6(const bool post, const __be32 low)
+{
+	struct in6_addr a = { .s6_addr32 = {
+		htonl(0x20010db8), post ? htonl(0x00010000) : 0, 0, low } };
+
+	return a;
+}
+
+/* add rule of entry i mapped to post */
+static int
+natmap_test_rule(char *buf, const int kind, const unsigned long i,
+const __be32 post)
+{
+	const __be32 key = natmap_test_key(kind, i);
+	const u8 *p = (const u8 *)&post;
+	const u8 *k = (const u8 *)&key;
+
+	switch (kind) {
+	case NATMAP_TEST_ADDR6:
+		return sprintf(buf, "+2001:db8::%x:%x/%u=2001:db8:1::%x:%x/%u",
+		    ntohl(key) >> 16, ntohl(key) & 0xffff,
+		    natmap_test_cidr(kind, i), ntohl(post) >> 16,
+		    ntohl(post) & 0xffff, natmap_test_cidr(kind, i));
+	case NATMAP_TEST_MARK:
+		return sprintf(buf, "+0x%x=%u.%u.%u.%u", key,
+		    p[0], p[1], p[2], p[3]);
+	case NATMAP_TEST_PRIO:
+		return sprintf(buf, "+%x:%x=%u.%u.%u.%u", TC_H_MAJ(key) >> 16,
+		    TC_H_MIN(key), p[0], p[1], p[2], p[3]);
+	case NATMAP_TEST_RANGE:
+		if (!natmap_test_prefix(kind, i))
+			break;
+		return sprintf(buf, "+%u.%u.%u.%u-%u.%u.%u.%u=%u.%u.%u.%u",
+		    k[0], k[1], k[2], k[3], k[0], k[1], k[2], k[3] + 200,
+		    p[0], p[1], p[2], p[3]);
+	case NATMAP_TEST_ZADDR:
+		return sprintf(buf, "+%u:%u.%u.%u.%u/%u=%u.%u.%u.%u",
+		    natmap_test_tag(key), k[0], k[1], k[2], k[3],
+		    natmap_test_cidr(kind, i), p[0], p[1], p[2], p[3]);
+	}
+	return sprintf(buf, "+%u.%u.%u.%u/%u=%u.%u.%u.%u",
+	    k[0], k[1], k[2], k[3], natmap_test_cidr(kind, i),
+	    p[0], p[1], p[2], p[3]);
+}
+
+/*
+ * Stress: reader threads run lookups as the target does, in softirq
+ * context under rcu, on a table that writer threads keep changing.
+ * The first half of the entries is stable: writers only remap it
+ * (except in two-way tables) or reload it through a shadow table, so
+ * any lookup of it must hit the entry with one of its two postnat
+ * addresses. The other half is added, deleted and flushed by postnat
+ * all the time, making the hash resize up and down; outside two-way
+ * tables NATMAP_STRESS_GROUP churn entries share a postnat, so each
+ * flush deletes a chain of them.
+ */
+#define NATMAP_STRESS_ALT(i)	htonl(0x66000000 + (i))	/* remapped */
+#define NATMAP_STRESS_GROUP	16
+#define NATMAP_STRESS_CHURN(st, i) htonl(0x65000000 + \
+	((st)->kind == NATMAP_TEST_2WAY ? (i) : (i) / NATMAP_STRESS_GROUP))
+#define NATMAP_STRESS_THREADS	64
+
+struct natmap_stress {
+	struct xt_natmap_tginfo tinfo;
+	int kind;
+	unsigned long stable;	/* entries 0..stable-1 */
+	unsigned long churn;	/* entries stable..stable+churn-1 */
+	atomic_long_t errors;	/* lookups that failed a check */
+	atomic_long_t lookups, ops;
+	unsigned int resizes;	/* of the hash, when the run ended */
+	long resize_miss;
+};
+
+struct natmap_stress_thread {
+	struct task_struct *task;
+	struct natmap_stress *st;
+	int id;
+};
+
+/* is pre a valid answer for stable entry i */
+static bool
+natmap_stress_check(const struct natmap_stress *st,
+const struct natmap_pre *pre, const unsigned long i)
+{
+	const __be32 from = READ_ONCE(pre->postnat.from);
+
+	if (st->kind == NATMAP_TEST_ADDR6) {
+		const struct natmap6_pre *pre6 = natmap6(pre);
+		const unsigned int plen = natmap_test_cidr(st->kind, i);
+		struct in6_addr a, p, alt;
+
+		a = natmap_test_in6(true, natmap_test_post(i));
+		ipv6_addr_prefix(&p, &a, plen);
+		a = natmap_test_in6(true, NATMAP_STRESS_ALT(i));
+		ipv6_addr_prefix(&alt, &a, plen);
+		a = natmap_test_in6(false, natmap_test_key(st->kind, i));
+		return pre6->plen == plen &&
+		    ipv6_addr_equal(&pre6->prenat, &a) &&
+		    (ipv6_addr_equal(&pre6->postnat, &p) ||
+		     ipv6_addr_equal(&pre6->postnat, &alt));
+	}
+	if (READ_ONCE(pre->prenat.addr) != natmap_test_key(st->kind, i) ||
+	    READ_ONCE(pre->prenat.cidr) != natmap_test_cidr(st->kind, i))
+		return false;
+	return from == natmap_test_post(i) || from == NATMAP_STRESS_ALT(i);
+}
+
+static void
+natmap_stress_error(struct natmap_stress *st, const char *what,
+const unsigned long i)
+{
+	if (atomic_long_inc_return(&st->errors) <= 10)
+		pr_err("stress: %s of stable entry %lu\n", what, i);
+}
+
+#ifdef NATMAP_KSHIM
+/* the whole target, NAT setup is stubbed by the benchmark; in the
+ * kernel it would need a conntrack per packet */
+static unsigned long
+natmap_stress_target(struct natmap_stress *st)
+{
+	struct iphdr iph = { .ihl_version = 0x45 };
+	struct ipv6hdr ip6h = { .priority_version = 0x60 };
+	struct nf_conn ct = { 0 };
+	struct sk_buff skb = { .len = 100, .data = &iph, .nfct = &ct };
+	struct xt_action_param par = { .targinfo = &st->tinfo };
+	const unsigned long all = st->stable + st->churn;
+	unsigned int j;
+
+	if (st->kind == NATMAP_TEST_ADDR6)
+		skb.data = &ip6h;
+	for (j = 0; j < 16; j++) {
+		const unsigned long i = get_random_u32() % all;
+
+		par.hooknum = NF_INET_POST_ROUTING;
+		skb.mark = skb.priority = iph.saddr =
+		    natmap_test_key(st->kind, i);
+		ip6h.saddr = natmap_test_in6(false, iph.saddr);
+		ct.zone.id = natmap_test_tag(iph.saddr);
+		natmap_tg(&skb, &par);
+		if (st->kind == NATMAP_TEST_2WAY) {
+			par.hooknum = NF_INET_PRE_ROUTING;
+			iph.daddr = natmap_test_post(i);
+			natmap_tg(&skb, &par);
+		}
+	}
+	return j;
+}
+#endif
+
+static int
+natmap_stress_reader(void *arg)
+{
+	struct natmap_stress_thread *t = arg;
+	struct natmap_stress *st = t->st;
+	struct xt_natmap_htable *ht = st->tinfo.ht;
+	const bool two_way = st->kind == NATMAP_TEST_2WAY;
+	const unsigned long all = st->stable + st->churn;
+	unsigned long n = 0;
+
+	while (!kthread_should_stop()) {
+		const struct natmap_data *d;
+		unsigned int j;
+
+		local_bh_disable();
+		rcu_read_lock();
+		d = rcu_dereference(ht->data);
+		for (j = 0; j < 64; j++, n++) {
+			const unsigned long i = get_random_u32() % all;
+			__be32 key = natmap_test_key(st->kind, i);
+			const struct natmap_pre *pre;
+			__be32 ip;
+
+			if (natmap_test_prefix(st->kind, i))
+				key |= htonl(get_random_u32() & 0xf);
+			if (st->kind == NATMAP_TEST_ADDR6) {
+				const struct in6_addr a =
+				    natmap_test_in6(false, key);
+
+				pre = natmap6_lookup(ht, d, &a, false);
+			} else if (st->kind == NATMAP_TEST_ZADDR)
+				pre = natmap_pre_tlookup(ht, d,
+				    natmap_test_tag(key), key);
+			else
+				pre = natmap_pre_lookup(ht, d, key);
+			if (i < st->stable &&
+			    (!pre || !natmap_stress_check(st, pre, i)))
+				natmap_stress_error(st,
+				    pre ? "wrong entry" : "miss", i);
+			if (!two_way || i >= st->stable)
+				continue;
+			pre = natmap_pre_rfind(d, natmap_test_post(i), &ip);
+			if (!pre || ip != key || !natmap_stress_check(st, pre, i))
+				natmap_stress_error(st, pre ?
+				    "wrong reverse entry" : "reverse miss", i);
+		}
+		rcu_read_unlock();
+		local_bh_enable();
+#ifdef NATMAP_KSHIM
+		n += natmap_stress_target(st);
+#endif
+		cond_resched();
+	}
+	atomic_long_add(n, &st->lookups);
+	return 0;
+}
+
+/* flush the churn half, one postnat at a time */
+static void
+natmap_stress_flush(struct natmap_stress *st, char *buf)
+{
+	unsigned long c;
+
+	for (c = st->stable; c < st->stable + st->churn &&
+	    !kthread_should_stop(); c += NATMAP_STRESS_GROUP) {
+		const __be32 post = NATMAP_STRESS_CHURN(st, c);
+		const u8 *p = (const u8 *)&post;
+
+		sprintf(buf, "@-=%u.%u.%u.%u", p[0], p[1], p[2], p[3]);
+		parse_rule(st->tinfo.ht, buf, strlen(buf));
+	}
+}
+
+/* reload the stable half through a shadow table */
+static void
+natmap_stress_reload(struct natmap_stress *st, char *buf)
+{
+	unsigned long i;
+
+	strcpy(buf, "+begin");
+	if (parse_rule(st->tinfo.ht, buf, strlen(buf)))
+		return;
+	for (i = 0; i < st->stable && !kthread_should_stop(); i++) {
+		natmap_test_rule(buf + 1, st->kind, i, natmap_test_post(i));
+		buf[0] = '@';
+		parse_rule(st->tinfo.ht, buf, strlen(buf));
+	}
+	strcpy(buf, kthread_should_stop() ? "+abort" : "+commit");
+	parse_rule(st->tinfo.ht, buf, strlen(buf));
+}
+
+static int
+natmap_stress_writer(void *arg)
+{
+	struct natmap_stress_thread *t = arg;
+	struct natmap_stress *st = t->st;
+	struct xt_natmap_htable *ht = st->tinfo.ht;
+	const unsigned long flush_every = st->churn * 4 + 1;
+	unsigned long n = 0;
+	char buf[NATMAP_TEST_RULE_LEN];
+
+	while (!kthread_should_stop()) {
+		const unsigned int op = get_random_u32() % 100;
+		const unsigned long i = get_random_u32() % st->stable;
+		const unsigned long c = st->stable +
+		    get_random_u32() % st->churn;
+
+		/* "@" keeps expected replies quiet: "@+KEY=POST", "@-KEY" */
+		if (op < 50) {
+			natmap_test_rule(buf + 1, st->kind, c,
+			    NATMAP_STRESS_CHURN(st, c));
+		} else if (op < 85) {
+			natmap_test_rule(buf + 1, st->kind, c, 0);
+			buf[1] = '-';
+			*strchr(buf + 1, '=') = '\0';
+		} else if (st->kind != NATMAP_TEST_2WAY) {
+			natmap_test_rule(buf + 1, st->kind, i, (op & 1) ?
+			    NATMAP_STRESS_ALT(i) : natmap_test_post(i));
+		} else {
+			continue;
+		}
+		buf[0] = '@';
+		parse_rule(ht, buf, strlen(buf));
+		n++;
+		cond_resched();
+
+		/* one writer also does the bulk operations, two-way and
+		 * IPv6 tables only delete single entries */
+		if (t->id || n % flush_every)
+			continue;
+		if (st->kind != NATMAP_TEST_2WAY &&
+		    st->kind != NATMAP_TEST_ADDR6)
+			natmap_stress_flush(st, buf);
+		if (n % (flush_every * 4) == 0)
+			natmap_stress_reload(st, buf);
+	}
+	atomic_long_add(n, &st->ops);
+	return 0;
+}
+
+/* run readers against writers for msecs on a table of count entries
+ * of kind, results are left in st */
+static int
+natmap_stress_run(struct natmap_stress *st, const int kind,
+const unsigned long count, const unsigned int msecs, const int readers,
+const int writers)
+{
+	struct natmap_stress_thread *th;
+	char buf[NATMAP_TEST_RULE_LEN];
+	unsigned long i;
+	int k, err;
+
+	if (readers < 1 || writers < 1 ||
+	    readers + writers > NATMAP_STRESS_THREADS)
+		return -EINVAL;
+	th = kcalloc(readers + writers, sizeof(*th), GFP_KERNEL);
+	if (!th)
+		return -ENOMEM;
+
+	memset(st, 0, sizeof(*st));
+	st->tinfo.mode = natmap_test_kinds[kind].mode | XT_NATMAP_STAT;
+	st->kind = kind;
+	st->stable = count / 2 ?: 1;
+	st->churn = count - count / 2 ?: 1;
+	strcpy(st->tinfo.name, "natmap_stress");
+	mutex_lock(&natmap_mutex);
+	err = htable_create(&init_net, &st->tinfo);
+	mutex_unlock(&natmap_mutex);
+	if (err)
+		goto out;
+
+	for (i = 0; i < st->stable; i++) {
+		natmap_test_rule(buf, kind, i, natmap_test_post(i));
+		err = parse_rule(st->tinfo.ht, buf, strlen(buf));
+		if (err) {
+			pr_err("stress: rule failed: %s\n", buf);
+			goto put;
+		}
+	}
+
+	for (k = 0; k < readers + writers; k++) {
+		th[k].st = st;
+		th[k].id = k < readers ? k : k - readers;
+		th[k].task = kthread_run(k < readers ? natmap_stress_reader :
+		    natmap_stress_writer, &th[k], "natmap_stress/%d", k);
+		if (IS_ERR(th[k].task)) {
+			err = PTR_ERR(th[k].task);
+			break;
+		}
+	}
+	if (!err)
+		msleep(msecs);
+	while (k--)
+		kthread_stop(th[k].task);
+
+	st->resizes = st->tinfo.ht->resizes;
+	st->resize_miss = atomic_long_read(&st->tinfo.ht->resize_miss);
+put:
+	mutex_lock(&natmap_mutex);
+	htable_put(st->tinfo.ht);
+	mutex_unlock(&natmap_mutex);
+out:
+	kfree(th);
+	return err;
+}
+
+/* no lookup of a stable entry may miss while the table changes */
+static void
+natmap_test_stress(struct kunit *test)
+{
+	static const unsigned long counts[] = { 1000, 50000 };
+	const unsigned int log = disable_log;
+	int kind, c;
+
+	disable_log = 1;
+	for (kind = 0; kind < NATMAP_TEST_KINDS; kind++)
+		for (c = 0; c < ARRAY_SIZE(counts); c++) {
+			struct natmap_stress st;
+
+			KUNIT_EXPECT_EQ(test, natmap_stress_run(&st, kind,
+			    counts[c], 1000, 4, 2), 0);
+			KUNIT_EXPECT_EQ(test, atomic_long_read(&st.errors), 0);
+			kunit_info(test, "%s %lu: %ld lookups/s %ld changes/s, %u resizes\n",
+			    natmap_test_kinds[kind].name, counts[c],
+			    atomic_long_read(&st.lookups),
+			    atomic_long_read(&st.ops), st.resizes);
+		}
+	disable_log = log;
+}
+
+static int
+natmap_test_cmd(struct xt_natmap_htable *ht, const char *cmd)
+{
+	char buf[NATMAP_TEST_RULE_LEN];
+
+	snprintf(buf, sizeof(buf), "%s", cmd);
+	return parse_rule(ht, buf, strlen(buf));
+}
+
+static int
+natmap_test_owner(void *arg, const struct natmap_pre *pre, __be32 prenat_ip)
+{
+	*(__be32 *)arg = prenat_ip;
+	return 1;
+}
+
+/* port blocks of a cg-nat entity never overlap: an entity whose blocks
+ * don't fit is refused, and so is a geometry it would not fit in */
+static void
+natmap_test_cgnt(struct kunit *test)
+{
+	struct xt_natmap_tginfo tinfo = {
+		.mode = XT_NATMAP_ADDR | XT_NATMAP_CGNT,
+		.name = "natmap_cgnt",
+	};
+	const struct natmap_cgnt *g;
+	struct natmap_pre *pre;
+	struct xt_natmap_htable *ht;
+	u32 slot, ports;
+	int err;
+
+	mutex_lock(&natmap_mutex);
+	err = htable_create(&init_net, &tinfo);
+	mutex_unlock(&natmap_mutex);
+	KUNIT_EXPECT_EQ(test, err, 0);
+	if (err)
+		return;
+	ht = tinfo.ht;
+
+	/* 256 prenat addresses per postnat, 16000 ports */
+	KUNIT_EXPECT_EQ(test, natmap_test_cmd(ht, "+ports=2000-17999"), 0);
+	KUNIT_EXPECT_EQ(test, natmap_test_cmd(ht, "+block=1000"), 0);
+	KUNIT_EXPECT_EQ(test, natmap_test_cmd(ht,
+	    "+10.0.0.0/16=100.64.0.0/24"), -ERANGE);
+	KUNIT_EXPECT_EQ(test, natmap_test_cmd(ht, "+block=50"), 0);
+	KUNIT_EXPECT_EQ(test, natmap_test_cmd(ht,
+	    "+10.0.0.0/16=100.64.0.0/24"), 0);
+	KUNIT_EXPECT_EQ(test, natmap_test_cmd(ht, "+block=100"), -ERANGE);
+	KUNIT_EXPECT_EQ(test, natmap_test_cmd(ht, "+ports=2000-4399"),
+	    -ERANGE);
+	KUNIT_EXPECT_EQ(test, natmap_test_cmd(ht, "+block=0"), 0);
+
+	/* last port of every slot is within the range and of its owner */
+	rcu_read_lock();
+	g = rcu_dereference(ht->cgnt);
+	pre = natmap_pre_lookup(ht, rcu_dereference(ht->data),
+	    htonl(0x0a000000));
+	KUNIT_EXPECT_TRUE(test, pre != NULL);
+	ports = pre ? natmap_cgnt_ports(g, pre->cgnt_bits) : 0;
+	for (slot = 0; pre && slot < 1U << pre->cgnt_bits; slot++) {
+		const __be32 prenat_ip = pre->prenat.addr |
+		    htonl(slot << pre->cgnt_shift);
+		const u32 max_port = g->min +
+		    natmap_cgnt_slot(pre, prenat_ip) * ports + ports - 1;
+		__be32 owner = 0;
+
+		KUNIT_EXPECT_TRUE(test, max_port < g->min + g->range);
+		natmap_cgnt_owners(ht, pre, pre->postnat.from, max_port,
+		    natmap_test_owner, &owner);
+		KUNIT_EXPECT_EQ(test, owner, prenat_ip);
+	}
+	rcu_read_unlock();
+
+	mutex_lock(&natmap_mutex);
+	htable_put(ht);
+	mutex_unlock(&natmap_mutex);
+}
+
+/* a shadow opened for no entries grows as a reload fills it */
+static void
+natmap_test_shadow(struct kunit *test)
+{
+	struct xt_natmap_tginfo tinfo = {
+		.mode = XT_NATMAP_ADDR,
+		.name = "natmap_shadow",
+	};
+	const unsigned long count = 20000;
+	char buf[NATMAP_TEST_RULE_LEN];
+	const struct natmap_hash *tbl;
+	struct xt_natmap_htable *ht;
+	unsigned long i;
+	int err, n;
+
+	mutex_lock(&natmap_mutex);
+	err = htable_create(&init_net, &tinfo);
+	mutex_unlock(&natmap_mutex);
+	KUNIT_EXPECT_EQ(test, err, 0);
+	if (err)
+		return;
+	ht = tinfo.ht;
+
+	KUNIT_EXPECT_EQ(test, natmap_test_cmd(ht, "+begin"), 0);
+	for (i = 0; i < count; i++) {
+		natmap_test_rule(buf, NATMAP_TEST_ADDR, i, natmap_test_post(i));
+		KUNIT_EXPECT_EQ(test, parse_rule(ht, buf, strlen(buf)), 0);
+	}
+	/* each resize kicks the next until the load factor is in bounds */
+	for (n = 0; n < 100 && flush_work(&ht->resize_work); n++)
+		;
+	spin_lock(&ht->lock);
+	tbl = natmap_deref(ht, natmap_deref(ht, ht->shadow)->pre);
+	KUNIT_EXPECT_EQ(test, natmap_hash_target(count, tbl->size),
+	    tbl->size);
+	KUNIT_EXPECT_TRUE(test, !natmap_hash_resize_target(ht));
+	spin_unlock(&ht->lock);
+	KUNIT_EXPECT_EQ(test, natmap_test_cmd(ht, "+commit"), 0);
+
+	mutex_lock(&natmap_mutex);
+	htable_put(ht);
+	mutex_unlock(&natmap_mutex);
+}
+
+/* an IPv6 table holds no more prefix lengths than packets probe */
+static void
+natmap_test_plen6(struct kunit *test)
+{
+	struct xt_natmap_tginfo tinfo = {
+		.mode = XT_NATMAP_ADDR | XT_NATMAP_IPV6,
+		.name = "natmap_plen6",
+	};
+	char buf[NATMAP_TEST_RULE_LEN];
+	struct xt_natmap_htable *ht;
+	unsigned int plen;
+	int err;
+
+	mutex_lock(&natmap_mutex);
+	err = htable_create(&init_net, &tinfo);
+	mutex_unlock(&natmap_mutex);
+	KUNIT_EXPECT_EQ(test, err, 0);
+	if (err)
+		return;
+	ht = tinfo.ht;
+
+	for (plen = 48; plen < 48 + NATMAP6_PLENS_MAX; plen++) {
+		sprintf(buf, "+2001:db8::/%u=2001:db8:1::/%u", plen, plen);
+		KUNIT_EXPECT_EQ(test, natmap_test_cmd(ht, buf), 0);
+	}
+	sprintf(buf, "+2001:db8::/%u=2001:db8:1::/%u", plen, plen);
+	KUNIT_EXPECT_EQ(test, natmap_test_cmd(ht, buf), -E2BIG);
+	/* lengths in use take more entries */
+	KUNIT_EXPECT_EQ(test, natmap_test_cmd(ht,
+	    "+2001:db8:2::/48=2001:db8:3::/48"), 0);
+	KUNIT_EXPECT_EQ(test, natmap_test_cmd(ht, "-2001:db8::/48"), 0);
+	KUNIT_EXPECT_EQ(test, natmap_test_cmd(ht, "-2001:db8:2::/48"), 0);
+	KUNIT_EXPECT_EQ(test, natmap_test_cmd(ht, buf), 0);
+
+	mutex_lock(&natmap_mutex);
+	htable_put(ht);
+	mutex_unlock(&natmap_mutex);
+}
+
+static struct kunit_case natmap_test_cases[] = {
+	KUNIT_CASE(natmap_test_stress),
+	KUNIT_CASE(natmap_test_cgnt),
+	KUNIT_CASE(natmap_test_shadow),
+	KUNIT_CASE(natmap_test_plen6),
+	{}
+};
+
+static struct kunit_suite natmap_test_suite = {
+	.name = "xt_natmap",
+	.test_cases = natmap_test_cases,
+};
+
+kunit_test_suite(natmap_test_suite);
@@ -0,0 +1,137 @@
+/*
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* tracepoints of the NAT decision path, under events/natmap/ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM natmap
+
+#if !defined(_XT_NATMAP_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _XT_NATMAP_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* key is the address in host order, the mark or the prio;
+ * reverse lookups are by postnat address of two-way tables */
+TRACE_EVENT(natmap_lookup,
+	TP_PROTO(const char *table, u32 key, bool reverse, bool hit),
+	TP_ARGS(table, key, reverse, hit),
+	TP_STRUCT__entry(
+		__string(table, table)
+		__field(u32, key)
+		__field(bool, reverse)
+		__field(bool, hit)
+	),
+	TP_fast_assign(
+		__assign_str(table, table);
+		__entry->key = key;
+		__entry->reverse = reverse;
+		__entry->hit = hit;
+	),
+	TP_printk("table=%s key=0x%08x%s %s", __get_str(table),
+	    __entry->key, __entry->reverse ? " reverse" : "",
+	    __entry->hit ? "hit" : "miss")
+);
+
+TRACE_EVENT(natmap_nat,
+	TP_PROTO(const char *table, bool dnat, __be32 min_addr,
+	    __be32 max_addr, unsigned int verdict),
+	TP_ARGS(table, dnat, min_addr, max_addr, verdict),
+	TP_STRUCT__entry(
+		__string(table, table)
+		__field(bool, dnat)
+		__field(__be32, min_addr)
+		__field(__be32, max_addr)
+		__field(unsigned int, verdict)
+	),
+	TP_fast_assign(
+		__assign_str(table, table);
+		__entry->dnat = dnat;
+		__entry->min_addr = min_addr;
+		__entry->max_addr = max_addr;
+		__entry->verdict = verdict;
+	),
+	TP_printk("table=%s %s %pI4-%pI4 %s", __get_str(table),
+	    __entry->dnat ? "dnat" : "snat",
+	    &__entry->min_addr, &__entry->max_addr,
+	    __entry->verdict == NF_ACCEPT ? "ok" : "failed")
+);
+
+TRACE_EVENT(natmap_hotdrop,
+	TP_PROTO(const char *table, u32 key),
+	TP_ARGS(table, key),
+	TP_STRUCT__entry(
+		__string(table, table)
+		__field(u32, key)
+	),
+	TP_fast_assign(
+		__assign_str(table, table);
+		__entry->key = key;
+	),
+	TP_printk("table=%s key=0x%08x", __get_str(table), __entry->key)
+);
+
+/* IPv6 tables, the packet address looked up and the one mapped to */
+TRACE_EVENT(natmap_lookup6,
+	TP_PROTO(const char *table, const struct in6_addr *key, bool reverse,
+	    bool hit),
+	TP_ARGS(table, key, reverse, hit),
+	TP_STRUCT__entry(
+		__string(table, table)
+		__array(u8, key, 16)
+		__field(bool, reverse)
+		__field(bool, hit)
+	),
+	TP_fast_assign(
+		__assign_str(table, table);
+		memcpy(__entry->key, key, 16);
+		__entry->reverse = reverse;
+		__entry->hit = hit;
+	),
+	TP_printk("table=%s key=%pI6c%s %s", __get_str(table),
+	    __entry->key, __entry->reverse ? " reverse" : "",
+	    __entry->hit ? "hit" : "miss")
+);
+
+TRACE_EVENT(natmap_nat6,
+	TP_PROTO(const char *table, bool dnat, const struct in6_addr *addr,
+	    unsigned int verdict),
+	TP_ARGS(table, dnat, addr, verdict),
+	TP_STRUCT__entry(
+		__string(table, table)
+		__field(bool, dnat)
+		__array(u8, addr, 16)
+		__field(unsigned int, verdict)
+	),
+	TP_fast_assign(
+		__assign_str(table, table);
+		__entry->dnat = dnat;
+		memcpy(__entry->addr, addr, 16);
+		__entry->verdict = verdict;
+	),
+	TP_printk("table=%s %s %pI6c %s", __get_str(table),
+	    __entry->dnat ? "dnat" : "snat", __entry->addr,
+	    __entry->verdict == NF_ACCEPT ? "ok" : "failed")
+);
+
+#endif /* _XT_NATMAP_TRACE_H */
+
+/* out of tree, found via -I$(src) */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE xt_NATMAP_trace
+#include <trace/define_trace.h>